@@ -0,0 +1,20 @@
+// Host versions of the kernels in kernel.cu, built instead of the PTX with the CUDABase host backend.
+#include <cuda_host_kernel.h>
+
+#include <algorithm>
+
+namespace {
+
+int arrSize;
+
+void adder(const CUDAHostThread &thread, int *arrA, int *arrB, int *result) {
+	int idx = thread.blockIdx.x * thread.blockDim.x + thread.threadIdx.x;
+	idx = std::min(idx, arrSize - 1);
+	result[idx] = arrA[idx] + arrB[idx];
+}
+
+const bool registered =
+	registerHostGlobal("arrSize", &arrSize) &&
+	registerHostKernel<int*, int*, int*>("adder", adder);
+
+} // namespace
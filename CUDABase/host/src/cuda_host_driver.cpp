@@ -0,0 +1,2002 @@
+#include <cuda.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else // !_WIN32
+#include <sys/mman.h>
+#endif // _WIN32
+
+namespace {
+
+constexpr int DRIVER_VERSION = 12000;
+constexpr int HOST_DEVICE_COUNT = 1;
+constexpr int MAX_THREADS_PER_BLOCK = 1024;
+constexpr int MAX_SHARED_MEMORY_PER_BLOCK = 48 * 1024;
+constexpr int MAX_SHARED_MEMORY_PER_BLOCK_OPTIN = 96 * 1024;
+constexpr size_t ALLOCATION_ALIGNMENT = 256; ///< Same as cuMemAlloc guarantees.
+constexpr size_t VIRTUAL_MEMORY_GRANULARITY = 64 * 1024; ///< Multiple of the page size on all supported platforms.
+constexpr size_t VIRTUAL_ADDRESS_SPACE_SIZE = size_t(64) << 30; ///< Reserved from the OS once, cuMemAddressReserve hands out ranges of it.
+constexpr size_t KERNEL_PARAM_ALIGNMENT = 16;
+constexpr size_t DEFAULT_DEVICE_MEMORY_MB = 4096;
+
+/// Greatest and least stream priority. Lower numbers mean higher priority, like on a GPU.
+constexpr int GREATEST_STREAM_PRIORITY = -1;
+constexpr int LEAST_STREAM_PRIORITY = 0;
+
+int getNumHostThreads() {
+	const unsigned int numThreads = std::thread::hardware_concurrency();
+	return numThreads > 0 ? int(numThreads) : 1;
+}
+
+size_t getDeviceMemorySize() {
+	static const size_t size = []() {
+		const char *envSize = getenv("CUDABASE_HOST_DEVICE_MEMORY_MB");
+		const long long megabytes = envSize != nullptr ? atoll(envSize) : 0;
+		return size_t(megabytes > 0 ? megabytes : DEFAULT_DEVICE_MEMORY_MB) * 1024 * 1024;
+	}();
+	return size;
+}
+
+bool isValidDevice(CUdevice dev) {
+	return dev >= 0 && dev < HOST_DEVICE_COUNT;
+}
+
+using Clock = std::chrono::steady_clock;
+
+} // namespace
+
+/*
+===============================================================
+Kernels and modules
+===============================================================
+*/
+struct CUfunc_st {
+	std::string name;
+	CUhostKernelFn fn;
+	void *userData;
+	std::vector<size_t> paramSizes;
+	std::atomic<int> maxDynamicSharedBytes;
+};
+
+struct CUmod_st {
+	int unused;
+};
+
+struct CUlinkState_st {
+	std::vector<std::string> inputs; ///< Names of the added inputs. There is no code to link on the host.
+};
+
+namespace {
+
+struct HostGlobal {
+	void *ptr;
+	size_t bytes;
+};
+
+/// Kernels and globals registered by the application. They make up every module.
+struct HostRegistry {
+	std::mutex mutex;
+	std::unordered_map<std::string, std::unique_ptr<CUfunc_st>> kernels;
+	std::unordered_map<std::string, HostGlobal> globals;
+};
+
+HostRegistry &getHostRegistry() {
+	// Never destroyed, registrations run from static initializers in any order.
+	static HostRegistry *registry = new HostRegistry();
+	return *registry;
+}
+
+/// Identifies a "linked" module. cuModuleLoadData accepts anything, this is only handed out by cuLinkComplete.
+const char HOST_MODULE_IMAGE[] = "CUDABaseHostModule";
+
+/*
+===============================================================
+Launches
+===============================================================
+*/
+/// Everything needed to run a kernel, with the parameters copied out of the caller's buffers.
+struct LaunchDesc {
+	CUfunc_st *func;
+	CUhostDim3 grid;
+	CUhostDim3 block;
+	unsigned int sharedMemBytes;
+	std::vector<char> paramStorage;
+	std::vector<size_t> paramOffsets;
+
+	LaunchDesc() : func(nullptr), grid{ 0, 0, 0 }, block{ 0, 0, 0 }, sharedMemBytes(0) { }
+};
+
+CUresult makeLaunchDesc(
+	CUfunc_st *func,
+	unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ,
+	unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ,
+	unsigned int sharedMemBytes,
+	void **kernelParams,
+	void **extra,
+	LaunchDesc &desc
+) {
+	if (func == nullptr) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	if (extra != nullptr) {
+		// Packed parameter buffers are not needed by CUDABase.
+		return CUDA_ERROR_NOT_SUPPORTED;
+	}
+
+	const unsigned long long numThreads = (unsigned long long)blockDimX * blockDimY * blockDimZ;
+	if (gridDimX == 0 || gridDimY == 0 || gridDimZ == 0 || numThreads == 0 || numThreads > MAX_THREADS_PER_BLOCK) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	const int maxSharedMem = std::max(MAX_SHARED_MEMORY_PER_BLOCK, func->maxDynamicSharedBytes.load());
+	if (sharedMemBytes > unsigned(maxSharedMem)) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (!func->paramSizes.empty() && kernelParams == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	desc.func = func;
+	desc.grid = CUhostDim3{ gridDimX, gridDimY, gridDimZ };
+	desc.block = CUhostDim3{ blockDimX, blockDimY, blockDimZ };
+	desc.sharedMemBytes = sharedMemBytes;
+
+	// Parameters are read at launch time on a GPU, so copy them before the call returns.
+	size_t storageSize = 0;
+	desc.paramOffsets.resize(func->paramSizes.size());
+	for (size_t i = 0; i < func->paramSizes.size(); ++i) {
+		desc.paramOffsets[i] = storageSize;
+		storageSize += (func->paramSizes[i] + KERNEL_PARAM_ALIGNMENT - 1) / KERNEL_PARAM_ALIGNMENT * KERNEL_PARAM_ALIGNMENT;
+	}
+
+	desc.paramStorage.resize(storageSize);
+	for (size_t i = 0; i < func->paramSizes.size(); ++i) {
+		memcpy(desc.paramStorage.data() + desc.paramOffsets[i], kernelParams[i], func->paramSizes[i]);
+	}
+
+	return CUDA_SUCCESS;
+}
+
+/// One launch being run by the worker pool.
+struct LaunchJob {
+	const LaunchDesc *desc;
+	std::vector<void*> params;
+	unsigned long long numBlocks;
+	unsigned long long chunkSize;
+	int priority;
+	std::atomic<unsigned long long> nextBlock;
+	std::atomic<unsigned long long> numDone;
+	std::mutex doneMutex;
+	std::condition_variable done;
+
+	LaunchJob() : desc(nullptr), numBlocks(0), chunkSize(1), priority(0), nextBlock(0), numDone(0) { }
+};
+
+/// Threads the blocks of all launches are spread over.
+/// The thread submitting a launch works on it too, so a launch always makes progress
+/// even while the pool is busy with launches of other streams.
+struct WorkerPool {
+	WorkerPool() : stopping(false) {
+		const int numWorkers = std::max(1, getNumHostThreads() - 1);
+		for (int i = 0; i < numWorkers; ++i) {
+			workers.emplace_back(&WorkerPool::workerMain, this);
+		}
+	}
+
+	int getNumThreads() const {
+		return int(workers.size()) + 1;
+	}
+
+	void run(const LaunchDesc &desc, int priority) {
+		const std::shared_ptr<LaunchJob> job = std::make_shared<LaunchJob>();
+		job->desc = &desc;
+		job->priority = priority;
+		job->numBlocks = (unsigned long long)desc.grid.x * desc.grid.y * desc.grid.z;
+		// A few chunks per thread balance uneven blocks without contending on the counter.
+		job->chunkSize = std::max(1ull, job->numBlocks / (unsigned long long)(getNumThreads() * 8));
+
+		job->params.resize(desc.paramOffsets.size());
+		for (size_t i = 0; i < desc.paramOffsets.size(); ++i) {
+			job->params[i] = const_cast<char*>(desc.paramStorage.data()) + desc.paramOffsets[i];
+		}
+
+		if (job->numBlocks > job->chunkSize) {
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = jobs.begin();
+			while (it != jobs.end() && (*it)->priority <= priority) {
+				++it;
+			}
+			jobs.insert(it, job);
+			workAvailable.notify_all();
+		}
+
+		runBlocks(*job);
+
+		std::unique_lock<std::mutex> lock(job->doneMutex);
+		job->done.wait(lock, [&job]() { return job->numDone.load() == job->numBlocks; });
+	}
+
+private:
+	void workerMain() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			workAvailable.wait(lock, [this]() { return stopping || !jobs.empty(); });
+			if (stopping) {
+				return;
+			}
+
+			const std::shared_ptr<LaunchJob> job = jobs.front();
+			if (job->nextBlock.load() >= job->numBlocks) {
+				jobs.pop_front();
+				continue;
+			}
+
+			lock.unlock();
+			runBlocks(*job);
+			lock.lock();
+		}
+	}
+
+	static void runBlocks(LaunchJob &job) {
+		const LaunchDesc &desc = *job.desc;
+
+		thread_local std::vector<char> sharedMem;
+		if (sharedMem.size() < desc.sharedMemBytes) {
+			sharedMem.resize(desc.sharedMemBytes);
+		}
+
+		CUhostKernelBlock block;
+		block.gridDim = desc.grid;
+		block.blockDim = desc.block;
+		block.sharedMem = sharedMem.data();
+
+		while (true) {
+			const unsigned long long first = job.nextBlock.fetch_add(job.chunkSize);
+			if (first >= job.numBlocks) {
+				return;
+			}
+
+			const unsigned long long last = std::min(first + job.chunkSize, job.numBlocks);
+			for (unsigned long long i = first; i < last; ++i) {
+				block.blockIdx.x = unsigned(i % desc.grid.x);
+				block.blockIdx.y = unsigned((i / desc.grid.x) % desc.grid.y);
+				block.blockIdx.z = unsigned(i / ((unsigned long long)desc.grid.x * desc.grid.y));
+				desc.func->fn(&block, job.params.data(), desc.func->userData);
+			}
+
+			if (job.numDone.fetch_add(last - first) + (last - first) == job.numBlocks) {
+				std::lock_guard<std::mutex> lock(job.doneMutex);
+				job.done.notify_all();
+			}
+		}
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable workAvailable;
+	std::deque<std::shared_ptr<LaunchJob>> jobs; ///< Ordered by stream priority.
+	std::vector<std::thread> workers;
+	bool stopping;
+};
+
+WorkerPool &getWorkerPool() {
+	// Never destroyed, streams may still run work while static destructors do.
+	static WorkerPool *pool = new WorkerPool();
+	return *pool;
+}
+
+} // namespace
+
+/*
+===============================================================
+Contexts and streams
+===============================================================
+*/
+struct CUctx_st {
+	CUdevice dev;
+	unsigned int flags;
+	std::mutex mutex;
+	std::vector<CUstream_st*> streams;
+};
+
+/// Ordered queue of work run by a thread of its own.
+struct CUstream_st {
+	CUctx_st *ctx;
+	unsigned int flags;
+	int priority;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<std::function<void()>> tasks;
+	bool busy;
+	bool stopping;
+	std::thread worker;
+
+	CUstream_st(CUctx_st *ctx, unsigned int flags, int priority) : ctx(ctx), flags(flags), priority(priority), busy(false), stopping(false) {
+		worker = std::thread(&CUstream_st::workerMain, this);
+	}
+
+	~CUstream_st() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		worker.join();
+	}
+
+	void enqueue(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		changed.notify_all();
+	}
+
+	void synchronize() {
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return tasks.empty() && !busy; });
+	}
+
+	bool isIdle() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return tasks.empty() && !busy;
+	}
+
+private:
+	void workerMain() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			changed.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty()) {
+				return;
+			}
+
+			std::function<void()> task = std::move(tasks.front());
+			tasks.pop_front();
+			busy = true;
+			lock.unlock();
+
+			task();
+
+			lock.lock();
+			busy = false;
+			changed.notify_all();
+		}
+	}
+};
+
+namespace {
+
+thread_local std::vector<CUctx_st*> contextStack;
+
+CUctx_st *getCurrentContext() {
+	return contextStack.empty() ? nullptr : contextStack.back();
+}
+
+/// Wait for all streams of ctx which synchronize with the NULL stream.
+void synchronizeContext(CUctx_st *ctx, bool blockingOnly) {
+	if (ctx == nullptr) {
+		return;
+	}
+
+	std::vector<CUstream_st*> streams;
+	{
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+		streams = ctx->streams;
+	}
+
+	for (size_t i = 0; i < streams.size(); ++i) {
+		if (!blockingOnly || (streams[i]->flags & CU_STREAM_NON_BLOCKING) == 0) {
+			streams[i]->synchronize();
+		}
+	}
+}
+
+/// Run task in stream order. The NULL stream runs it right away on the calling thread,
+/// after everything submitted to the blocking streams, as the legacy default stream does.
+void submit(CUstream stream, std::function<void()> task) {
+	if (stream == NULL) {
+		synchronizeContext(getCurrentContext(), true);
+		task();
+		return;
+	}
+
+	stream->enqueue(std::move(task));
+}
+
+int getStreamPriority(CUstream stream) {
+	return stream != NULL ? stream->priority : LEAST_STREAM_PRIORITY;
+}
+
+/*
+===============================================================
+Memory
+===============================================================
+*/
+struct Allocation {
+	size_t size;
+	CUmemorytype type;
+	CUctx_st *ctx;
+};
+
+struct PhysicalAllocation {
+	size_t size;
+};
+
+struct MemoryState {
+	std::mutex mutex;
+	std::map<uintptr_t, Allocation> allocations; ///< By start address, for pointer queries.
+	size_t usedDeviceBytes;
+
+	MemoryState() : usedDeviceBytes(0) { }
+};
+
+MemoryState &getMemoryState() {
+	static MemoryState *state = new MemoryState();
+	return *state;
+}
+
+/// Account for bytes of "device" memory. Fails once the configured device size is used up.
+bool reserveDeviceBytes(MemoryState &state, size_t bytes) {
+	if (state.usedDeviceBytes + bytes > getDeviceMemorySize()) {
+		return false;
+	}
+
+	state.usedDeviceBytes += bytes;
+	return true;
+}
+
+CUresult allocate(void **ptr, size_t bytesize, CUmemorytype type) {
+	if (ptr == nullptr || bytesize == 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	MemoryState &state = getMemoryState();
+	const bool countsAsDevice = type != CU_MEMORYTYPE_HOST;
+	{
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if (countsAsDevice && !reserveDeviceBytes(state, bytesize)) {
+			return CUDA_ERROR_OUT_OF_MEMORY;
+		}
+	}
+
+	void *result = ::operator new(bytesize, std::align_val_t(ALLOCATION_ALIGNMENT), std::nothrow);
+
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (result == nullptr) {
+		if (countsAsDevice) {
+			state.usedDeviceBytes -= bytesize;
+		}
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	}
+
+	state.allocations[uintptr_t(result)] = Allocation{ bytesize, type, getCurrentContext() };
+	*ptr = result;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult deallocate(void *ptr, bool host) {
+	if (ptr == nullptr) {
+		return CUDA_SUCCESS;
+	}
+
+	MemoryState &state = getMemoryState();
+	{
+		std::lock_guard<std::mutex> lock(state.mutex);
+		auto it = state.allocations.find(uintptr_t(ptr));
+		if (it == state.allocations.end() || (it->second.type == CU_MEMORYTYPE_HOST) != host) {
+			return CUDA_ERROR_INVALID_VALUE;
+		}
+
+		if (it->second.type != CU_MEMORYTYPE_HOST) {
+			state.usedDeviceBytes -= it->second.size;
+		}
+		state.allocations.erase(it);
+	}
+
+	::operator delete(ptr, std::align_val_t(ALLOCATION_ALIGNMENT));
+
+	return CUDA_SUCCESS;
+}
+
+void *toHostPointer(CUdeviceptr ptr) {
+	return reinterpret_cast<void*>(uintptr_t(ptr));
+}
+
+void copy3D(const CUDA_MEMCPY3D &params) {
+	const char *src = params.srcMemoryType == CU_MEMORYTYPE_HOST ?
+		static_cast<const char*>(params.srcHost) :
+		static_cast<const char*>(toHostPointer(params.srcDevice));
+	char *dst = params.dstMemoryType == CU_MEMORYTYPE_HOST ?
+		static_cast<char*>(params.dstHost) :
+		static_cast<char*>(toHostPointer(params.dstDevice));
+
+	const size_t height = std::max<size_t>(params.Height, 1);
+	const size_t depth = std::max<size_t>(params.Depth, 1);
+	for (size_t z = 0; z < depth; ++z) {
+		for (size_t y = 0; y < height; ++y) {
+			const size_t srcOffset = params.srcXInBytes + (params.srcY + y) * params.srcPitch + (params.srcZ + z) * params.srcHeight * params.srcPitch;
+			const size_t dstOffset = params.dstXInBytes + (params.dstY + y) * params.dstPitch + (params.dstZ + z) * params.dstHeight * params.dstPitch;
+			memcpy(dst + dstOffset, src + srcOffset, params.WidthInBytes);
+		}
+	}
+}
+
+CUresult copyAsync(void *dst, const void *src, size_t byteCount, CUstream stream) {
+	if (byteCount == 0) {
+		return CUDA_SUCCESS;
+	}
+
+	if (dst == nullptr || src == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	submit(stream, [dst, src, byteCount]() {
+		memcpy(dst, src, byteCount);
+	});
+
+	return CUDA_SUCCESS;
+}
+
+CUresult copySync(void *dst, const void *src, size_t byteCount) {
+	// Synchronous copies are ordered after all blocking streams, like on the NULL stream.
+	return copyAsync(dst, src, byteCount, NULL);
+}
+
+/*
+===============================================================
+Events
+===============================================================
+*/
+struct EventState {
+	std::mutex mutex;
+	std::condition_variable completedChanged;
+	unsigned long long numRecorded; ///< Generation of the last cuEventRecord.
+	unsigned long long numCompleted; ///< Generation of the last record the stream got to.
+	Clock::time_point timestamp;
+
+	EventState() : numRecorded(0), numCompleted(0) { }
+};
+
+} // namespace
+
+struct CUevent_st {
+	unsigned int flags;
+	std::shared_ptr<EventState> state; ///< Shared with queued records and waits, which may outlive the event.
+};
+
+/*
+===============================================================
+Graphs
+===============================================================
+*/
+namespace {
+
+struct GraphNodeDesc {
+	bool isKernel;
+	LaunchDesc launch;
+	CUDA_MEMCPY3D copy;
+};
+
+} // namespace
+
+struct CUgraphNode_st {
+	size_t index;
+};
+
+struct CUgraph_st {
+	std::vector<std::unique_ptr<CUgraphNode_st>> handles;
+	std::vector<GraphNodeDesc> nodes; ///< In insertion order, which is always a valid execution order.
+};
+
+struct CUgraphExec_st {
+	std::shared_ptr<std::vector<GraphNodeDesc>> nodes; ///< Copied on update, so launches in flight keep theirs.
+};
+
+namespace {
+
+/// Handles and memory reserved through the virtual memory API.
+struct VirtualMemoryState {
+	std::mutex mutex;
+	std::map<uintptr_t, size_t> reservations;
+	std::unordered_map<CUmemGenericAllocationHandle, PhysicalAllocation> physicalAllocations;
+	CUmemGenericAllocationHandle nextHandle;
+	uintptr_t addressSpace; ///< Start of the address space all ranges are reserved from, 0 until the first reservation.
+	uintptr_t nextRange; ///< Ranges are handed out one after the other, so the newest one can always be extended like on a GPU.
+
+	VirtualMemoryState() : nextHandle(1), addressSpace(0), nextRange(0) { }
+};
+
+VirtualMemoryState &getVirtualMemoryState() {
+	static VirtualMemoryState *state = new VirtualMemoryState();
+	return *state;
+}
+
+void *reserveAddressSpace(size_t size) {
+#ifdef _WIN32
+	return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else // !_WIN32
+	void *result = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return result == MAP_FAILED ? nullptr : result;
+#endif // _WIN32
+}
+
+bool commitPages(void *ptr, size_t size) {
+#ifdef _WIN32
+	return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else // !_WIN32
+	return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0;
+#endif // _WIN32
+}
+
+bool decommitPages(void *ptr, size_t size) {
+#ifdef _WIN32
+	return VirtualFree(ptr, size, MEM_DECOMMIT) != 0;
+#else // !_WIN32
+	// Mapping fresh pages over the range drops the old ones and their contents.
+	return mmap(ptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) != MAP_FAILED;
+#endif // _WIN32
+}
+
+/// Check nothing is reserved in [start, start + size). Caller holds state.mutex.
+bool isAddressRangeFree(const VirtualMemoryState &state, uintptr_t start, size_t size) {
+	if (start < state.addressSpace || start + size > state.addressSpace + VIRTUAL_ADDRESS_SPACE_SIZE) {
+		return false;
+	}
+
+	auto next = state.reservations.lower_bound(start);
+	if (next != state.reservations.end() && next->first < start + size) {
+		return false;
+	}
+	if (next != state.reservations.begin()) {
+		--next;
+		if (next->first + next->second > start) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/// Reserve size bytes at hint if they are free there, anywhere otherwise. Caller holds state.mutex.
+/// @return Start of the range or 0 if there is no room left.
+uintptr_t reserveAddressRange(VirtualMemoryState &state, size_t size, uintptr_t hint) {
+	if (state.addressSpace == 0) {
+		state.addressSpace = uintptr_t(reserveAddressSpace(VIRTUAL_ADDRESS_SPACE_SIZE));
+		state.nextRange = state.addressSpace;
+		if (state.addressSpace == 0) {
+			return 0;
+		}
+	}
+
+	uintptr_t result = 0;
+	if (hint != 0 && isAddressRangeFree(state, hint, size)) {
+		result = hint;
+	} else if (isAddressRangeFree(state, state.nextRange, size)) {
+		result = state.nextRange;
+	} else {
+		// Out of fresh address space, take the first gap big enough.
+		uintptr_t gapStart = state.addressSpace;
+		for (auto it = state.reservations.begin(); it != state.reservations.end() && result == 0; ++it) {
+			if (it->first - gapStart >= size) {
+				result = gapStart;
+			}
+			gapStart = it->first + it->second;
+		}
+		if (result == 0 && isAddressRangeFree(state, gapStart, size)) {
+			result = gapStart;
+		}
+	}
+
+	if (result != 0) {
+		state.reservations[result] = size;
+		state.nextRange = std::max(state.nextRange, result + size);
+	}
+	return result;
+}
+
+/// The driver only maps and sets access within one reserved range, never across two adjacent ones.
+/// Caller holds state.mutex.
+bool isInsideOneRange(const VirtualMemoryState &state, uintptr_t ptr, size_t size) {
+	auto it = state.reservations.upper_bound(ptr);
+	if (it == state.reservations.begin()) {
+		return false;
+	}
+	--it;
+	return size > 0 && ptr + size <= it->first + it->second;
+}
+
+} // namespace
+
+/*
+===============================================================
+Initialization and errors
+===============================================================
+*/
+CUresult cuGetErrorName(CUresult error, const char **pStr) {
+	if (pStr == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	switch (error) {
+	case CUDA_SUCCESS: *pStr = "CUDA_SUCCESS"; break;
+	case CUDA_ERROR_INVALID_VALUE: *pStr = "CUDA_ERROR_INVALID_VALUE"; break;
+	case CUDA_ERROR_OUT_OF_MEMORY: *pStr = "CUDA_ERROR_OUT_OF_MEMORY"; break;
+	case CUDA_ERROR_NOT_INITIALIZED: *pStr = "CUDA_ERROR_NOT_INITIALIZED"; break;
+	case CUDA_ERROR_DEINITIALIZED: *pStr = "CUDA_ERROR_DEINITIALIZED"; break;
+	case CUDA_ERROR_NO_DEVICE: *pStr = "CUDA_ERROR_NO_DEVICE"; break;
+	case CUDA_ERROR_INVALID_DEVICE: *pStr = "CUDA_ERROR_INVALID_DEVICE"; break;
+	case CUDA_ERROR_INVALID_IMAGE: *pStr = "CUDA_ERROR_INVALID_IMAGE"; break;
+	case CUDA_ERROR_INVALID_CONTEXT: *pStr = "CUDA_ERROR_INVALID_CONTEXT"; break;
+	case CUDA_ERROR_PEER_ACCESS_UNSUPPORTED: *pStr = "CUDA_ERROR_PEER_ACCESS_UNSUPPORTED"; break;
+	case CUDA_ERROR_FILE_NOT_FOUND: *pStr = "CUDA_ERROR_FILE_NOT_FOUND"; break;
+	case CUDA_ERROR_INVALID_HANDLE: *pStr = "CUDA_ERROR_INVALID_HANDLE"; break;
+	case CUDA_ERROR_NOT_FOUND: *pStr = "CUDA_ERROR_NOT_FOUND"; break;
+	case CUDA_ERROR_NOT_READY: *pStr = "CUDA_ERROR_NOT_READY"; break;
+	case CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED: *pStr = "CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED"; break;
+	case CUDA_ERROR_LAUNCH_FAILED: *pStr = "CUDA_ERROR_LAUNCH_FAILED"; break;
+	case CUDA_ERROR_COOPERATIVE_LAUNCH_TOO_LARGE: *pStr = "CUDA_ERROR_COOPERATIVE_LAUNCH_TOO_LARGE"; break;
+	case CUDA_ERROR_NOT_SUPPORTED: *pStr = "CUDA_ERROR_NOT_SUPPORTED"; break;
+	case CUDA_ERROR_UNKNOWN: *pStr = "CUDA_ERROR_UNKNOWN"; break;
+	default:
+		*pStr = nullptr;
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuGetErrorString(CUresult error, const char **pStr) {
+	if (pStr == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	switch (error) {
+	case CUDA_SUCCESS: *pStr = "no error"; break;
+	case CUDA_ERROR_INVALID_VALUE: *pStr = "invalid argument"; break;
+	case CUDA_ERROR_OUT_OF_MEMORY: *pStr = "out of memory"; break;
+	case CUDA_ERROR_NOT_INITIALIZED: *pStr = "initialization error"; break;
+	case CUDA_ERROR_NOT_SUPPORTED: *pStr = "operation not supported by the host backend"; break;
+	case CUDA_ERROR_NOT_FOUND: *pStr = "named symbol not found"; break;
+	case CUDA_ERROR_NOT_READY: *pStr = "device not ready"; break;
+	default: {
+		const char *name = nullptr;
+		if (cuGetErrorName(error, &name) != CUDA_SUCCESS) {
+			*pStr = nullptr;
+			return CUDA_ERROR_INVALID_VALUE;
+		}
+		*pStr = name;
+		break;
+	}
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuInit(unsigned int flags) {
+	if (flags != 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	// Start the workers now rather than in the first launch.
+	getWorkerPool();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDriverGetVersion(int *driverVersion) {
+	if (driverVersion == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	*driverVersion = DRIVER_VERSION;
+	return CUDA_SUCCESS;
+}
+
+/*
+===============================================================
+Devices
+===============================================================
+*/
+CUresult cuDeviceGet(CUdevice *device, int ordinal) {
+	if (device == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (!isValidDevice(ordinal)) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+
+	*device = ordinal;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetCount(int *count) {
+	if (count == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	*count = HOST_DEVICE_COUNT;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetName(char *name, int len, CUdevice dev) {
+	if (name == nullptr || len <= 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (!isValidDevice(dev)) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+
+	snprintf(name, size_t(len), "CUDABase host device (%d threads)", getNumHostThreads());
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceTotalMem(size_t *bytes, CUdevice dev) {
+	if (bytes == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (!isValidDevice(dev)) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+
+	*bytes = getDeviceMemorySize();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetAttribute(int *pi, CUdevice_attribute attrib, CUdevice dev) {
+	if (pi == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (!isValidDevice(dev)) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+
+	switch (attrib) {
+	case CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_BLOCK: *pi = MAX_THREADS_PER_BLOCK; break;
+	case CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_X: *pi = 1024; break;
+	case CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Y: *pi = 1024; break;
+	case CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Z: *pi = 64; break;
+	case CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_X: *pi = 2147483647; break;
+	case CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Y: *pi = 65535; break;
+	case CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Z: *pi = 65535; break;
+	case CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_BLOCK: *pi = MAX_SHARED_MEMORY_PER_BLOCK; break;
+	case CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_BLOCK_OPTIN: *pi = MAX_SHARED_MEMORY_PER_BLOCK_OPTIN; break;
+	case CU_DEVICE_ATTRIBUTE_WARP_SIZE: *pi = 32; break;
+	case CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT: *pi = getWorkerPool().getNumThreads(); break;
+	// Host memory is device memory, so pinned buffers should map instead of staging.
+	case CU_DEVICE_ATTRIBUTE_INTEGRATED: *pi = 1; break;
+	case CU_DEVICE_ATTRIBUTE_CAN_MAP_HOST_MEMORY: *pi = 1; break;
+	case CU_DEVICE_ATTRIBUTE_CAN_USE_HOST_POINTER_FOR_REGISTERED_MEM: *pi = 1; break;
+	case CU_DEVICE_ATTRIBUTE_UNIFIED_ADDRESSING: *pi = 1; break;
+	case CU_DEVICE_ATTRIBUTE_MANAGED_MEMORY: *pi = 1; break;
+	case CU_DEVICE_ATTRIBUTE_CONCURRENT_MANAGED_ACCESS: *pi = 1; break;
+	case CU_DEVICE_ATTRIBUTE_VIRTUAL_MEMORY_MANAGEMENT_SUPPORTED: *pi = 1; break;
+	case CU_DEVICE_ATTRIBUTE_ASYNC_ENGINE_COUNT: *pi = 0; break;
+	// Blocks of a grid can't synchronize with each other on the host.
+	case CU_DEVICE_ATTRIBUTE_COOPERATIVE_LAUNCH: *pi = 0; break;
+	// The lowest compute capability CUDABase supports, so no newer feature is assumed.
+	case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR: *pi = 5; break;
+	case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR: *pi = 2; break;
+	default:
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceCanAccessPeer(int *canAccessPeer, CUdevice dev, CUdevice peerDev) {
+	if (canAccessPeer == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (!isValidDevice(dev) || !isValidDevice(peerDev)) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+
+	*canAccessPeer = 0;
+	return CUDA_SUCCESS;
+}
+
+/*
+===============================================================
+Contexts
+===============================================================
+*/
+CUresult cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev) {
+	if (pctx == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (!isValidDevice(dev)) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+
+	CUctx_st *ctx = new CUctx_st();
+	ctx->dev = dev;
+	ctx->flags = flags;
+
+	contextStack.push_back(ctx);
+	*pctx = ctx;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxDestroy(CUcontext ctx) {
+	if (ctx == NULL) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	std::vector<CUstream_st*> streams;
+	{
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+		streams.swap(ctx->streams);
+	}
+
+	for (size_t i = 0; i < streams.size(); ++i) {
+		streams[i]->synchronize();
+		delete streams[i];
+	}
+
+	contextStack.erase(std::remove(contextStack.begin(), contextStack.end(), ctx), contextStack.end());
+	delete ctx;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSetCurrent(CUcontext ctx) {
+	if (ctx == NULL) {
+		if (!contextStack.empty()) {
+			contextStack.pop_back();
+		}
+		return CUDA_SUCCESS;
+	}
+
+	if (contextStack.empty()) {
+		contextStack.push_back(ctx);
+	} else {
+		contextStack.back() = ctx;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetCurrent(CUcontext *pctx) {
+	if (pctx == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	*pctx = getCurrentContext();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetDevice(CUdevice *device) {
+	if (device == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	CUctx_st *ctx = getCurrentContext();
+	if (ctx == nullptr) {
+		return CUDA_ERROR_INVALID_CONTEXT;
+	}
+
+	*device = ctx->dev;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxPushCurrent(CUcontext ctx) {
+	if (ctx == NULL) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	contextStack.push_back(ctx);
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxPopCurrent(CUcontext *pctx) {
+	if (contextStack.empty()) {
+		return CUDA_ERROR_INVALID_CONTEXT;
+	}
+
+	if (pctx != nullptr) {
+		*pctx = contextStack.back();
+	}
+	contextStack.pop_back();
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSynchronize() {
+	CUctx_st *ctx = getCurrentContext();
+	if (ctx == nullptr) {
+		return CUDA_ERROR_INVALID_CONTEXT;
+	}
+
+	synchronizeContext(ctx, false);
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetStreamPriorityRange(int *leastPriority, int *greatestPriority) {
+	if (leastPriority != nullptr) {
+		*leastPriority = LEAST_STREAM_PRIORITY;
+	}
+	if (greatestPriority != nullptr) {
+		*greatestPriority = GREATEST_STREAM_PRIORITY;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuCtxEnablePeerAccess(CUcontext peerContext, unsigned int flags) {
+	return CUDA_ERROR_PEER_ACCESS_UNSUPPORTED;
+}
+
+/*
+===============================================================
+Linking and modules
+===============================================================
+*/
+CUresult cuLinkCreate(unsigned int numOptions, CUjit_option *options, void **optionValues, CUlinkState *stateOut) {
+	if (stateOut == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	*stateOut = new CUlinkState_st();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuLinkAddFile(CUlinkState state, CUjitInputType type, const char *path, unsigned int numOptions, CUjit_option *options, void **optionValues) {
+	if (state == NULL || path == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	state->inputs.push_back(path);
+	return CUDA_SUCCESS;
+}
+
+CUresult cuLinkAddData(CUlinkState state, CUjitInputType type, void *data, size_t size, const char *name, unsigned int numOptions, CUjit_option *options, void **optionValues) {
+	if (state == NULL || data == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	state->inputs.push_back(name != nullptr ? name : "");
+	return CUDA_SUCCESS;
+}
+
+CUresult cuLinkComplete(CUlinkState state, void **cubinOut, size_t *sizeOut) {
+	if (state == NULL || cubinOut == nullptr || sizeOut == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	*cubinOut = const_cast<char*>(HOST_MODULE_IMAGE);
+	*sizeOut = sizeof(HOST_MODULE_IMAGE);
+	return CUDA_SUCCESS;
+}
+
+CUresult cuLinkDestroy(CUlinkState state) {
+	delete state;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuModuleLoadData(CUmodule *module, const void *image) {
+	if (module == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	// Every module sees all registered kernels, so there is nothing to load.
+	*module = new CUmod_st();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuModuleUnload(CUmodule hmod) {
+	if (hmod == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	delete hmod;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuModuleGetFunction(CUfunction *hfunc, CUmodule hmod, const char *name) {
+	if (hfunc == nullptr || name == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (hmod == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	HostRegistry &registry = getHostRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	auto it = registry.kernels.find(name);
+	if (it == registry.kernels.end()) {
+		return CUDA_ERROR_NOT_FOUND;
+	}
+
+	*hfunc = it->second.get();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuModuleGetGlobal(CUdeviceptr *dptr, size_t *bytes, CUmodule hmod, const char *name) {
+	if (name == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (hmod == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	HostRegistry &registry = getHostRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	auto it = registry.globals.find(name);
+	if (it == registry.globals.end()) {
+		return CUDA_ERROR_NOT_FOUND;
+	}
+
+	if (dptr != nullptr) {
+		*dptr = CUdeviceptr(uintptr_t(it->second.ptr));
+	}
+	if (bytes != nullptr) {
+		*bytes = it->second.bytes;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuHostRegisterKernel(const char *name, CUhostKernelFn fn, void *userData, const size_t *paramSizes, unsigned int numParams) {
+	if (name == nullptr || fn == nullptr || (numParams > 0 && paramSizes == nullptr)) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	std::unique_ptr<CUfunc_st> func(new CUfunc_st());
+	func->name = name;
+	func->fn = fn;
+	func->userData = userData;
+	func->paramSizes.assign(paramSizes, paramSizes + numParams);
+	func->maxDynamicSharedBytes = MAX_SHARED_MEMORY_PER_BLOCK;
+
+	HostRegistry &registry = getHostRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	if (registry.kernels.count(name) > 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	registry.kernels[name] = std::move(func);
+	return CUDA_SUCCESS;
+}
+
+CUresult cuHostRegisterGlobal(const char *name, void *ptr, size_t bytes) {
+	if (name == nullptr || ptr == nullptr || bytes == 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	HostRegistry &registry = getHostRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	if (registry.globals.count(name) > 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	registry.globals[name] = HostGlobal{ ptr, bytes };
+	return CUDA_SUCCESS;
+}
+
+/*
+===============================================================
+Memory
+===============================================================
+*/
+CUresult cuMemAlloc(CUdeviceptr *dptr, size_t bytesize) {
+	if (dptr == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	void *ptr = nullptr;
+	const CUresult res = allocate(&ptr, bytesize, CU_MEMORYTYPE_DEVICE);
+	*dptr = CUdeviceptr(uintptr_t(ptr));
+	return res;
+}
+
+CUresult cuMemFree(CUdeviceptr dptr) {
+	return deallocate(toHostPointer(dptr), false);
+}
+
+CUresult cuMemGetInfo(size_t *free, size_t *total) {
+	MemoryState &state = getMemoryState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	if (free != nullptr) {
+		*free = getDeviceMemorySize() - state.usedDeviceBytes;
+	}
+	if (total != nullptr) {
+		*total = getDeviceMemorySize();
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemHostAlloc(void **pp, size_t bytesize, unsigned int flags) {
+	return allocate(pp, bytesize, CU_MEMORYTYPE_HOST);
+}
+
+CUresult cuMemFreeHost(void *p) {
+	return deallocate(p, true);
+}
+
+CUresult cuMemHostGetDevicePointer(CUdeviceptr *pdptr, void *p, unsigned int flags) {
+	if (pdptr == nullptr || p == nullptr || flags != 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	*pdptr = CUdeviceptr(uintptr_t(p));
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemAllocManaged(CUdeviceptr *dptr, size_t bytesize, unsigned int flags) {
+	if (dptr == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	void *ptr = nullptr;
+	const CUresult res = allocate(&ptr, bytesize, CU_MEMORYTYPE_UNIFIED);
+	*dptr = CUdeviceptr(uintptr_t(ptr));
+	return res;
+}
+
+CUresult cuMemPrefetchAsync(CUdeviceptr devPtr, size_t count, CUdevice dstDevice, CUstream hStream) {
+	if (dstDevice != CU_DEVICE_CPU && !isValidDevice(dstDevice)) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+
+	// There is only one memory, but keep the stream order a prefetch would have.
+	submit(hStream, []() { });
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemAdvise(CUdeviceptr devPtr, size_t count, CUmem_advise advice, CUdevice device) {
+	if (device != CU_DEVICE_CPU && !isValidDevice(device)) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuPointerGetAttribute(void *data, CUpointer_attribute attribute, CUdeviceptr ptr) {
+	if (data == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	MemoryState &state = getMemoryState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+
+	// Last allocation starting at or before ptr.
+	auto it = state.allocations.upper_bound(uintptr_t(ptr));
+	if (it == state.allocations.begin()) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+	--it;
+	if (uintptr_t(ptr) >= it->first + it->second.size) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	switch (attribute) {
+	case CU_POINTER_ATTRIBUTE_CONTEXT:
+		*static_cast<CUcontext*>(data) = it->second.ctx;
+		break;
+	case CU_POINTER_ATTRIBUTE_MEMORY_TYPE:
+		*static_cast<unsigned int*>(data) = it->second.type == CU_MEMORYTYPE_UNIFIED ? CU_MEMORYTYPE_DEVICE : it->second.type;
+		break;
+	case CU_POINTER_ATTRIBUTE_DEVICE_ORDINAL:
+		*static_cast<int*>(data) = it->second.ctx != nullptr ? it->second.ctx->dev : 0;
+		break;
+	default:
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemcpy(CUdeviceptr dst, CUdeviceptr src, size_t byteCount) {
+	return copySync(toHostPointer(dst), toHostPointer(src), byteCount);
+}
+
+CUresult cuMemcpyAsync(CUdeviceptr dst, CUdeviceptr src, size_t byteCount, CUstream hStream) {
+	return copyAsync(toHostPointer(dst), toHostPointer(src), byteCount, hStream);
+}
+
+CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost, size_t byteCount) {
+	return copySync(toHostPointer(dstDevice), srcHost, byteCount);
+}
+
+CUresult cuMemcpyHtoDAsync(CUdeviceptr dstDevice, const void *srcHost, size_t byteCount, CUstream hStream) {
+	return copyAsync(toHostPointer(dstDevice), srcHost, byteCount, hStream);
+}
+
+CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, size_t byteCount) {
+	return copySync(dstHost, toHostPointer(srcDevice), byteCount);
+}
+
+CUresult cuMemcpyDtoHAsync(void *dstHost, CUdeviceptr srcDevice, size_t byteCount, CUstream hStream) {
+	return copyAsync(dstHost, toHostPointer(srcDevice), byteCount, hStream);
+}
+
+CUresult cuMemcpyDtoD(CUdeviceptr dstDevice, CUdeviceptr srcDevice, size_t byteCount) {
+	return copySync(toHostPointer(dstDevice), toHostPointer(srcDevice), byteCount);
+}
+
+CUresult cuMemcpyDtoDAsync(CUdeviceptr dstDevice, CUdeviceptr srcDevice, size_t byteCount, CUstream hStream) {
+	return copyAsync(toHostPointer(dstDevice), toHostPointer(srcDevice), byteCount, hStream);
+}
+
+CUresult cuMemcpyPeerAsync(CUdeviceptr dstDevice, CUcontext dstContext, CUdeviceptr srcDevice, CUcontext srcContext, size_t byteCount, CUstream hStream) {
+	return copyAsync(toHostPointer(dstDevice), toHostPointer(srcDevice), byteCount, hStream);
+}
+
+/*
+===============================================================
+Virtual memory
+===============================================================
+*/
+CUresult cuMemAddressReserve(CUdeviceptr *ptr, size_t size, size_t alignment, CUdeviceptr addr, unsigned long long flags) {
+	if (ptr == nullptr || size == 0 || size % VIRTUAL_MEMORY_GRANULARITY != 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	// The address is only a hint, the caller checks where the range ended up.
+	VirtualMemoryState &state = getVirtualMemoryState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	const uintptr_t result = reserveAddressRange(state, size, uintptr_t(addr));
+	if (result == 0) {
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	}
+	*ptr = CUdeviceptr(result);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemAddressFree(CUdeviceptr ptr, size_t size) {
+	VirtualMemoryState &state = getVirtualMemoryState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	auto it = state.reservations.find(uintptr_t(ptr));
+	if (it == state.reservations.end() || it->second != size) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	// Drop whatever is still mapped before the range can be handed out again.
+	if (!decommitPages(toHostPointer(ptr), size)) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+	state.reservations.erase(it);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemCreate(CUmemGenericAllocationHandle *handle, size_t size, const CUmemAllocationProp *prop, unsigned long long flags) {
+	if (handle == nullptr || prop == nullptr || size == 0 || size % VIRTUAL_MEMORY_GRANULARITY != 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (prop->location.type != CU_MEM_LOCATION_TYPE_DEVICE || !isValidDevice(prop->location.id)) {
+		return CUDA_ERROR_INVALID_DEVICE;
+	}
+
+	// Pages are committed by cuMemMap. Only the budget is taken here, like physical memory on a GPU.
+	{
+		MemoryState &memState = getMemoryState();
+		std::lock_guard<std::mutex> lock(memState.mutex);
+		if (!reserveDeviceBytes(memState, size)) {
+			return CUDA_ERROR_OUT_OF_MEMORY;
+		}
+	}
+
+	VirtualMemoryState &state = getVirtualMemoryState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	*handle = state.nextHandle++;
+	state.physicalAllocations[*handle] = PhysicalAllocation{ size };
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemRelease(CUmemGenericAllocationHandle handle) {
+	size_t size = 0;
+	{
+		VirtualMemoryState &state = getVirtualMemoryState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		auto it = state.physicalAllocations.find(handle);
+		if (it == state.physicalAllocations.end()) {
+			return CUDA_ERROR_INVALID_VALUE;
+		}
+		size = it->second.size;
+		state.physicalAllocations.erase(it);
+	}
+
+	MemoryState &memState = getMemoryState();
+	std::lock_guard<std::mutex> lock(memState.mutex);
+	memState.usedDeviceBytes -= size;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemMap(CUdeviceptr ptr, size_t size, size_t offset, CUmemGenericAllocationHandle handle, unsigned long long flags) {
+	{
+		VirtualMemoryState &state = getVirtualMemoryState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		auto it = state.physicalAllocations.find(handle);
+		if (it == state.physicalAllocations.end() || offset != 0 || size != it->second.size) {
+			return CUDA_ERROR_INVALID_VALUE;
+		}
+		if (!isInsideOneRange(state, uintptr_t(ptr), size)) {
+			return CUDA_ERROR_INVALID_VALUE;
+		}
+	}
+
+	if (!commitPages(toHostPointer(ptr), size)) {
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemUnmap(CUdeviceptr ptr, size_t size) {
+	{
+		VirtualMemoryState &state = getVirtualMemoryState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if (!isInsideOneRange(state, uintptr_t(ptr), size)) {
+			return CUDA_ERROR_INVALID_VALUE;
+		}
+	}
+
+	if (!decommitPages(toHostPointer(ptr), size)) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuMemSetAccess(CUdeviceptr ptr, size_t size, const CUmemAccessDesc *desc, size_t count) {
+	if (desc == nullptr || count == 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	// Mapped pages are committed read-write already.
+	VirtualMemoryState &state = getVirtualMemoryState();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	return isInsideOneRange(state, uintptr_t(ptr), size) ? CUDA_SUCCESS : CUDA_ERROR_INVALID_VALUE;
+}
+
+CUresult cuMemGetAllocationGranularity(size_t *granularity, const CUmemAllocationProp *prop, CUmemAllocationGranularity_flags option) {
+	if (granularity == nullptr || prop == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	*granularity = VIRTUAL_MEMORY_GRANULARITY;
+	return CUDA_SUCCESS;
+}
+
+/*
+===============================================================
+Streams
+===============================================================
+*/
+CUresult cuStreamCreate(CUstream *phStream, unsigned int flags) {
+	return cuStreamCreateWithPriority(phStream, flags, LEAST_STREAM_PRIORITY);
+}
+
+CUresult cuStreamCreateWithPriority(CUstream *phStream, unsigned int flags, int priority) {
+	if (phStream == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	CUctx_st *ctx = getCurrentContext();
+	if (ctx == nullptr) {
+		return CUDA_ERROR_INVALID_CONTEXT;
+	}
+
+	// Out of range priorities are clamped like the driver does.
+	priority = std::min(std::max(priority, GREATEST_STREAM_PRIORITY), LEAST_STREAM_PRIORITY);
+
+	CUstream_st *stream = new CUstream_st(ctx, flags, priority);
+	{
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+		ctx->streams.push_back(stream);
+	}
+
+	*phStream = stream;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuStreamDestroy(CUstream hStream) {
+	if (hStream == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	{
+		CUctx_st *ctx = hStream->ctx;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+		ctx->streams.erase(std::remove(ctx->streams.begin(), ctx->streams.end(), hStream), ctx->streams.end());
+	}
+
+	// Work already submitted still runs, as on a GPU.
+	hStream->synchronize();
+	delete hStream;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuStreamSynchronize(CUstream hStream) {
+	if (hStream == NULL) {
+		synchronizeContext(getCurrentContext(), true);
+		return CUDA_SUCCESS;
+	}
+
+	hStream->synchronize();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuStreamQuery(CUstream hStream) {
+	if (hStream == NULL) {
+		return CUDA_SUCCESS;
+	}
+
+	return hStream->isIdle() ? CUDA_SUCCESS : CUDA_ERROR_NOT_READY;
+}
+
+CUresult cuStreamWaitEvent(CUstream hStream, CUevent hEvent, unsigned int flags) {
+	if (hEvent == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	// Waits for the record made before this call, not for later ones.
+	std::shared_ptr<EventState> state = hEvent->state;
+	unsigned long long generation = 0;
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		generation = state->numRecorded;
+	}
+
+	submit(hStream, [state, generation]() {
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->completedChanged.wait(lock, [&state, generation]() { return state->numCompleted >= generation; });
+	});
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuLaunchHostFunc(CUstream hStream, CUhostFn fn, void *userData) {
+	if (fn == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	submit(hStream, [fn, userData]() {
+		fn(userData);
+	});
+
+	return CUDA_SUCCESS;
+}
+
+/*
+===============================================================
+Events
+===============================================================
+*/
+CUresult cuEventCreate(CUevent *phEvent, unsigned int flags) {
+	if (phEvent == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	CUevent_st *event = new CUevent_st();
+	event->flags = flags;
+	event->state = std::make_shared<EventState>();
+
+	*phEvent = event;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventRecord(CUevent hEvent, CUstream hStream) {
+	if (hEvent == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	std::shared_ptr<EventState> state = hEvent->state;
+	unsigned long long generation = 0;
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		generation = ++state->numRecorded;
+	}
+
+	submit(hStream, [state, generation]() {
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->numCompleted = std::max(state->numCompleted, generation);
+			state->timestamp = Clock::now();
+		}
+		state->completedChanged.notify_all();
+	});
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventQuery(CUevent hEvent) {
+	if (hEvent == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	EventState &state = *hEvent->state;
+	std::lock_guard<std::mutex> lock(state.mutex);
+	return state.numCompleted >= state.numRecorded ? CUDA_SUCCESS : CUDA_ERROR_NOT_READY;
+}
+
+CUresult cuEventSynchronize(CUevent hEvent) {
+	if (hEvent == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	EventState &state = *hEvent->state;
+	std::unique_lock<std::mutex> lock(state.mutex);
+	const unsigned long long generation = state.numRecorded;
+	state.completedChanged.wait(lock, [&state, generation]() { return state.numCompleted >= generation; });
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventElapsedTime(float *pMilliseconds, CUevent hStart, CUevent hEnd) {
+	if (pMilliseconds == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (hStart == NULL || hEnd == NULL || (hStart->flags & CU_EVENT_DISABLE_TIMING) || (hEnd->flags & CU_EVENT_DISABLE_TIMING)) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	Clock::time_point start, end;
+	{
+		EventState &state = *hStart->state;
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if (state.numRecorded == 0 || state.numCompleted < state.numRecorded) {
+			return state.numRecorded == 0 ? CUDA_ERROR_INVALID_HANDLE : CUDA_ERROR_NOT_READY;
+		}
+		start = state.timestamp;
+	}
+	{
+		EventState &state = *hEnd->state;
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if (state.numRecorded == 0 || state.numCompleted < state.numRecorded) {
+			return state.numRecorded == 0 ? CUDA_ERROR_INVALID_HANDLE : CUDA_ERROR_NOT_READY;
+		}
+		end = state.timestamp;
+	}
+
+	*pMilliseconds = std::chrono::duration<float, std::milli>(end - start).count();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuEventDestroy(CUevent hEvent) {
+	if (hEvent == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	delete hEvent;
+	return CUDA_SUCCESS;
+}
+
+/*
+===============================================================
+Kernels
+===============================================================
+*/
+CUresult cuFuncGetAttribute(int *pi, CUfunction_attribute attrib, CUfunction hfunc) {
+	if (pi == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (hfunc == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	switch (attrib) {
+	case CU_FUNC_ATTRIBUTE_MAX_THREADS_PER_BLOCK: *pi = MAX_THREADS_PER_BLOCK; break;
+	case CU_FUNC_ATTRIBUTE_SHARED_SIZE_BYTES: *pi = 0; break;
+	case CU_FUNC_ATTRIBUTE_MAX_DYNAMIC_SHARED_SIZE_BYTES: *pi = hfunc->maxDynamicSharedBytes.load(); break;
+	default:
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuFuncSetAttribute(CUfunction hfunc, CUfunction_attribute attrib, int value) {
+	if (hfunc == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	if (attrib != CU_FUNC_ATTRIBUTE_MAX_DYNAMIC_SHARED_SIZE_BYTES || value < 0 || value > MAX_SHARED_MEMORY_PER_BLOCK_OPTIN) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	hfunc->maxDynamicSharedBytes = value;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuOccupancyMaxPotentialBlockSize(int *minGridSize, int *blockSize, CUfunction func, CUoccupancyB2DSize blockSizeToDynamicSMemSize, size_t dynamicSMemSize, int blockSizeLimit) {
+	if (minGridSize == nullptr || blockSize == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (func == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	// Threads of a block run in a loop, so the block size barely matters. Keep grids of a useful size.
+	const int limit = blockSizeLimit > 0 ? std::min(blockSizeLimit, MAX_THREADS_PER_BLOCK) : MAX_THREADS_PER_BLOCK;
+	*blockSize = std::min(256, limit);
+	*minGridSize = getWorkerPool().getNumThreads() * std::max(1, MAX_THREADS_PER_BLOCK / *blockSize);
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuOccupancyMaxActiveBlocksPerMultiprocessor(int *numBlocks, CUfunction func, int blockSize, size_t dynamicSMemSize) {
+	if (numBlocks == nullptr || blockSize <= 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	if (func == NULL) {
+		return CUDA_ERROR_INVALID_HANDLE;
+	}
+
+	*numBlocks = std::max(1, MAX_THREADS_PER_BLOCK / blockSize);
+	return CUDA_SUCCESS;
+}
+
+CUresult cuLaunchKernel(CUfunction f, unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ, unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ, unsigned int sharedMemBytes, CUstream hStream, void **kernelParams, void **extra) {
+	std::shared_ptr<LaunchDesc> desc = std::make_shared<LaunchDesc>();
+	const CUresult res = makeLaunchDesc(
+		f,
+		gridDimX, gridDimY, gridDimZ,
+		blockDimX, blockDimY, blockDimZ,
+		sharedMemBytes,
+		kernelParams,
+		extra,
+		*desc
+	);
+	if (res != CUDA_SUCCESS) {
+		return res;
+	}
+
+	const int priority = getStreamPriority(hStream);
+	submit(hStream, [desc, priority]() {
+		getWorkerPool().run(*desc, priority);
+	});
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuLaunchCooperativeKernel(CUfunction f, unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ, unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ, unsigned int sharedMemBytes, CUstream hStream, void **kernelParams) {
+	return CUDA_ERROR_NOT_SUPPORTED;
+}
+
+CUresult cuLaunchKernelEx(const CUlaunchConfig *config, CUfunction f, void **kernelParams, void **extra) {
+	if (config == nullptr || (config->numAttrs > 0 && config->attrs == nullptr)) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	for (unsigned int i = 0; i < config->numAttrs; ++i) {
+		const CUlaunchAttribute &attr = config->attrs[i];
+		const bool isTrivialCluster =
+			attr.id == CU_LAUNCH_ATTRIBUTE_CLUSTER_DIMENSION &&
+			attr.value.clusterDim.x * attr.value.clusterDim.y * attr.value.clusterDim.z <= 1;
+		const bool isTrivialCooperative = attr.id == CU_LAUNCH_ATTRIBUTE_COOPERATIVE && attr.value.cooperative == 0;
+		if (!isTrivialCluster && !isTrivialCooperative) {
+			return CUDA_ERROR_NOT_SUPPORTED;
+		}
+	}
+
+	return cuLaunchKernel(
+		f,
+		config->gridDimX, config->gridDimY, config->gridDimZ,
+		config->blockDimX, config->blockDimY, config->blockDimZ,
+		config->sharedMemBytes,
+		config->hStream,
+		kernelParams,
+		extra
+	);
+}
+
+/*
+===============================================================
+Graphs
+===============================================================
+*/
+namespace {
+
+CUresult makeKernelNode(const CUDA_KERNEL_NODE_PARAMS *nodeParams, GraphNodeDesc &node) {
+	if (nodeParams == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	node.isKernel = true;
+	return makeLaunchDesc(
+		nodeParams->func,
+		nodeParams->gridDimX, nodeParams->gridDimY, nodeParams->gridDimZ,
+		nodeParams->blockDimX, nodeParams->blockDimY, nodeParams->blockDimZ,
+		nodeParams->sharedMemBytes,
+		nodeParams->kernelParams,
+		nodeParams->extra,
+		node.launch
+	);
+}
+
+CUresult makeMemcpyNode(const CUDA_MEMCPY3D *copyParams, GraphNodeDesc &node) {
+	if (copyParams == nullptr) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	node.isKernel = false;
+	node.copy = *copyParams;
+	return CUDA_SUCCESS;
+}
+
+CUresult addGraphNode(CUgraphNode *phGraphNode, CUgraph hGraph, const CUgraphNode *dependencies, size_t numDependencies, GraphNodeDesc &&node) {
+	for (size_t i = 0; i < numDependencies; ++i) {
+		if (dependencies[i] == NULL || dependencies[i]->index >= hGraph->nodes.size()) {
+			return CUDA_ERROR_INVALID_VALUE;
+		}
+	}
+
+	std::unique_ptr<CUgraphNode_st> handle(new CUgraphNode_st());
+	handle->index = hGraph->nodes.size();
+	*phGraphNode = handle.get();
+
+	hGraph->nodes.push_back(std::move(node));
+	hGraph->handles.push_back(std::move(handle));
+
+	return CUDA_SUCCESS;
+}
+
+} // namespace
+
+CUresult cuGraphCreate(CUgraph *phGraph, unsigned int flags) {
+	if (phGraph == nullptr || flags != 0) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	*phGraph = new CUgraph_st();
+	return CUDA_SUCCESS;
+}
+
+CUresult cuGraphDestroy(CUgraph hGraph) {
+	if (hGraph == NULL) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	delete hGraph;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuGraphAddKernelNode(CUgraphNode *phGraphNode, CUgraph hGraph, const CUgraphNode *dependencies, size_t numDependencies, const CUDA_KERNEL_NODE_PARAMS *nodeParams) {
+	if (phGraphNode == nullptr || hGraph == NULL) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	GraphNodeDesc node;
+	const CUresult res = makeKernelNode(nodeParams, node);
+	if (res != CUDA_SUCCESS) {
+		return res;
+	}
+
+	return addGraphNode(phGraphNode, hGraph, dependencies, numDependencies, std::move(node));
+}
+
+CUresult cuGraphAddMemcpyNode(CUgraphNode *phGraphNode, CUgraph hGraph, const CUgraphNode *dependencies, size_t numDependencies, const CUDA_MEMCPY3D *copyParams, CUcontext ctx) {
+	if (phGraphNode == nullptr || hGraph == NULL) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	GraphNodeDesc node;
+	const CUresult res = makeMemcpyNode(copyParams, node);
+	if (res != CUDA_SUCCESS) {
+		return res;
+	}
+
+	return addGraphNode(phGraphNode, hGraph, dependencies, numDependencies, std::move(node));
+}
+
+CUresult cuGraphInstantiateWithFlags(CUgraphExec *phGraphExec, CUgraph hGraph, unsigned long long flags) {
+	if (phGraphExec == nullptr || hGraph == NULL) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	CUgraphExec_st *exec = new CUgraphExec_st();
+	exec->nodes = std::make_shared<std::vector<GraphNodeDesc>>(hGraph->nodes);
+
+	*phGraphExec = exec;
+	return CUDA_SUCCESS;
+}
+
+CUresult cuGraphLaunch(CUgraphExec hGraphExec, CUstream hStream) {
+	if (hGraphExec == NULL) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	std::shared_ptr<const std::vector<GraphNodeDesc>> nodes = hGraphExec->nodes;
+	const int priority = getStreamPriority(hStream);
+	submit(hStream, [nodes, priority]() {
+		for (size_t i = 0; i < nodes->size(); ++i) {
+			const GraphNodeDesc &node = (*nodes)[i];
+			if (node.isKernel) {
+				getWorkerPool().run(node.launch, priority);
+			} else {
+				copy3D(node.copy);
+			}
+		}
+	});
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuGraphExecKernelNodeSetParams(CUgraphExec hGraphExec, CUgraphNode hNode, const CUDA_KERNEL_NODE_PARAMS *nodeParams) {
+	if (hGraphExec == NULL || hNode == NULL || hNode->index >= hGraphExec->nodes->size() || !(*hGraphExec->nodes)[hNode->index].isKernel) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	GraphNodeDesc node;
+	const CUresult res = makeKernelNode(nodeParams, node);
+	if (res != CUDA_SUCCESS) {
+		return res;
+	}
+
+	std::shared_ptr<std::vector<GraphNodeDesc>> nodes = std::make_shared<std::vector<GraphNodeDesc>>(*hGraphExec->nodes);
+	(*nodes)[hNode->index] = std::move(node);
+	hGraphExec->nodes = nodes;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuGraphExecMemcpyNodeSetParams(CUgraphExec hGraphExec, CUgraphNode hNode, const CUDA_MEMCPY3D *copyParams, CUcontext ctx) {
+	if (hGraphExec == NULL || hNode == NULL || hNode->index >= hGraphExec->nodes->size() || (*hGraphExec->nodes)[hNode->index].isKernel) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	GraphNodeDesc node;
+	const CUresult res = makeMemcpyNode(copyParams, node);
+	if (res != CUDA_SUCCESS) {
+		return res;
+	}
+
+	std::shared_ptr<std::vector<GraphNodeDesc>> nodes = std::make_shared<std::vector<GraphNodeDesc>>(*hGraphExec->nodes);
+	(*nodes)[hNode->index] = std::move(node);
+	hGraphExec->nodes = nodes;
+
+	return CUDA_SUCCESS;
+}
+
+CUresult cuGraphExecDestroy(CUgraphExec hGraphExec) {
+	if (hGraphExec == NULL) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+
+	delete hGraphExec;
+	return CUDA_SUCCESS;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cuda_memory_defines.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Copy of the counters of one allocator on one device at some point in time.
+/// Counters are read one by one while other threads keep allocating, so they may be off by the allocations in flight.
+struct CUDAAllocatorStatsSnapshot {
+	static constexpr int NUM_SIZE_BUCKETS = 48; ///< Bucket i holds requests in [2^i, 2^(i+1)) bytes.
+	static constexpr int NUM_CHUNK_BUCKETS = 8; ///< Bucket i holds mappings split in [2^i, 2^(i+1)) chunks.
+
+	int deviceOrdinal; ///< -1 for blocks whose device is not known.
+	double timeMs; ///< When the snapshot was taken, for computing rates.
+
+	SizeType liveBytes; ///< Bytes held by live blocks, including rounding to size classes or granularity.
+	SizeType liveRequestedBytes; ///< Bytes the live blocks were asked for.
+	SizeType liveBlocks;
+	SizeType peakBytes; ///< Highest liveBytes since the start or the last resetPeaks().
+
+	SizeType numAllocs;
+	SizeType numFrees;
+	SizeType numFailedAllocs;
+
+	SizeType sizeHistogram[NUM_SIZE_BUCKETS]; ///< Allocations by requested size.
+
+	SizeType numPhysicalChunks; ///< Physical chunks mapped right now. Virtual allocator only.
+	SizeType chunksPerMappingHistogram[NUM_CHUNK_BUCKETS]; ///< How many chunks each mapping had to be split into. Virtual allocator only.
+
+	CUDAAllocatorStatsSnapshot();
+
+	/// Share of liveBytes nobody asked for, in [0, 1].
+	float getInternalFragmentation() const;
+
+	/// Allocations and frees per second between an older snapshot and this one.
+	void getRates(const CUDAAllocatorStatsSnapshot &older, double &allocsPerSecond, double &freesPerSecond) const;
+};
+
+/// Per device counters of an allocator.
+/// Updates are a few relaxed atomic operations and never lock, so the statistics are always on.
+/// Safe to use from many threads.
+struct CUDAAllocatorStats {
+	static constexpr int MAX_DEVICES = 16; ///< Devices with higher ordinals are counted as unknown.
+
+public:
+	CUDAAllocatorStats();
+
+	CUDAAllocatorStats(const CUDAAllocatorStats&) = delete;
+	CUDAAllocatorStats &operator=(const CUDAAllocatorStats&) = delete;
+
+	void recordAllocation(int deviceOrdinal, SizeType requestedBytes, SizeType reservedBytes);
+	void recordFree(int deviceOrdinal, SizeType requestedBytes, SizeType reservedBytes);
+
+	/// A live block changed its size in place.
+	void recordResize(int deviceOrdinal, SizeType oldRequestedBytes, SizeType oldReservedBytes, SizeType newRequestedBytes, SizeType newReservedBytes);
+
+	void recordFailedAllocation(int deviceOrdinal);
+
+	/// Physical chunks were mapped (delta > 0) or unmapped (delta < 0).
+	void recordPhysicalChunks(int deviceOrdinal, int delta);
+
+	/// A mapping of a new or grown block was split into numChunks physical chunks.
+	void recordMappingSplit(int deviceOrdinal, int numChunks);
+
+	/// Snapshot of one device.
+	/// @return false if the allocator was never used on the device.
+	bool getSnapshot(int deviceOrdinal, CUDAAllocatorStatsSnapshot &snapshot) const;
+
+	/// Snapshots of all devices the allocator was used on.
+	void getSnapshots(std::vector<CUDAAllocatorStatsSnapshot> &snapshots) const;
+
+	/// Start tracking the peak again from the current live bytes.
+	void resetPeaks();
+
+	/// Log the snapshots of all devices. Rates are computed since the previous dump.
+	void dump(const char *allocatorName, LogLevel level);
+
+	static int getSizeBucket(SizeType bytes);
+	static int getChunkBucket(int numChunks);
+
+private:
+	struct DeviceCounters {
+		std::atomic<bool> used;
+		std::atomic<SizeType> liveBytes;
+		std::atomic<SizeType> liveRequestedBytes;
+		std::atomic<SizeType> liveBlocks;
+		std::atomic<SizeType> peakBytes;
+		std::atomic<SizeType> numAllocs;
+		std::atomic<SizeType> numFrees;
+		std::atomic<SizeType> numFailedAllocs;
+		std::atomic<SizeType> sizeHistogram[CUDAAllocatorStatsSnapshot::NUM_SIZE_BUCKETS];
+		std::atomic<SizeType> numPhysicalChunks;
+		std::atomic<SizeType> chunksPerMappingHistogram[CUDAAllocatorStatsSnapshot::NUM_CHUNK_BUCKETS];
+	};
+
+	DeviceCounters &getCounters(int deviceOrdinal);
+	static void addLiveBytes(DeviceCounters &counters, SizeType bytes);
+	void takeSnapshot(int slot, CUDAAllocatorStatsSnapshot &snapshot) const;
+
+private:
+	DeviceCounters counters[MAX_DEVICES + 1]; ///< The last one is for unknown devices.
+
+	std::mutex dumpMutex;
+	std::vector<CUDAAllocatorStatsSnapshot> lastDumped; ///< Guarded by dumpMutex.
+};
+
+/// Calls a function every intervalMs milliseconds on a thread of its own, f.e. to dump allocator statistics.
+struct CUDAPeriodicReporter {
+	CUDAPeriodicReporter();
+	~CUDAPeriodicReporter();
+
+	CUDAPeriodicReporter(const CUDAPeriodicReporter&) = delete;
+	CUDAPeriodicReporter &operator=(const CUDAPeriodicReporter&) = delete;
+
+	/// Start calling report. A running reporter is stopped first.
+	void start(unsigned int intervalMs, std::function<void()> report);
+
+	/// Stop and wait for a report in progress to finish.
+	void stop();
+
+	bool isRunning() const;
+
+private:
+	void run(unsigned int intervalMs, std::function<void()> report);
+
+private:
+	mutable std::mutex mutex;
+	std::condition_variable stopRequested;
+	std::thread thread;
+	bool stopping;
+};
@@ -2,6 +2,8 @@
 
 #include <cuda_manager.h>
 
+#include <utility>
+
 template <class T>
 struct CUDABuffer {
 private:
@@ -19,10 +21,33 @@ public:
 
 	CUDABuffer(const CUDABuffer&) = delete;
 	CUDABuffer &operator=(const CUDABuffer&) = delete;
-	CUDABuffer(CUDABuffer&&) = delete;
-	CUDABuffer &operator=(CUDABuffer&&) = delete;
 
-	CUDAError initialize(SizeType size) {
+	/// Take over the memory of other, which is left empty. Nothing is copied or reallocated.
+	CUDABuffer(CUDABuffer &&other) noexcept : memBlock(other.memBlock) {
+		other.memBlock = CUDAMemBlock();
+	}
+
+	/// Free the memory held so far and take over the memory of other, which is left empty.
+	CUDABuffer &operator=(CUDABuffer &&other) noexcept {
+		if (this != &other) {
+			deinitialize();
+			memBlock = other.memBlock;
+			other.memBlock = CUDAMemBlock();
+		}
+		return *this;
+	}
+
+	void swap(CUDABuffer &other) noexcept {
+		std::swap(memBlock, other.memBlock);
+	}
+
+	/// Allocate size bytes of device memory.
+	/// Buffers of allocators which can grow in place keep their contents when they get bigger,
+	/// they are copied to a new block if growing in place fails.
+	/// @param size Size of the buffer in bytes.
+	/// @param stream Stream the buffer is going to be used on. Pooling allocators
+	/// reuse memory freed on that stream without synchronization.
+	CUDAError initialize(SizeType size, CUstream stream = NULL) {
 		if (size == 0) {
 			return CUDAError();
 		}
@@ -31,11 +56,21 @@ public:
 			memBlock.size = size;
 			return CUDAError();
 		}
+
+		if constexpr (Allocator::canGrowInPlace) {
+			if (memBlock.ptr != NULL) {
+				if (!grow(size).hasError()) {
+					return CUDAError();
+				}
+				return moveToNewBlock(size, stream);
+			}
+		}
 		
 		deinitialize();
 
 		memBlock.reserved = size;
 		memBlock.size = size;
+		memBlock.stream = stream;
 
 		CUDAManager &cudaman = getCUDAManager();
 		Allocator &allocator = cudaman.getAllocator<Allocator>();
@@ -62,6 +97,122 @@ public:
 		return CUDAError();
 	}
 
+	/// Grow the buffer to newSize bytes without moving it. Only for allocators which can grow in place.
+	/// The device pointer and the current contents are kept.
+	CUDAError grow(SizeType newSize) {
+		static_assert(Allocator::canGrowInPlace, "Allocator can't grow buffers in place!");
+
+		if (memBlock.ptr == NULL) {
+			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDABuffer_ERROR_NOT_INITIALIZED", "Attempt to grow uninitalized CUDABuffer!");
+		}
+
+		if (newSize <= memBlock.size) {
+			return CUDAError();
+		}
+
+		CUDAManager &cudaman = getCUDAManager();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.grow(memBlock, newSize));
+
+		return CUDAError();
+	}
+
+	/// Shrink the buffer to newSize bytes and give the unused memory back. Only for allocators which can grow in place.
+	/// The device pointer and the contents up to newSize are kept.
+	CUDAError shrink(SizeType newSize) {
+		static_assert(Allocator::canGrowInPlace, "Allocator can't shrink buffers in place!");
+
+		if (memBlock.ptr == NULL) {
+			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDABuffer_ERROR_NOT_INITIALIZED", "Attempt to shrink uninitalized CUDABuffer!");
+		}
+
+		if (newSize >= memBlock.size) {
+			return CUDAError();
+		}
+
+		CUDAManager &cudaman = getCUDAManager();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.shrink(memBlock, newSize));
+
+		return CUDAError();
+	}
+
+	/// Move the buffer to faster memory if some was freed since it was allocated. Only for allocators which can promote blocks.
+	/// The contents are copied on stream and handle() changes when the buffer moves, so kernels launched afterwards must use the new one.
+	/// Work using the old handle must be on stream or finished.
+	/// @param promoted Set to true if the buffer moved.
+	CUDAError promote(CUstream stream, bool &promoted) {
+		static_assert(Allocator::canPromote, "Allocator can't promote buffers!");
+
+		promoted = false;
+		if (memBlock.ptr == NULL) {
+			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDABuffer_ERROR_NOT_INITIALIZED", "Attempt to promote uninitalized CUDABuffer!");
+		}
+
+		if (stream != NULL) {
+			memBlock.stream = stream;
+		}
+
+		CUDAManager &cudaman = getCUDAManager();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.promote(memBlock, stream, promoted));
+
+		return CUDAError();
+	}
+
+	/// Memory tier the buffer lives in. Only for allocators which can promote blocks.
+	CUDAMemoryTier getMemoryTier() const {
+		static_assert(Allocator::canPromote, "Allocator has no memory tiers!");
+
+		if (memBlock.ptr == NULL) {
+			return CUDAMemoryTier::Count;
+		}
+
+		return getCUDAManager().getAllocator<Allocator>().getTier(memBlock);
+	}
+
+	/// Start moving the pages of the buffer to location, ordered on stream. Only for managed memory.
+	/// Kernels and host code touching the buffer afterwards don't fault on the pages which already arrived.
+	CUDAError prefetchTo(CUDAMemoryLocation location, CUstream stream) {
+		static_assert(Allocator::isManaged, "Only managed buffers can be prefetched!");
+
+		if (memBlock.ptr == NULL) {
+			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDABuffer_ERROR_NOT_INITIALIZED", "Attempt to prefetch uninitalized CUDABuffer!");
+		}
+
+		if (stream != NULL) {
+			memBlock.stream = stream;
+		}
+
+		CUDAManager &cudaman = getCUDAManager();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.prefetch(memBlock, location, stream));
+
+		return CUDAError();
+	}
+
+	/// Tell the driver how the buffer is used, see CUDAManagedAllocator::advise. Only for managed memory.
+	CUDAError advise(bool readMostly, CUDAMemoryLocation preferredLocation) {
+		static_assert(Allocator::isManaged, "Only managed buffers take advice!");
+
+		if (memBlock.ptr == NULL) {
+			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDABuffer_ERROR_NOT_INITIALIZED", "Attempt to advise uninitalized CUDABuffer!");
+		}
+
+		CUDAManager &cudaman = getCUDAManager();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.advise(memBlock, readMostly, preferredLocation));
+
+		return CUDAError();
+	}
+
+	/// Pointer the host can read and write the buffer through. Only for managed memory.
+	/// Work on the device using the buffer must be finished before the host touches it.
+	void *hostHandle() const {
+		static_assert(Allocator::isManaged, "Only managed buffers can be used from the host!");
+		return reinterpret_cast<void*>(memBlock.ptr);
+	}
+
 	CUDAError upload(const void *hostPtr) {
 		return uploadAsync(hostPtr, NULL);
 	}
@@ -76,9 +227,16 @@ public:
 			return CUDAError(CUDA_ERROR_UNKNOWN, "CUDABuffer_ERROR_IVALID_HOST_HANDLE", "");
 		}
 
+		if (stream != NULL) {
+			memBlock.stream = stream;
+		}
+
 		CUDAManager &cudaman = getCUDAManager();
 		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		CUDAProfiler::Range profileRange;
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().begin(stream, profileRange));
 		RETURN_ON_CUDA_ERROR_HANDLED(allocator.upload(memBlock, hostPtr, stream));
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().end("CUDABuffer::upload", stream, profileRange));
 
 		return CUDAError();
 	}
@@ -97,14 +255,112 @@ public:
 			return CUDAError(CUDA_ERROR_UNKNOWN, "CUDABuffer_ERROR_IVALID_HOST_HANDLE", "");
 		}
 
+		if (stream != NULL) {
+			memBlock.stream = stream;
+		}
+
 		CUDAManager &cudaman = getCUDAManager();
 		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		CUDAProfiler::Range profileRange;
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().begin(stream, profileRange));
 		RETURN_ON_CUDA_ERROR_HANDLED(allocator.download(memBlock, hostPtr, stream));
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().end("CUDABuffer::download", stream, profileRange));
 
 		return CUDAError();
 	}
 
-	CUDAMemHandle handle() {
+	/// Upload in chunks of at most maxChunkSize so kernels on other streams can start
+	/// on the landed part with transfer.waitForChunk() while the rest is still copied.
+	/// For overlap hostPtr should be page-locked.
+	CUDAError uploadChunked(const void *hostPtr, CUDAChunkedTransfer &transfer, CUstream stream, SizeType maxChunkSize = DEFAULT_TRANSFER_CHUNK_SIZE) {
+		if (memBlock.ptr == NULL) {
+			massert(memBlock.size == 0);
+			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDABuffer_ERROR_NOT_INITIALIZED", "Attempt to upload uninitalized CUDABuffer!");
+		}
+
+		if (hostPtr == nullptr) {
+			return CUDAError(CUDA_ERROR_UNKNOWN, "CUDABuffer_ERROR_IVALID_HOST_HANDLE", "");
+		}
+
+		if (stream != NULL) {
+			memBlock.stream = stream;
+		}
+
+		CUDAManager &cudaman = getCUDAManager();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		CUDAProfiler::Range profileRange;
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().begin(stream, profileRange));
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.uploadChunked(memBlock, hostPtr, transfer, maxChunkSize, stream));
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().end("CUDABuffer::uploadChunked", stream, profileRange));
+
+		return CUDAError();
+	}
+
+	/// Download in chunks of at most maxChunkSize. See uploadChunked().
+	CUDAError downloadChunked(void *hostPtr, CUDAChunkedTransfer &transfer, CUstream stream, SizeType maxChunkSize = DEFAULT_TRANSFER_CHUNK_SIZE) {
+		if (memBlock.ptr == NULL) {
+			massert(memBlock.size == 0);
+			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDABuffer_ERROR_NOT_INITIALIZED", "Attempt to download uninitalized CUDABuffer!");
+		}
+
+		if (hostPtr == nullptr) {
+			return CUDAError(CUDA_ERROR_UNKNOWN, "CUDABuffer_ERROR_IVALID_HOST_HANDLE", "");
+		}
+
+		if (stream != NULL) {
+			memBlock.stream = stream;
+		}
+
+		CUDAManager &cudaman = getCUDAManager();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		CUDAProfiler::Range profileRange;
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().begin(stream, profileRange));
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.downloadChunked(memBlock, hostPtr, transfer, maxChunkSize, stream));
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().end("CUDABuffer::downloadChunked", stream, profileRange));
+
+		return CUDAError();
+	}
+
+	/// Copy all of other to the start of this buffer. See the range version.
+	template <class U>
+	CUDAError copyFrom(const CUDABuffer<U> &other, CUstream stream) {
+		return copyFrom(other, 0, 0, other.getSize(), stream);
+	}
+
+	/// Copy size bytes at srcOffset of other to dstOffset of this buffer. The buffers may live on different devices.
+	/// Devices with a peer link copy directly, the others are staged through page-locked host memory, see CUDAPeerAccess.
+	/// @param stream Stream of the device of this buffer. The copy is ordered after the work already on it.
+	template <class U>
+	CUDAError copyFrom(const CUDABuffer<U> &other, SizeType dstOffset, SizeType srcOffset, SizeType size, CUstream stream) {
+		if (memBlock.ptr == NULL || other.handle() == NULL) {
+			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDABuffer_ERROR_NOT_INITIALIZED", "Attempt to copy from or to uninitalized CUDABuffer!");
+		}
+
+		if (dstOffset + size > memBlock.size || srcOffset + size > other.getSize()) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDABuffer_ERROR_INVALID_COPY_RANGE", "");
+		}
+
+		if (stream != NULL) {
+			memBlock.stream = stream;
+		}
+
+		CUDAManager &cudaman = getCUDAManager();
+		CUDAProfiler::Range profileRange;
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().begin(stream, profileRange));
+		RETURN_ON_CUDA_ERROR_HANDLED(copyBetweenDevices(
+			memBlock.ptr + dstOffset,
+			memBlock.deviceOrdinal,
+			other.handle() + srcOffset,
+			other.getDeviceOrdinal(),
+			size,
+			stream
+		));
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().end("CUDABuffer::copyFrom", stream, profileRange));
+
+		return CUDAError();
+	}
+
+	CUDAMemHandle handle() const {
 		return memBlock.ptr;
 	}
 
@@ -112,12 +368,49 @@ public:
 		return memBlock.size;
 	}
 
+	/// Driver ordinal of the device the buffer was allocated on, -1 if not known.
+	int getDeviceOrdinal() const {
+		return memBlock.deviceOrdinal;
+	}
+
+private:
+	/// Allocate a block of size bytes and copy the contents over before the current one is freed.
+	CUDAError moveToNewBlock(SizeType size, CUstream stream) {
+		CUDABASE_LOG(LogLevel::Warning, "CUDABuffer: failed to grow %llu bytes in place, copying them to a new block", (unsigned long long)memBlock.size);
+
+		CUDAMemBlock newBlock;
+		newBlock.reserved = size;
+		newBlock.size = size;
+		newBlock.stream = stream != NULL ? stream : memBlock.stream;
+
+		CUDAManager &cudaman = getCUDAManager();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.allocate(newBlock));
+
+		// The old block is unmapped right away when it is freed, so wait for the copy.
+		CUresult res = cuMemcpyDtoDAsync(newBlock.ptr, memBlock.ptr, memBlock.size, newBlock.stream);
+		if (res == CUDA_SUCCESS) {
+			res = cuStreamSynchronize(newBlock.stream);
+		}
+		if (res != CUDA_SUCCESS) {
+			allocator.free(newBlock);
+			RETURN_ON_CUDA_ERROR(res);
+		}
+
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.free(memBlock));
+		memBlock = newBlock;
+
+		return CUDAError();
+	}
+
 private:
 	CUDAMemBlock memBlock;
 };
 
 using CUDADefaultBuffer = CUDABuffer<CUDADefaultAllocator>;
 using CUDAVirtualBuffer = CUDABuffer<CUDAVirtualAllocator>;
+using CUDAFallbackBuffer = CUDABuffer<CUDAFallbackAllocator>;
+using CUDAManagedBuffer = CUDABuffer<CUDAManagedAllocator>;
 
 template <typename T>
 struct CUDAPinnedMemoryBuffer {
@@ -129,58 +422,101 @@ public:
 	using HostMemHandle = void*;
 
 public:
-	CUDAPinnedMemoryBuffer() : hostPtr(nullptr) { }
+	CUDAPinnedMemoryBuffer() : mappedPtr(NULL), mode(CUDAHostMemoryMode::Staged) { }
 
 	~CUDAPinnedMemoryBuffer() {
 		deinitialize();
 	}
 
-	// TODO: try zero copy. Somehow we need to know which device allocates the pinned memory so we can ask
-	// if it has the CU_DEVICE_ATTRIBUTE_CAN_USE_HOST_POINTER_FOR_REGISTERED_MEM so it can just use the hostPtr
-	CUDAError initialize(SizeType size) {
+	CUDAPinnedMemoryBuffer(const CUDAPinnedMemoryBuffer&) = delete;
+	CUDAPinnedMemoryBuffer &operator=(const CUDAPinnedMemoryBuffer&) = delete;
+
+	/// Take over the host slice and device side of other, which is left empty.
+	CUDAPinnedMemoryBuffer(CUDAPinnedMemoryBuffer &&other) noexcept
+		: memBlock(other.memBlock), hostSlice(other.hostSlice), mappedPtr(other.mappedPtr), mode(other.mode) {
+		other.reset();
+	}
+
+	/// Free the memory held so far and take over the memory of other, which is left empty.
+	CUDAPinnedMemoryBuffer &operator=(CUDAPinnedMemoryBuffer &&other) noexcept {
+		if (this != &other) {
+			deinitialize();
+			memBlock = other.memBlock;
+			hostSlice = other.hostSlice;
+			mappedPtr = other.mappedPtr;
+			mode = other.mode;
+			other.reset();
+		}
+		return *this;
+	}
+
+	void swap(CUDAPinnedMemoryBuffer &other) noexcept {
+		std::swap(memBlock, other.memBlock);
+		std::swap(hostSlice, other.hostSlice);
+		std::swap(mappedPtr, other.mappedPtr);
+		std::swap(mode, other.mode);
+	}
+
+	/// Allocate a slice of page-locked host memory from the manager's CUDAPinnedHostPool
+	/// and its device side.
+	/// @param size Size of the buffer in bytes.
+	/// @param stream Stream the buffer is going to be used on.
+	/// @param requestedMode How the device side is backed. CUDAHostMemoryMode::Auto uses
+	/// the preference of the device current on the calling thread.
+	CUDAError initialize(SizeType size, CUstream stream = NULL, CUDAHostMemoryMode requestedMode = CUDAHostMemoryMode::Auto) {
 		if (size <= 0) {
 			return CUDAError(CUDA_ERROR_UNKNOWN, "CUDAPinnedMemoryBuffer_INVALID_INIT_ARGUMENTS", "");
 		}
 
-		if (memBlock.ptr != NULL && memBlock.reserved >= size) {
+		CUDAManager &cudaman = getCUDAManager();
+		if (requestedMode == CUDAHostMemoryMode::Auto) {
+			RETURN_ON_CUDA_ERROR_HANDLED(bindThreadContext());
+			const CUDADevice *device = cudaman.getCurrentDevice();
+			requestedMode = device ? device->getHostMemoryMode() : CUDAHostMemoryMode::Staged;
+		}
+
+		if (handle() != NULL && mode == requestedMode && hostSlice.size >= size && (mode == CUDAHostMemoryMode::Mapped || memBlock.reserved >= size)) {
 			memBlock.size = size;
 			return CUDAError();
 		}
 
-		if (memBlock.ptr != NULL && memBlock.reserved < size) {
-			deinitialize();
-		}
+		RETURN_ON_CUDA_ERROR_HANDLED(deinitialize());
+
+		mode = requestedMode;
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getPinnedHostPool().acquire(size, hostSlice));
 
-		if (hostPtr != nullptr) {
-			RETURN_ON_CUDA_ERROR(cuMemHostAlloc(&hostPtr, size, CU_MEMHOSTALLOC_PORTABLE));
+		memBlock.stream = stream;
+
+		if (mode == CUDAHostMemoryMode::Mapped) {
+			// The pool's chunks are allocated with CU_MEMHOSTALLOC_DEVICEMAP, so every slice is mapped already.
+			RETURN_ON_CUDA_ERROR(cuMemHostGetDevicePointer(reinterpret_cast<CUdeviceptr*>(&mappedPtr), hostSlice.ptr, 0));
+			memBlock.size = size;
+			return CUDAError();
 		}
 
 		memBlock.size = size;
 		memBlock.reserved = size;
 		
-		CUDAManager &cudaman = getCUDAManager();
-		Allocator allocator = cudaman.getAllocator<Allocator>();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
 		RETURN_ON_CUDA_ERROR_HANDLED(allocator.allocate(memBlock));
 
 		return CUDAError();
 	}
 
 	CUDAError deinitialize() {
-		if (hostPtr != nullptr) {
-			RETURN_ON_CUDA_ERROR(cuMemFreeHost(hostPtr));
-			hostPtr = nullptr;
-		}
+		CUDAManager &cudaman = getCUDAManager();
+
+		// The slice goes back to the pool only once the last stream we used it on is done with it.
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getPinnedHostPool().release(hostSlice, memBlock.stream));
+		mappedPtr = NULL;
 
 		if (memBlock.ptr == NULL) {
-			massert(hostPtr == nullptr);
-			massert(memBlock.size == 0);
 			memBlock.size = 0;
 			memBlock.reserved = 0;
 			return CUDAError();
 		}
 
-		CUDAManager &cudaman = getCUDAManager();
-		Allocator allocator = cudaman.getAllocator<Allocator>();
+		Allocator &allocator = cudaman.getAllocator<Allocator>();
 		RETURN_ON_CUDA_ERROR_HANDLED(allocator.free(memBlock));
 		memBlock.ptr = NULL;
 		memBlock.size = 0;
@@ -193,61 +529,113 @@ public:
 		return uploadAsync(NULL);
 	}
 
+	/// Copy the host memory to the device side. Does nothing in mapped mode
+	/// but the stream is still remembered so the host slice outlives the work on it.
 	CUDAError uploadAsync(CUstream stream) {
-		if (memBlock.ptr == NULL) {
+		if (handle() == NULL) {
 			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDAPinnedMemoryBuffer_NOT_INITIALIZED", "");
 		}
 
-		if (hostPtr == nullptr) {
+		if (hostSlice.ptr == nullptr) {
 			return CUDAError(CUDA_ERROR_UNKNOWN, "CUDABuffer_ERROR_IVALID_HOST_HANDLE", "");
 		}
 
 		massert(memBlock.size > 0);
 
+		if (stream != NULL) {
+			memBlock.stream = stream;
+		}
+
+		if (mode == CUDAHostMemoryMode::Mapped) {
+			return CUDAError();
+		}
+
 		CUDAManager &cudaman = getCUDAManager();
 		Allocator &allocator = cudaman.getAllocator<Allocator>();
-		RETURN_ON_CUDA_ERROR_HANDLED(allocator.upload(memBlock, hostPtr, stream));
+		CUDAProfiler::Range profileRange;
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().begin(stream, profileRange));
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.upload(memBlock, hostSlice.ptr, stream));
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().end("CUDAPinnedMemoryBuffer::upload", stream, profileRange));
 
 		return CUDAError();
 	}
 
+	/// Copy the device side to the host memory and wait for it, hostHandle() can be read afterwards.
 	CUDAError download() {
 		return downloadAsync(NULL);
 	}
 
+	/// Copy the device side to the host memory. In mapped mode there is nothing to copy,
+	/// but with stream NULL the call still waits for the work on the buffer's stream
+	/// (or on the context if it has none), like the blocking copy of staged mode does.
 	CUDAError downloadAsync(CUstream stream) {
-		if (memBlock.ptr == NULL) {
+		if (handle() == NULL) {
 			return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDAPinnedMemoryBuffer_NOT_INITIALIZED", "");
 		}
 
-		if (hostPtr == nullptr) {
+		if (hostSlice.ptr == nullptr) {
 			return CUDAError(CUDA_ERROR_UNKNOWN, "CUDABuffer_ERROR_IVALID_HOST_HANDLE", "");
 		}
 
 		massert(memBlock.size > 0);
 
+		if (stream != NULL) {
+			memBlock.stream = stream;
+		}
+
+		if (mode == CUDAHostMemoryMode::Mapped) {
+			// Kernels write the host memory directly, so the blocking download only has to wait for them.
+			if (stream == NULL) {
+				if (memBlock.stream != NULL) {
+					RETURN_ON_CUDA_ERROR(cuStreamSynchronize(memBlock.stream));
+				} else {
+					RETURN_ON_CUDA_ERROR(cuCtxSynchronize());
+				}
+			}
+			return CUDAError();
+		}
+
 		CUDAManager &cudaman = getCUDAManager();
 		Allocator &allocator = cudaman.getAllocator<Allocator>();
-		RETURN_ON_CUDA_ERROR_HANDLED(allocator.download(memBlock, hostPtr, stream));
+		CUDAProfiler::Range profileRange;
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().begin(stream, profileRange));
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator.download(memBlock, hostSlice.ptr, stream));
+		RETURN_ON_CUDA_ERROR_HANDLED(cudaman.getProfiler().end("CUDAPinnedMemoryBuffer::download", stream, profileRange));
 
 		return CUDAError();
 	}
 
 	HostMemHandle hostHandle() const {
-		return hostPtr;
+		return hostSlice.ptr;
 	}
 
+	/// Device pointer to pass to kernels. Points to the host memory in mapped mode.
 	CUDAMemHandle handle() const {
-		return memBlock.ptr;
+		return mode == CUDAHostMemoryMode::Mapped ? mappedPtr : memBlock.ptr;
 	}
 
 	SizeType getSize() const {
 		return memBlock.size;
 	}
 
+	CUDAHostMemoryMode getMode() const {
+		return mode;
+	}
+
+private:
+	/// Forget the memory without freeing it, after it was moved to another buffer.
+	void reset() {
+		memBlock = CUDAMemBlock();
+		hostSlice = CUDAPinnedSlice();
+		mappedPtr = NULL;
+		mode = CUDAHostMemoryMode::Staged;
+	}
+
 private:
 	CUDAMemBlock memBlock;
-	HostMemHandle hostPtr;
+	CUDAPinnedSlice hostSlice;
+	CUDAMemHandle mappedPtr;
+	CUDAHostMemoryMode mode;
 };
 
 using CUDADefaultPinnedBuffer = CUDAPinnedMemoryBuffer<CUDADefaultAllocator>;
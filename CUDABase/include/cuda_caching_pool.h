@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cuda_memory_backend.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/// Identifies the stream a pooled block was last used on.
+/// The context is part of the key since the NULL stream is per context
+/// and a block must never be handed out to a different device.
+struct CUDAPoolStream {
+	CUcontext ctx;
+	CUstream stream;
+
+	CUDAPoolStream() : ctx(NULL), stream(NULL) { }
+	CUDAPoolStream(CUcontext ctx, CUstream stream) : ctx(ctx), stream(stream) { }
+
+	bool operator==(const CUDAPoolStream &other) const {
+		return ctx == other.ctx && stream == other.stream;
+	}
+};
+
+namespace std {
+template <>
+struct hash<CUDAPoolStream> {
+	std::size_t operator()(const CUDAPoolStream &key) const {
+		return hash<void*>()(key.ctx) ^ (hash<void*>()(key.stream) << 1);
+	}
+};
+}
+
+struct CUDAPoolThreadCache;
+
+/// Size-class caching pool on top of a CUDAMemoryBackend.
+/// Freed blocks are not returned to the backend but kept on a free list
+/// for the stream they were last used on. A later allocation on the same stream
+/// reuses them without any synchronization since the stream already orders the
+/// old and the new work. Blocks are only given back to the backend when the cached
+/// bytes go above the high-water cap, on trim() or on deinitialize().
+/// With a fence backend, a block cached on another stream of the same context is
+/// reused when the stream it was freed on is done with it, instead of asking the backend.
+/// If the backend is out of memory, the pool waits for that stream before it releases its cache.
+///
+/// The pool can be used from many threads. Small blocks freed with a known size and
+/// context go to a cache owned by the calling thread, which later allocations on that
+/// thread take from without locking. The thread cache is refilled from and flushed to
+/// the shared free lists in batches, and is returned to them when the thread exits.
+struct CUDACachingPool {
+	static constexpr SizeType MIN_BIN_SIZE = 512;
+	static constexpr SizeType SMALL_BIN_LIMIT = SizeType(1) << 20;
+	static constexpr SizeType LARGE_BIN_GRANULARITY = SizeType(2) << 20;
+	static constexpr SizeType DEFAULT_MAX_CACHED_BYTES = 512 * MEGABYTE_IN_BYTES;
+	static constexpr int THREAD_CACHE_MAX_BLOCKS = 16;
+	static constexpr SizeType THREAD_CACHE_MAX_BYTES = SizeType(4) << 20;
+	static constexpr int THREAD_CACHE_REFILL_COUNT = 4;
+
+public:
+	CUDACachingPool();
+	~CUDACachingPool();
+
+	CUDACachingPool(const CUDACachingPool&) = delete;
+	CUDACachingPool &operator=(const CUDACachingPool&) = delete;
+
+	/// @param backend Where the memory comes from. Must outlive the pool.
+	/// @param maxCachedBytes High-water cap for the bytes kept on the free lists.
+	/// @param fenceBackend Used to find out when blocks cached on other streams can be reused.
+	/// nullptr means blocks are only reused on the stream they were freed on. Must outlive the pool.
+	CUDAError initialize(CUDAMemoryBackend *backend, SizeType maxCachedBytes = DEFAULT_MAX_CACHED_BYTES, CUDAFenceBackend *fenceBackend = nullptr);
+
+	/// Releases all cached blocks. Blocks still in use are released as well.
+	/// No other thread may use the pool during the call.
+	CUDAError deinitialize();
+
+	/// Get a block of at least size bytes usable on the given stream.
+	/// @param ptr Handle to the block.
+	/// @param blockSize Actual size of the block. Always >= size.
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType &blockSize, SizeType size, CUDAPoolStream stream);
+
+	/// Return a block to the free list of the given stream in the context it was allocated in.
+	/// Pending work on that stream may still use the block.
+	CUDAError free(CUDAMemHandle ptr, CUstream stream);
+
+	/// Same as free(ptr, stream), but small blocks go to the calling thread's cache without locking.
+	/// Without the lock the block can't be looked up, only freeing it again while it is in the cache
+	/// of the calling thread is caught. Callers which may free unknown blocks must check them first,
+	/// like CUDADefaultAllocator does.
+	/// @param blockSize Size returned by allocate.
+	/// @param stream Stream the block was last used on, in the context it was allocated in.
+	CUDAError free(CUDAMemHandle ptr, SizeType blockSize, CUDAPoolStream stream);
+
+	/// Release cached blocks back to the backend until at most targetCachedBytes are cached.
+	/// Blocks in the caches of other threads are not touched, they are bounded by THREAD_CACHE_MAX_BYTES each.
+	CUDAError trim(SizeType targetCachedBytes = 0);
+
+	void setMaxCachedBytes(SizeType maxBytes);
+	SizeType getMaxCachedBytes() const;
+
+	/// Bytes sitting on the free lists and in thread caches.
+	SizeType getCachedBytes() const;
+
+	/// Bytes handed out and not yet freed. Blocks freed to a thread cache are not counted.
+	SizeType getLiveBytes() const;
+
+	/// Number of blocks on the free lists.
+	SizeType getNumCachedBlocks() const;
+
+	/// Size class for a request of size bytes.
+	/// Small requests are rounded to the next power of two, large ones to LARGE_BIN_GRANULARITY.
+	static SizeType getBinSize(SizeType size);
+
+private:
+	using FreeList = std::multimap<SizeType, CUDAMemHandle>;
+
+	struct LiveBlock {
+		SizeType size;
+		CUcontext ctx;
+	};
+
+	friend struct CUDAPoolThreadCacheSet;
+
+	bool takeCached(CUDAMemHandle &ptr, SizeType &blockSize, SizeType binSize, CUDAPoolStream stream);
+
+	/// Take a block cached on another stream of stream's context once that stream is done with it.
+	/// @param waitForStream Block until the other stream is done instead of only taking blocks of idle streams.
+	bool takeFromOtherStream(CUDAMemHandle &ptr, SizeType &blockSize, SizeType binSize, CUDAPoolStream stream, bool waitForStream);
+	CUDAError releaseCached(FreeList &freeList, SizeType targetCachedBytes);
+	CUDAError freeLocked(CUDAMemHandle ptr, CUstream stream);
+	CUDAError trimLocked(SizeType targetCachedBytes);
+
+	/// Cache of the calling thread. nullptr if it does not exist and create is false or it can't be created.
+	CUDAPoolThreadCache *getThreadCache(bool create);
+
+	/// Move blocks of a thread cache to the shared free lists, keeping the newest numToKeep. Needs mutex.
+	void flushThreadCache(CUDAPoolThreadCache &cache, int numToKeep);
+
+	/// Move up to THREAD_CACHE_REFILL_COUNT - 1 cached blocks of binSize on stream to the thread cache. Needs mutex.
+	void refillThreadCache(CUDAPoolThreadCache &cache, SizeType binSize, CUDAPoolStream stream);
+
+private:
+	mutable std::mutex mutex; ///< Guards everything but the thread caches.
+	CUDAMemoryBackend *backend;
+	CUDAFenceBackend *fenceBackend;
+	std::unordered_map<CUDAPoolStream, FreeList> freeLists;
+	std::unordered_map<CUDAMemHandle, LiveBlock> liveBlocks; ///< Includes the blocks in thread caches.
+	std::vector<CUDAPoolThreadCache*> threadCaches; ///< Guarded by the global thread cache mutex.
+	std::atomic<SizeType> threadCachedBytes;
+	std::atomic<SizeType> numThreadCachedBlocks;
+	SizeType maxCachedBytes;
+	SizeType cachedBytes;
+	SizeType liveBytes; ///< Bytes of liveBlocks, so thread cached blocks are included.
+};
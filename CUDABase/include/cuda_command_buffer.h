@@ -0,0 +1,255 @@
+#pragma once
+
+#include <cuda_manager.h>
+
+#include <cstring>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+enum class CUDACommandType : int {
+	Upload = 0,
+	Download,
+	Kernel,
+	WaitEvent, ///< Later commands wait for the last record of the event.
+	RecordEvent,
+};
+
+const char *getCommandTypeName(CUDACommandType type);
+
+/// Recorded operation of a CUDACommandBuffer.
+struct CUDACommand {
+	CUDACommandType type;
+
+	// Upload and Download
+	CUDAMemHandle devicePtr;
+	void *hostPtr;
+	SizeType size;
+
+	// Kernel
+	CUfunction func;
+	CUDALaunchConfig config;
+	const char *name;
+	int firstArg; ///< Index of the first argument in the argument storage of the buffer.
+	int numArgs;
+
+	// WaitEvent and RecordEvent
+	CUevent event;
+
+	CUDACommand()
+		: type(CUDACommandType::Kernel),
+		devicePtr(NULL),
+		hostPtr(nullptr),
+		size(0),
+		func(NULL),
+		name(nullptr),
+		firstArg(0),
+		numArgs(0),
+		event(NULL) { }
+};
+
+/// Issues the commands of a CUDACommandBuffer.
+struct CUDACommandBackend {
+	virtual ~CUDACommandBackend() { }
+
+	virtual CUDAError getCurrentContext(CUcontext &ctx) = 0;
+	virtual CUDAError setCurrentContext(CUcontext ctx) = 0;
+
+	virtual CUDAError upload(CUDAMemHandle dst, const void *src, SizeType size, CUstream stream) = 0;
+	virtual CUDAError download(void *dst, CUDAMemHandle src, SizeType size, CUstream stream) = 0;
+	/// @param paramSizes Size of each parameter, only informative since the driver knows them from the kernel.
+	virtual CUDAError launch(CUfunction func, void **params, const SizeType *paramSizes, int numParams, const CUDALaunchConfig &config, CUstream stream, const char *name) = 0;
+	virtual CUDAError waitEvent(CUstream stream, CUevent event) = 0;
+	virtual CUDAError recordEvent(CUevent event, CUstream stream) = 0;
+};
+
+/// Commands go to the driver, kernels through launchKernel.
+/// The context of threads which have none yet is bound with bindThreadContext.
+struct CUDADriverCommandBackend : CUDACommandBackend {
+	CUDAError getCurrentContext(CUcontext &ctx) override;
+	CUDAError setCurrentContext(CUcontext ctx) override;
+	CUDAError upload(CUDAMemHandle dst, const void *src, SizeType size, CUstream stream) override;
+	CUDAError download(void *dst, CUDAMemHandle src, SizeType size, CUstream stream) override;
+	CUDAError launch(CUfunction func, void **params, const SizeType *paramSizes, int numParams, const CUDALaunchConfig &config, CUstream stream, const char *name) override;
+	CUDAError waitEvent(CUstream stream, CUevent event) override;
+	CUDAError recordEvent(CUevent event, CUstream stream) override;
+};
+
+/// Host stand-in for CUDADriverCommandBackend.
+/// Nothing is executed, the submitted commands and context switches are only recorded,
+/// so the order a CUDACommandBuffer issues its work in can be checked without a GPU.
+struct CUDAHostCommandBackend : CUDACommandBackend {
+	/// A command as it was submitted, kernel arguments copied out of the buffer.
+	struct Submission {
+		CUDACommand command;
+		CUstream stream;
+		CUcontext ctx; ///< Context current when it was submitted.
+		std::vector<std::vector<char>> args; ///< Value of every kernel argument.
+	};
+
+public:
+	CUDAHostCommandBackend();
+
+	/// Context reported as current before the first setCurrentContext.
+	void setInitialContext(CUcontext ctx);
+
+	CUDAError getCurrentContext(CUcontext &ctx) override;
+	CUDAError setCurrentContext(CUcontext ctx) override;
+	CUDAError upload(CUDAMemHandle dst, const void *src, SizeType size, CUstream stream) override;
+	CUDAError download(void *dst, CUDAMemHandle src, SizeType size, CUstream stream) override;
+	CUDAError launch(CUfunction func, void **params, const SizeType *paramSizes, int numParams, const CUDALaunchConfig &config, CUstream stream, const char *name) override;
+	CUDAError waitEvent(CUstream stream, CUevent event) override;
+	CUDAError recordEvent(CUevent event, CUstream stream) override;
+
+	std::vector<Submission> getSubmissions() const;
+	int getNumContextSwitches() const;
+	void reset();
+
+private:
+	void submit(const CUDACommand &command, CUstream stream);
+
+private:
+	mutable std::mutex mutex;
+	std::vector<Submission> submissions;
+	CUcontext currentCtx;
+	int numContextSwitches;
+};
+
+/// Records transfers, kernel launches and event operations for a single stream and submits them together in flush().
+/// Many small launches from different call sites then cost one context switch at most instead of one each,
+/// and the work of a frame can be assembled before any of it reaches the driver.
+/// While recording
+///  - kernel arguments are copied into the buffer, so they can change right after the call,
+///  - uploads or downloads continuing the previous one in both host and device memory are merged into one copy,
+///  - waits for an event the stream already waits for are dropped.
+/// Host memory of transfers is read when the commands are flushed and should be page-locked for the copies to be asynchronous.
+/// Opt-in, the buffers, kernels and transfers of CUDABase still submit directly.
+/// Not safe to use from many threads, use one buffer per stream and thread.
+struct CUDACommandBuffer {
+	CUDACommandBuffer();
+	~CUDACommandBuffer();
+
+	CUDACommandBuffer(const CUDACommandBuffer&) = delete;
+	CUDACommandBuffer &operator=(const CUDACommandBuffer&) = delete;
+
+	/// @param stream Stream all commands are submitted to.
+	/// @param ctx Context of stream. NULL means the one current on the calling thread.
+	/// @param backend Where the commands are submitted to. nullptr means the driver. Must outlive the buffer.
+	CUDAError initialize(CUstream stream, CUcontext ctx = NULL, CUDACommandBackend *backend = nullptr);
+
+	/// Flush the pending commands.
+	CUDAError deinitialize();
+
+	/// Flush on its own once this many commands are pending. 0, the default, only flushes when asked to.
+	void setAutoFlushThreshold(int numCommands);
+	int getAutoFlushThreshold() const { return autoFlushThreshold; }
+
+	CUDAError recordUpload(CUDAMemHandle dst, const void *src, SizeType size);
+	CUDAError recordDownload(void *dst, CUDAMemHandle src, SizeType size);
+
+	/// Record a launch of func with the given arguments, which are copied.
+	/// Args must match the kernel's parameters in the PTX, device pointers are passed as CUDAMemHandle.
+	template <class ...Args>
+	CUDAError recordKernel(CUfunction func, const CUDALaunchConfig &config, const char *name, const Args &...args) {
+		if (func == NULL) {
+			return CUDAError(CUDA_ERROR_INVALID_HANDLE, "CUDACommandBuffer_ERROR_INVALID_FUNCTION", "");
+		}
+
+		CUDACommand command;
+		command.type = CUDACommandType::Kernel;
+		command.func = func;
+		command.config = config;
+		command.name = name;
+		command.firstArg = int(argOffsets.size());
+		command.numArgs = int(sizeof...(Args));
+
+		(addArg(args), ...);
+
+		return addCommand(command);
+	}
+
+	/// Record a launch of a CUDAFunction or a TypedKernel with the given arguments.
+	/// The arguments stored in the kernel object are not used.
+	template <class Kernel, class ...Args>
+	CUDAError recordLaunch(Kernel &kernel, const CUDALaunchConfig &config, const Args &...args) {
+		return recordKernel(kernel.getFunction(), config, nullptr, args...);
+	}
+
+	template <class Buffer>
+	CUDAError recordUpload(Buffer &buffer, const void *src) {
+		return recordUpload(buffer.handle(), src, buffer.getSize());
+	}
+
+	template <class Buffer>
+	CUDAError recordDownload(void *dst, Buffer &buffer) {
+		return recordDownload(dst, buffer.handle(), buffer.getSize());
+	}
+
+	/// Make the commands recorded after this wait for the last record of event at the time of the flush.
+	CUDAError recordWaitEvent(CUevent event);
+	CUDAError recordEvent(CUevent event);
+
+	/// Submit all pending commands in recording order, switching to the buffer's context if it is not current already.
+	/// The context current before is restored afterwards.
+	/// Commands after a failing one are dropped.
+	CUDAError flush();
+
+	/// Drop the pending commands without submitting them.
+	void discard();
+
+	CUstream getStream() const { return stream; }
+	CUcontext getContext() const { return ctx; }
+
+	/// Pending commands in recording order.
+	const std::vector<CUDACommand> &getCommands() const { return commands; }
+	int getNumPendingCommands() const { return int(commands.size()); }
+
+	/// Pointer to argument argIndex of a pending kernel command.
+	const void *getArg(const CUDACommand &command, int argIndex) const;
+
+	/// Commands which were dropped or merged into the previous one while recording.
+	SizeType getNumMergedCommands() const { return numMerged; }
+	SizeType getNumFlushes() const { return numFlushes; }
+	SizeType getNumSubmittedCommands() const { return numSubmitted; }
+
+private:
+	friend CUDAError flushCommandBuffers(CUDACommandBuffer *const *buffers, int count);
+
+	template <class T>
+	void addArg(const T &arg) {
+		static_assert(std::is_trivially_copyable<T>::value, "Kernel arguments must be trivially copyable!");
+
+		// The driver reads each argument through its pointer, so it has to be aligned for its type.
+		// The storage itself is aligned for any type.
+		const SizeType alignedOffset = (SizeType(args.size()) + alignof(T) - 1) / alignof(T) * alignof(T);
+		args.resize(size_t(alignedOffset + sizeof(T)));
+		memcpy(args.data() + alignedOffset, &arg, sizeof(T));
+		argOffsets.push_back(alignedOffset);
+		argSizes.push_back(sizeof(T));
+	}
+
+	CUDAError addCommand(const CUDACommand &command);
+
+	/// Submit the pending commands, the context has to be current already.
+	CUDAError submit();
+
+private:
+	std::vector<CUDACommand> commands;
+	std::vector<char> args; ///< Argument values of the pending kernel commands.
+	std::vector<SizeType> argOffsets; ///< Offset of each argument in args.
+	std::vector<SizeType> argSizes;
+	std::vector<void*> argPointers; ///< Argument pointers handed to the backend, rebuilt on each flush.
+	CUDADriverCommandBackend driverBackend;
+	CUDACommandBackend *backend;
+	CUstream stream;
+	CUcontext ctx;
+	int autoFlushThreshold;
+	SizeType numMerged;
+	SizeType numFlushes;
+	SizeType numSubmitted;
+};
+
+/// Flush buffers in the given order with as few context switches as possible.
+/// Consecutive buffers of the same context share one switch and the context current before is restored once at the end.
+/// All buffers must use the same backend. Stops at the first error.
+CUDAError flushCommandBuffers(CUDACommandBuffer *const *buffers, int count);
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cuda_memory_defines.h>
+
+/// How the device side of a CUDAPinnedMemoryBuffer is backed.
+enum class CUDAHostMemoryMode : int {
+	Auto = 0, ///< Let the device decide. See chooseHostMemoryMode.
+	Staged, ///< Separate device allocation. upload()/download() copy over the bus.
+	Mapped, ///< Device reads and writes the page-locked host memory directly. upload()/download() are no-ops.
+};
+
+/// Snapshot of the device attributes CUDABase makes decisions on.
+/// Kept as plain data so the decisions can be checked with hand-filled values.
+struct CUDADeviceProperties {
+	int ordinal;
+	int computeCapabilityMajor;
+	int computeCapabilityMinor;
+	SizeType totalMem;
+	bool unifiedAddressing;
+	bool integrated;
+	bool canMapHostMemory;
+	bool canUseHostPointerForRegisteredMem;
+	bool cooperativeLaunch;
+	int warpSize;
+	int multiProcessorCount;
+	int maxThreadsPerBlock;
+	int maxBlockDim[3];
+	int maxGridDim[3];
+	int maxSharedMemPerBlock; ///< Shared memory available to a block without opting in.
+	int maxSharedMemPerBlockOptin; ///< Shared memory a block can get after raising CU_FUNC_ATTRIBUTE_MAX_DYNAMIC_SHARED_SIZE_BYTES.
+
+	CUDADeviceProperties()
+		: ordinal(-1),
+		computeCapabilityMajor(0),
+		computeCapabilityMinor(0),
+		totalMem(0),
+		unifiedAddressing(false),
+		integrated(false),
+		canMapHostMemory(false),
+		canUseHostPointerForRegisteredMem(false),
+		cooperativeLaunch(false),
+		warpSize(32),
+		multiProcessorCount(0),
+		maxThreadsPerBlock(0),
+		maxBlockDim{ 0, 0, 0 },
+		maxGridDim{ 0, 0, 0 },
+		maxSharedMemPerBlock(0),
+		maxSharedMemPerBlockOptin(0) { }
+
+	/// Clusters of thread blocks need compute capability 9.0.
+	bool supportsClusterLaunch() const {
+		return computeCapabilityMajor >= 9;
+	}
+};
+
+/// Fill props with the attributes of dev.
+CUDAError queryDeviceProperties(CUdevice dev, int ordinal, CUDADeviceProperties &props);
+
+/// Pick the cheapest way for the device to access pinned host buffers.
+/// Integrated GPUs share the physical memory with the host, so a separate device
+/// copy is pure overhead. Devices which can use host pointers of registered memory
+/// directly also access mapped memory efficiently.
+/// @return Never CUDAHostMemoryMode::Auto.
+CUDAHostMemoryMode chooseHostMemoryMode(const CUDADeviceProperties &props);
+
+/// CUDABase needs unified addressing and compute capability 5.2 or newer.
+bool isDeviceSupported(const CUDADeviceProperties &props);
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cuda_device_properties.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct CUDADevice;
+
+/// Lifetime of a device slot in a CUDADeviceRegistry.
+enum class CUDADeviceState : int {
+	Discovered = 0, ///< Properties are known, no context exists yet.
+	Initializing, ///< Bring-up in progress.
+	Ready, ///< Context, module and streams are created.
+	Failed, ///< Bring-up failed. The device is skipped by later lookups.
+};
+
+const char *getDeviceStateName(CUDADeviceState state);
+
+/// What a device has to offer to be picked by CUDADeviceRegistry::findDevice.
+struct CUDADeviceRequirements {
+	int minComputeCapabilityMajor;
+	int minComputeCapabilityMinor;
+	SizeType minTotalMem;
+	bool cooperativeLaunch;
+	bool clusterLaunch;
+	bool preferMostMemory; ///< Pick the matching device with the most memory instead of the first one.
+
+	CUDADeviceRequirements()
+		: minComputeCapabilityMajor(0),
+		minComputeCapabilityMinor(0),
+		minTotalMem(0),
+		cooperativeLaunch(false),
+		clusterLaunch(false),
+		preferMostMemory(false) { }
+};
+
+bool meetsRequirements(const CUDADeviceProperties &props, const CUDADeviceRequirements &requirements);
+
+/// Parse a CUDA_VISIBLE_DEVICES-style list of device ordinals, f.e. "2,0".
+/// Like the driver, parsing stops at the first entry which is not a valid ordinal,
+/// is out of range or repeats an earlier one. A null spec makes all devices visible.
+/// @param ordinals Visible ordinals in the order they are listed.
+/// @return false if an entry was rejected.
+bool parseVisibleDevices(const char *spec, int deviceCount, std::vector<int> &ordinals);
+
+/// Discovery and bring-up of devices as seen by CUDADeviceRegistry.
+/// Implemented on top of the driver API by CUDADefaultDeviceDriver. Tests can
+/// plug in a fake to drive the registry without a GPU.
+struct CUDADeviceDriver {
+	virtual ~CUDADeviceDriver() { }
+
+	virtual CUDAError getDeviceCount(int &count) = 0;
+
+	/// Attributes of the device. Should be cheap, no context may be created.
+	virtual CUDAError queryDevice(int ordinal, CUDADeviceProperties &props) = 0;
+
+	/// Create everything needed to run work on the device.
+	virtual CUDAError initializeDevice(int ordinal, CUDADevice &device) = 0;
+	virtual CUDAError deinitializeDevice(CUDADevice &device) = 0;
+};
+
+/// Devices visible to the process.
+/// discover() only enumerates the devices and reads their attributes. A device is
+/// brought up the first time it is asked for, so processes using one GPU on a
+/// multi GPU machine don't pay for contexts and modules on all of them.
+/// Lookups are safe from many threads. A thread asking for a device another thread
+/// is bringing up waits for it. discover() and deinitialize() need the registry to be idle.
+struct CUDADeviceRegistry {
+	CUDADeviceRegistry();
+	~CUDADeviceRegistry();
+
+	CUDADeviceRegistry(const CUDADeviceRegistry&) = delete;
+	CUDADeviceRegistry &operator=(const CUDADeviceRegistry&) = delete;
+
+	/// Enumerate the devices of driver. Unsupported devices (see isDeviceSupported) are left out.
+	/// @param visibleDevices Filter in the format of parseVisibleDevices. nullptr keeps all devices.
+	CUDAError discover(CUDADeviceDriver *driver, const char *visibleDevices);
+
+	/// Deinitialize all ready devices and forget the discovered ones.
+	CUDAError deinitialize();
+
+	/// Number of discovered devices, including the failed ones.
+	int getNumDevices() const;
+
+	CUDADeviceState getState(int idx) const;
+	const CUDADeviceProperties &getProperties(int idx) const;
+
+	/// Error the bring-up of a failed device ended with.
+	CUDAError getError(int idx) const;
+
+	/// Milliseconds the bring-up of the device took. 0 if it was not attempted yet.
+	float getInitializationTime(int idx) const;
+
+	/// Get the idx-th visible device, bringing it up if this is its first use.
+	CUDAError getDevice(int idx, const CUDADevice *&device);
+
+	/// Same as getDevice, but by the driver ordinal of the device.
+	CUDAError getDeviceByOrdinal(int ordinal, const CUDADevice *&device);
+
+	/// Get a device meeting requirements, bringing it up if needed.
+	/// Devices failing bring-up are skipped in favor of the next match.
+	CUDAError findDevice(const CUDADeviceRequirements &requirements, const CUDADevice *&device);
+
+	/// Bring up every discovered device, each on its own host thread.
+	/// Context creation and module linking are independent per device, so this takes
+	/// about as long as the slowest device instead of the sum of all of them.
+	/// Failed devices are recorded in their slots, see getError.
+	/// @return Error only if no device is ready afterwards.
+	CUDAError initializeAll();
+
+	/// Ready device with the driver handle dev or nullptr.
+	const CUDADevice *findReadyDevice(CUdevice dev) const;
+
+private:
+	struct DeviceSlot {
+		CUDADeviceProperties properties;
+		CUDADeviceState state;
+		CUDAError error;
+		float initializationMs;
+		std::unique_ptr<CUDADevice> device; ///< Heap allocated so handed out pointers stay valid.
+
+		DeviceSlot();
+		~DeviceSlot();
+		DeviceSlot(DeviceSlot&&);
+	};
+
+	CUDAError bringUp(int idx);
+
+	/// Run the driver bring-up of a slot already marked as Initializing.
+	/// Touches nothing but the slot, so different slots can run on different threads.
+	void initializeSlot(int idx);
+
+private:
+	mutable std::mutex mutex; ///< Guards the state, error and time of the slots.
+	std::condition_variable stateChanged;
+	std::vector<DeviceSlot> slots; ///< Not resized between discover() and deinitialize().
+	CUDADeviceDriver *driver;
+};
@@ -1,6 +1,40 @@
 #pragma once
 
+#ifdef _WIN32
 #include <Windows.h>
+#else // !_WIN32
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/// True when a debugger is attached to the process (TracerPid in /proc/self/status is not 0).
+inline bool isDebuggerPresent() {
+	FILE *status = fopen("/proc/self/status", "r");
+	if (status == NULL) {
+		return false;
+	}
+
+	bool traced = false;
+	char line[256];
+	while (fgets(line, sizeof(line), status) != NULL) {
+		if (strncmp(line, "TracerPid:", 10) == 0) {
+			traced = atoi(line + 10) != 0;
+			break;
+		}
+	}
+	fclose(status);
+	return traced;
+}
+
+/// Stops in the debugger if one is attached. Unlike raise(SIGTRAP) this doesn't end the process
+/// when there is none, so Debug builds keep running on Linux machines and CI.
+inline void DebugBreak() {
+	if (isDebuggerPresent()) {
+		raise(SIGTRAP);
+	}
+}
+#endif // _WIN32
 
 // User
 #include <logger.h>
@@ -17,7 +51,20 @@ do { \
 
 #define LOG_CUDA_ERROR(err, logLevel) \
 do { \
-	Logger::log((logLevel), \
+	CUDABASE_LOG((logLevel), \
+	"CUDA Error(%d) at %s in %s:%d:\n" \
+	"\tError name: %s\n" \
+	"\tError description : %s\n", \
+	(err).getError(), \
+	__FUNCTION__, __FILE__, __LINE__, \
+	(err).getName(), \
+	(err).getDesc()); \
+} while (false)
+
+/// LOG_CUDA_ERROR for hot paths like kernel launches, logs at most maxPerSecond errors per second from the call site.
+#define LOG_CUDA_ERROR_RATE_LIMITED(err, logLevel, maxPerSecond) \
+do { \
+	CUDABASE_LOG_RATE_LIMITED((logLevel), (maxPerSecond), \
 	"CUDA Error(%d) at %s in %s:%d:\n" \
 	"\tError name: %s\n" \
 	"\tError description : %s\n", \
@@ -72,7 +119,9 @@ struct CUDAError {
 	CUDAError() : error(CUDA_SUCCESS), name("CUDA_SUCCESS"), desc("") { }
 	CUDAError(CUresult error, const char *name, const char *desc) : error(error), name(name), desc(desc) { 
 #ifdef CUDA_DEBUG
-		if (error != CUDA_SUCCESS) {
+		// Running out of memory is expected and handled by the callers, f.e. the fallback
+		// allocator tries the next tier and CUDABuffer moves a block it can't grow in place.
+		if (error != CUDA_SUCCESS && error != CUDA_ERROR_OUT_OF_MEMORY) {
 			DebugBreak();
 		}
 #endif // CUDA_DEBUG
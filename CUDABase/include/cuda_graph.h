@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cuda_kernel.h>
+#include <cuda_manager.h>
+
+#include <vector>
+
+enum class CUDAGraphNodeType : int {
+	Upload = 0,
+	Download,
+	Kernel,
+};
+
+/// Recorded operation of a CUDAGraph.
+struct CUDAGraphNode {
+	CUDAGraphNodeType type;
+
+	// Upload and Download
+	CUDAMemHandle devicePtr;
+	void *hostPtr;
+	SizeType size;
+
+	// Kernel
+	CUfunction func;
+	std::vector<char> args; ///< Copy of the argument values, so the caller's storage can go away after recording.
+	std::vector<SizeType> argOffsets; ///< Offset of each argument in args.
+	CUDALaunchConfig config;
+	const char *name;
+
+	CUDAGraphNode()
+		: type(CUDAGraphNodeType::Kernel),
+		devicePtr(NULL),
+		hostPtr(nullptr),
+		size(0),
+		func(NULL),
+		name(nullptr) { }
+};
+
+enum class CUDAGraphMode : int {
+	Graph = 0, ///< Replay the instantiated CUDA graph. Falls back to Eager if the graph can't be built.
+	Eager, ///< Issue every node through the regular driver calls.
+};
+
+/// Records a linear pipeline of transfers and kernel launches and replays it as a CUDA graph.
+/// Building the graph costs about as much as issuing the work once, but every later launch()
+/// is a single driver call. Between launches the nodes can be pointed to new buffers, sizes or
+/// kernel arguments with the update functions, which patch the instantiated graph in place
+/// and only rebuild it when the driver refuses the change.
+/// Host memory of transfers should be page-locked, f.e. from a CUDAPinnedMemoryBuffer.
+struct CUDAGraph {
+	CUDAGraph();
+	~CUDAGraph();
+
+	CUDAGraph(const CUDAGraph&) = delete;
+	CUDAGraph &operator=(const CUDAGraph&) = delete;
+
+	/// Destroy the graph and forget all the nodes.
+	CUDAError deinitialize();
+
+	/// Record a host to device copy after the previously recorded node.
+	/// @return Index of the node for later updates.
+	int addUpload(CUDAMemHandle dst, const void *src, SizeType size);
+
+	/// Record a device to host copy after the previously recorded node.
+	int addDownload(void *dst, CUDAMemHandle src, SizeType size);
+
+	/// Record a kernel launch after the previously recorded node.
+	/// The arguments are copied, so params can change or go away right after the call.
+	/// @param paramSizes Size of each of the numParams arguments.
+	int addKernel(CUfunction func, void **params, const SizeType *paramSizes, int numParams, const CUDALaunchConfig &config, const char *name = nullptr);
+
+	/// Record a kernel launch with the arguments pushed to args.
+	int addKernel(CUfunction func, const CUDAArgumentFrame &args, const CUDALaunchConfig &config, const char *name = nullptr) {
+		return addKernel(func, args.getParams(), args.getSizes(), args.getNumArgs(), config, name);
+	}
+
+	/// Record a launch of a CUDAFunction or a TypedKernel with its current arguments.
+	/// Later changes to the arguments of the kernel object are not seen by the graph, use updateKernel for them.
+	template <class Kernel>
+	int addKernel(Kernel &kernel, const CUDALaunchConfig &config, const char *name = nullptr) {
+		return addKernel(kernel.getFunction(), kernel.getParams(), kernel.getParamSizes(), int(kernel.getNumParams()), config, name);
+	}
+
+	template <class Buffer>
+	int addUpload(Buffer &buffer, const void *src) {
+		return addUpload(buffer.handle(), src, buffer.getSize());
+	}
+
+	template <class Buffer>
+	int addDownload(void *dst, Buffer &buffer) {
+		return addDownload(dst, buffer.handle(), buffer.getSize());
+	}
+
+	CUDAError updateUpload(int nodeIdx, CUDAMemHandle dst, const void *src, SizeType size);
+	CUDAError updateDownload(int nodeIdx, void *dst, CUDAMemHandle src, SizeType size);
+
+	/// Pick up new arguments or a new launch config for a kernel node. The arguments are copied like in addKernel.
+	CUDAError updateKernel(int nodeIdx, void **params, const SizeType *paramSizes, int numParams, const CUDALaunchConfig &config);
+
+	CUDAError updateKernel(int nodeIdx, const CUDAArgumentFrame &args, const CUDALaunchConfig &config) {
+		return updateKernel(nodeIdx, args.getParams(), args.getSizes(), args.getNumArgs(), config);
+	}
+
+	/// Build and instantiate the graph in the current context.
+	/// Called by launch() if needed, but can be called earlier to move the cost out of the hot path.
+	CUDAError instantiate();
+
+	/// Run all nodes in order on stream.
+	CUDAError launch(CUstream stream);
+
+	/// Run all nodes in order on stream through the regular driver calls.
+	CUDAError launchEager(CUstream stream);
+
+	void setMode(CUDAGraphMode mode);
+	CUDAGraphMode getMode() const { return mode; }
+
+	bool isInstantiated() const { return graphExec != NULL; }
+	const std::vector<CUDAGraphNode> &getNodes() const { return nodes; }
+
+private:
+	int addNode(const CUDAGraphNode &node);
+	CUDAError destroyGraph();
+	CUDAError updateNode(int nodeIdx);
+
+	static void copyKernelArgs(CUDAGraphNode &node, void **params, const SizeType *paramSizes, int numParams);
+	static void fillCopyParams(const CUDAGraphNode &node, CUDA_MEMCPY3D &copyParams);
+
+	/// Point argPointers to the arguments of node, nullptr if it has none.
+	void **getArgPointers(const CUDAGraphNode &node);
+	CUDAError fillKernelParams(const CUDAGraphNode &node, CUDA_KERNEL_NODE_PARAMS &kernelParams);
+
+private:
+	std::vector<CUDAGraphNode> nodes;
+	std::vector<CUgraphNode> graphNodes; ///< Driver node of every recorded node while the graph exists.
+	std::vector<void*> argPointers; ///< Argument pointers of the node handed to the driver last.
+	CUgraph graph;
+	CUgraphExec graphExec;
+	CUcontext ctx; ///< Context the graph was built in.
+	CUDAGraphMode mode;
+	bool needsRebuild;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cuda.h>
+
+#ifndef CUDA_HOST_BACKEND
+#error "cuda_host_kernel.h is only available when CUDABase is built with CUDABASE_HOST_BACKEND"
+#endif // !CUDA_HOST_BACKEND
+
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// Built-in variables of a CUDA thread for host kernels.
+struct CUDAHostThread {
+	CUhostDim3 threadIdx;
+	CUhostDim3 blockIdx;
+	CUhostDim3 blockDim;
+	CUhostDim3 gridDim;
+	void *sharedMem; ///< Dynamic shared memory of the block.
+};
+
+/// Runs one block of a host kernel, the function registered with the driver for registerHostKernel.
+template <class FuncType, class ...Args>
+struct CUDAHostKernelTrampoline {
+	using ArgsTuple = std::tuple<std::decay_t<Args>...>;
+
+	static void runBlock(const CUhostKernelBlock *block, void **kernelParams, void *userData) {
+		runBlockImpl(*block, kernelParams, *static_cast<FuncType*>(userData), std::index_sequence_for<Args...>());
+	}
+
+	template <size_t ...Indices>
+	static void runBlockImpl(const CUhostKernelBlock &block, void **kernelParams, FuncType &func, std::index_sequence<Indices...>) {
+		// Unpacked once per block, kernel parameters may be unaligned in the launch buffer.
+		ArgsTuple args;
+		((void)memcpy(&std::get<Indices>(args), kernelParams[Indices], sizeof(std::tuple_element_t<Indices, ArgsTuple>)), ...);
+
+		CUDAHostThread thread;
+		thread.blockIdx = block.blockIdx;
+		thread.blockDim = block.blockDim;
+		thread.gridDim = block.gridDim;
+		thread.sharedMem = block.sharedMem;
+		for (unsigned int z = 0; z < block.blockDim.z; ++z) {
+			for (unsigned int y = 0; y < block.blockDim.y; ++y) {
+				for (unsigned int x = 0; x < block.blockDim.x; ++x) {
+					thread.threadIdx = CUhostDim3{ x, y, z };
+					func(static_cast<const CUDAHostThread&>(thread), std::get<Indices>(args)...);
+				}
+			}
+		}
+	}
+};
+
+/// Register a host implementation of the kernel name.
+/// func is called once per thread of the grid as func(thread, args...) and has to be
+/// callable with the exact argument types of the device kernel. Threads of a block run
+/// one after the other on the same host thread, so kernels relying on __syncthreads
+/// or warp level primitives need a host version written per block instead.
+/// Usually called from the initializer of a static, so the kernel exists before any module is loaded.
+/// @return false if a kernel with that name is already registered.
+template <class ...Args, class Func>
+bool registerHostKernel(const char *name, Func &&func) {
+	using FuncType = std::decay_t<Func>;
+
+	const size_t paramSizes[] = { sizeof(std::decay_t<Args>)..., 0 };
+
+	// Lives as long as the registration, which is the whole process.
+	FuncType *storedFunc = new FuncType(std::forward<Func>(func));
+	const CUresult res = cuHostRegisterKernel(name, &CUDAHostKernelTrampoline<FuncType, Args...>::runBlock, storedFunc, paramSizes, unsigned(sizeof...(Args)));
+	if (res != CUDA_SUCCESS) {
+		delete storedFunc;
+		return false;
+	}
+
+	return true;
+}
+
+/// Register value as the module global name, f.e. for a __constant__ variable of the device code.
+template <class T>
+bool registerHostGlobal(const char *name, T *value) {
+	return cuHostRegisterGlobal(name, static_cast<void*>(value), sizeof(T)) == CUDA_SUCCESS;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cuda_memory_defines.h>
+
+#include <string>
+#include <vector>
+
+/// Everything which changes the cubin cuLinkComplete produces.
+struct CUDAJitCacheKeyDesc {
+	const std::vector<std::string> *ptxSources; ///< Contents of the PTX files in link order.
+	std::vector<int> linkOptionValues; ///< Values of the JIT options passed to cuLinkCreate.
+	std::string libraryFingerprint; ///< See CUDAJitCache::getFileFingerprint. Empty if no library is linked.
+	int driverVersion;
+	int computeCapabilityMajor;
+	int computeCapabilityMinor;
+	bool useDynamicParallelism;
+
+	CUDAJitCacheKeyDesc()
+		: ptxSources(nullptr),
+		driverVersion(0),
+		computeCapabilityMajor(0),
+		computeCapabilityMinor(0),
+		useDynamicParallelism(false) { }
+};
+
+/// Persistent cache of linked cubins.
+/// Each entry is a file named after the hash of its CUDAJitCacheKeyDesc. It holds a
+/// header with the key, payload size and checksum followed by the cubin. Entries are
+/// written to a temporary file and renamed into place, so readers in other processes
+/// never see a partial entry. Entries failing validation are deleted on load.
+struct CUDAJitCache {
+	static constexpr uint32_t FILE_MAGIC = 0x4A434243; ///< "CBCJ"
+	static constexpr uint32_t FILE_VERSION = 1;
+
+public:
+	/// Cache in CUDABASE_JIT_CACHE_DIR if set or in a CUDABaseJitCache folder in the temp directory otherwise.
+	CUDAJitCache();
+
+	/// Use directory for the entries. An empty string disables the cache.
+	void setDirectory(const std::string &directory);
+	const std::string &getDirectory() const { return directory; }
+	bool isEnabled() const { return !directory.empty(); }
+
+	/// Look up the cubin stored under key.
+	/// @return false on a miss or if the entry was corrupt.
+	bool load(uint64_t key, std::vector<char> &cubin) const;
+
+	/// Atomically store a cubin under key. Failures only cost a relink next time, so they are just logged.
+	bool store(uint64_t key, const void *cubin, SizeType size) const;
+
+	/// Delete the entry stored under key, f.e. when the driver refused to load it.
+	void invalidate(uint64_t key) const;
+
+	static uint64_t computeKey(const CUDAJitCacheKeyDesc &desc);
+
+	/// Path, size and modification time of a file. Cheaper than hashing big libraries on every start.
+	static std::string getFileFingerprint(const std::string &path);
+
+	/// Read a whole file. @return false if it can't be opened.
+	static bool readFile(const std::string &path, std::string &contents);
+
+	/// 64-bit FNV-1a.
+	static uint64_t hash(const void *data, SizeType size, uint64_t seed = FNV_OFFSET_BASIS);
+
+private:
+	static constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+	static constexpr uint64_t FNV_PRIME = 0x100000001b3ull;
+
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t key;
+		uint64_t payloadSize;
+		uint64_t payloadHash;
+	};
+
+	std::string getEntryPath(uint64_t key) const;
+
+private:
+	std::string directory;
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cuda_manager.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+/// Arguments of a single kernel launch.
+/// The values are stored inline, so a frame on the stack costs no allocation, and each one is aligned for its type.
+/// Not copyable, the pointers handed to the driver point into the frame itself.
+struct CUDAArgumentFrame {
+	static constexpr int maxBytes = 1024;
+	static constexpr int maxArgs = 32;
+
+public:
+	CUDAArgumentFrame() : size(0), numArgs(0) { }
+
+	CUDAArgumentFrame(const CUDAArgumentFrame&) = delete;
+	CUDAArgumentFrame &operator=(const CUDAArgumentFrame&) = delete;
+
+	/// Append arguments after the ones pushed so far.
+	/// Args must match the kernel's parameters in the PTX, device pointers are passed as CUDAMemHandle.
+	template <class T, class ...Types>
+	CUDAError push(const T &arg, const Types &...args) {
+		static_assert(std::is_trivially_copyable<T>::value, "Kernel arguments must be trivially copyable!");
+		static_assert(alignof(T) <= alignof(std::max_align_t), "Kernel argument is over-aligned!");
+
+		const SizeType alignedOffset = (size + alignof(T) - 1) / alignof(T) * alignof(T);
+		if (numArgs >= maxArgs || alignedOffset + sizeof(T) > maxBytes) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAArgumentFrame_ERROR_TOO_MANY_ARGUMENTS", "");
+		}
+
+		memcpy(storage + alignedOffset, &arg, sizeof(T));
+		pointers[numArgs] = storage + alignedOffset;
+		sizes[numArgs] = sizeof(T);
+		size = alignedOffset + sizeof(T);
+		++numArgs;
+
+		return push(args...);
+	}
+
+	/// Helper function for the variadic template function push.
+	CUDAError push() {
+		return CUDAError();
+	}
+
+	void clear() {
+		size = 0;
+		numArgs = 0;
+	}
+
+	/// Argument pointers in the layout the driver expects, nullptr without arguments.
+	/// The driver only reads through them.
+	void **getParams() const { return numArgs > 0 ? const_cast<void**>(pointers) : nullptr; }
+
+	const SizeType *getSizes() const { return sizes; }
+	int getNumArgs() const { return numArgs; }
+
+	/// Bytes used by the arguments, including the padding between them.
+	SizeType getSize() const { return size; }
+
+private:
+	alignas(std::max_align_t) char storage[maxBytes];
+	void *pointers[maxArgs];
+	SizeType sizes[maxArgs];
+	SizeType size;
+	int numArgs;
+};
+
+/// Kernel launched with the arguments of each launch given to it.
+/// Unlike CUDAFunction and TypedKernel it keeps no argument state, so a single object can be launched
+/// from many threads and kept in flight on many streams at once.
+/// The CUfunction is looked up in the module of the current device on its first launch there and cached per device.
+/// The cache is filled without locks, handles are valid as long as the modules of the devices are.
+struct CUDAKernel {
+	/// Devices with a higher driver handle look the function up on every launch.
+	static constexpr int maxCachedDevices = 16;
+
+public:
+	CUDAKernel();
+	explicit CUDAKernel(const char *name);
+
+	CUDAKernel(const CUDAKernel&) = delete;
+	CUDAKernel &operator=(const CUDAKernel&) = delete;
+
+	/// Set the name of the kernel and forget the cached handles. Not safe while other threads launch the kernel.
+	void initialize(const char *name);
+
+	/// Forget the cached handles, f.e. after the devices were brought up again.
+	void clearCache();
+
+	/// Handle of the kernel in the module of device.
+	CUDAError getFunction(const CUDADevice &device, CUfunction &func) const;
+
+	/// Launch on the current device with the arguments in args. The frame can be reused as soon as this returns.
+	CUDAError launch(const CUDALaunchConfig &config, CUstream stream, const CUDAArgumentFrame &args) const;
+
+	/// Launch on the current device with the given arguments, packed into a frame on the stack.
+	template <class ...Args>
+	CUDAError launch(const CUDALaunchConfig &config, CUstream stream, const Args &...args) const {
+		CUDAArgumentFrame frame;
+		RETURN_ON_CUDA_ERROR_HANDLED(frame.push(args...));
+		return launch(config, stream, frame);
+	}
+
+	/// Launches the kernel and then synchronizes with the stream
+	CUDAError launchSync(const CUDALaunchConfig &config, CUstream stream, const CUDAArgumentFrame &args) const;
+
+	/// Handle of the kernel for the current device, f.e. to record it in a CUDAGraph.
+	CUDAError getCurrentFunction(CUfunction &func) const;
+
+	const char *getName() const { return name.c_str(); }
+
+private:
+	std::string name;
+	mutable std::atomic<CUfunction> functions[maxCachedDevices]; ///< By driver device handle, NULL until looked up.
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cuda_device_properties.h>
+
+#include <mutex>
+#include <unordered_map>
+
+/// Extent of a grid, a block or a cluster.
+struct CUDADim3 {
+	unsigned int x;
+	unsigned int y;
+	unsigned int z;
+
+	CUDADim3(unsigned int x = 1, unsigned int y = 1, unsigned int z = 1) : x(x), y(y), z(z) { }
+
+	SizeType count() const {
+		return SizeType(x) * y * z;
+	}
+
+	bool operator==(const CUDADim3 &other) const {
+		return x == other.x && y == other.y && z == other.z;
+	}
+};
+
+enum class CUDALaunchMode : int {
+	Default = 0, ///< cuLaunchKernel
+	Cooperative, ///< All blocks are resident at once so the kernel may sync the whole grid. Uses cuLaunchCooperativeKernel.
+	Cluster, ///< Blocks are grouped in clusters sharing distributed shared memory. Needs compute capability 9.0 and CUDA 12.
+};
+
+/// Shape of a kernel launch.
+/// The grid and the block can be given explicitly or derived for the device the
+/// kernel is launched on:
+/// - autoBlock picks the block with the best occupancy for the kernel (cuOccupancyMaxPotentialBlockSize)
+///   and shapes it after the threads extent.
+/// - autoGrid covers the threads extent with blocks. For cooperative launches the grid
+///   is also capped to the number of blocks which fit on the device at once.
+struct CUDALaunchConfig {
+	CUDADim3 threads; ///< Threads needed in each dimension. Only used with autoGrid.
+	CUDADim3 grid;
+	CUDADim3 block;
+	CUDADim3 cluster; ///< Only used with CUDALaunchMode::Cluster. grid must be a multiple of it.
+	unsigned int dynamicSharedMemBytes;
+	CUDALaunchMode mode;
+	bool autoBlock;
+	bool autoGrid;
+
+	CUDALaunchConfig()
+		: dynamicSharedMemBytes(0),
+		mode(CUDALaunchMode::Default),
+		autoBlock(false),
+		autoGrid(false) { }
+
+	/// Cover threads with blocks of the best size for the kernel.
+	static CUDALaunchConfig forThreads(const CUDADim3 &threads, unsigned int dynamicSharedMemBytes = 0);
+
+	/// Cover threads with blocks of the given shape.
+	static CUDALaunchConfig forThreads(const CUDADim3 &threads, const CUDADim3 &block, unsigned int dynamicSharedMemBytes = 0);
+
+	/// Launch exactly grid x block threads.
+	static CUDALaunchConfig forGrid(const CUDADim3 &grid, const CUDADim3 &block, unsigned int dynamicSharedMemBytes = 0);
+
+	CUDALaunchConfig &cooperative() {
+		mode = CUDALaunchMode::Cooperative;
+		return *this;
+	}
+
+	CUDALaunchConfig &withCluster(const CUDADim3 &clusterDim) {
+		mode = CUDALaunchMode::Cluster;
+		cluster = clusterDim;
+		return *this;
+	}
+};
+
+/// Turn the flat block size suggested by the occupancy calculator into a block for threads.
+/// Rows are kept a multiple of the warp size so warps access contiguous memory and
+/// the remaining threads are spread over y and z for 2D and 3D extents.
+CUDADim3 shapeBlock(int blockSize, const CUDADim3 &threads, const CUDADeviceProperties &props);
+
+/// Number of blocks needed in each dimension to cover threads.
+CUDADim3 computeGrid(const CUDADim3 &threads, const CUDADim3 &block);
+
+/// Fill in the block and the grid of config.
+/// @param occupancyBlockSize Block size suggested for the kernel. Only used with config.autoBlock.
+/// @param maxActiveBlocksPerSM Blocks of the resolved size which fit on a multiprocessor at once.
+/// Only used for cooperative launches, 0 means unknown.
+/// @param resolved Config with explicit grid and block. Safe to alias config.
+CUDAError resolveLaunchConfig(
+	const CUDALaunchConfig &config,
+	int occupancyBlockSize,
+	int maxActiveBlocksPerSM,
+	const CUDADeviceProperties &props,
+	CUDALaunchConfig &resolved
+);
+
+/// Check a resolved config against the limits of the device.
+CUDAError validateLaunchConfig(const CUDALaunchConfig &config, int maxActiveBlocksPerSM, const CUDADeviceProperties &props);
+
+/// Occupancy answers for each kernel and device.
+/// The occupancy calculator is not free, so it is asked once per combination of
+/// kernel, device, block size and dynamic shared memory.
+/// Safe to use from many threads.
+struct CUDAOccupancyCache {
+	/// Block size with the maximum occupancy for func when launched on the current context's device dev.
+	CUDAError getBlockSize(CUfunction func, CUdevice dev, unsigned int dynamicSharedMemBytes, int &blockSize);
+
+	/// Number of blocks of blockSize threads of func which fit on one multiprocessor of dev at once.
+	CUDAError getMaxActiveBlocksPerSM(CUfunction func, CUdevice dev, int blockSize, unsigned int dynamicSharedMemBytes, int &numBlocks);
+
+	void clear();
+
+private:
+	struct Key {
+		CUfunction func;
+		CUdevice dev;
+		int blockSize; ///< 0 for block size queries.
+		unsigned int dynamicSharedMemBytes;
+
+		bool operator==(const Key &other) const {
+			return
+				func == other.func &&
+				dev == other.dev &&
+				blockSize == other.blockSize &&
+				dynamicSharedMemBytes == other.dynamicSharedMemBytes;
+		}
+	};
+
+	struct KeyHash {
+		std::size_t operator()(const Key &key) const {
+			return
+				std::hash<void*>()(key.func) ^
+				(std::hash<int>()(key.dev) << 1) ^
+				(std::hash<int>()(key.blockSize) << 8) ^
+				(std::hash<unsigned int>()(key.dynamicSharedMemBytes) << 16);
+		}
+	};
+
+	/// Cached answer for key. @return false if it is not known yet.
+	bool findAnswer(const Key &key, int &answer) const;
+	void storeAnswer(const Key &key, int answer);
+
+private:
+	mutable std::mutex mutex;
+	std::unordered_map<Key, int, KeyHash> answers;
+};
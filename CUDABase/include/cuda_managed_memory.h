@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cuda_allocator_stats.h>
+#include <cuda_memory_backend.h>
+#include <cuda_memory_defines.h>
+#include <cuda_transfer.h>
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/// Where the pages of managed memory are moved to or preferred to live.
+struct CUDAMemoryLocation {
+	enum class Kind : int {
+		None = 0, ///< No location, f.e. to drop a preferred location given before.
+		Host,
+		Device,
+	};
+
+	Kind kind;
+	int deviceOrdinal; ///< Driver ordinal for Kind::Device, -1 otherwise.
+
+	CUDAMemoryLocation() : kind(Kind::None), deviceOrdinal(-1) { }
+
+	static CUDAMemoryLocation none() { return CUDAMemoryLocation(); }
+	static CUDAMemoryLocation host() { return CUDAMemoryLocation(Kind::Host, -1); }
+	static CUDAMemoryLocation device(int ordinal) { return CUDAMemoryLocation(Kind::Device, ordinal); }
+
+	bool operator==(const CUDAMemoryLocation &other) const {
+		return kind == other.kind && deviceOrdinal == other.deviceOrdinal;
+	}
+
+private:
+	CUDAMemoryLocation(Kind kind, int deviceOrdinal) : kind(kind), deviceOrdinal(deviceOrdinal) { }
+};
+
+/// Source of managed memory and the driver calls which move it.
+/// Devices are given as CUdevice, CU_DEVICE_CPU stands for the host.
+struct CUDAManagedMemoryBackend : CUDAMemoryBackend {
+	/// If pages can be prefetched to device. Needs concurrent managed access,
+	/// without it the driver migrates all pages of a block at each kernel launch anyway.
+	virtual CUDAError canPrefetch(CUdevice device, bool &result) = 0;
+
+	/// Start moving size bytes at ptr to device, ordered on stream.
+	virtual CUDAError prefetch(CUDAMemHandle ptr, SizeType size, CUdevice device, CUstream stream) = 0;
+
+	virtual CUDAError advise(CUDAMemHandle ptr, SizeType size, CUmem_advise advice, CUdevice device) = 0;
+};
+
+/// Managed memory from cuMemAllocManaged, attached globally so every stream can use it.
+struct CUDADriverManagedMemoryBackend : CUDAManagedMemoryBackend {
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType size) override;
+	CUDAError free(CUDAMemHandle ptr) override;
+	CUDAError canPrefetch(CUdevice device, bool &result) override;
+	CUDAError prefetch(CUDAMemHandle ptr, SizeType size, CUdevice device, CUstream stream) override;
+	CUDAError advise(CUDAMemHandle ptr, SizeType size, CUmem_advise advice, CUdevice device) override;
+};
+
+/// Host stand-in for CUDADriverManagedMemoryBackend.
+/// Memory is plain host memory and the prefetches and advice are only recorded,
+/// so the calls CUDAManagedAllocator issues can be checked without a device.
+struct CUDAHostManagedMemoryBackend : CUDAManagedMemoryBackend {
+	struct Prefetch {
+		CUDAMemHandle ptr;
+		SizeType size;
+		CUdevice device;
+		CUstream stream;
+	};
+
+	struct Advice {
+		CUDAMemHandle ptr;
+		SizeType size;
+		CUmem_advise advice;
+		CUdevice device;
+	};
+
+public:
+	CUDAHostManagedMemoryBackend();
+
+	/// Simulate devices without concurrent managed access, on which nothing is prefetched.
+	void setCanPrefetch(bool canPrefetch);
+
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType size) override;
+	CUDAError free(CUDAMemHandle ptr) override;
+	CUDAError canPrefetch(CUdevice device, bool &result) override;
+	CUDAError prefetch(CUDAMemHandle ptr, SizeType size, CUdevice device, CUstream stream) override;
+	CUDAError advise(CUDAMemHandle ptr, SizeType size, CUmem_advise advice, CUdevice device) override;
+
+	std::vector<Prefetch> getPrefetches() const;
+	std::vector<Advice> getAdvice() const;
+	int getNumLiveBlocks() const;
+
+private:
+	mutable std::mutex mutex;
+	CUDAHostMemoryBackend hostBackend;
+	std::vector<Prefetch> prefetches;
+	std::vector<Advice> advice;
+	int numLiveBlocks;
+	bool prefetchSupported;
+};
+
+/// Allocator for memory both the host and the devices can use through the same pointer.
+/// The driver migrates pages to where they are touched. prefetch() moves them ahead of
+/// time on a stream and advise() tells the driver how the block is going to be used.
+/// Useful for data touched on both sides and for working sets larger than the device memory.
+/// Safe to use from many threads.
+struct CUDAManagedAllocator {
+	static constexpr AllocatorType type = AllocatorType::Managed;
+	static constexpr bool canGrowInPlace = false;
+	static constexpr bool canPromote = false;
+	static constexpr bool isManaged = true;
+	using CUDAMemBlock = CUDAMemoryBlock<type>;
+
+public:
+	CUDAManagedAllocator();
+
+	/// @param backend Memory source and migration calls. nullptr means the driver. Must outlive the allocator.
+	CUDAError initialize(CUDAManagedMemoryBackend *backend = nullptr);
+	CUDAError deinitialize();
+
+	CUDAError allocate(CUDAMemBlock &memBlock);
+
+	CUDAError upload(const CUDAMemBlock &memBlock, const void *hostPtr, CUstream stream);
+	CUDAError download(const CUDAMemBlock &memBlock, void *hostPtr, CUstream stream);
+
+	/// Pipelined upload in pieces of at most maxChunkSize. Kernels can wait for parts of the block with transfer.waitForChunk().
+	CUDAError uploadChunked(const CUDAMemBlock &memBlock, const void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream);
+
+	/// Pipelined download in pieces of at most maxChunkSize. Consumers can wait for parts of the block with transfer.waitForChunk().
+	CUDAError downloadChunked(const CUDAMemBlock &memBlock, void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream);
+
+	CUDAError free(CUDAMemBlock &memBlock);
+
+	/// Move the pages of the block to location, ordered on stream. The host is not blocked.
+	/// Does nothing on devices which can't prefetch, see CUDAManagedMemoryBackend::canPrefetch.
+	CUDAError prefetch(const CUDAMemBlock &memBlock, CUDAMemoryLocation location, CUstream stream);
+
+	/// Set the usage hints of the block. Read mostly blocks are duplicated to every processor reading them
+	/// instead of moving back and forth, writing to them drops the copies.
+	/// Pages stay at preferredLocation unless they have to move, CUDAMemoryLocation::none() drops the preference.
+	CUDAError advise(const CUDAMemBlock &memBlock, bool readMostly, CUDAMemoryLocation preferredLocation);
+
+	/// Live, peak and requested bytes of the blocks handed out, per device.
+	const CUDAAllocatorStats &getStats() const { return stats; }
+	CUDAAllocatorStats &getStats() { return stats; }
+
+	void dumpStats(LogLevel level);
+
+private:
+	/// Driver device of location, CU_DEVICE_CPU for the host.
+	static CUDAError getDevice(CUDAMemoryLocation location, CUdevice &device);
+
+private:
+	std::mutex allocationsMutex;
+	/// Live blocks by pointer, so the objects holding them can be moved around freely.
+	std::unordered_map<CUDAMemHandle, CUDAMemBlock> allocations;
+	CUDADriverManagedMemoryBackend driverBackend;
+	CUDAManagedMemoryBackend *backend;
+	CUDAAllocatorStats stats;
+};
@@ -1,9 +1,20 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
+#include <cstring>
 #include <vector>
 
+#include <cuda_device_properties.h>
+#include <cuda_device_registry.h>
+#include <cuda_jit_cache.h>
+#include <cuda_launch_config.h>
+#include <cuda_managed_memory.h>
 #include <cuda_memory.h>
+#include <cuda_peer_access.h>
+#include <cuda_pinned_host_pool.h>
+#include <cuda_profiler.h>
+#include <cuda_stream_pool.h>
 #include <timer.h>
 
 enum class CUDADefaultStreamsEnumeration : int {
@@ -20,14 +31,25 @@ struct CUDADevice {
 
 	CUDAError deinitialize();
 
-	CUDAError initialize(int deviceOridnal, const std::vector<std::string> &ptxFiles, bool useDynamicParallelism);
+	/// @param jitCache Cache of linked modules. nullptr always links the PTX files.
+	CUDAError initialize(int deviceOridnal, const std::vector<std::string> &ptxFiles, bool useDynamicParallelism, const CUDAJitCache *jitCache = nullptr);
 
+	/// Make the device's context current on the calling thread.
+	/// The thread is bound to the device from then on, see bindThreadContext.
 	CUDAError use() const;
 
 	CUdevice getDevice() const;
+	CUcontext getContext() const;
 	CUmodule getModule() const;
+	const CUDADeviceProperties &getProperties() const;
+
+	/// How pinned buffers allocated while this device is current are backed by default.
+	CUDAHostMemoryMode getHostMemoryMode() const;
 	CUstream getDefaultStream(CUDADefaultStreamsEnumeration defStreamEnum) const;
 
+	/// Prioritized streams for concurrent work on the device, see CUDAStreamPool.
+	CUDAStreamPool &getStreamPool() const;
+
 	CUDAError getTotalMemory(SizeType &result) const;
 	CUDAError getName(std::string &result) const;
 	CUDAError getFreeMemory(SizeType &result) const;
@@ -67,16 +89,38 @@ struct CUDADevice {
 	}
 
 private:
-	CUDAError loadModule(const std::vector<std::string> &ptxFiles, bool useDynamicParallelism);
+	CUDAError loadModule(const std::vector<std::string> &ptxFiles, bool useDynamicParallelism, const CUDAJitCache *jitCache);
 	
 private:
 	std::vector<CUstream> streams;
+	CUDADriverStreamBackend streamBackend;
+	mutable CUDAStreamPool streamPool;
 	CUcontext ctx;
 	CUlinkState linkState;
 	CUmodule module;
 	CUdevice dev;
 	char name[128];
 	SizeType totalMem;
+	CUDADeviceProperties properties;
+	CUDAHostMemoryMode hostMemoryMode;
+};
+
+/// CUDADeviceDriver on top of the CUDA driver API.
+/// Devices are brought up with the module linked from the configured PTX files.
+struct CUDADefaultDeviceDriver : CUDADeviceDriver {
+	CUDADefaultDeviceDriver();
+
+	void setModule(const std::vector<std::string> &ptxFiles, bool useDynamicParallelism, const CUDAJitCache *jitCache);
+
+	CUDAError getDeviceCount(int &count) override;
+	CUDAError queryDevice(int ordinal, CUDADeviceProperties &props) override;
+	CUDAError initializeDevice(int ordinal, CUDADevice &device) override;
+	CUDAError deinitializeDevice(CUDADevice &device) override;
+
+private:
+	std::vector<std::string> ptxFiles;
+	const CUDAJitCache *jitCache;
+	bool useDynamicParallelism;
 };
 
 struct CUDAFunction {
@@ -86,31 +130,47 @@ struct CUDAFunction {
 	void initialize(CUmodule module, const char *name);
 
 	/// Launch the currnet CUDA kernel with the specified thread count
+	/// The block size is the one with the best occupancy for the kernel on the current device.
 	/// @param threadCount Number of CUDA threads we want to execute
 	/// @param stream CUDA stream on which to launch the kernel
 	/// @return CUDAError() on success
 	CUDAError launch(unsigned int threadCount, CUstream stream);
 
+	/// Launch the current CUDA kernel on the current device.
+	/// Automatic parts of config are resolved for the device and the result is checked against its limits.
+	/// @param config Grid, block, dynamic shared memory and launch mode.
+	/// @param stream CUDA stream on which to launch the kernel
+	CUDAError launch(const CUDALaunchConfig &config, CUstream stream);
+
 	/// Launches the kernel and then synchronizes with the stream
 	CUDAError launchSync(unsigned int threadCount, CUstream stream);
+	CUDAError launchSync(const CUDALaunchConfig &config, CUstream stream);
 
 	template <class T, class ...Types>
 	CUDAError addParams(T param, Types ... paramList) {
+		static_assert(alignof(T) <= alignof(std::max_align_t), "Kernel parameter is over-aligned!");
+
 		if (!successfulLoading) {
 			CUDAError err(CUDA_ERROR_UNKNOWN, "HOST Error", "Adding parameters to non-loaded funtion!");
 			LOG_CUDA_ERROR(err, LogLevel::Warning);
 			return err;
 		}
 
-		memcpy(currParam, (void*)&param, sizeof(T));
-		kernelParams.push_back(static_cast<void*>(currParam));
-		currParam += sizeof(T);
-		if (currParam > params + paramsSize) {
+		// The driver reads each parameter through its pointer, so it has to be aligned for its type.
+		const SizeType offset = SizeType(currParam - params);
+		const SizeType alignedOffset = (offset + alignof(T) - 1) / alignof(T) * alignof(T);
+		if (alignedOffset + sizeof(T) > paramsSize) {
 			CUDAError err(CUDA_ERROR_UNKNOWN, "HOST Error", "Too many parameters!");
 			LOG_CUDA_ERROR(err, LogLevel::Error);
 			return err;
 		}
 
+		currParam = params + alignedOffset;
+		memcpy(currParam, (void*)&param, sizeof(T));
+		kernelParams.push_back(static_cast<void*>(currParam));
+		kernelParamSizes.push_back(sizeof(T));
+		currParam += sizeof(T);
+
 		return addParams(paramList...);
 	}
 
@@ -121,11 +181,12 @@ struct CUDAFunction {
 
 	CUfunction getFunction() const { return func; }
 	void** getParams() { return kernelParams.data(); }
+	const SizeType *getParamSizes() const { return kernelParamSizes.data(); }
 	
 	SizeType getNumParams() const { return kernelParams.size(); }
 	
 	template <class T>
-	bool changeParam(T *newParam, int paramIndex) {
+	CUDAError changeParam(T *newParam, int paramIndex) {
 		if (!successfulLoading) {
 			CUDAError err(CUDA_ERROR_UNKNOWN, "HOST Error", "Changing parameters of a non-loaded funtion!");
 			LOG_CUDA_ERROR(err, LogLevel::Warning);
@@ -141,30 +202,66 @@ struct CUDAFunction {
 		void *oldParamPtr = kernelParams[paramIndex];
 		memcpy(oldParamPtr, newParam, sizeof(T));
 
-		return true;
+		return CUDAError();
 	}
 
 	void clearParams();
 
 private:
 	static const int paramsSize = 1024;
+	static const int maxParams = 32;
 
 	CUfunction func;
 	std::vector<void *> kernelParams;
-	char params[paramsSize];
+	std::vector<SizeType> kernelParamSizes;
+	alignas(std::max_align_t) char params[paramsSize]; ///< Offsets are aligned relative to the start, so it has to be aligned for any type.
 	char *currParam;
 	int successfulLoading;
 
-#ifdef TIME_KERNEL_EXECUTION
 	std::string kernelName;
-#endif
 };
 
+/// Resolve the automatic parts of config for func on the current device and check
+/// the result against the device limits. Raises the dynamic shared memory limit of func if needed.
+CUDAError resolveKernelLaunch(CUfunction func, const CUDALaunchConfig &config, CUDALaunchConfig &resolved);
+
+/// Launch func on the current device.
+/// Automatic parts of config are resolved for the device and the result is checked against its limits.
+/// Shared by CUDAFunction and TypedKernel.
+/// @param kernelName Name the launch is profiled under.
+CUDAError launchKernel(CUfunction func, void **params, const CUDALaunchConfig &config, CUstream stream, const char *kernelName);
+
 struct CUDAManager {
 	template <class T>
 	T& getAllocator();
 
-	const std::vector<CUDADevice>& getDevices() const;
+	/// Page-locked staging memory shared by all CUDAPinnedMemoryBuffers.
+	CUDAPinnedHostPool &getPinnedHostPool();
+
+	/// Block sizes and residency limits of the kernels launched so far.
+	CUDAOccupancyCache &getOccupancyCache();
+
+	/// GPU timings of kernel launches and copies. Disabled unless TIME_KERNEL_EXECUTION is defined.
+	CUDAProfiler &getProfiler();
+
+	/// On-disk cache of the modules linked for each device.
+	CUDAJitCache &getJitCache();
+
+	/// How copies between the memory of two devices are done, see CUDABuffer::copyFrom.
+	CUDAPeerAccess &getPeerAccess();
+
+	/// Devices visible to the process. They are brought up on their first use.
+	CUDADeviceRegistry &getDevices();
+
+	/// Log the statistics of the device allocators.
+	void dumpAllocatorStats(LogLevel level);
+
+	/// Dump the allocator statistics every intervalMs milliseconds from a background thread, 0 stops.
+	/// Also enabled at startup by setting CUDABASE_ALLOCATOR_STATS_INTERVAL_MS.
+	void setAllocatorStatsInterval(unsigned int intervalMs);
+
+	/// Device of the context current on the calling thread or nullptr if there is none.
+	const CUDADevice *getCurrentDevice() const;
 
 	/// Test everything is working correctly.
 	/// Requires a kernel with the following definition
@@ -186,13 +283,39 @@ private:
 	CUDAError initializeAllocators();
 
 private:
-	std::vector<CUDADevice> devices;
+	CUDADefaultDeviceDriver deviceDriver;
+	CUDADeviceRegistry devices;
 	CUDADefaultAllocator defaultAllocator;
 	CUDAVirtualAllocator virtualAllocator;
+	CUDAFallbackAllocator fallbackAllocator;
+	CUDAManagedAllocator managedAllocator;
+	CUDAPinnedHostMemoryBackend pinnedHostBackend;
+	CUDAEventFenceBackend eventFenceBackend;
+	CUDAPinnedHostPool pinnedHostPool;
+	CUDAOccupancyCache occupancyCache;
+	CUDAProfiler profiler;
+	CUDAJitCache jitCache;
+	CUDADriverPeerTopology peerTopology;
+	CUDAPeerAccess peerAccess;
+	CUDAPeriodicReporter allocatorStatsReporter;
 	int cudaVersion;
 	bool initialized;
 };
 
+/// Create the manager. Safe to call from many threads, only the first call does the work.
 bool initializeCUDAManager(const std::vector<std::string> &ptxFiles, bool useDynamicParallelism);
+
+/// Destroy the manager. No other thread may use it anymore.
 void deinitializeCUDAManager();
+
 CUDAManager &getCUDAManager();
+bool isCUDAManagerInitialized();
+
+/// Make sure a context is current on the calling thread.
+/// Threads which never called CUDADevice::use() are bound to the first usable device,
+/// threads which did get the context of the device they used last. Does nothing
+/// if a context is current already or the manager is not initialized.
+CUDAError bindThreadContext();
+
+/// Ordinal of the device the calling thread used last, -1 if it never used one.
+int getThreadDeviceOrdinal();
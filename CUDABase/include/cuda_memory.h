@@ -1,15 +1,30 @@
 #pragma once
 
+#include <cuda_allocator_stats.h>
+#include <cuda_caching_pool.h>
+#include <cuda_memory_backend.h>
 #include <cuda_memory_defines.h>
+#include <cuda_transfer.h>
 
-#include <unordered_set>
+#include <array>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
+/// Device memory allocator backed by a CUDACachingPool.
+/// Blocks freed through it stay cached on the stream they were last used on
+/// and are handed out again to allocations on that stream.
+/// Safe to use from many threads. Small blocks are recycled through per-thread caches.
 struct CUDADefaultAllocator {
 	static constexpr AllocatorType type = AllocatorType::Default;
+	static constexpr bool canGrowInPlace = false;
+	static constexpr bool canPromote = false;
+	static constexpr bool isManaged = false;
 	using CUDAMemBlock = CUDAMemoryBlock<type>;
 public:
-	CUDAError initialize();
+	/// @param backend Memory source for the pool. nullptr means device memory.
+	/// @param fenceBackend Lets the pool reuse blocks cached on other streams, see CUDACachingPool::initialize.
+	CUDAError initialize(CUDAMemoryBackend *backend = nullptr, CUDAFenceBackend *fenceBackend = nullptr);
 	CUDAError deinitialize();
 
 	CUDAError allocate(CUDAMemBlock &memBlock);
@@ -17,88 +32,268 @@ public:
 	CUDAError upload(const CUDAMemBlock &memBlock, const void *hostPtr, CUstream stream);
 	CUDAError download(const CUDAMemBlock &memBlock, void *hostPtr, CUstream stream);
 
+	/// Pipelined upload in pieces of at most maxChunkSize. Kernels can wait for parts of the block with transfer.waitForChunk().
+	CUDAError uploadChunked(const CUDAMemBlock &memBlock, const void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream);
+
+	/// Pipelined download in pieces of at most maxChunkSize. Consumers can wait for parts of the block with transfer.waitForChunk().
+	CUDAError downloadChunked(const CUDAMemBlock &memBlock, void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream);
+
+	/// Give the block back to the pool. Fails for blocks which are not allocated, f.e. freed already.
 	CUDAError free(CUDAMemBlock &memBlock);
 
+	/// Release cached blocks until at most targetCachedBytes remain cached.
+	CUDAError trim(SizeType targetCachedBytes = 0);
+
+	/// Set the high-water cap for cached bytes. Anything above it is released on free.
+	void setMaxCachedBytes(SizeType maxBytes);
+
+	const CUDACachingPool &getPool() const { return pool; }
+
+	/// Live, peak and requested bytes of the blocks handed out, per device.
+	const CUDAAllocatorStats &getStats() const { return stats; }
+	CUDAAllocatorStats &getStats() { return stats; }
+
+	/// Log the statistics and how much the pool keeps cached.
+	void dumpStats(LogLevel level);
+
 private:
 	CUDAError internalFree(CUDAMemBlock &memBlock);
 
-	std::unordered_set<CUDAMemBlock*> allocations;
+	std::mutex allocationsMutex;
+	/// Live blocks by device pointer, so the objects holding them can be moved around freely.
+	std::unordered_map<CUDAMemHandle, CUDAMemBlock> allocations;
+	CUDADeviceMemoryBackend deviceBackend;
+	CUDACachingPool pool;
+	CUDAAllocatorStats stats;
 };
 
+/// Allocator built on the CUDA virtual memory management API.
+/// Each block reserves a large virtual address range once and only the used part
+/// of it is backed by physical chunks. grow() and shrink() map and unmap chunks at
+/// the end of the range, so the device pointer and the contents stay the same.
+/// Safe to use from many threads as long as each block is used by one thread at a time.
 struct CUDAVirtualAllocator {
 private:
 	struct PhysicalMemAllocation {
 		CUDAMemHandle virtualPtr;
-		CUDAMemHandle physicalPtr;
+		CUmemGenericAllocationHandle physicalPtr;
 		SizeType size;
 	};
 
+	struct VirtualReservation {
+		SizeType addressRangeSize; ///< Size of the reserved virtual address range.
+		SizeType mappedSize; ///< Bytes at the start of the range backed by physical memory.
+		SizeType requestedSize; ///< Size of the block in the statistics. 0 until the allocation succeeded.
+		SizeType granularity;
+		int deviceOrdinal;
+		CUmemAllocationProp allocationProperties;
+		std::vector<PhysicalMemAllocation> physicalAllocations;
+		std::vector<std::pair<CUDAMemHandle, SizeType>> extraRanges; ///< Ranges reserved later to extend the original one.
+	};
+
 public:
 	static constexpr AllocatorType type = AllocatorType::Virtual;
+	static constexpr bool canGrowInPlace = true;
+	static constexpr bool canPromote = false;
+	static constexpr bool isManaged = false;
+	/// New blocks reserve this many times their size up front, so they can grow in place a few times.
+	static constexpr SizeType RESERVATION_SIZE_FACTOR = 4;
+	/// Cap on the address space reserved past the size of a block, so large blocks don't reserve far more than they use.
+	static constexpr SizeType DEFAULT_MAX_RESERVATION_HEADROOM = SizeType(256) << 20;
 	using CUDAMemBlock = CUDAMemoryBlock<type>;
 
 public:
+	CUDAVirtualAllocator();
+
 	CUDAError initialize();
 	CUDAError deinitialize();
 
+	/// Reserve address space for memBlock.size bytes and room to grow (see getReservationSize)
+	/// and map memBlock.size bytes of it.
 	CUDAError allocate(CUDAMemBlock &memBlock);
 
+	/// Map more physical memory at the end of the block. Pointer and contents are kept.
+	/// If newSize does not fit the reservation we try to extend it right after its end and fail if that is not possible.
+	/// Fails if newSize is smaller than the block, use shrink() for that.
+	CUDAError grow(CUDAMemBlock &memBlock, SizeType newSize);
+
+	/// Unmap the physical chunks past newSize. Contents up to newSize are kept.
+	CUDAError shrink(CUDAMemBlock &memBlock, SizeType newSize);
+
+	/// Copy the block one physical chunk at a time.
 	CUDAError upload(const CUDAMemBlock &memBlock, const void *hostPtr, CUstream stream);
 	CUDAError download(const CUDAMemBlock &memBlock, void *hostPtr, CUstream stream);
 
+	/// Split a transfer of the whole block on its physical chunk boundaries and into pieces of at most maxChunkSize.
+	CUDAError planTransfer(const CUDAMemBlock &memBlock, SizeType maxChunkSize, std::vector<CUDATransferChunk> &chunks) const;
+
+	/// Pipelined upload. Kernels can wait for parts of the block with transfer.waitForChunk().
+	CUDAError uploadChunked(const CUDAMemBlock &memBlock, const void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream);
+
+	/// Pipelined download. Consumers can wait for parts of the block with transfer.waitForChunk().
+	CUDAError downloadChunked(const CUDAMemBlock &memBlock, void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream);
+
 	CUDAError free(CUDAMemBlock &memBlock);
 
+	/// Set how much address space new blocks may reserve past their size. 0 reserves only the size itself.
+	void setMaxReservationHeadroom(SizeType headroom);
+
+	/// Address space reserved up front for a block of size bytes:
+	/// RESERVATION_SIZE_FACTOR times size, with at most the max headroom over size. Before padding to the granularity.
+	SizeType getReservationSize(SizeType size) const;
+
+	/// Live and peak mapped bytes per device and how many physical chunks each mapping took.
+	const CUDAAllocatorStats &getStats() const { return stats; }
+	CUDAAllocatorStats &getStats() { return stats; }
+
+	void dumpStats(LogLevel level);
+
+private:
+	CUDAError mapPhysicalMemory(CUDAMemHandle basePtr, VirtualReservation &reservation, SizeType newMappedSize);
+	CUDAError unmapPhysicalMemory(CUDAMemHandle basePtr, VirtualReservation &reservation, SizeType newMappedSize);
+	CUDAError extendReservation(CUDAMemHandle basePtr, VirtualReservation &reservation, SizeType newRangeSize);
+	static SizeType getExtraRangesSize(const VirtualReservation &reservation);
+
+	/// Offset from the start of the block where the reserved range containing offset ends.
+	/// Physical chunks and access rights are set up per range, the driver rejects calls spanning two.
+	static SizeType getRangeEnd(const VirtualReservation &reservation, SizeType offset);
+
+	/// Reservation of the block starting at ptr or nullptr.
+	/// Elements of the map never move, so the result stays valid until the block is freed.
+	VirtualReservation *findReservation(CUDAMemHandle ptr) const;
+
+private:
+	mutable std::mutex reservationsMutex; ///< Guards the map itself, not the reservations in it.
+	std::unordered_map<CUDAMemHandle, VirtualReservation> reservations;
+	SizeType maxReservationHeadroom;
+	CUDAAllocatorStats stats;
+};
+
+/// Where a block of CUDAFallbackAllocator lives, fastest first.
+enum class CUDAMemoryTier : int {
+	Device = 0, ///< Device memory in one piece.
+	Virtual, ///< Device memory mapped from physical chunks by CUDAVirtualAllocator, still found when the free memory is fragmented.
+	MappedHost, ///< Page-locked host memory mapped for the device. Kernels reach it over the bus.
+	Count,
+};
+
+const char *getMemoryTierName(CUDAMemoryTier tier);
+
+/// Memory of the virtual tier of CUDAFallbackAllocator, taken from a CUDAVirtualAllocator.
+/// Blocks the allocator places on another device than the current one are given back
+/// and reported as out of memory, since the current context could not use them.
+struct CUDAVirtualMemoryBackend : CUDAMemoryBackend {
+	CUDAVirtualMemoryBackend();
+
+	/// @param allocator Must outlive the backend.
+	void initialize(CUDAVirtualAllocator *allocator);
+
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType size) override;
+	CUDAError free(CUDAMemHandle ptr) override;
+
 private:
-	std::unordered_map<CUDAMemBlock, std::vector<PhysicalMemAllocation>> virtualToPhysicalAllocations;
+	CUDAVirtualAllocator *allocator;
 };
 
-//template <class T = CUDADefaultAllocator, class U = CUDAVirtualAllocator>
-//struct CUDAFallbackAllocator {
-//private:
-//	using BaseAllocator = T;
-//	using FallbackAllocator = U;
-//
-//public:
-//	CUDAFallbackAllocator() { }
-//	~CUDAFallbackAllocator() { }
-//
-//	CUDAError initialize() {
-//		RETURN_ON_CUDA_ERROR(baseAllocator.initialize());
-//		RETURN_ON_CUDA_ERROR(fallbackAllocator.initialize());
-//	}
-//	
-//	CUDAError allocate(CUDAMemBlock &memBlock) {
-//		if (memBlock.ptr != NULL) {
-//			return CUDAError(CUDA_ERROR_UNKNOWN, "FallbackAllocator_ERROR_BLOCK_INITIALIZED", "");
-//		}
-//
-//		if (baseAllocator.allocate(memBlock).hasError()) {
-//			RETURN_ON_CUDA_ERROR(fallbackAllocator.allocate(memBlock));
-//			fallbackAllocatorBlocks.push_back(&memBlock);
-//		} else {
-//			baseAllocatorBlocks.push_back(memBlocks);
-//		}
-//
-//		return CUDAError();
-//	}
-//
-//	CUDAError upload(const CUDAMemBlock &memBlock, void *hostPtr) {
-//		if (baseAllocator.upload(memBlock, hostPtr).hasError()) {
-//			RETURN_ON_CUDA_ERROR(fallbackAllocator.upload(memBlock, hostPtr));
-//		}
-//
-//		return CUDAError();
-//	}
-//
-//	CUDAError free(const CUDAMemBlock &memBlock) {
-//		if (baseAllocator.free(memBlock, hostPtr).hasError()) {
-//			RETURN_ON_CUDA_ERROR(fallbackAllocator.upload(memBlock, hostPtr));
-//		}
-//
-//		return CUDAError();
-//	}
-//
-//private:
-//	BaseAllocator baseAllocator;
-//	FallbackAllocator fallbackAllocator;
-//};
\ No newline at end of file
+/// Allocator which slows down instead of failing when the device runs out of memory.
+/// Each block comes from the first tier with room for it: device memory, then the virtual allocator,
+/// then mapped page-locked host memory. All tiers hand out device pointers, so kernels can use any block.
+/// Only running out of memory falls through to the next tier, other errors fail the allocation.
+/// Blocks in a slower tier move back up with promote() once memory of a faster tier was freed.
+/// Safe to use from many threads as long as each block is used by one thread at a time.
+struct CUDAFallbackAllocator {
+	static constexpr AllocatorType type = AllocatorType::Fallback;
+	static constexpr bool canGrowInPlace = false;
+	static constexpr bool canPromote = true;
+	static constexpr bool isManaged = false;
+	static constexpr int NUM_TIERS = int(CUDAMemoryTier::Count);
+	using CUDAMemBlock = CUDAMemoryBlock<type>;
+	using TierBackends = std::array<CUDAMemoryBackend*, NUM_TIERS>;
+
+public:
+	CUDAFallbackAllocator();
+
+	/// Use device memory, virtualAllocator and mapped host memory as the tiers.
+	/// @param virtualAllocator Must outlive the allocator.
+	CUDAError initialize(CUDAVirtualAllocator *virtualAllocator);
+
+	/// Use custom memory for the tiers, f.e. CUDABudgetMemoryBackends to simulate a full device.
+	/// @param tierBackends Memory of each tier, indexed by CUDAMemoryTier. Must outlive the allocator.
+	/// @param fences Tells when the copies of promote() are done. Must outlive the allocator.
+	CUDAError initialize(const TierBackends &tierBackends, CUDAFenceBackend *fences);
+	CUDAError deinitialize();
+
+	CUDAError allocate(CUDAMemBlock &memBlock);
+
+	CUDAError upload(const CUDAMemBlock &memBlock, const void *hostPtr, CUstream stream);
+	CUDAError download(const CUDAMemBlock &memBlock, void *hostPtr, CUstream stream);
+
+	/// Pipelined upload in pieces of at most maxChunkSize. Kernels can wait for parts of the block with transfer.waitForChunk().
+	CUDAError uploadChunked(const CUDAMemBlock &memBlock, const void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream);
+
+	/// Pipelined download in pieces of at most maxChunkSize. Consumers can wait for parts of the block with transfer.waitForChunk().
+	CUDAError downloadChunked(const CUDAMemBlock &memBlock, void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream);
+
+	CUDAError free(CUDAMemBlock &memBlock);
+
+	/// Move a block to the fastest tier above its current one which has room for it.
+	/// Blocks in device memory stay where they are. So do blocks which failed to move before,
+	/// until some memory of the faster tiers is freed.
+	/// The contents are copied on stream, NULL blocks until the copy is done. memBlock.ptr changes when the block moves,
+	/// the old memory is released once the copy is done, so work using the old pointer must be on stream or finished.
+	/// @param promoted Set to true if the block moved.
+	CUDAError promote(CUDAMemBlock &memBlock, CUstream stream, bool &promoted);
+
+	CUDAMemoryTier getTier(const CUDAMemBlock &memBlock) const;
+
+	/// Bytes and number of the live blocks in tier.
+	SizeType getTierBytes(CUDAMemoryTier tier) const;
+	SizeType getTierBlocks(CUDAMemoryTier tier) const;
+
+	/// Live, peak and requested bytes of the blocks handed out, per device and over all tiers.
+	const CUDAAllocatorStats &getStats() const { return stats; }
+	CUDAAllocatorStats &getStats() { return stats; }
+
+	/// Log the statistics and how the live blocks are spread over the tiers.
+	void dumpStats(LogLevel level);
+
+private:
+	struct Allocation {
+		CUDAMemoryTier tier;
+		SizeType size;
+		int deviceOrdinal;
+		SizeType numFreesSeen; ///< numFrees when the block last failed to move up.
+	};
+
+	/// Memory of a promoted block, kept until the copy out of it is done.
+	struct PendingRelease {
+		CUDAMemHandle ptr;
+		CUDAMemoryTier tier;
+		SizeType size;
+		CUDAFence fence;
+	};
+
+	/// Allocate size bytes from the first tier before endTier with room.
+	CUDAError allocateFromTiers(CUDAMemHandle &ptr, SizeType size, CUDAMemoryTier endTier, CUDAMemoryTier &tier);
+
+	/// Give memory back to its tier and let the blocks waiting for room retry.
+	CUDAError releaseMemory(CUDAMemHandle ptr, CUDAMemoryTier tier, SizeType size);
+
+	/// Release the memory of finished promotions. With wait true all of them are waited for.
+	CUDAError releaseFinishedPromotions(bool wait);
+
+private:
+	mutable std::mutex mutex;
+	TierBackends backends;
+	CUDAFenceBackend *fenceBackend;
+	std::unordered_map<CUDAMemHandle, Allocation> allocations;
+	std::vector<PendingRelease> pendingReleases;
+	SizeType tierBytes[NUM_TIERS];
+	SizeType tierBlocks[NUM_TIERS];
+	SizeType numFrees; ///< Releases of memory in the tiers which blocks can be promoted to.
+	CUDADeviceMemoryBackend deviceBackend;
+	CUDAVirtualMemoryBackend virtualBackend;
+	CUDAMappedHostMemoryBackend mappedHostBackend;
+	CUDAEventFenceBackend eventFenceBackend;
+	CUDAAllocatorStats stats;
+};
\ No newline at end of file
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cuda_memory_defines.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+/// Source of raw memory used by the pooling allocators.
+/// The pools only do bookkeeping on top of it, so swapping the backend
+/// for CUDAHostMemoryBackend lets the pools run without a device.
+struct CUDAMemoryBackend {
+	virtual ~CUDAMemoryBackend() { }
+
+	/// Allocate size bytes and return them in ptr.
+	virtual CUDAError allocate(CUDAMemHandle &ptr, SizeType size) = 0;
+
+	/// Release memory previously returned by allocate.
+	virtual CUDAError free(CUDAMemHandle ptr) = 0;
+};
+
+/// Device memory from cuMemAlloc in the current context.
+struct CUDADeviceMemoryBackend : CUDAMemoryBackend {
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType size) override;
+	CUDAError free(CUDAMemHandle ptr) override;
+};
+
+/// Page-locked host memory from cuMemHostAlloc.
+/// Allocations are portable and mapped so they can be used from every context.
+/// The returned handle is the host pointer.
+struct CUDAPinnedHostMemoryBackend : CUDAMemoryBackend {
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType size) override;
+	CUDAError free(CUDAMemHandle ptr) override;
+};
+
+/// Page-locked host memory mapped into the address space of the current context.
+/// Unlike CUDAPinnedHostMemoryBackend the returned handle is the device pointer,
+/// so kernels and device to device copies can use it like device memory, only slower.
+struct CUDAMappedHostMemoryBackend : CUDAMemoryBackend {
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType size) override;
+	CUDAError free(CUDAMemHandle ptr) override;
+
+private:
+	std::mutex mutex;
+	std::unordered_map<CUDAMemHandle, void*> hostPointers; ///< Host pointer of each device pointer handed out.
+};
+
+/// Plain host memory. Does not touch the driver at all.
+struct CUDAHostMemoryBackend : CUDAMemoryBackend {
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType size) override;
+	CUDAError free(CUDAMemHandle ptr) override;
+};
+
+/// Host stand-in for a device with little memory left.
+/// Memory comes from another backend, but allocations which would take more than budget bytes
+/// in total fail with CUDA_ERROR_OUT_OF_MEMORY, so allocators can be run under memory pressure without a GPU.
+struct CUDABudgetMemoryBackend : CUDAMemoryBackend {
+	/// @param backend Must outlive the object.
+	CUDABudgetMemoryBackend(CUDAMemoryBackend *backend, SizeType budget);
+
+	/// Blocks allocated already are kept even if they no longer fit.
+	void setBudget(SizeType budget);
+
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType size) override;
+	CUDAError free(CUDAMemHandle ptr) override;
+
+	SizeType getBudget() const;
+	SizeType getUsedBytes() const;
+	int getNumFailedAllocations() const;
+
+private:
+	mutable std::mutex mutex;
+	CUDAMemoryBackend *backend;
+	SizeType budget;
+	SizeType usedBytes;
+	int numFailedAllocations;
+	std::unordered_map<CUDAMemHandle, SizeType> sizes;
+};
+
+using CUDAFence = CUevent;
+
+/// Tells the pools when the work submitted to a stream so far has finished.
+struct CUDAFenceBackend {
+	virtual ~CUDAFenceBackend() { }
+
+	/// Create a fence which is signaled once all work currently on stream is done.
+	virtual CUDAError record(CUDAFence &fence, CUstream stream) = 0;
+
+	/// Non-blocking check if the fence is signaled.
+	virtual bool isComplete(CUDAFence fence) = 0;
+
+	/// Block until the fence is signaled.
+	virtual CUDAError wait(CUDAFence fence) = 0;
+
+	/// Destroy a fence created by record.
+	virtual void destroy(CUDAFence fence) = 0;
+};
+
+/// Fences implemented with CUDA events.
+struct CUDAEventFenceBackend : CUDAFenceBackend {
+	CUDAError record(CUDAFence &fence, CUstream stream) override;
+	bool isComplete(CUDAFence fence) override;
+	CUDAError wait(CUDAFence fence) override;
+	void destroy(CUDAFence fence) override;
+};
+
+/// Host stand-in for CUDAEventFenceBackend.
+/// Fences are signaled right away unless manual signaling is enabled,
+/// in which case they stay pending until signalAll() is called.
+/// Fences may be checked from other threads than the ones recording and signaling them.
+struct CUDAHostFenceBackend : CUDAFenceBackend {
+	CUDAHostFenceBackend() : manualSignal(false), nextFence(0), signaledUpTo(0) { }
+
+	CUDAError record(CUDAFence &fence, CUstream stream) override;
+	bool isComplete(CUDAFence fence) override;
+	CUDAError wait(CUDAFence fence) override;
+	void destroy(CUDAFence fence) override;
+
+	void setManualSignal(bool manual) { manualSignal = manual; }
+	void signalAll() { signalUpTo(nextFence.load()); }
+
+private:
+	void signalUpTo(SizeType fence);
+
+private:
+	std::atomic<bool> manualSignal;
+	std::atomic<SizeType> nextFence;
+	std::atomic<SizeType> signaledUpTo;
+};
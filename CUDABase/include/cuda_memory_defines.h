@@ -12,7 +12,9 @@ using SizeType = unsigned long long;
 enum class AllocatorType : uint8_t {
 	Default,
 	Pinned,
-	Virtual
+	Virtual,
+	Fallback,
+	Managed
 };
 
 template <AllocatorType allocatorType>
@@ -20,9 +22,12 @@ struct CUDAMemoryBlock {
 	CUDAMemHandle ptr;
 	SizeType size;
 	SizeType reserved;
+	CUstream stream; ///< Stream the block was last used on. Pooling allocators recycle the block on it.
+	CUcontext ctx; ///< Context the block was allocated in. Only set by pooling allocators.
+	int deviceOrdinal; ///< Device the block is accounted to in the allocator statistics, -1 if not known.
 
-	CUDAMemoryBlock() : ptr(NULL), size(0), reserved(0) { }
-	CUDAMemoryBlock(CUDAMemHandle ptr, SizeType size) : ptr(ptr), size(size), reserved(size) { }
+	CUDAMemoryBlock() : ptr(NULL), size(0), reserved(0), stream(NULL), ctx(NULL), deviceOrdinal(-1) { }
+	CUDAMemoryBlock(CUDAMemHandle ptr, SizeType size) : ptr(ptr), size(size), reserved(size), stream(NULL), ctx(NULL), deviceOrdinal(-1) { }
 
 	bool operator==(const CUDAMemoryBlock &other) const {
 		const bool result = ptr == other.ptr;
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cuda_memory_defines.h>
+#include <cuda_transfer.h>
+
+#include <map>
+#include <mutex>
+#include <utility>
+
+struct CUDADevice;
+struct CUDADeviceRegistry;
+
+/// How data moves from the memory of one device to the memory of another one.
+enum class CUDACopyPath : int {
+	SameDevice = 0, ///< Plain device to device copy.
+	Peer, ///< Direct copy between the devices with cuMemcpyPeerAsync, peer access is enabled.
+	Staged, ///< Downloaded to page-locked host memory and uploaded again, chunk by chunk.
+};
+
+const char *getCopyPathName(CUDACopyPath path);
+
+/// Path for a copy into the memory of dstOrdinal from the memory of srcOrdinal.
+/// @param peerAccessEnabled If the context of dstOrdinal can access the memory of srcOrdinal.
+CUDACopyPath chooseCopyPath(int dstOrdinal, int srcOrdinal, bool peerAccessEnabled);
+
+/// Peer capabilities of the devices as seen by CUDAPeerAccess.
+/// Devices are identified by their driver ordinals.
+struct CUDAPeerTopology {
+	virtual ~CUDAPeerTopology() { }
+
+	/// If the hardware lets dstOrdinal access the memory of srcOrdinal. Should be cheap, no context may be created.
+	virtual CUDAError canAccessPeer(int dstOrdinal, int srcOrdinal, bool &result) = 0;
+
+	/// Let the context of dstOrdinal access the memory of srcOrdinal.
+	virtual CUDAError enablePeerAccess(int dstOrdinal, int srcOrdinal) = 0;
+};
+
+/// Peer capabilities of the devices of a CUDADeviceRegistry.
+/// Enabling peer access brings both devices up.
+struct CUDADriverPeerTopology : CUDAPeerTopology {
+	CUDADriverPeerTopology();
+
+	/// @param devices Must outlive the topology.
+	void initialize(CUDADeviceRegistry *devices);
+
+	CUDAError canAccessPeer(int dstOrdinal, int srcOrdinal, bool &result) override;
+	CUDAError enablePeerAccess(int dstOrdinal, int srcOrdinal) override;
+
+private:
+	CUDADeviceRegistry *devices;
+};
+
+/// Host stand-in for CUDADriverPeerTopology.
+/// Links between devices are set by hand, so the path chosen for any topology can be checked without GPUs.
+struct CUDAHostPeerTopology : CUDAPeerTopology {
+	CUDAHostPeerTopology();
+
+	/// Let dstOrdinal access the memory of srcOrdinal. Links are one-directional, like in the driver.
+	void setLink(int dstOrdinal, int srcOrdinal, bool canAccess);
+
+	/// Make enablePeerAccess fail, f.e. like the driver does when a device has too many peers already.
+	void setEnableFails(bool fails);
+
+	CUDAError canAccessPeer(int dstOrdinal, int srcOrdinal, bool &result) override;
+	CUDAError enablePeerAccess(int dstOrdinal, int srcOrdinal) override;
+
+	int getNumEnableCalls() const;
+	bool isEnabled(int dstOrdinal, int srcOrdinal) const;
+
+private:
+	mutable std::mutex mutex;
+	std::map<std::pair<int, int>, bool> links;
+	std::map<std::pair<int, int>, bool> enabled;
+	int numEnableCalls;
+	bool enableFails;
+};
+
+/// Chooses the copy path for each pair of devices and enables peer access on first use of a pair.
+/// The result is remembered, so the topology is asked at most once per pair.
+/// Safe to use from many threads.
+struct CUDAPeerAccess {
+	CUDAPeerAccess();
+
+	CUDAPeerAccess(const CUDAPeerAccess&) = delete;
+	CUDAPeerAccess &operator=(const CUDAPeerAccess&) = delete;
+
+	/// @param topology Must outlive the object.
+	void initialize(CUDAPeerTopology *topology);
+
+	/// Forget the pairs seen so far. Peer access that was enabled stays enabled until the contexts are destroyed.
+	void deinitialize();
+
+	/// Path for copies into the memory of dstOrdinal from the memory of srcOrdinal.
+	/// Pairs without a peer link and pairs where enabling peer access failed are staged.
+	CUDACopyPath getCopyPath(int dstOrdinal, int srcOrdinal);
+
+private:
+	enum class PairState : int {
+		Enabled = 0,
+		Unavailable,
+	};
+
+	mutable std::mutex mutex;
+	CUDAPeerTopology *topology;
+	std::map<std::pair<int, int>, PairState> pairs;
+};
+
+/// Copy size bytes from src on srcDevice to dst on dstDevice using path.
+/// stream must belong to dstDevice. The copy is ordered after the work already on stream and
+/// work submitted to stream later is ordered after the copy. The host is not blocked.
+/// The staged path pipelines chunks of at most maxChunkSize through two page-locked slices
+/// from the manager's CUDAPinnedHostPool, downloads run on a stream of srcDevice.
+CUDAError copyDeviceMemory(
+	CUDAMemHandle dst,
+	const CUDADevice &dstDevice,
+	CUDAMemHandle src,
+	const CUDADevice &srcDevice,
+	SizeType size,
+	CUDACopyPath path,
+	CUstream stream,
+	SizeType maxChunkSize = DEFAULT_TRANSFER_CHUNK_SIZE
+);
+
+/// Copy size bytes between the memory of two devices with the path chosen by the manager's CUDAPeerAccess.
+/// Ordinals are driver ordinals, -1 means the device current on the calling thread.
+/// See copyDeviceMemory for the ordering.
+CUDAError copyBetweenDevices(CUDAMemHandle dst, int dstOrdinal, CUDAMemHandle src, int srcOrdinal, SizeType size, CUstream stream);
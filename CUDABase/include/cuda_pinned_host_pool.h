@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cuda_memory_backend.h>
+
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/// Slice of page-locked host memory handed out by CUDAPinnedHostPool.
+struct CUDAPinnedSlice {
+	void *ptr;
+	SizeType size; ///< Size of the slice's size class, or of its own allocation for big slices. Always >= the requested size.
+
+	CUDAPinnedSlice() : ptr(nullptr), size(0) { }
+};
+
+/// Arena of page-locked host memory used for staging transfers.
+/// Memory is page-locked in big chunks which are carved into size-class slices.
+/// A released slice is kept in flight until the stream that used it passes
+/// the fence recorded at release time and only then it is handed out again,
+/// so the expensive page-locking happens once per chunk instead of once per buffer.
+/// Slices bigger than a quarter of a chunk get an allocation of their own instead,
+/// which is given back to the backend once the slice is released and its stream passed it.
+/// Page-locked memory is taken from the OS, so the pool does not hoard it: chunks without
+/// any slice in use are carved anew before new chunks are page-locked, and are released
+/// while the pool holds more than its high-water cap, on trim() or on deinitialize().
+/// Safe to use from many threads.
+struct CUDAPinnedHostPool {
+	static constexpr SizeType MIN_SLICE_SIZE = 4096;
+	static constexpr SizeType DEFAULT_CHUNK_SIZE = SizeType(64) << 20;
+	static constexpr SizeType DEFAULT_MAX_PINNED_BYTES = SizeType(256) << 20;
+
+public:
+	CUDAPinnedHostPool();
+	~CUDAPinnedHostPool();
+
+	CUDAPinnedHostPool(const CUDAPinnedHostPool&) = delete;
+	CUDAPinnedHostPool &operator=(const CUDAPinnedHostPool&) = delete;
+
+	/// @param memoryBackend Source of the chunks. Must outlive the pool.
+	/// @param fenceBackend Used to find out when in-flight slices are done. Must outlive the pool.
+	/// @param chunkSize Size of each page-locked chunk. Slices bigger than a quarter of it get an allocation of their own.
+	/// @param maxPinnedBytes High-water cap for the page-locked bytes. Idle chunks are released while the pool holds more.
+	/// Slices in use are never taken away, so the pool can go above the cap while they are.
+	CUDAError initialize(CUDAMemoryBackend *memoryBackend, CUDAFenceBackend *fenceBackend, SizeType chunkSize = DEFAULT_CHUNK_SIZE, SizeType maxPinnedBytes = DEFAULT_MAX_PINNED_BYTES);
+
+	/// Waits for all in-flight slices and releases all chunks.
+	CUDAError deinitialize();
+
+	/// Get a slice of at least size bytes.
+	CUDAError acquire(SizeType size, CUDAPinnedSlice &slice);
+
+	/// Give a slice back to the pool.
+	/// @param stream Stream the slice was last used on. It is reused only after all work
+	/// currently on that stream is done. NULL means the slice is not in use anymore.
+	CUDAError release(CUDAPinnedSlice &slice, CUstream stream);
+
+	/// Move every in-flight slice whose fence is signaled back to the free lists.
+	/// Big slices are released to the backend instead.
+	CUDAError reclaim();
+
+	/// Release chunks without any slice in use until at most targetPinnedBytes are page-locked.
+	/// In-flight slices whose fence is signaled are reclaimed first.
+	CUDAError trim(SizeType targetPinnedBytes = 0);
+
+	void setMaxPinnedBytes(SizeType maxBytes);
+	SizeType getMaxPinnedBytes() const;
+
+	/// Number of page-locked chunks held right now.
+	SizeType getNumChunks() const;
+
+	/// Number of big slices with an allocation of their own, in use or in flight.
+	SizeType getNumDedicatedSlices() const;
+
+	/// Bytes of all page-locked chunks and big slices.
+	SizeType getPinnedBytes() const;
+
+	/// Number of released slices still waiting on their fence.
+	SizeType getNumInFlight() const;
+
+	/// Size of the slice handed out for a request of size bytes.
+	/// Powers of two starting from MIN_SLICE_SIZE up to a quarter of the chunk size,
+	/// bigger requests are only rounded up to a multiple of MIN_SLICE_SIZE.
+	SizeType getSliceSize(SizeType size) const;
+
+private:
+	struct Chunk {
+		char *ptr;
+		SizeType size;
+		SizeType used; ///< Bytes carved into slices from the start of the chunk.
+		SizeType numSlicesInUse; ///< Slices carved from the chunk which are acquired or in flight.
+	};
+
+	struct InFlightSlice {
+		CUDAPinnedSlice slice;
+		CUDAFence fence;
+	};
+
+	SizeType getMaxPooledSliceSize() const { return chunkSize / 4; }
+
+	CUDAError carve(SizeType sliceSize, CUDAPinnedSlice &slice);
+	CUDAError acquireDedicated(SizeType sliceSize, CUDAPinnedSlice &slice);
+
+	/// Put a slice nobody uses anymore back on its free list, or release it if it is a big one.
+	CUDAError recycle(const CUDAPinnedSlice &slice);
+
+	/// Chunk the pooled slice at ptr was carved from.
+	Chunk *findChunk(void *ptr);
+
+	/// Forget the free slices of an idle chunk, so it can be carved anew or released.
+	void dropFreeSlices(const Chunk &chunk);
+
+	CUDAError reclaimLocked();
+	CUDAError trimLocked(SizeType targetPinnedBytes);
+
+private:
+	mutable std::mutex mutex;
+	CUDAMemoryBackend *memoryBackend;
+	CUDAFenceBackend *fenceBackend;
+	std::map<char*, Chunk> chunks; ///< By start address, to find the chunk of a slice.
+	std::unordered_map<void*, SizeType> dedicatedSlices; ///< Size of each big slice with an allocation of its own.
+	std::unordered_map<SizeType, std::vector<void*>> freeSlices;
+	std::vector<InFlightSlice> inFlight;
+	SizeType chunkSize;
+	SizeType maxPinnedBytes;
+	SizeType pinnedBytes;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cuda_memory_defines.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Latency histogram with logarithmic buckets.
+/// Each doubling of the latency is split in BUCKETS_PER_DOUBLING buckets, so
+/// percentiles are exact to about 9% over the whole range with constant memory.
+struct CUDALatencyHistogram {
+	static constexpr int BUCKETS_PER_DOUBLING = 8;
+	static constexpr int NUM_DOUBLINGS = 28; ///< From 1us to about 4.5 minutes.
+	static constexpr int NUM_BUCKETS = BUCKETS_PER_DOUBLING * NUM_DOUBLINGS;
+
+public:
+	CUDALatencyHistogram();
+
+	void add(float ms);
+	void reset();
+
+	/// Latency below which fraction of the samples are. Returns the upper bound of the bucket, capped to the max.
+	/// @param fraction In [0, 1], f.e. 0.99 for p99.
+	float getPercentile(float fraction) const;
+
+	SizeType getCount() const { return count; }
+	float getMax() const { return maxMs; }
+	double getTotal() const { return totalMs; }
+
+	static int getBucket(float ms);
+	static float getBucketUpperBound(int bucket);
+
+private:
+	SizeType buckets[NUM_BUCKETS];
+	SizeType count;
+	float maxMs;
+	double totalMs;
+};
+
+/// GPU side profiler for kernel launches and copies.
+/// Ranges are delimited by a pair of events recorded on the stream of the work,
+/// so the measured time is what the GPU spent on it and the host is never blocked.
+/// Finished ranges are folded into a histogram per name by collect() which only
+/// queries the events. Cheap enough to stay enabled in production.
+/// Safe to use from many threads.
+struct CUDAProfiler {
+	/// Ranges waiting for the GPU above which new ones are dropped.
+	static constexpr int MAX_PENDING_RANGES = 4096;
+
+	/// Handle of a started range. Invalid when the profiler is disabled.
+	struct Range {
+		CUevent start;
+		CUcontext ctx;
+
+		Range() : start(NULL), ctx(NULL) { }
+	};
+
+public:
+	CUDAProfiler();
+	~CUDAProfiler();
+
+	CUDAProfiler(const CUDAProfiler&) = delete;
+	CUDAProfiler &operator=(const CUDAProfiler&) = delete;
+
+	void setEnabled(bool enabled);
+	bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+	/// Mark the start of a range on stream. Must be paired with end() on the same stream.
+	CUDAError begin(CUstream stream, Range &range);
+
+	/// Mark the end of the range started with begin(). The GPU time is accounted to name.
+	CUDAError end(const char *name, CUstream stream, Range &range);
+
+	/// Fold all ranges the GPU has finished into the histograms. Does not block.
+	void collect();
+
+	/// Wait for all pending ranges and collect them. Other threads wait meanwhile.
+	CUDAError flush();
+
+	/// Log the statistics of every name.
+	void dump(LogLevel level) const;
+
+	/// Drop all collected statistics.
+	void reset();
+
+	/// Flush, dump if there is anything to report and release the events.
+	/// Must be called while the contexts the ranges were recorded in are still alive.
+	CUDAError deinitialize();
+
+	/// The histogram stays at the same address until deinitialize(), but is updated by collect().
+	const CUDALatencyHistogram *getHistogram(const char *name) const;
+	SizeType getNumDropped() const;
+
+private:
+	struct PendingRange {
+		CUevent start;
+		CUevent end;
+		CUcontext ctx;
+		int histogramIdx;
+	};
+
+	struct NamedHistogram {
+		std::string name;
+		CUDALatencyHistogram histogram;
+	};
+
+	CUDAError acquireEvent(CUcontext ctx, CUevent &event);
+	void releaseEvent(CUcontext ctx, CUevent event);
+	int getHistogramIdx(const char *name);
+	void collectLocked();
+	CUDAError flushLocked();
+	void dumpLocked(LogLevel level) const;
+
+private:
+	mutable std::mutex mutex;
+	/// Events can only be recorded on streams of the context they were created in.
+	std::unordered_map<CUcontext, std::vector<CUevent>> freeEvents;
+	std::vector<PendingRange> pending;
+	std::unordered_map<std::string, int> histogramIndices;
+	std::deque<NamedHistogram> histograms; ///< Deque so handed out histograms never move.
+	SizeType numDropped;
+	std::atomic<bool> enabled;
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cuda_memory_defines.h>
+
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// Streams and events for CUDAStreamPool and CUDAEventPool.
+struct CUDAStreamBackend {
+	virtual ~CUDAStreamBackend() { }
+
+	/// Lower numbers mean higher priority, like in the driver.
+	virtual CUDAError getPriorityRange(int &leastPriority, int &greatestPriority) = 0;
+
+	virtual CUDAError createStream(CUstream &stream, int priority) = 0;
+	virtual CUDAError destroyStream(CUstream stream) = 0;
+
+	virtual CUDAError createEvent(CUevent &event) = 0;
+	virtual CUDAError destroyEvent(CUevent event) = 0;
+
+	/// Capture the work submitted to stream so far in event.
+	virtual CUDAError recordEvent(CUevent event, CUstream stream) = 0;
+
+	/// Make later work on stream wait for the last record of event, without blocking the host.
+	virtual CUDAError waitEvent(CUstream stream, CUevent event) = 0;
+
+	/// Non-blocking check if the last record of event is done.
+	virtual bool isEventComplete(CUevent event) = 0;
+
+	/// Block the host until the last record of event is done.
+	virtual CUDAError synchronizeEvent(CUevent event) = 0;
+};
+
+/// Streams and events of the context current on the calling thread.
+/// Streams don't synchronize with the NULL stream and events have timing disabled, which makes them cheaper to record.
+struct CUDADriverStreamBackend : CUDAStreamBackend {
+	CUDAError getPriorityRange(int &leastPriority, int &greatestPriority) override;
+	CUDAError createStream(CUstream &stream, int priority) override;
+	CUDAError destroyStream(CUstream stream) override;
+	CUDAError createEvent(CUevent &event) override;
+	CUDAError destroyEvent(CUevent event) override;
+	CUDAError recordEvent(CUevent event, CUstream stream) override;
+	CUDAError waitEvent(CUstream stream, CUevent event) override;
+	bool isEventComplete(CUevent event) override;
+	CUDAError synchronizeEvent(CUevent event) override;
+};
+
+/// Host stand-in for CUDADriverStreamBackend.
+/// Handles are plain numbers. Every record completes right away and every wait
+/// is remembered, so the dependencies set up by the pool can be checked without a GPU.
+struct CUDAHostStreamBackend : CUDAStreamBackend {
+	/// A wait issued through waitEvent: stream waits for the stream event was last recorded on.
+	struct Wait {
+		CUstream stream;
+		CUevent event;
+		CUstream recordedOn;
+	};
+
+public:
+	CUDAHostStreamBackend();
+
+	CUDAError getPriorityRange(int &leastPriority, int &greatestPriority) override;
+	CUDAError createStream(CUstream &stream, int priority) override;
+	CUDAError destroyStream(CUstream stream) override;
+	CUDAError createEvent(CUevent &event) override;
+	CUDAError destroyEvent(CUevent event) override;
+	CUDAError recordEvent(CUevent event, CUstream stream) override;
+	CUDAError waitEvent(CUstream stream, CUevent event) override;
+	bool isEventComplete(CUevent event) override;
+	CUDAError synchronizeEvent(CUevent event) override;
+
+	int getStreamPriority(CUstream stream) const;
+	int getNumLiveStreams() const;
+	int getNumLiveEvents() const;
+	std::vector<Wait> getWaits() const;
+
+private:
+	mutable std::mutex mutex;
+	std::unordered_map<CUstream, int> streamPriorities;
+	std::unordered_map<CUevent, CUstream> eventStreams; ///< Stream each live event was last recorded on.
+	std::vector<Wait> waits;
+	SizeType nextHandle;
+};
+
+/// Reusable events of one context. Creating an event is far more expensive than recording one,
+/// so events used to order work between streams come from here.
+/// Safe to use from many threads.
+struct CUDAEventPool {
+	CUDAEventPool();
+	~CUDAEventPool();
+
+	CUDAEventPool(const CUDAEventPool&) = delete;
+	CUDAEventPool &operator=(const CUDAEventPool&) = delete;
+
+	/// @param backend Must outlive the pool.
+	CUDAError initialize(CUDAStreamBackend *backend);
+
+	/// Destroy the pooled events. Events still acquired are destroyed when released.
+	CUDAError deinitialize();
+
+	CUDAError acquire(CUevent &event);
+
+	/// Give an event back. It may still be pending, the next record simply replaces it.
+	void release(CUevent event);
+
+	CUDAStreamBackend *getBackend() const { return backend; }
+
+	SizeType getNumCreated() const;
+	SizeType getNumFree() const;
+
+private:
+	mutable std::mutex mutex;
+	CUDAStreamBackend *backend;
+	std::vector<CUevent> freeEvents;
+	SizeType numCreated;
+	bool deinitialized;
+};
+
+/// A point in a stream other streams can wait for on the device.
+/// Owns a pooled event which goes back to the pool on destruction. Waits issued before that are not affected.
+struct CUDADependency {
+	CUDADependency();
+	~CUDADependency();
+
+	CUDADependency(CUDADependency &&other);
+	CUDADependency &operator=(CUDADependency &&other);
+
+	CUDADependency(const CUDADependency&) = delete;
+	CUDADependency &operator=(const CUDADependency&) = delete;
+
+	bool isValid() const { return event != NULL; }
+
+	/// Non-blocking check if the work before the dependency is done.
+	bool isComplete() const;
+
+	/// Block the host until the work before the dependency is done. Prefer CUDAStreamPool::waitFor.
+	CUDAError synchronize() const;
+
+	CUevent getEvent() const { return event; }
+
+	/// Return the event to its pool.
+	void reset();
+
+private:
+	friend struct CUDAStreamPool;
+
+	CUevent event;
+	CUDAEventPool *eventPool;
+};
+
+enum class CUDAStreamPriority : int {
+	Normal = 0, ///< Least priority of the device, same as streams created without one.
+	High, ///< Greatest priority of the device. Its kernels are scheduled before those of Normal streams.
+
+	Count
+};
+
+struct CUDAStreamPool;
+
+/// Use of a pooled stream. The stream goes back to the pool when the lease is released or destroyed.
+struct CUDAStreamLease {
+	CUDAStreamLease();
+	~CUDAStreamLease();
+
+	CUDAStreamLease(CUDAStreamLease &&other);
+	CUDAStreamLease &operator=(CUDAStreamLease &&other);
+
+	CUDAStreamLease(const CUDAStreamLease&) = delete;
+	CUDAStreamLease &operator=(const CUDAStreamLease&) = delete;
+
+	CUstream get() const { return stream; }
+	CUDAStreamPriority getPriority() const { return priority; }
+	bool isValid() const { return stream != NULL; }
+
+	void release();
+
+private:
+	friend struct CUDAStreamPool;
+
+	CUDAStreamPool *pool;
+	CUstream stream;
+	CUDAStreamPriority priority;
+};
+
+/// Prioritized streams of one device, handed out with leases, and the events which order work between them.
+/// A lease gets a stream no one else holds if there is one. Streams are created on demand up
+/// to maxStreamsPerPriority per priority, after that the least shared stream is leased again,
+/// so the number of streams stays bounded however many jobs run.
+/// Work on different leases only overlaps if nothing orders it. Use record and waitFor to
+/// express "kernel X needs upload Y" on the device instead of synchronizing the host.
+/// Safe to use from many threads.
+struct CUDAStreamPool {
+	static constexpr int DEFAULT_MAX_STREAMS_PER_PRIORITY = 8;
+
+public:
+	CUDAStreamPool();
+	~CUDAStreamPool();
+
+	CUDAStreamPool(const CUDAStreamPool&) = delete;
+	CUDAStreamPool &operator=(const CUDAStreamPool&) = delete;
+
+	/// Streams and events are created in the context current when they are first needed.
+	/// @param backend Must outlive the pool.
+	CUDAError initialize(CUDAStreamBackend *backend, int maxStreamsPerPriority = DEFAULT_MAX_STREAMS_PER_PRIORITY);
+
+	/// Destroy the streams and events. Work still running on them finishes first.
+	CUDAError deinitialize();
+
+	CUDAError acquire(CUDAStreamPriority priority, CUDAStreamLease &lease);
+
+	/// Capture the work submitted to stream so far.
+	CUDAError record(CUstream stream, CUDADependency &dependency);
+
+	/// Make work submitted to stream from now on wait for dependency. The host is not blocked.
+	CUDAError waitFor(CUstream stream, const CUDADependency &dependency);
+
+	/// Make work submitted to stream from now on wait for the work submitted to producer so far.
+	CUDAError waitForStream(CUstream stream, CUstream producer);
+
+	CUDAEventPool &getEventPool() { return eventPool; }
+
+	/// Driver priority the streams of a priority class are created with.
+	int getDriverPriority(CUDAStreamPriority priority) const;
+
+	int getNumStreams(CUDAStreamPriority priority) const;
+	int getNumLeases(CUDAStreamPriority priority) const;
+
+private:
+	friend struct CUDAStreamLease;
+
+	struct PooledStream {
+		CUstream stream;
+		int numLeases;
+	};
+
+	void release(CUstream stream, CUDAStreamPriority priority);
+
+private:
+	mutable std::mutex mutex;
+	CUDAStreamBackend *backend;
+	CUDAEventPool eventPool;
+	std::vector<PooledStream> streams[int(CUDAStreamPriority::Count)];
+	int driverPriorities[int(CUDAStreamPriority::Count)];
+	int maxStreamsPerPriority;
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cuda_memory_backend.h>
+#include <cuda_memory_defines.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Unit of host work, f.e. decoding an image. The error is reported by the group the task ran in.
+using CUDATask = std::function<CUDAError()>;
+
+/// Body of CUDATaskScheduler::parallelFor, called for the elements in [begin, end).
+using CUDARangeTask = std::function<CUDAError(SizeType begin, SizeType end)>;
+
+struct CUDATaskScheduler;
+
+/// Tasks which are waited for together.
+/// wait() runs queued tasks of the scheduler instead of idling, so tasks may themselves start groups and wait for them.
+/// Safe to use from many threads. Must not be destroyed before wait() returned.
+struct CUDATaskGroup {
+	explicit CUDATaskGroup(CUDATaskScheduler &scheduler);
+	~CUDATaskGroup();
+
+	CUDATaskGroup(const CUDATaskGroup&) = delete;
+	CUDATaskGroup &operator=(const CUDATaskGroup&) = delete;
+
+	void run(CUDATask task);
+
+	/// Run task once fence is signaled, see CUDATaskScheduler::runAfter.
+	void runAfter(CUDAFence fence, CUDATask task);
+
+	/// Run task once the work currently on stream is done, see CUDATaskScheduler::runAfterStream.
+	CUDAError runAfterStream(CUstream stream, CUDATask task);
+
+	/// Block until every task of the group ran, helping with queued tasks meanwhile.
+	/// @return The first error a task returned since the previous wait().
+	CUDAError wait();
+
+private:
+	/// Wrap task so it reports to the group.
+	std::function<void()> wrap(CUDATask task);
+	void finishTask(const CUDAError &err);
+
+private:
+	CUDATaskScheduler &scheduler;
+	std::atomic<int> numPending;
+	std::mutex mutex;
+	std::condition_variable finished;
+	CUDAError firstError;
+};
+
+/// Pool of host worker threads with a deque each.
+/// Tasks started on a worker go to the back of its own deque and it takes work from the back too,
+/// so related work stays on one core. Idle workers steal from the front of the deques of the others,
+/// tasks started from other threads are shared by all workers. Idle workers sleep.
+/// Continuations can wait for CUDA work: they are queued once their fence is signaled,
+/// which is checked by a single watcher thread, so no worker blocks on the device.
+/// Safe to use from many threads.
+struct CUDATaskScheduler {
+	CUDATaskScheduler();
+	~CUDATaskScheduler();
+
+	CUDATaskScheduler(const CUDATaskScheduler&) = delete;
+	CUDATaskScheduler &operator=(const CUDATaskScheduler&) = delete;
+
+	/// Start the workers.
+	/// @param numWorkers 0 starts one per hardware thread.
+	/// @param fences Tells when the fences of continuations are signaled. nullptr means CUDA events. Must outlive the scheduler.
+	CUDAError initialize(int numWorkers = 0, CUDAFenceBackend *fences = nullptr);
+
+	/// Run the queued tasks and stop the workers. Continuations whose fence is not signaled yet are dropped,
+	/// so groups with continuations must be waited for first.
+	void deinitialize();
+
+	/// Queue a task which belongs to no group. Its error is logged.
+	void submit(CUDATask task);
+
+	/// Queue task once fence is signaled. The fence must stay valid until then.
+	void runAfter(CUDAFence fence, CUDATask task);
+
+	/// Queue task once the work currently on stream is done. The fence is created and destroyed by the scheduler.
+	CUDAError runAfterStream(CUstream stream, CUDATask task);
+
+	/// Call body for consecutive pieces of [begin, end) on all workers and the calling thread and wait for all of them.
+	/// Ranges are split in halves until they have at most grainSize elements, idle workers steal the halves.
+	/// @param grainSize 0 picks one giving each worker about 8 pieces.
+	/// @return The first error body returned.
+	CUDAError parallelFor(SizeType begin, SizeType end, SizeType grainSize, const CUDARangeTask &body);
+
+	int getNumWorkers() const;
+
+	/// Tasks run so far and how many of them were stolen from another worker.
+	SizeType getNumExecuted() const;
+	SizeType getNumStolen() const;
+
+private:
+	friend struct CUDATaskGroup;
+
+	using Job = std::function<void()>;
+
+	struct alignas(64) Worker {
+		std::mutex mutex;
+		std::deque<Job> jobs;
+		std::thread thread;
+		std::atomic<SizeType> numExecuted;
+		std::atomic<SizeType> numStolen;
+		unsigned int randomState; ///< Picks the first worker to steal from. Only used by the worker's thread.
+
+		Worker() : numExecuted(0), numStolen(0), randomState(0) { }
+	};
+
+	struct Continuation {
+		CUDAFence fence;
+		Job job;
+		bool ownsFence;
+	};
+
+	/// Queue job on the calling worker or in the shared queue when called from another thread.
+	void push(Job job);
+
+	/// Take one queued job and run it.
+	/// @param workerIndex Worker of this scheduler the calling thread is, -1 for other threads.
+	/// @return false if nothing was queued.
+	bool tryRunOne(int workerIndex);
+
+	/// Index of the calling thread in workers or -1 if it is no worker of this scheduler.
+	int getCurrentWorkerIndex() const;
+
+	void addContinuation(const Continuation &continuation);
+	void workerLoop(int workerIndex);
+	void watcherLoop();
+
+private:
+	std::vector<std::unique_ptr<Worker>> workers;
+
+	std::mutex sharedMutex;
+	std::deque<Job> sharedJobs; ///< Jobs queued by threads which are no workers.
+
+	std::atomic<int> numQueued; ///< Jobs in all queues together.
+	std::atomic<int> numSleeping;
+	std::atomic<bool> stopping;
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+
+	std::mutex continuationsMutex;
+	std::condition_variable continuationAdded;
+	std::vector<Continuation> continuations;
+	std::thread watcher;
+	bool stoppingWatcher; ///< Guarded by continuationsMutex.
+
+	CUDAEventFenceBackend eventFenceBackend;
+	CUDAFenceBackend *fenceBackend;
+};
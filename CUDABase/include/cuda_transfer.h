@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cuda_memory_defines.h>
+
+#include <vector>
+
+/// Default upper limit of a chunk for pipelined transfers.
+constexpr SizeType DEFAULT_TRANSFER_CHUNK_SIZE = SizeType(4) << 20;
+
+/// Part of a transfer. Offsets are relative to the start of the buffer.
+struct CUDATransferChunk {
+	SizeType offset;
+	SizeType size;
+};
+
+/// Split the first transferSize bytes of a buffer into chunks.
+/// Chunks never cross a boundary of the buffer's physical allocations and are
+/// never bigger than maxChunkSize.
+/// @param physicalChunkSizes Sizes of the buffer's physical allocations in address order.
+/// Empty means the buffer is one contiguous allocation.
+/// @param transferSize Number of bytes to transfer from the start of the buffer. Must not be more than the physical allocations hold.
+/// @param maxChunkSize Upper limit of a chunk. 0 means no limit.
+CUDAError planTransferChunks(const std::vector<SizeType> &physicalChunkSizes, SizeType transferSize, SizeType maxChunkSize, std::vector<CUDATransferChunk> &chunks);
+
+/// Pipelined transfer of a buffer split by planTransferChunks.
+/// Each chunk is issued as a separate async copy followed by an event, so consumers
+/// on other streams can wait for single chunks with waitForChunk() and start working
+/// on the data which already landed while the rest is still in flight.
+/// All chunks are queued on one stream right away, which runs them in order. The host is never blocked.
+struct CUDAChunkedTransfer {
+	CUDAChunkedTransfer();
+	~CUDAChunkedTransfer();
+
+	CUDAChunkedTransfer(const CUDAChunkedTransfer&) = delete;
+	CUDAChunkedTransfer &operator=(const CUDAChunkedTransfer&) = delete;
+
+	/// Release the events. The transfer must not be in flight anymore.
+	CUDAError deinitialize();
+
+	/// Copy host memory to the device chunk by chunk on stream.
+	CUDAError upload(CUDAMemHandle dst, const void *src, const std::vector<CUDATransferChunk> &chunks, CUstream stream);
+
+	/// Copy device memory to the host chunk by chunk on stream.
+	CUDAError download(void *dst, CUDAMemHandle src, const std::vector<CUDATransferChunk> &chunks, CUstream stream);
+
+	/// Make consumer wait until the chunk at chunkIdx has landed. Does not block the host.
+	CUDAError waitForChunk(int chunkIdx, CUstream consumer) const;
+
+	/// Make consumer wait until the whole transfer has landed. Does not block the host.
+	CUDAError waitForAll(CUstream consumer) const;
+
+	/// Block the host until the whole transfer has landed.
+	CUDAError synchronize() const;
+
+	/// Non-blocking check if the chunk at chunkIdx has landed.
+	bool isChunkDone(int chunkIdx) const;
+
+	const std::vector<CUDATransferChunk> &getChunks() const { return chunks; }
+	int getNumChunks() const { return int(chunks.size()); }
+
+private:
+	CUDAError prepare(const std::vector<CUDATransferChunk> &newChunks);
+
+private:
+	std::vector<CUDATransferChunk> chunks;
+	std::vector<CUevent> events;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cuda_manager.h>
+
+#include <array>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/// True if From converts to the kernel parameter type To without narrowing.
+template <class To, class From, class = void>
+struct IsKernelArgCompatible : std::false_type { };
+
+template <class To, class From>
+struct IsKernelArgCompatible<To, From, std::void_t<decltype(To{ std::declval<From>() })>> : std::true_type { };
+
+/// Kernel with a signature known at compile time.
+/// The arguments live in a tuple, so each one is aligned for its type, and the
+/// pointer array handed to the driver is built once and points into it.
+/// Launching does not allocate and arguments can be changed one at a time with
+/// setArg<Index>() between launches.
+/// Args must match the kernel's parameters in the PTX, device pointers are passed as CUDAMemHandle.
+template <class ...Args>
+struct TypedKernel {
+	static constexpr int numArgs = int(sizeof...(Args));
+	using ArgsTuple = std::tuple<Args...>;
+
+	static_assert(std::conjunction_v<std::is_trivially_copyable<Args>...>, "Kernel arguments must be trivially copyable!");
+
+	static constexpr SizeType argSizes[numArgs > 0 ? numArgs : 1] = { sizeof(Args)... };
+
+public:
+	TypedKernel() : func(NULL), successfulLoading(false) {
+		bindArgPointers(std::make_index_sequence<numArgs>());
+	}
+
+	TypedKernel(CUmodule module, const char *name) : TypedKernel() {
+		initialize(module, name);
+	}
+
+	TypedKernel(const TypedKernel &other)
+		: func(other.func), args(other.args), successfulLoading(other.successfulLoading), name(other.name) {
+		bindArgPointers(std::make_index_sequence<numArgs>());
+	}
+
+	TypedKernel &operator=(const TypedKernel &other) {
+		// argPointers keeps pointing to our own args.
+		func = other.func;
+		args = other.args;
+		successfulLoading = other.successfulLoading;
+		name = other.name;
+		return *this;
+	}
+
+	void initialize(CUmodule module, const char *name) {
+		func = NULL;
+		this->name = name;
+
+		CUDAError err = handleCUDAError(cuModuleGetFunction(&func, module, name));
+		if (err.hasError()) {
+			LOG_CUDA_ERROR(err, LogLevel::Error);
+			CUDABASE_LOG(LogLevel::Error, "Failed to load function %s", name);
+		}
+		successfulLoading = !err.hasError();
+	}
+
+	/// Set all arguments at once. Checked against the signature at compile time.
+	template <class ...Params>
+	void setArgs(Params&& ...params) {
+		static_assert(sizeof...(Params) == numArgs, "Wrong number of kernel arguments!");
+		static_assert(std::conjunction_v<IsKernelArgCompatible<Args, Params&&>...>, "Kernel argument does not match the signature!");
+
+		args = ArgsTuple(Args{ std::forward<Params>(params) }...);
+	}
+
+	/// Change a single argument, the rest keep their values from the previous launch.
+	template <int Index, class T>
+	void setArg(T &&value) {
+		static_assert(Index >= 0 && Index < numArgs, "Kernel argument index out of range!");
+		using ArgType = std::tuple_element_t<Index, ArgsTuple>;
+		static_assert(IsKernelArgCompatible<ArgType, T&&>::value, "Kernel argument does not match the signature!");
+
+		std::get<Index>(args) = ArgType{ std::forward<T>(value) };
+	}
+
+	template <int Index>
+	const std::tuple_element_t<Index, ArgsTuple> &getArg() const {
+		return std::get<Index>(args);
+	}
+
+	/// Launch with the arguments set so far.
+	CUDAError launch(const CUDALaunchConfig &config, CUstream stream) {
+		if (!successfulLoading) {
+			CUDAError err(CUDA_ERROR_NOT_INITIALIZED, "HOST Error", "Launching non-loaded funtion!");
+			LOG_CUDA_ERROR_RATE_LIMITED(err, LogLevel::Warning, 10);
+			return err;
+		}
+
+		return launchKernel(func, getParams(), config, stream, name.c_str());
+	}
+
+	/// Launches the kernel and then synchronizes with the stream
+	CUDAError launchSync(const CUDALaunchConfig &config, CUstream stream) {
+		RETURN_ON_CUDA_ERROR_HANDLED(launch(config, stream));
+
+		RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream));
+
+		return CUDAError();
+	}
+
+	CUfunction getFunction() const { return func; }
+	void **getParams() { return numArgs > 0 ? argPointers.data() : nullptr; }
+	const SizeType *getParamSizes() const { return argSizes; }
+	int getNumParams() const { return numArgs; }
+	bool isLoaded() const { return successfulLoading; }
+
+private:
+	template <std::size_t ...Indices>
+	void bindArgPointers(std::index_sequence<Indices...>) {
+		argPointers = { { static_cast<void*>(&std::get<Indices>(args))... } };
+	}
+
+private:
+	CUfunction func;
+	ArgsTuple args;
+	std::array<void*, numArgs> argPointers;
+	bool successfulLoading;
+	std::string name;
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+
 enum class LogLevel : int {
 	Debug = 0,
 	Error,
@@ -8,7 +10,25 @@ enum class LogLevel : int {
 	InfoFancy,
 };
 
+/// Most verbose level compiled in by CUDABASE_LOG. Calls to levels above it compile to nothing.
+/// LogLevel::Error is always compiled in, LogLevel::Debug only with CUDA_DEBUG.
+#ifndef CUDABASE_LOG_LEVEL
+#define CUDABASE_LOG_LEVEL 4 // LogLevel::InfoFancy
+#endif // !CUDABASE_LOG_LEVEL
+
+/// Asynchronous logger.
+/// Messages are formatted on the calling thread into fixed-size records of a lock-free
+/// ring buffer owned by that thread. A background thread drains the rings of all threads
+/// in the order the messages were logged and writes them out. A full ring drops the
+/// message instead of waiting, so logging never blocks the caller.
+/// The rings are also flushed at exit and when the process crashes.
 struct Logger {
+	/// Longer messages are truncated.
+	static constexpr int MAX_MESSAGE_SIZE = 480;
+
+	/// Records per thread ring. Must be a power of two.
+	static constexpr int RING_CAPACITY = 256;
+
 	/// Set log level. Each log after this call will be printed only if its log level
 	/// is below or equal to the one specified here.
 	static void setLogLevel(LogLevel lvl);
@@ -17,6 +37,58 @@ struct Logger {
 	/// and never in Release.
 	static void log(LogLevel lvl, const char *fmt, ...);
 
+	/// Write out everything logged so far on any thread. Blocks until done.
+	static void flush();
+
+	/// Messages dropped so far because the ring of their thread was full.
+	static unsigned long long getNumDropped();
+
+	static constexpr bool isCompiledIn(LogLevel lvl) {
+#ifdef CUDA_DEBUG
+		return lvl == LogLevel::Debug || lvl == LogLevel::Error || static_cast<int>(lvl) <= CUDABASE_LOG_LEVEL;
+#else // !CUDA_DEBUG
+		return lvl == LogLevel::Error || (lvl != LogLevel::Debug && static_cast<int>(lvl) <= CUDABASE_LOG_LEVEL);
+#endif // CUDA_DEBUG
+	}
+
 private:
-	static int loggingLevel;
+	static std::atomic<int> loggingLevel;
 };
+
+/// Limits how often a single call site logs. See CUDABASE_LOG_RATE_LIMITED.
+struct LogRateLimiter {
+	explicit LogRateLimiter(unsigned int maxPerSecond) : maxPerSecond(maxPerSecond), windowStartMs(0), numInWindow(0), numSuppressed(0) { }
+
+	/// @param suppressed Messages suppressed since the last allowed one.
+	/// @return true if the message may be logged.
+	bool allow(unsigned int &suppressed);
+
+private:
+	const unsigned int maxPerSecond;
+	std::atomic<long long> windowStartMs;
+	std::atomic<unsigned int> numInWindow;
+	std::atomic<unsigned int> numSuppressed;
+};
+
+/// Log through Logger::log unless lvl is compiled out by CUDABASE_LOG_LEVEL.
+#define CUDABASE_LOG(lvl, ...) \
+do { \
+	if constexpr (Logger::isCompiledIn(lvl)) { \
+		Logger::log(lvl, __VA_ARGS__); \
+	} \
+} while (0)
+
+/// CUDABASE_LOG which logs at most maxPerSecond messages per second from this call site.
+#define CUDABASE_LOG_RATE_LIMITED(lvl, maxPerSecond, ...) \
+do { \
+	if constexpr (Logger::isCompiledIn(lvl)) { \
+		static LogRateLimiter logRateLimiter_(maxPerSecond); \
+		unsigned int logSuppressed_ = 0; \
+		if (logRateLimiter_.allow(logSuppressed_)) { \
+			if (logSuppressed_ > 0) { \
+				Logger::log(lvl, "(%u messages suppressed)", logSuppressed_); \
+			} \
+			Logger::log(lvl, __VA_ARGS__); \
+		} \
+	} \
+} while (0)
@@ -1,5 +1,6 @@
 #pragma once
 
+#ifdef _WIN32
 #include <Windows.h>
 
 /// Class for measuring time in milliseconds.
@@ -17,7 +18,7 @@ struct Timer {
 	void restart() {
 		QueryPerformanceCounter(&startTime);
 	}
-	
+
 	/// Get time since the timer was launched or last restarted
 	/// @return time since last launch in milliseconds
 	float time() {
@@ -31,4 +32,25 @@ struct Timer {
 private:
 	LARGE_INTEGER startTime;
 	double frequency;
-};
\ No newline at end of file
+};
+#else // !_WIN32
+#include <chrono>
+
+/// Class for measuring time in milliseconds.
+struct Timer {
+	Timer() : startTime(std::chrono::steady_clock::now()) { }
+
+	void restart() {
+		startTime = std::chrono::steady_clock::now();
+	}
+
+	/// Get time since the timer was launched or last restarted
+	/// @return time since last launch in milliseconds
+	float time() {
+		return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	}
+
+private:
+	std::chrono::steady_clock::time_point startTime;
+};
+#endif // _WIN32
\ No newline at end of file
@@ -0,0 +1,323 @@
+#include <cuda_allocator_stats.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+static double getTimeMs() {
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+/// Short human readable size, f.e. "512B", "4KB" or "2GB". Sizes are powers of two in the histograms.
+static void formatSize(SizeType bytes, char *buffer, int bufferSize) {
+	static const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+	int unit = 0;
+	while (bytes >= 1024 && bytes % 1024 == 0 && unit < 4) {
+		bytes /= 1024;
+		++unit;
+	}
+	snprintf(buffer, bufferSize, "%llu%s", bytes, units[unit]);
+}
+
+/*
+===============================================================
+CUDAAllocatorStatsSnapshot
+===============================================================
+*/
+CUDAAllocatorStatsSnapshot::CUDAAllocatorStatsSnapshot() :
+	deviceOrdinal(-1),
+	timeMs(0.0),
+	liveBytes(0),
+	liveRequestedBytes(0),
+	liveBlocks(0),
+	peakBytes(0),
+	numAllocs(0),
+	numFrees(0),
+	numFailedAllocs(0),
+	numPhysicalChunks(0)
+{
+	for (int i = 0; i < NUM_SIZE_BUCKETS; ++i) {
+		sizeHistogram[i] = 0;
+	}
+	for (int i = 0; i < NUM_CHUNK_BUCKETS; ++i) {
+		chunksPerMappingHistogram[i] = 0;
+	}
+}
+
+float CUDAAllocatorStatsSnapshot::getInternalFragmentation() const {
+	if (liveBytes == 0 || liveRequestedBytes >= liveBytes) {
+		return 0.f;
+	}
+
+	return float(liveBytes - liveRequestedBytes) / float(liveBytes);
+}
+
+void CUDAAllocatorStatsSnapshot::getRates(const CUDAAllocatorStatsSnapshot &older, double &allocsPerSecond, double &freesPerSecond) const {
+	const double seconds = (timeMs - older.timeMs) / 1000.0;
+	if (seconds <= 0.0) {
+		allocsPerSecond = 0.0;
+		freesPerSecond = 0.0;
+		return;
+	}
+
+	allocsPerSecond = double(numAllocs - older.numAllocs) / seconds;
+	freesPerSecond = double(numFrees - older.numFrees) / seconds;
+}
+
+/*
+===============================================================
+CUDAAllocatorStats
+===============================================================
+*/
+CUDAAllocatorStats::CUDAAllocatorStats() {
+	for (int i = 0; i <= MAX_DEVICES; ++i) {
+		DeviceCounters &c = counters[i];
+		c.used = false;
+		c.liveBytes = 0;
+		c.liveRequestedBytes = 0;
+		c.liveBlocks = 0;
+		c.peakBytes = 0;
+		c.numAllocs = 0;
+		c.numFrees = 0;
+		c.numFailedAllocs = 0;
+		for (int j = 0; j < CUDAAllocatorStatsSnapshot::NUM_SIZE_BUCKETS; ++j) {
+			c.sizeHistogram[j] = 0;
+		}
+		c.numPhysicalChunks = 0;
+		for (int j = 0; j < CUDAAllocatorStatsSnapshot::NUM_CHUNK_BUCKETS; ++j) {
+			c.chunksPerMappingHistogram[j] = 0;
+		}
+	}
+}
+
+CUDAAllocatorStats::DeviceCounters &CUDAAllocatorStats::getCounters(int deviceOrdinal) {
+	const int slot = deviceOrdinal >= 0 && deviceOrdinal < MAX_DEVICES ? deviceOrdinal : MAX_DEVICES;
+	DeviceCounters &result = counters[slot];
+	// Checked first so the cache line is only written once.
+	if (!result.used.load(std::memory_order_relaxed)) {
+		result.used.store(true, std::memory_order_relaxed);
+	}
+	return result;
+}
+
+void CUDAAllocatorStats::addLiveBytes(DeviceCounters &c, SizeType bytes) {
+	const SizeType newLive = c.liveBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	SizeType peak = c.peakBytes.load(std::memory_order_relaxed);
+	while (newLive > peak && !c.peakBytes.compare_exchange_weak(peak, newLive, std::memory_order_relaxed)) { }
+}
+
+int CUDAAllocatorStats::getSizeBucket(SizeType bytes) {
+	int bucket = 0;
+	while (bytes > 1 && bucket < CUDAAllocatorStatsSnapshot::NUM_SIZE_BUCKETS - 1) {
+		bytes >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+int CUDAAllocatorStats::getChunkBucket(int numChunks) {
+	int bucket = 0;
+	while (numChunks > 1 && bucket < CUDAAllocatorStatsSnapshot::NUM_CHUNK_BUCKETS - 1) {
+		numChunks >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+void CUDAAllocatorStats::recordAllocation(int deviceOrdinal, SizeType requestedBytes, SizeType reservedBytes) {
+	DeviceCounters &c = getCounters(deviceOrdinal);
+	addLiveBytes(c, reservedBytes);
+	c.liveRequestedBytes.fetch_add(requestedBytes, std::memory_order_relaxed);
+	c.liveBlocks.fetch_add(1, std::memory_order_relaxed);
+	c.numAllocs.fetch_add(1, std::memory_order_relaxed);
+	c.sizeHistogram[getSizeBucket(requestedBytes)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void CUDAAllocatorStats::recordFree(int deviceOrdinal, SizeType requestedBytes, SizeType reservedBytes) {
+	DeviceCounters &c = getCounters(deviceOrdinal);
+	c.liveBytes.fetch_sub(reservedBytes, std::memory_order_relaxed);
+	c.liveRequestedBytes.fetch_sub(requestedBytes, std::memory_order_relaxed);
+	c.liveBlocks.fetch_sub(1, std::memory_order_relaxed);
+	c.numFrees.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CUDAAllocatorStats::recordResize(int deviceOrdinal, SizeType oldRequestedBytes, SizeType oldReservedBytes, SizeType newRequestedBytes, SizeType newReservedBytes) {
+	DeviceCounters &c = getCounters(deviceOrdinal);
+	if (newReservedBytes >= oldReservedBytes) {
+		addLiveBytes(c, newReservedBytes - oldReservedBytes);
+	} else {
+		c.liveBytes.fetch_sub(oldReservedBytes - newReservedBytes, std::memory_order_relaxed);
+	}
+	// Unsigned wrap around makes this right for shrinking too.
+	c.liveRequestedBytes.fetch_add(newRequestedBytes - oldRequestedBytes, std::memory_order_relaxed);
+}
+
+void CUDAAllocatorStats::recordFailedAllocation(int deviceOrdinal) {
+	getCounters(deviceOrdinal).numFailedAllocs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CUDAAllocatorStats::recordPhysicalChunks(int deviceOrdinal, int delta) {
+	getCounters(deviceOrdinal).numPhysicalChunks.fetch_add(SizeType(delta), std::memory_order_relaxed);
+}
+
+void CUDAAllocatorStats::recordMappingSplit(int deviceOrdinal, int numChunks) {
+	if (numChunks <= 0) {
+		return;
+	}
+	getCounters(deviceOrdinal).chunksPerMappingHistogram[getChunkBucket(numChunks)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void CUDAAllocatorStats::takeSnapshot(int slot, CUDAAllocatorStatsSnapshot &snapshot) const {
+	const DeviceCounters &c = counters[slot];
+	snapshot.deviceOrdinal = slot < MAX_DEVICES ? slot : -1;
+	snapshot.timeMs = getTimeMs();
+	snapshot.liveBytes = c.liveBytes.load(std::memory_order_relaxed);
+	snapshot.liveRequestedBytes = c.liveRequestedBytes.load(std::memory_order_relaxed);
+	snapshot.liveBlocks = c.liveBlocks.load(std::memory_order_relaxed);
+	snapshot.peakBytes = c.peakBytes.load(std::memory_order_relaxed);
+	snapshot.numAllocs = c.numAllocs.load(std::memory_order_relaxed);
+	snapshot.numFrees = c.numFrees.load(std::memory_order_relaxed);
+	snapshot.numFailedAllocs = c.numFailedAllocs.load(std::memory_order_relaxed);
+	for (int i = 0; i < CUDAAllocatorStatsSnapshot::NUM_SIZE_BUCKETS; ++i) {
+		snapshot.sizeHistogram[i] = c.sizeHistogram[i].load(std::memory_order_relaxed);
+	}
+	snapshot.numPhysicalChunks = c.numPhysicalChunks.load(std::memory_order_relaxed);
+	for (int i = 0; i < CUDAAllocatorStatsSnapshot::NUM_CHUNK_BUCKETS; ++i) {
+		snapshot.chunksPerMappingHistogram[i] = c.chunksPerMappingHistogram[i].load(std::memory_order_relaxed);
+	}
+}
+
+bool CUDAAllocatorStats::getSnapshot(int deviceOrdinal, CUDAAllocatorStatsSnapshot &snapshot) const {
+	const int slot = deviceOrdinal >= 0 && deviceOrdinal < MAX_DEVICES ? deviceOrdinal : MAX_DEVICES;
+	if (!counters[slot].used.load(std::memory_order_relaxed)) {
+		return false;
+	}
+
+	takeSnapshot(slot, snapshot);
+	return true;
+}
+
+void CUDAAllocatorStats::getSnapshots(std::vector<CUDAAllocatorStatsSnapshot> &snapshots) const {
+	snapshots.clear();
+	for (int i = 0; i <= MAX_DEVICES; ++i) {
+		if (counters[i].used.load(std::memory_order_relaxed)) {
+			snapshots.emplace_back();
+			takeSnapshot(i, snapshots.back());
+		}
+	}
+}
+
+void CUDAAllocatorStats::resetPeaks() {
+	for (int i = 0; i <= MAX_DEVICES; ++i) {
+		counters[i].peakBytes.store(counters[i].liveBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+}
+
+void CUDAAllocatorStats::dump(const char *allocatorName, LogLevel level) {
+	std::vector<CUDAAllocatorStatsSnapshot> snapshots;
+	getSnapshots(snapshots);
+
+	std::lock_guard<std::mutex> lock(dumpMutex);
+	Logger::log(level, "%s statistics (%d devices):", allocatorName, int(snapshots.size()));
+	for (int i = 0; i < snapshots.size(); ++i) {
+		const CUDAAllocatorStatsSnapshot &snapshot = snapshots[i];
+
+		double allocsPerSecond = 0.0;
+		double freesPerSecond = 0.0;
+		for (int j = 0; j < lastDumped.size(); ++j) {
+			if (lastDumped[j].deviceOrdinal == snapshot.deviceOrdinal) {
+				snapshot.getRates(lastDumped[j], allocsPerSecond, freesPerSecond);
+			}
+		}
+
+		Logger::log(
+			level,
+			"\tdevice %d: live %.2fMB in %llu blocks (%.1f%% rounding) peak: %.2fMB allocs: %llu frees: %llu failed: %llu rate: %.1f allocs/s %.1f frees/s",
+			snapshot.deviceOrdinal,
+			double(snapshot.liveBytes) / MEGABYTE_IN_BYTES,
+			snapshot.liveBlocks,
+			snapshot.getInternalFragmentation() * 100.f,
+			double(snapshot.peakBytes) / MEGABYTE_IN_BYTES,
+			snapshot.numAllocs,
+			snapshot.numFrees,
+			snapshot.numFailedAllocs,
+			allocsPerSecond,
+			freesPerSecond
+		);
+
+		std::string sizes;
+		char entry[64];
+		char sizeName[16];
+		for (int j = 0; j < CUDAAllocatorStatsSnapshot::NUM_SIZE_BUCKETS; ++j) {
+			if (snapshot.sizeHistogram[j] > 0) {
+				formatSize(SizeType(1) << j, sizeName, sizeof(sizeName));
+				snprintf(entry, sizeof(entry), " %s+:%llu", sizeName, snapshot.sizeHistogram[j]);
+				sizes += entry;
+			}
+		}
+		if (!sizes.empty()) {
+			Logger::log(level, "\t\tsizes:%s", sizes.c_str());
+		}
+
+		std::string chunks;
+		for (int j = 0; j < CUDAAllocatorStatsSnapshot::NUM_CHUNK_BUCKETS; ++j) {
+			if (snapshot.chunksPerMappingHistogram[j] > 0) {
+				snprintf(entry, sizeof(entry), " %d+:%llu", 1 << j, snapshot.chunksPerMappingHistogram[j]);
+				chunks += entry;
+			}
+		}
+		if (!chunks.empty()) {
+			Logger::log(level, "\t\tphysical chunks mapped: %llu, chunks per mapping:%s", snapshot.numPhysicalChunks, chunks.c_str());
+		}
+	}
+
+	lastDumped = snapshots;
+}
+
+/*
+===============================================================
+CUDAPeriodicReporter
+===============================================================
+*/
+CUDAPeriodicReporter::CUDAPeriodicReporter() : stopping(false) { }
+
+CUDAPeriodicReporter::~CUDAPeriodicReporter() {
+	stop();
+}
+
+void CUDAPeriodicReporter::start(unsigned int intervalMs, std::function<void()> report) {
+	stop();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	stopping = false;
+	thread = std::thread(&CUDAPeriodicReporter::run, this, intervalMs, std::move(report));
+}
+
+void CUDAPeriodicReporter::stop() {
+	std::thread toJoin;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		toJoin = std::move(thread);
+	}
+	stopRequested.notify_all();
+
+	if (toJoin.joinable()) {
+		toJoin.join();
+	}
+}
+
+bool CUDAPeriodicReporter::isRunning() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return thread.joinable();
+}
+
+void CUDAPeriodicReporter::run(unsigned int intervalMs, std::function<void()> report) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopRequested.wait_for(lock, std::chrono::milliseconds(intervalMs), [this]() { return stopping; })) {
+		lock.unlock();
+		report();
+		lock.lock();
+	}
+}
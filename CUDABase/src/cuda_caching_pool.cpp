@@ -0,0 +1,551 @@
+#include <cuda_caching_pool.h>
+
+#include <new>
+
+/*
+===============================================================
+CUDAPoolThreadCache
+===============================================================
+*/
+/// Small blocks owned by one thread. Only the owning thread touches the entries,
+/// apart from CUDACachingPool::deinitialize which requires the pool to be idle.
+struct CUDAPoolThreadCache {
+	struct Entry {
+		CUDAMemHandle ptr;
+		SizeType size;
+		CUDAPoolStream stream;
+	};
+
+	Entry entries[CUDACachingPool::THREAD_CACHE_MAX_BLOCKS]; ///< Oldest first.
+	int numEntries;
+	SizeType bytes;
+	std::atomic<CUDACachingPool*> pool; ///< nullptr once the pool is deinitialized.
+
+	CUDAPoolThreadCache(CUDACachingPool *pool) : numEntries(0), bytes(0), pool(pool) { }
+
+	bool take(SizeType binSize, CUDAPoolStream stream, CUDAMemHandle &ptr) {
+		// Newest first, it is the most likely one to still be in the device caches.
+		for (int i = numEntries - 1; i >= 0; --i) {
+			if (entries[i].size != binSize || !(entries[i].stream == stream)) {
+				continue;
+			}
+
+			ptr = entries[i].ptr;
+			bytes -= binSize;
+			for (int j = i + 1; j < numEntries; ++j) {
+				entries[j - 1] = entries[j];
+			}
+			--numEntries;
+
+			return true;
+		}
+
+		return false;
+	}
+
+	bool contains(CUDAMemHandle ptr) const {
+		for (int i = 0; i < numEntries; ++i) {
+			if (entries[i].ptr == ptr) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool canPut(SizeType size) const {
+		return numEntries < CUDACachingPool::THREAD_CACHE_MAX_BLOCKS && bytes + size <= CUDACachingPool::THREAD_CACHE_MAX_BYTES;
+	}
+
+	void put(CUDAMemHandle ptr, SizeType size, CUDAPoolStream stream) {
+		entries[numEntries++] = Entry{ ptr, size, stream };
+		bytes += size;
+	}
+};
+
+/// Thread caches of all the pools the owning thread used.
+/// They are given back to their pools when the thread exits.
+struct CUDAPoolThreadCacheSet {
+	std::vector<CUDAPoolThreadCache*> caches;
+
+	~CUDAPoolThreadCacheSet();
+};
+
+/// Guards CUDACachingPool::threadCaches and the pool pointers of the caches.
+/// Always taken before the mutex of a pool.
+static std::mutex threadCacheMutex;
+static thread_local CUDAPoolThreadCacheSet threadCacheSet;
+
+CUDAPoolThreadCacheSet::~CUDAPoolThreadCacheSet() {
+	std::lock_guard<std::mutex> registryLock(threadCacheMutex);
+	for (int i = 0; i < caches.size(); ++i) {
+		CUDAPoolThreadCache *cache = caches[i];
+		CUDACachingPool *pool = cache->pool.load();
+		if (pool != nullptr) {
+			std::lock_guard<std::mutex> lock(pool->mutex);
+			pool->flushThreadCache(*cache, 0);
+
+			std::vector<CUDAPoolThreadCache*> &poolCaches = pool->threadCaches;
+			for (int j = 0; j < poolCaches.size(); ++j) {
+				if (poolCaches[j] == cache) {
+					poolCaches[j] = poolCaches.back();
+					poolCaches.pop_back();
+					break;
+				}
+			}
+		}
+
+		delete cache;
+	}
+	caches.clear();
+}
+
+/*
+===============================================================
+CUDACachingPool
+===============================================================
+*/
+CUDACachingPool::CUDACachingPool()
+	: backend(nullptr),
+	fenceBackend(nullptr),
+	threadCachedBytes(0),
+	numThreadCachedBlocks(0),
+	maxCachedBytes(DEFAULT_MAX_CACHED_BYTES),
+	cachedBytes(0),
+	liveBytes(0) { }
+
+CUDACachingPool::~CUDACachingPool() {
+	deinitialize();
+}
+
+CUDAError CUDACachingPool::initialize(CUDAMemoryBackend *backend, SizeType maxCachedBytes, CUDAFenceBackend *fenceBackend) {
+	RETURN_ON_CUDA_ERROR_HANDLED(deinitialize());
+
+	if (backend == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDACachingPool_ERROR_INVALID_BACKEND", "");
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	this->backend = backend;
+	this->fenceBackend = fenceBackend;
+	this->maxCachedBytes = maxCachedBytes;
+
+	return CUDAError();
+}
+
+CUDAError CUDACachingPool::deinitialize() {
+	{
+		// Pull the blocks out of the thread caches and detach them, so their threads
+		// neither use them anymore nor return them to a dead pool when they exit.
+		std::lock_guard<std::mutex> registryLock(threadCacheMutex);
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < threadCaches.size(); ++i) {
+			flushThreadCache(*threadCaches[i], 0);
+			threadCaches[i]->pool.store(nullptr);
+		}
+		threadCaches.clear();
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (backend == nullptr) {
+		return CUDAError();
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(trimLocked(0));
+
+	if (!liveBlocks.empty()) {
+		CUDABASE_LOG(LogLevel::Warning, "CUDACachingPool: releasing %llu blocks still in use!", SizeType(liveBlocks.size()));
+	}
+
+	for (auto it = liveBlocks.begin(); it != liveBlocks.end(); ++it) {
+		RETURN_ON_CUDA_ERROR_HANDLED(backend->free(it->first));
+	}
+
+	liveBlocks.clear();
+	freeLists.clear();
+	liveBytes = 0;
+	cachedBytes = 0;
+	backend = nullptr;
+	fenceBackend = nullptr;
+
+	return CUDAError();
+}
+
+SizeType CUDACachingPool::getBinSize(SizeType size) {
+	if (size <= MIN_BIN_SIZE) {
+		return MIN_BIN_SIZE;
+	}
+
+	if (size <= SMALL_BIN_LIMIT) {
+		SizeType binSize = MIN_BIN_SIZE;
+		while (binSize < size) {
+			binSize <<= 1;
+		}
+		return binSize;
+	}
+
+	return ((size + LARGE_BIN_GRANULARITY - 1) / LARGE_BIN_GRANULARITY) * LARGE_BIN_GRANULARITY;
+}
+
+bool CUDACachingPool::takeCached(CUDAMemHandle &ptr, SizeType &blockSize, SizeType binSize, CUDAPoolStream stream) {
+	auto listIt = freeLists.find(stream);
+	if (listIt == freeLists.end()) {
+		return false;
+	}
+
+	FreeList &freeList = listIt->second;
+	auto it = freeList.lower_bound(binSize);
+	if (it == freeList.end()) {
+		return false;
+	}
+
+	// Small bins must match exactly, otherwise a 512B request could pin a 1MB block.
+	// Large blocks may be reused with up to 25% slack.
+	const SizeType maxAcceptedSize = binSize <= SMALL_BIN_LIMIT ? binSize : binSize + binSize / 4;
+	if (it->first > maxAcceptedSize) {
+		return false;
+	}
+
+	ptr = it->second;
+	blockSize = it->first;
+	cachedBytes -= blockSize;
+	freeList.erase(it);
+
+	return true;
+}
+
+bool CUDACachingPool::takeFromOtherStream(CUDAMemHandle &ptr, SizeType &blockSize, SizeType binSize, CUDAPoolStream stream, bool waitForStream) {
+	if (fenceBackend == nullptr) {
+		return false;
+	}
+
+	CUDAPoolStream otherStream;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		bool found = false;
+		for (auto it = freeLists.begin(); it != freeLists.end() && !found; ++it) {
+			if (it->first.ctx == stream.ctx && !(it->first == stream)) {
+				otherStream = it->first;
+				found = takeCached(ptr, blockSize, binSize, otherStream);
+			}
+		}
+
+		if (!found) {
+			return false;
+		}
+	}
+
+	// Work queued on the other stream may still use the block. The fence covers all of it.
+	CUDAFence fence = NULL;
+	bool isDone = false;
+	if (!fenceBackend->record(fence, otherStream.stream).hasError()) {
+		isDone = waitForStream ? !fenceBackend->wait(fence).hasError() : fenceBackend->isComplete(fence);
+		fenceBackend->destroy(fence);
+	}
+
+	if (!isDone) {
+		std::lock_guard<std::mutex> lock(mutex);
+		freeLists[otherStream].insert(std::make_pair(blockSize, ptr));
+		cachedBytes += blockSize;
+		return false;
+	}
+
+	return true;
+}
+
+CUDAPoolThreadCache *CUDACachingPool::getThreadCache(bool create) {
+	std::vector<CUDAPoolThreadCache*> &caches = threadCacheSet.caches;
+	for (int i = 0; i < caches.size(); ++i) {
+		if (caches[i]->pool.load(std::memory_order_relaxed) == this) {
+			return caches[i];
+		}
+	}
+
+	if (!create) {
+		return nullptr;
+	}
+
+	// Caches of pools deinitialized since are not referenced by anyone else anymore.
+	for (int i = 0; i < caches.size(); ) {
+		if (caches[i]->pool.load(std::memory_order_relaxed) == nullptr) {
+			delete caches[i];
+			caches[i] = caches.back();
+			caches.pop_back();
+		} else {
+			++i;
+		}
+	}
+
+	CUDAPoolThreadCache *cache = new (std::nothrow) CUDAPoolThreadCache(this);
+	if (cache == nullptr) {
+		return nullptr;
+	}
+
+	{
+		std::lock_guard<std::mutex> registryLock(threadCacheMutex);
+		threadCaches.push_back(cache);
+	}
+	caches.push_back(cache);
+
+	return cache;
+}
+
+void CUDACachingPool::flushThreadCache(CUDAPoolThreadCache &cache, int numToKeep) {
+	const int numToFlush = cache.numEntries > numToKeep ? cache.numEntries - numToKeep : 0;
+	for (int i = 0; i < numToFlush; ++i) {
+		const CUDAPoolThreadCache::Entry &entry = cache.entries[i];
+		liveBlocks.erase(entry.ptr);
+		liveBytes -= entry.size;
+		freeLists[entry.stream].insert(std::make_pair(entry.size, entry.ptr));
+		cachedBytes += entry.size;
+
+		cache.bytes -= entry.size;
+		threadCachedBytes -= entry.size;
+		--numThreadCachedBlocks;
+	}
+
+	for (int i = numToFlush; i < cache.numEntries; ++i) {
+		cache.entries[i - numToFlush] = cache.entries[i];
+	}
+	cache.numEntries -= numToFlush;
+}
+
+void CUDACachingPool::refillThreadCache(CUDAPoolThreadCache &cache, SizeType binSize, CUDAPoolStream stream) {
+	auto listIt = freeLists.find(stream);
+	if (listIt == freeLists.end()) {
+		return;
+	}
+
+	FreeList &freeList = listIt->second;
+	for (int i = 1; i < THREAD_CACHE_REFILL_COUNT && cache.canPut(binSize); ++i) {
+		auto it = freeList.find(binSize);
+		if (it == freeList.end()) {
+			break;
+		}
+
+		const CUDAMemHandle ptr = it->second;
+		freeList.erase(it);
+		cachedBytes -= binSize;
+		liveBlocks[ptr] = LiveBlock{ binSize, stream.ctx };
+		liveBytes += binSize;
+
+		cache.put(ptr, binSize, stream);
+		threadCachedBytes += binSize;
+		++numThreadCachedBlocks;
+	}
+}
+
+CUDAError CUDACachingPool::allocate(CUDAMemHandle &ptr, SizeType &blockSize, SizeType size, CUDAPoolStream stream) {
+	if (backend == nullptr) {
+		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDACachingPool_ERROR_NOT_INITIALIZED", "");
+	}
+
+	if (size == 0) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDACachingPool_ERROR_INVALID_SIZE", "");
+	}
+
+	const SizeType binSize = getBinSize(size);
+	CUDAPoolThreadCache *cache = binSize <= SMALL_BIN_LIMIT ? getThreadCache(true) : nullptr;
+	if (cache != nullptr && cache->take(binSize, stream, ptr)) {
+		// Still accounted as live by the pool.
+		blockSize = binSize;
+		threadCachedBytes -= binSize;
+		--numThreadCachedBlocks;
+		return CUDAError();
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if (takeCached(ptr, blockSize, binSize, stream)) {
+		// Blocks of this size are recycled on this stream, take a few more while we hold the lock.
+		if (cache != nullptr) {
+			refillThreadCache(*cache, binSize, stream);
+		}
+	} else {
+		// The backend may take a while, don't block the other threads meanwhile.
+		lock.unlock();
+		CUDAError err;
+		if (!takeFromOtherStream(ptr, blockSize, binSize, stream, false)) {
+			blockSize = binSize;
+			err = backend->allocate(ptr, blockSize);
+		}
+
+		// Waiting for another stream to be done with a cached block is cheaper than releasing the cache.
+		if (err.hasError() && err.getError() == CUDA_ERROR_OUT_OF_MEMORY && takeFromOtherStream(ptr, blockSize, binSize, stream, true)) {
+			err = CUDAError();
+		}
+
+		// The cached blocks may be what keeps us from allocating. Release them and try again.
+		if (err.hasError() && err.getError() == CUDA_ERROR_OUT_OF_MEMORY) {
+			lock.lock();
+			if (cache != nullptr) {
+				flushThreadCache(*cache, 0);
+			}
+			const bool hadCachedBlocks = cachedBytes > 0;
+			RETURN_ON_CUDA_ERROR_HANDLED(trimLocked(0));
+			lock.unlock();
+
+			if (hadCachedBlocks) {
+				err = backend->allocate(ptr, blockSize);
+			}
+		}
+
+		if (err.hasError()) {
+			return err;
+		}
+
+		lock.lock();
+	}
+
+	liveBlocks[ptr] = LiveBlock{ blockSize, stream.ctx };
+	liveBytes += blockSize;
+
+	return CUDAError();
+}
+
+CUDAError CUDACachingPool::free(CUDAMemHandle ptr, CUstream stream) {
+	if (backend == nullptr) {
+		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDACachingPool_ERROR_NOT_INITIALIZED", "");
+	}
+
+	// Blocks in the cache of the calling thread are still live for the pool, but already freed.
+	CUDAPoolThreadCache *cache = getThreadCache(false);
+	if (cache != nullptr && cache->contains(ptr)) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDACachingPool_ERROR_DOUBLE_FREE", "");
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return freeLocked(ptr, stream);
+}
+
+CUDAError CUDACachingPool::free(CUDAMemHandle ptr, SizeType blockSize, CUDAPoolStream stream) {
+	if (backend == nullptr) {
+		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDACachingPool_ERROR_NOT_INITIALIZED", "");
+	}
+
+	const bool isSmallBlock = blockSize <= SMALL_BIN_LIMIT && blockSize == getBinSize(blockSize);
+	CUDAPoolThreadCache *cache = isSmallBlock ? getThreadCache(true) : nullptr;
+	if (cache == nullptr) {
+		return free(ptr, stream.stream);
+	}
+
+	if (ptr == NULL || cache->contains(ptr)) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDACachingPool_ERROR_DOUBLE_FREE", "");
+	}
+
+	if (cache->canPut(blockSize)) {
+		cache->put(ptr, blockSize, stream);
+		threadCachedBytes += blockSize;
+		++numThreadCachedBlocks;
+		return CUDAError();
+	}
+
+	// Full. Hand the older half to the other threads and keep this block, it is the warmest one.
+	std::lock_guard<std::mutex> lock(mutex);
+	flushThreadCache(*cache, THREAD_CACHE_MAX_BLOCKS / 2);
+	if (!cache->canPut(blockSize)) {
+		return freeLocked(ptr, stream.stream);
+	}
+
+	cache->put(ptr, blockSize, stream);
+	threadCachedBytes += blockSize;
+	++numThreadCachedBlocks;
+
+	if (cachedBytes > maxCachedBytes) {
+		RETURN_ON_CUDA_ERROR_HANDLED(trimLocked(maxCachedBytes));
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDACachingPool::freeLocked(CUDAMemHandle ptr, CUstream stream) {
+	auto it = liveBlocks.find(ptr);
+	if (it == liveBlocks.end()) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDACachingPool_ERROR_UNKNOWN_BLOCK", "");
+	}
+
+	const SizeType blockSize = it->second.size;
+	const CUDAPoolStream poolStream(it->second.ctx, stream);
+	liveBlocks.erase(it);
+	liveBytes -= blockSize;
+
+	FreeList &freeList = freeLists[poolStream];
+	freeList.insert(std::make_pair(blockSize, ptr));
+	cachedBytes += blockSize;
+
+	if (cachedBytes > maxCachedBytes) {
+		// Prefer dropping blocks of the stream we just freed on, it is the one
+		// that is producing the excess.
+		RETURN_ON_CUDA_ERROR_HANDLED(releaseCached(freeList, maxCachedBytes));
+		RETURN_ON_CUDA_ERROR_HANDLED(trimLocked(maxCachedBytes));
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDACachingPool::releaseCached(FreeList &freeList, SizeType targetCachedBytes) {
+	// Largest blocks go first so we get under the target with the fewest driver calls.
+	while (cachedBytes > targetCachedBytes && !freeList.empty()) {
+		auto it = std::prev(freeList.end());
+		RETURN_ON_CUDA_ERROR_HANDLED(backend->free(it->second));
+		cachedBytes -= it->first;
+		freeList.erase(it);
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDACachingPool::trim(SizeType targetCachedBytes) {
+	CUDAPoolThreadCache *cache = getThreadCache(false);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (cache != nullptr) {
+		flushThreadCache(*cache, 0);
+	}
+
+	return trimLocked(targetCachedBytes);
+}
+
+CUDAError CUDACachingPool::trimLocked(SizeType targetCachedBytes) {
+	if (backend == nullptr) {
+		return CUDAError();
+	}
+
+	for (auto it = freeLists.begin(); it != freeLists.end() && cachedBytes > targetCachedBytes; ++it) {
+		RETURN_ON_CUDA_ERROR_HANDLED(releaseCached(it->second, targetCachedBytes));
+	}
+
+	for (auto it = freeLists.begin(); it != freeLists.end(); ) {
+		it = it->second.empty() ? freeLists.erase(it) : std::next(it);
+	}
+
+	return CUDAError();
+}
+
+void CUDACachingPool::setMaxCachedBytes(SizeType maxBytes) {
+	std::lock_guard<std::mutex> lock(mutex);
+	maxCachedBytes = maxBytes;
+	trimLocked(maxCachedBytes);
+}
+
+SizeType CUDACachingPool::getMaxCachedBytes() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return maxCachedBytes;
+}
+
+SizeType CUDACachingPool::getCachedBytes() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return cachedBytes + threadCachedBytes;
+}
+
+SizeType CUDACachingPool::getLiveBytes() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return liveBytes - threadCachedBytes;
+}
+
+SizeType CUDACachingPool::getNumCachedBlocks() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	SizeType result = numThreadCachedBlocks;
+	for (auto it = freeLists.begin(); it != freeLists.end(); ++it) {
+		result += it->second.size();
+	}
+	return result;
+}
@@ -0,0 +1,419 @@
+#include <cuda_command_buffer.h>
+
+const char *getCommandTypeName(CUDACommandType type) {
+	switch (type) {
+	case CUDACommandType::Upload:
+		return "upload";
+	case CUDACommandType::Download:
+		return "download";
+	case CUDACommandType::Kernel:
+		return "kernel";
+	case CUDACommandType::WaitEvent:
+		return "wait event";
+	case CUDACommandType::RecordEvent:
+		return "record event";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+===============================================================
+CUDADriverCommandBackend
+===============================================================
+*/
+CUDAError CUDADriverCommandBackend::getCurrentContext(CUcontext &ctx) {
+	RETURN_ON_CUDA_ERROR_HANDLED(bindThreadContext());
+	RETURN_ON_CUDA_ERROR(cuCtxGetCurrent(&ctx));
+	return CUDAError();
+}
+
+CUDAError CUDADriverCommandBackend::setCurrentContext(CUcontext ctx) {
+	RETURN_ON_CUDA_ERROR(cuCtxSetCurrent(ctx));
+	return CUDAError();
+}
+
+CUDAError CUDADriverCommandBackend::upload(CUDAMemHandle dst, const void *src, SizeType size, CUstream stream) {
+	RETURN_ON_CUDA_ERROR(cuMemcpyHtoDAsync(dst, src, size, stream));
+	return CUDAError();
+}
+
+CUDAError CUDADriverCommandBackend::download(void *dst, CUDAMemHandle src, SizeType size, CUstream stream) {
+	RETURN_ON_CUDA_ERROR(cuMemcpyDtoHAsync(dst, src, size, stream));
+	return CUDAError();
+}
+
+CUDAError CUDADriverCommandBackend::launch(CUfunction func, void **params, const SizeType *paramSizes, int numParams, const CUDALaunchConfig &config, CUstream stream, const char *name) {
+	return launchKernel(func, numParams > 0 ? params : nullptr, config, stream, name);
+}
+
+CUDAError CUDADriverCommandBackend::waitEvent(CUstream stream, CUevent event) {
+	RETURN_ON_CUDA_ERROR(cuStreamWaitEvent(stream, event, 0));
+	return CUDAError();
+}
+
+CUDAError CUDADriverCommandBackend::recordEvent(CUevent event, CUstream stream) {
+	RETURN_ON_CUDA_ERROR(cuEventRecord(event, stream));
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDAHostCommandBackend
+===============================================================
+*/
+CUDAHostCommandBackend::CUDAHostCommandBackend() : currentCtx(NULL), numContextSwitches(0) { }
+
+void CUDAHostCommandBackend::setInitialContext(CUcontext ctx) {
+	std::lock_guard<std::mutex> lock(mutex);
+	currentCtx = ctx;
+}
+
+CUDAError CUDAHostCommandBackend::getCurrentContext(CUcontext &ctx) {
+	std::lock_guard<std::mutex> lock(mutex);
+	ctx = currentCtx;
+	return CUDAError();
+}
+
+CUDAError CUDAHostCommandBackend::setCurrentContext(CUcontext ctx) {
+	std::lock_guard<std::mutex> lock(mutex);
+	currentCtx = ctx;
+	++numContextSwitches;
+	return CUDAError();
+}
+
+CUDAError CUDAHostCommandBackend::upload(CUDAMemHandle dst, const void *src, SizeType size, CUstream stream) {
+	CUDACommand command;
+	command.type = CUDACommandType::Upload;
+	command.devicePtr = dst;
+	command.hostPtr = const_cast<void*>(src);
+	command.size = size;
+	submit(command, stream);
+	return CUDAError();
+}
+
+CUDAError CUDAHostCommandBackend::download(void *dst, CUDAMemHandle src, SizeType size, CUstream stream) {
+	CUDACommand command;
+	command.type = CUDACommandType::Download;
+	command.devicePtr = src;
+	command.hostPtr = dst;
+	command.size = size;
+	submit(command, stream);
+	return CUDAError();
+}
+
+CUDAError CUDAHostCommandBackend::launch(CUfunction func, void **params, const SizeType *paramSizes, int numParams, const CUDALaunchConfig &config, CUstream stream, const char *name) {
+	CUDACommand command;
+	command.type = CUDACommandType::Kernel;
+	command.func = func;
+	command.config = config;
+	command.name = name;
+	command.numArgs = numParams;
+	submit(command, stream);
+
+	// The arguments are only valid during the call.
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<std::vector<char>> &args = submissions.back().args;
+	args.resize(numParams);
+	for (int i = 0; i < numParams; ++i) {
+		const char *param = static_cast<const char*>(params[i]);
+		args[i].assign(param, param + paramSizes[i]);
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAHostCommandBackend::waitEvent(CUstream stream, CUevent event) {
+	CUDACommand command;
+	command.type = CUDACommandType::WaitEvent;
+	command.event = event;
+	submit(command, stream);
+	return CUDAError();
+}
+
+CUDAError CUDAHostCommandBackend::recordEvent(CUevent event, CUstream stream) {
+	CUDACommand command;
+	command.type = CUDACommandType::RecordEvent;
+	command.event = event;
+	submit(command, stream);
+	return CUDAError();
+}
+
+std::vector<CUDAHostCommandBackend::Submission> CUDAHostCommandBackend::getSubmissions() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return submissions;
+}
+
+int CUDAHostCommandBackend::getNumContextSwitches() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return numContextSwitches;
+}
+
+void CUDAHostCommandBackend::reset() {
+	std::lock_guard<std::mutex> lock(mutex);
+	submissions.clear();
+	numContextSwitches = 0;
+}
+
+void CUDAHostCommandBackend::submit(const CUDACommand &command, CUstream stream) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Submission submission;
+	submission.command = command;
+	submission.stream = stream;
+	submission.ctx = currentCtx;
+	submissions.push_back(submission);
+}
+
+/*
+===============================================================
+CUDACommandBuffer
+===============================================================
+*/
+CUDACommandBuffer::CUDACommandBuffer()
+	: backend(nullptr)
+	, stream(NULL)
+	, ctx(NULL)
+	, autoFlushThreshold(0)
+	, numMerged(0)
+	, numFlushes(0)
+	, numSubmitted(0) { }
+
+CUDACommandBuffer::~CUDACommandBuffer() {
+	CUDAError err = deinitialize();
+	if (err.hasError()) {
+		LOG_CUDA_ERROR(err, LogLevel::Error);
+	}
+}
+
+CUDAError CUDACommandBuffer::initialize(CUstream stream, CUcontext ctx, CUDACommandBackend *backend) {
+	RETURN_ON_CUDA_ERROR_HANDLED(deinitialize());
+
+	this->backend = backend != nullptr ? backend : &driverBackend;
+	this->stream = stream;
+
+	if (ctx == NULL) {
+		RETURN_ON_CUDA_ERROR_HANDLED(this->backend->getCurrentContext(ctx));
+	}
+	if (ctx == NULL) {
+		this->backend = nullptr;
+		return CUDAError(CUDA_ERROR_INVALID_CONTEXT, "CUDACommandBuffer_ERROR_NO_CURRENT_CONTEXT", "");
+	}
+	this->ctx = ctx;
+
+	return CUDAError();
+}
+
+CUDAError CUDACommandBuffer::deinitialize() {
+	if (backend == nullptr) {
+		return CUDAError();
+	}
+
+	CUDAError err = flush();
+	discard();
+	backend = nullptr;
+	stream = NULL;
+	ctx = NULL;
+
+	return err;
+}
+
+void CUDACommandBuffer::setAutoFlushThreshold(int numCommands) {
+	autoFlushThreshold = numCommands > 0 ? numCommands : 0;
+}
+
+CUDAError CUDACommandBuffer::recordUpload(CUDAMemHandle dst, const void *src, SizeType size) {
+	CUDACommand command;
+	command.type = CUDACommandType::Upload;
+	command.devicePtr = dst;
+	command.hostPtr = const_cast<void*>(src);
+	command.size = size;
+
+	return addCommand(command);
+}
+
+CUDAError CUDACommandBuffer::recordDownload(void *dst, CUDAMemHandle src, SizeType size) {
+	CUDACommand command;
+	command.type = CUDACommandType::Download;
+	command.devicePtr = src;
+	command.hostPtr = dst;
+	command.size = size;
+
+	return addCommand(command);
+}
+
+CUDAError CUDACommandBuffer::recordWaitEvent(CUevent event) {
+	CUDACommand command;
+	command.type = CUDACommandType::WaitEvent;
+	command.event = event;
+
+	return addCommand(command);
+}
+
+CUDAError CUDACommandBuffer::recordEvent(CUevent event) {
+	CUDACommand command;
+	command.type = CUDACommandType::RecordEvent;
+	command.event = event;
+
+	return addCommand(command);
+}
+
+CUDAError CUDACommandBuffer::flush() {
+	CUDACommandBuffer *self = this;
+	return flushCommandBuffers(&self, 1);
+}
+
+void CUDACommandBuffer::discard() {
+	commands.clear();
+	args.clear();
+	argOffsets.clear();
+	argSizes.clear();
+}
+
+const void *CUDACommandBuffer::getArg(const CUDACommand &command, int argIndex) const {
+	massert(command.type == CUDACommandType::Kernel && argIndex >= 0 && argIndex < command.numArgs);
+	return args.data() + argOffsets[command.firstArg + argIndex];
+}
+
+CUDAError CUDACommandBuffer::addCommand(const CUDACommand &command) {
+	if (backend == nullptr) {
+		// Arguments of a kernel were stored already.
+		discard();
+		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDACommandBuffer_ERROR_NOT_INITIALIZED", "");
+	}
+
+	const bool isTransfer = command.type == CUDACommandType::Upload || command.type == CUDACommandType::Download;
+	if (isTransfer && command.size == 0) {
+		++numMerged;
+		return CUDAError();
+	}
+
+	// A copy continuing the previous one in both memories is one larger copy.
+	if (isTransfer && !commands.empty()) {
+		CUDACommand &prev = commands.back();
+		if (prev.type == command.type &&
+			prev.devicePtr + prev.size == command.devicePtr &&
+			static_cast<char*>(prev.hostPtr) + prev.size == command.hostPtr
+		) {
+			prev.size += command.size;
+			++numMerged;
+			return CUDAError();
+		}
+	}
+
+	// Waiting again for an event not recorded in between waits for the same work.
+	if (command.type == CUDACommandType::WaitEvent) {
+		for (int i = int(commands.size()) - 1; i >= 0; --i) {
+			const CUDACommand &prev = commands[i];
+			if (prev.event != command.event) {
+				continue;
+			}
+			if (prev.type == CUDACommandType::RecordEvent) {
+				break;
+			}
+			if (prev.type == CUDACommandType::WaitEvent) {
+				++numMerged;
+				return CUDAError();
+			}
+		}
+	}
+
+	commands.push_back(command);
+
+	if (autoFlushThreshold > 0 && commands.size() >= autoFlushThreshold) {
+		return flush();
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDACommandBuffer::submit() {
+	// The storage doesn't move anymore, so the pointers can be taken now.
+	argPointers.resize(argOffsets.size());
+	for (int i = 0; i < argOffsets.size(); ++i) {
+		argPointers[i] = args.data() + argOffsets[i];
+	}
+
+	CUDAError err;
+	int numIssued = 0;
+	for (; numIssued < commands.size() && !err.hasError(); ++numIssued) {
+		const CUDACommand &command = commands[numIssued];
+		switch (command.type) {
+		case CUDACommandType::Upload:
+			err = backend->upload(command.devicePtr, command.hostPtr, command.size, stream);
+			break;
+		case CUDACommandType::Download:
+			err = backend->download(command.hostPtr, command.devicePtr, command.size, stream);
+			break;
+		case CUDACommandType::Kernel:
+			err = backend->launch(
+				command.func,
+				argPointers.data() + command.firstArg,
+				argSizes.data() + command.firstArg,
+				command.numArgs,
+				command.config,
+				stream,
+				command.name
+			);
+			break;
+		case CUDACommandType::WaitEvent:
+			err = backend->waitEvent(stream, command.event);
+			break;
+		case CUDACommandType::RecordEvent:
+			err = backend->recordEvent(command.event, stream);
+			break;
+		default:
+			break;
+		}
+	}
+
+	numSubmitted += numIssued;
+	++numFlushes;
+	discard();
+
+	return err;
+}
+
+CUDAError flushCommandBuffers(CUDACommandBuffer *const *buffers, int count) {
+	CUDACommandBackend *backend = nullptr;
+	for (int i = 0; i < count && backend == nullptr; ++i) {
+		if (!buffers[i]->commands.empty()) {
+			backend = buffers[i]->backend;
+		}
+	}
+	if (backend == nullptr) {
+		// Nothing pending.
+		return CUDAError();
+	}
+
+	CUcontext prevCtx = NULL;
+	RETURN_ON_CUDA_ERROR_HANDLED(backend->getCurrentContext(prevCtx));
+
+	CUDAError err;
+	CUcontext currentCtx = prevCtx;
+	for (int i = 0; i < count && !err.hasError(); ++i) {
+		CUDACommandBuffer &buffer = *buffers[i];
+		if (buffer.commands.empty()) {
+			continue;
+		}
+
+		massert(buffer.backend == backend);
+		if (buffer.ctx != currentCtx) {
+			err = backend->setCurrentContext(buffer.ctx);
+			if (err.hasError()) {
+				break;
+			}
+			currentCtx = buffer.ctx;
+		}
+
+		err = buffer.submit();
+	}
+
+	if (currentCtx != prevCtx) {
+		CUDAError restoreErr = backend->setCurrentContext(prevCtx);
+		if (!err.hasError()) {
+			err = restoreErr;
+		}
+	}
+
+	return err;
+}
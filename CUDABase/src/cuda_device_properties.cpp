@@ -0,0 +1,72 @@
+#include <cuda_device_properties.h>
+
+CUDAError queryDeviceProperties(CUdevice dev, int ordinal, CUDADeviceProperties &props) {
+	props = CUDADeviceProperties();
+	props.ordinal = ordinal;
+
+	RETURN_ON_CUDA_ERROR(cuDeviceTotalMem(&props.totalMem, dev));
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&props.computeCapabilityMajor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, dev));
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&props.computeCapabilityMinor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, dev));
+
+	int value = 0;
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&value, CU_DEVICE_ATTRIBUTE_UNIFIED_ADDRESSING, dev));
+	props.unifiedAddressing = value != 0;
+
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&value, CU_DEVICE_ATTRIBUTE_INTEGRATED, dev));
+	props.integrated = value != 0;
+
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&value, CU_DEVICE_ATTRIBUTE_CAN_MAP_HOST_MEMORY, dev));
+	props.canMapHostMemory = value != 0;
+
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&value, CU_DEVICE_ATTRIBUTE_CAN_USE_HOST_POINTER_FOR_REGISTERED_MEM, dev));
+	props.canUseHostPointerForRegisteredMem = value != 0;
+
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&value, CU_DEVICE_ATTRIBUTE_COOPERATIVE_LAUNCH, dev));
+	props.cooperativeLaunch = value != 0;
+
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&props.warpSize, CU_DEVICE_ATTRIBUTE_WARP_SIZE, dev));
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&props.multiProcessorCount, CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT, dev));
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&props.maxThreadsPerBlock, CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_BLOCK, dev));
+
+	const CUdevice_attribute blockDimAttributes[3] = {
+		CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_X,
+		CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Y,
+		CU_DEVICE_ATTRIBUTE_MAX_BLOCK_DIM_Z
+	};
+	const CUdevice_attribute gridDimAttributes[3] = {
+		CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_X,
+		CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Y,
+		CU_DEVICE_ATTRIBUTE_MAX_GRID_DIM_Z
+	};
+	for (int i = 0; i < 3; ++i) {
+		RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&props.maxBlockDim[i], blockDimAttributes[i], dev));
+		RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&props.maxGridDim[i], gridDimAttributes[i], dev));
+	}
+
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&props.maxSharedMemPerBlock, CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_BLOCK, dev));
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&props.maxSharedMemPerBlockOptin, CU_DEVICE_ATTRIBUTE_MAX_SHARED_MEMORY_PER_BLOCK_OPTIN, dev));
+
+	return CUDAError();
+}
+
+CUDAHostMemoryMode chooseHostMemoryMode(const CUDADeviceProperties &props) {
+	if (!props.canMapHostMemory || !props.unifiedAddressing) {
+		return CUDAHostMemoryMode::Staged;
+	}
+
+	if (props.integrated || props.canUseHostPointerForRegisteredMem) {
+		return CUDAHostMemoryMode::Mapped;
+	}
+
+	return CUDAHostMemoryMode::Staged;
+}
+
+bool isDeviceSupported(const CUDADeviceProperties &props) {
+	if (!props.unifiedAddressing) {
+		return false;
+	}
+
+	const int cpMajor = props.computeCapabilityMajor;
+	const int cpMinor = props.computeCapabilityMinor;
+	return cpMajor > 5 || (cpMajor == 5 && cpMinor >= 2);
+}
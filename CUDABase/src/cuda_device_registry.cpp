@@ -0,0 +1,374 @@
+#include <cuda_device_registry.h>
+#include <cuda_manager.h>
+#include <timer.h>
+
+#include <cctype>
+#include <cstdlib>
+#include <thread>
+
+const char *getDeviceStateName(CUDADeviceState state) {
+	switch (state) {
+	case CUDADeviceState::Discovered: return "discovered";
+	case CUDADeviceState::Initializing: return "initializing";
+	case CUDADeviceState::Ready: return "ready";
+	case CUDADeviceState::Failed: return "failed";
+	default: return "unknown";
+	}
+}
+
+bool meetsRequirements(const CUDADeviceProperties &props, const CUDADeviceRequirements &requirements) {
+	const int cpMajor = props.computeCapabilityMajor;
+	const int cpMinor = props.computeCapabilityMinor;
+	if (cpMajor < requirements.minComputeCapabilityMajor ||
+		(cpMajor == requirements.minComputeCapabilityMajor && cpMinor < requirements.minComputeCapabilityMinor)) {
+		return false;
+	}
+
+	if (props.totalMem < requirements.minTotalMem) {
+		return false;
+	}
+
+	if (requirements.cooperativeLaunch && !props.cooperativeLaunch) {
+		return false;
+	}
+
+	if (requirements.clusterLaunch && !props.supportsClusterLaunch()) {
+		return false;
+	}
+
+	return true;
+}
+
+bool parseVisibleDevices(const char *spec, int deviceCount, std::vector<int> &ordinals) {
+	ordinals.clear();
+
+	if (spec == nullptr) {
+		for (int i = 0; i < deviceCount; ++i) {
+			ordinals.push_back(i);
+		}
+		return true;
+	}
+
+	const char *curr = spec;
+	while (true) {
+		while (isspace((unsigned char)*curr)) {
+			++curr;
+		}
+
+		if (*curr == '\0') {
+			// An empty list hides every device, a trailing comma is fine.
+			return true;
+		}
+
+		char *end = nullptr;
+		const long ordinal = strtol(curr, &end, 10);
+		if (end == curr || ordinal < 0 || ordinal >= deviceCount) {
+			return false;
+		}
+
+		for (int i = 0; i < ordinals.size(); ++i) {
+			if (ordinals[i] == ordinal) {
+				return false;
+			}
+		}
+
+		curr = end;
+		while (isspace((unsigned char)*curr)) {
+			++curr;
+		}
+
+		if (*curr != ',' && *curr != '\0') {
+			return false;
+		}
+
+		ordinals.push_back(int(ordinal));
+
+		if (*curr == ',') {
+			++curr;
+		}
+	}
+}
+
+/*
+===============================================================
+CUDADeviceRegistry
+===============================================================
+*/
+CUDADeviceRegistry::DeviceSlot::DeviceSlot() : state(CUDADeviceState::Discovered), initializationMs(0.f), device(new CUDADevice()) { }
+
+CUDADeviceRegistry::DeviceSlot::~DeviceSlot() = default;
+
+CUDADeviceRegistry::DeviceSlot::DeviceSlot(DeviceSlot&&) = default;
+
+CUDADeviceRegistry::CUDADeviceRegistry() : driver(nullptr) { }
+
+CUDADeviceRegistry::~CUDADeviceRegistry() {
+	deinitialize();
+}
+
+CUDAError CUDADeviceRegistry::discover(CUDADeviceDriver *driver, const char *visibleDevices) {
+	RETURN_ON_CUDA_ERROR_HANDLED(deinitialize());
+
+	if (driver == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDADeviceRegistry_ERROR_NO_DRIVER", "");
+	}
+	this->driver = driver;
+
+	int deviceCount = 0;
+	RETURN_ON_CUDA_ERROR_HANDLED(driver->getDeviceCount(deviceCount));
+
+	std::vector<int> ordinals;
+	if (!parseVisibleDevices(visibleDevices, deviceCount, ordinals)) {
+		CUDABASE_LOG(LogLevel::Warning, "Visible devices list \"%s\" has an invalid entry, devices after it are hidden", visibleDevices);
+	}
+
+	slots.reserve(ordinals.size());
+	for (int i = 0; i < ordinals.size(); ++i) {
+		DeviceSlot slot;
+		CUDAError err = driver->queryDevice(ordinals[i], slot.properties);
+		if (err.hasError()) {
+			CUDABASE_LOG(LogLevel::Warning, "Failed to query device %d, skipping it", ordinals[i]);
+			continue;
+		}
+
+		if (!isDeviceSupported(slot.properties)) {
+			CUDABASE_LOG(
+				LogLevel::Warning,
+				"Device %d with compute capability %d.%d is not supported, skipping it",
+				ordinals[i],
+				slot.properties.computeCapabilityMajor,
+				slot.properties.computeCapabilityMinor
+			);
+			continue;
+		}
+
+		slots.push_back(std::move(slot));
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDADeviceRegistry::deinitialize() {
+	CUDAError result;
+	for (int i = 0; i < slots.size(); ++i) {
+		if (slots[i].state != CUDADeviceState::Ready) {
+			continue;
+		}
+
+		CUDAError err = driver->deinitializeDevice(*slots[i].device);
+		if (err.hasError() && !result.hasError()) {
+			result = err;
+		}
+	}
+
+	slots.clear();
+	driver = nullptr;
+
+	return result;
+}
+
+int CUDADeviceRegistry::getNumDevices() const {
+	return int(slots.size());
+}
+
+CUDADeviceState CUDADeviceRegistry::getState(int idx) const {
+	massert(idx >= 0 && idx < slots.size());
+	std::lock_guard<std::mutex> lock(mutex);
+	return slots[idx].state;
+}
+
+const CUDADeviceProperties &CUDADeviceRegistry::getProperties(int idx) const {
+	massert(idx >= 0 && idx < slots.size());
+	return slots[idx].properties;
+}
+
+CUDAError CUDADeviceRegistry::getError(int idx) const {
+	massert(idx >= 0 && idx < slots.size());
+	std::lock_guard<std::mutex> lock(mutex);
+	return slots[idx].error;
+}
+
+float CUDADeviceRegistry::getInitializationTime(int idx) const {
+	massert(idx >= 0 && idx < slots.size());
+	std::lock_guard<std::mutex> lock(mutex);
+	return slots[idx].initializationMs;
+}
+
+void CUDADeviceRegistry::initializeSlot(int idx) {
+	DeviceSlot &slot = slots[idx];
+
+	// The driver call is what takes long, the others only wait if they need this very device.
+	Timer timer;
+	CUDAError err = driver->initializeDevice(slot.properties.ordinal, *slot.device);
+	const float initializationMs = timer.time();
+
+	if (err.hasError()) {
+		CUDABASE_LOG(LogLevel::Warning, "Failed to initialize device %d in %.2fms: %s", slot.properties.ordinal, initializationMs, err.getName());
+	} else {
+		CUDABASE_LOG(LogLevel::Info, "Device %d brought up in %.2fms", slot.properties.ordinal, initializationMs);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		slot.initializationMs = initializationMs;
+		slot.error = err;
+		slot.state = err.hasError() ? CUDADeviceState::Failed : CUDADeviceState::Ready;
+	}
+	stateChanged.notify_all();
+}
+
+CUDAError CUDADeviceRegistry::bringUp(int idx) {
+	DeviceSlot &slot = slots[idx];
+
+	std::unique_lock<std::mutex> lock(mutex);
+	stateChanged.wait(lock, [&slot]() { return slot.state != CUDADeviceState::Initializing; });
+
+	if (slot.state != CUDADeviceState::Discovered) {
+		return slot.error;
+	}
+
+	slot.state = CUDADeviceState::Initializing;
+	lock.unlock();
+
+	initializeSlot(idx);
+
+	lock.lock();
+	return slot.error;
+}
+
+CUDAError CUDADeviceRegistry::getDevice(int idx, const CUDADevice *&device) {
+	device = nullptr;
+	if (idx < 0 || idx >= slots.size()) {
+		return CUDAError(CUDA_ERROR_INVALID_DEVICE, "CUDADeviceRegistry_ERROR_INVALID_INDEX", "");
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(bringUp(idx));
+	device = slots[idx].device.get();
+
+	return CUDAError();
+}
+
+CUDAError CUDADeviceRegistry::getDeviceByOrdinal(int ordinal, const CUDADevice *&device) {
+	for (int i = 0; i < slots.size(); ++i) {
+		if (slots[i].properties.ordinal == ordinal) {
+			return getDevice(i, device);
+		}
+	}
+
+	device = nullptr;
+	return CUDAError(CUDA_ERROR_INVALID_DEVICE, "CUDADeviceRegistry_ERROR_DEVICE_NOT_VISIBLE", "");
+}
+
+CUDAError CUDADeviceRegistry::findDevice(const CUDADeviceRequirements &requirements, const CUDADevice *&device) {
+	device = nullptr;
+
+	std::vector<int> candidates;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < slots.size(); ++i) {
+			if (slots[i].state != CUDADeviceState::Failed && meetsRequirements(slots[i].properties, requirements)) {
+				candidates.push_back(i);
+			}
+		}
+	}
+
+	while (!candidates.empty()) {
+		int best = 0;
+		if (requirements.preferMostMemory) {
+			for (int i = 1; i < candidates.size(); ++i) {
+				if (slots[candidates[i]].properties.totalMem > slots[candidates[best]].properties.totalMem) {
+					best = i;
+				}
+			}
+		}
+
+		const int idx = candidates[best];
+		if (!bringUp(idx).hasError()) {
+			device = slots[idx].device.get();
+			return CUDAError();
+		}
+
+		candidates.erase(candidates.begin() + best);
+	}
+
+	return CUDAError(CUDA_ERROR_INVALID_DEVICE, "CUDADeviceRegistry_ERROR_NO_MATCHING_DEVICE", "");
+}
+
+CUDAError CUDADeviceRegistry::initializeAll() {
+	// Claim the slots up front, so lookups on other threads wait for the workers instead of racing them.
+	std::vector<int> pending;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < slots.size(); ++i) {
+			if (slots[i].state == CUDADeviceState::Discovered) {
+				slots[i].state = CUDADeviceState::Initializing;
+				pending.push_back(i);
+			}
+		}
+	}
+
+	Timer timer;
+	if (pending.size() == 1) {
+		initializeSlot(pending[0]);
+	} else if (pending.size() > 1) {
+		std::vector<std::thread> workers;
+		workers.reserve(pending.size());
+		// The contexts end up current on the workers. Callers have to use() a device anyway.
+		for (int i = 0; i < pending.size(); ++i) {
+			workers.emplace_back(&CUDADeviceRegistry::initializeSlot, this, pending[i]);
+		}
+
+		for (int i = 0; i < workers.size(); ++i) {
+			workers[i].join();
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	// Devices claimed by lookups on other threads may still be on their way.
+	stateChanged.wait(lock, [this]() {
+		for (int i = 0; i < slots.size(); ++i) {
+			if (slots[i].state == CUDADeviceState::Initializing) {
+				return false;
+			}
+		}
+		return true;
+	});
+
+	int numFailed = 0;
+	for (int i = 0; i < pending.size(); ++i) {
+		numFailed += slots[pending[i]].state == CUDADeviceState::Failed ? 1 : 0;
+	}
+
+	int numReady = 0;
+	for (int i = 0; i < slots.size(); ++i) {
+		numReady += slots[i].state == CUDADeviceState::Ready ? 1 : 0;
+	}
+
+	if (!pending.empty()) {
+		CUDABASE_LOG(
+			LogLevel::Info,
+			"Brought up %d of %d devices in %.2fms",
+			int(pending.size()) - numFailed,
+			int(pending.size()),
+			timer.time()
+		);
+	}
+
+	if (numReady == 0) {
+		return CUDAError(CUDA_ERROR_NO_DEVICE, "CUDADeviceRegistry_ERROR_NO_DEVICE_INITIALIZED", "");
+	}
+
+	return CUDAError();
+}
+
+const CUDADevice *CUDADeviceRegistry::findReadyDevice(CUdevice dev) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (int i = 0; i < slots.size(); ++i) {
+		if (slots[i].state == CUDADeviceState::Ready && slots[i].device->getDevice() == dev) {
+			return slots[i].device.get();
+		}
+	}
+
+	return nullptr;
+}
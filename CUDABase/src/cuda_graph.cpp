@@ -0,0 +1,323 @@
+#include <cuda_graph.h>
+
+#include <cstddef>
+
+/*
+===============================================================
+CUDAGraph
+===============================================================
+*/
+CUDAGraph::CUDAGraph() : graph(NULL), graphExec(NULL), ctx(NULL), mode(CUDAGraphMode::Graph), needsRebuild(false) { }
+
+CUDAGraph::~CUDAGraph() {
+	deinitialize();
+}
+
+CUDAError CUDAGraph::deinitialize() {
+	RETURN_ON_CUDA_ERROR_HANDLED(destroyGraph());
+	nodes.clear();
+	needsRebuild = false;
+
+	return CUDAError();
+}
+
+CUDAError CUDAGraph::destroyGraph() {
+	if (graphExec != NULL) {
+		RETURN_ON_CUDA_ERROR(cuGraphExecDestroy(graphExec));
+		graphExec = NULL;
+	}
+
+	if (graph != NULL) {
+		RETURN_ON_CUDA_ERROR(cuGraphDestroy(graph));
+		graph = NULL;
+	}
+
+	graphNodes.clear();
+	ctx = NULL;
+
+	return CUDAError();
+}
+
+int CUDAGraph::addNode(const CUDAGraphNode &node) {
+	nodes.push_back(node);
+
+	// New nodes change the topology which can't be patched into an instantiated graph.
+	needsRebuild = true;
+
+	return int(nodes.size()) - 1;
+}
+
+int CUDAGraph::addUpload(CUDAMemHandle dst, const void *src, SizeType size) {
+	CUDAGraphNode node;
+	node.type = CUDAGraphNodeType::Upload;
+	node.devicePtr = dst;
+	node.hostPtr = const_cast<void*>(src);
+	node.size = size;
+
+	return addNode(node);
+}
+
+int CUDAGraph::addDownload(void *dst, CUDAMemHandle src, SizeType size) {
+	CUDAGraphNode node;
+	node.type = CUDAGraphNodeType::Download;
+	node.devicePtr = src;
+	node.hostPtr = dst;
+	node.size = size;
+
+	return addNode(node);
+}
+
+int CUDAGraph::addKernel(CUfunction func, void **params, const SizeType *paramSizes, int numParams, const CUDALaunchConfig &config, const char *name) {
+	CUDAGraphNode node;
+	node.type = CUDAGraphNodeType::Kernel;
+	node.func = func;
+	copyKernelArgs(node, params, paramSizes, numParams);
+	node.config = config;
+	node.name = name;
+
+	return addNode(node);
+}
+
+CUDAError CUDAGraph::updateUpload(int nodeIdx, CUDAMemHandle dst, const void *src, SizeType size) {
+	if (nodeIdx < 0 || nodeIdx >= nodes.size() || nodes[nodeIdx].type != CUDAGraphNodeType::Upload) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAGraph_ERROR_INVALID_NODE", "");
+	}
+
+	CUDAGraphNode &node = nodes[nodeIdx];
+	node.devicePtr = dst;
+	node.hostPtr = const_cast<void*>(src);
+	node.size = size;
+
+	return updateNode(nodeIdx);
+}
+
+CUDAError CUDAGraph::updateDownload(int nodeIdx, void *dst, CUDAMemHandle src, SizeType size) {
+	if (nodeIdx < 0 || nodeIdx >= nodes.size() || nodes[nodeIdx].type != CUDAGraphNodeType::Download) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAGraph_ERROR_INVALID_NODE", "");
+	}
+
+	CUDAGraphNode &node = nodes[nodeIdx];
+	node.devicePtr = src;
+	node.hostPtr = dst;
+	node.size = size;
+
+	return updateNode(nodeIdx);
+}
+
+CUDAError CUDAGraph::updateKernel(int nodeIdx, void **params, const SizeType *paramSizes, int numParams, const CUDALaunchConfig &config) {
+	if (nodeIdx < 0 || nodeIdx >= nodes.size() || nodes[nodeIdx].type != CUDAGraphNodeType::Kernel) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAGraph_ERROR_INVALID_NODE", "");
+	}
+
+	CUDAGraphNode &node = nodes[nodeIdx];
+	copyKernelArgs(node, params, paramSizes, numParams);
+	node.config = config;
+
+	return updateNode(nodeIdx);
+}
+
+CUDAError CUDAGraph::updateNode(int nodeIdx) {
+	// Not built yet, the next instantiate() picks the change up.
+	if (graphExec == NULL || needsRebuild) {
+		return CUDAError();
+	}
+
+	const CUDAGraphNode &node = nodes[nodeIdx];
+	CUresult res = CUDA_SUCCESS;
+	if (node.type == CUDAGraphNodeType::Kernel) {
+		CUDA_KERNEL_NODE_PARAMS kernelParams;
+		RETURN_ON_CUDA_ERROR_HANDLED(fillKernelParams(node, kernelParams));
+		res = cuGraphExecKernelNodeSetParams(graphExec, graphNodes[nodeIdx], &kernelParams);
+	} else {
+		CUDA_MEMCPY3D copyParams;
+		fillCopyParams(node, copyParams);
+		res = cuGraphExecMemcpyNodeSetParams(graphExec, graphNodes[nodeIdx], &copyParams, ctx);
+	}
+
+	// Some changes (f.e. memory from another context) can't be patched in. Build the graph again instead.
+	if (res != CUDA_SUCCESS) {
+		CUDABASE_LOG(LogLevel::Debug, "CUDAGraph: node %d can't be updated in place (error %d), rebuilding", nodeIdx, int(res));
+		needsRebuild = true;
+	}
+
+	return CUDAError();
+}
+
+void CUDAGraph::copyKernelArgs(CUDAGraphNode &node, void **params, const SizeType *paramSizes, int numParams) {
+	massert(numParams == 0 || (params != nullptr && paramSizes != nullptr));
+
+	node.args.clear();
+	node.argOffsets.resize(numParams);
+	for (int i = 0; i < numParams; ++i) {
+		// Only the size is known, so align to the largest power of two dividing it.
+		// No type of that size needs more, and the storage itself is aligned for any type.
+		const SizeType size = paramSizes[i];
+		SizeType alignment = 1;
+		while (alignment < alignof(std::max_align_t) && size % (alignment * 2) == 0) {
+			alignment *= 2;
+		}
+
+		const SizeType alignedOffset = (SizeType(node.args.size()) + alignment - 1) / alignment * alignment;
+		node.args.resize(size_t(alignedOffset + size));
+		memcpy(node.args.data() + alignedOffset, params[i], size);
+		node.argOffsets[i] = alignedOffset;
+	}
+}
+
+void **CUDAGraph::getArgPointers(const CUDAGraphNode &node) {
+	if (node.argOffsets.empty()) {
+		return nullptr;
+	}
+
+	// The driver only reads through the pointers.
+	char *args = const_cast<char*>(node.args.data());
+	argPointers.resize(node.argOffsets.size());
+	for (int i = 0; i < node.argOffsets.size(); ++i) {
+		argPointers[i] = args + node.argOffsets[i];
+	}
+
+	return argPointers.data();
+}
+
+void CUDAGraph::fillCopyParams(const CUDAGraphNode &node, CUDA_MEMCPY3D &copyParams) {
+	memset(&copyParams, 0, sizeof(copyParams));
+
+	if (node.type == CUDAGraphNodeType::Upload) {
+		copyParams.srcMemoryType = CU_MEMORYTYPE_HOST;
+		copyParams.srcHost = node.hostPtr;
+		copyParams.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+		copyParams.dstDevice = node.devicePtr;
+	} else {
+		copyParams.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+		copyParams.srcDevice = node.devicePtr;
+		copyParams.dstMemoryType = CU_MEMORYTYPE_HOST;
+		copyParams.dstHost = node.hostPtr;
+	}
+
+	copyParams.WidthInBytes = node.size;
+	copyParams.Height = 1;
+	copyParams.Depth = 1;
+}
+
+CUDAError CUDAGraph::fillKernelParams(const CUDAGraphNode &node, CUDA_KERNEL_NODE_PARAMS &kernelParams) {
+	CUDALaunchConfig resolved;
+	RETURN_ON_CUDA_ERROR_HANDLED(resolveKernelLaunch(node.func, node.config, resolved));
+
+	if (resolved.mode != CUDALaunchMode::Default) {
+		return CUDAError(CUDA_ERROR_NOT_SUPPORTED, "CUDAGraph_ERROR_UNSUPPORTED_LAUNCH_MODE", "");
+	}
+
+	memset(&kernelParams, 0, sizeof(kernelParams));
+	kernelParams.func = node.func;
+	kernelParams.gridDimX = resolved.grid.x;
+	kernelParams.gridDimY = resolved.grid.y;
+	kernelParams.gridDimZ = resolved.grid.z;
+	kernelParams.blockDimX = resolved.block.x;
+	kernelParams.blockDimY = resolved.block.y;
+	kernelParams.blockDimZ = resolved.block.z;
+	kernelParams.sharedMemBytes = resolved.dynamicSharedMemBytes;
+	kernelParams.kernelParams = getArgPointers(node);
+	kernelParams.extra = nullptr;
+
+	return CUDAError();
+}
+
+CUDAError CUDAGraph::instantiate() {
+	RETURN_ON_CUDA_ERROR_HANDLED(destroyGraph());
+
+	if (nodes.empty()) {
+		needsRebuild = false;
+		return CUDAError();
+	}
+
+	struct DestructRAII {
+		CUDAGraph &graph;
+		bool hasError;
+
+		DestructRAII(CUDAGraph &graph) : graph(graph), hasError(true) { }
+		~DestructRAII() {
+			if (hasError) graph.destroyGraph();
+		}
+	} destructRAII(*this);
+
+	RETURN_ON_CUDA_ERROR(cuCtxGetCurrent(&ctx));
+	RETURN_ON_CUDA_ERROR(cuGraphCreate(&graph, 0));
+
+	graphNodes.resize(nodes.size());
+	for (int i = 0; i < nodes.size(); ++i) {
+		// The pipeline is linear, every node waits for the one recorded before it.
+		const CUgraphNode *dependencies = i > 0 ? &graphNodes[i - 1] : nullptr;
+		const size_t numDependencies = i > 0 ? 1 : 0;
+
+		const CUDAGraphNode &node = nodes[i];
+		if (node.type == CUDAGraphNodeType::Kernel) {
+			CUDA_KERNEL_NODE_PARAMS kernelParams;
+			RETURN_ON_CUDA_ERROR_HANDLED(fillKernelParams(node, kernelParams));
+			RETURN_ON_CUDA_ERROR(cuGraphAddKernelNode(&graphNodes[i], graph, dependencies, numDependencies, &kernelParams));
+		} else {
+			CUDA_MEMCPY3D copyParams;
+			fillCopyParams(node, copyParams);
+			RETURN_ON_CUDA_ERROR(cuGraphAddMemcpyNode(&graphNodes[i], graph, dependencies, numDependencies, &copyParams, ctx));
+		}
+	}
+
+	RETURN_ON_CUDA_ERROR(cuGraphInstantiateWithFlags(&graphExec, graph, 0));
+
+	needsRebuild = false;
+	destructRAII.hasError = false;
+
+	return CUDAError();
+}
+
+CUDAError CUDAGraph::launch(CUstream stream) {
+	if (mode == CUDAGraphMode::Eager) {
+		return launchEager(stream);
+	}
+
+	if (graphExec == NULL || needsRebuild) {
+		CUDAError err = instantiate();
+		if (err.hasError()) {
+			CUDABASE_LOG(LogLevel::Warning, "CUDAGraph: failed to build the graph, falling back to eager launches");
+			mode = CUDAGraphMode::Eager;
+			return launchEager(stream);
+		}
+	}
+
+	if (graphExec == NULL) {
+		// Nothing recorded.
+		return CUDAError();
+	}
+
+	CUDAProfiler &profiler = getCUDAManager().getProfiler();
+	CUDAProfiler::Range profileRange;
+	RETURN_ON_CUDA_ERROR_HANDLED(profiler.begin(stream, profileRange));
+	RETURN_ON_CUDA_ERROR(cuGraphLaunch(graphExec, stream));
+	RETURN_ON_CUDA_ERROR_HANDLED(profiler.end("CUDAGraph::launch", stream, profileRange));
+
+	return CUDAError();
+}
+
+CUDAError CUDAGraph::launchEager(CUstream stream) {
+	for (int i = 0; i < nodes.size(); ++i) {
+		const CUDAGraphNode &node = nodes[i];
+		switch (node.type) {
+		case CUDAGraphNodeType::Upload:
+			RETURN_ON_CUDA_ERROR(cuMemcpyHtoDAsync(node.devicePtr, node.hostPtr, node.size, stream));
+			break;
+		case CUDAGraphNodeType::Download:
+			RETURN_ON_CUDA_ERROR(cuMemcpyDtoHAsync(node.hostPtr, node.devicePtr, node.size, stream));
+			break;
+		case CUDAGraphNodeType::Kernel:
+			RETURN_ON_CUDA_ERROR_HANDLED(launchKernel(node.func, getArgPointers(node), node.config, stream, node.name));
+			break;
+		default:
+			break;
+		}
+	}
+
+	return CUDAError();
+}
+
+void CUDAGraph::setMode(CUDAGraphMode mode) {
+	this->mode = mode;
+}
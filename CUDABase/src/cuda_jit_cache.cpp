@@ -0,0 +1,214 @@
+#include <cuda_jit_cache.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+/*
+===============================================================
+CUDAJitCache
+===============================================================
+*/
+CUDAJitCache::CUDAJitCache() {
+	const char *envDirectory = getenv("CUDABASE_JIT_CACHE_DIR");
+	if (envDirectory != nullptr) {
+		directory = envDirectory;
+		return;
+	}
+
+	std::error_code ec;
+	const fs::path tempPath = fs::temp_directory_path(ec);
+	if (!ec) {
+		directory = (tempPath / "CUDABaseJitCache").string();
+	}
+}
+
+void CUDAJitCache::setDirectory(const std::string &directory) {
+	this->directory = directory;
+}
+
+uint64_t CUDAJitCache::hash(const void *data, SizeType size, uint64_t seed) {
+	const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+	uint64_t result = seed;
+	for (SizeType i = 0; i < size; ++i) {
+		result ^= bytes[i];
+		result *= FNV_PRIME;
+	}
+	return result;
+}
+
+uint64_t CUDAJitCache::computeKey(const CUDAJitCacheKeyDesc &desc) {
+	uint64_t key = FNV_OFFSET_BASIS;
+
+	// Sizes are hashed in front of the variable length parts so different splits of the same bytes differ.
+	const uint64_t numSources = desc.ptxSources != nullptr ? desc.ptxSources->size() : 0;
+	key = hash(&numSources, sizeof(numSources), key);
+	for (uint64_t i = 0; i < numSources; ++i) {
+		const std::string &source = (*desc.ptxSources)[i];
+		const uint64_t sourceSize = source.size();
+		key = hash(&sourceSize, sizeof(sourceSize), key);
+		key = hash(source.data(), source.size(), key);
+	}
+
+	const uint64_t numOptions = desc.linkOptionValues.size();
+	key = hash(&numOptions, sizeof(numOptions), key);
+	key = hash(desc.linkOptionValues.data(), numOptions * sizeof(int), key);
+
+	const uint64_t fingerprintSize = desc.libraryFingerprint.size();
+	key = hash(&fingerprintSize, sizeof(fingerprintSize), key);
+	key = hash(desc.libraryFingerprint.data(), fingerprintSize, key);
+
+	const int values[4] = {
+		desc.driverVersion,
+		desc.computeCapabilityMajor,
+		desc.computeCapabilityMinor,
+		desc.useDynamicParallelism ? 1 : 0
+	};
+	key = hash(values, sizeof(values), key);
+
+	return key;
+}
+
+std::string CUDAJitCache::getFileFingerprint(const std::string &path) {
+	std::string result = path;
+
+	std::error_code ec;
+	const uintmax_t size = fs::file_size(path, ec);
+	if (!ec) {
+		result += ":" + std::to_string(size);
+	}
+
+	const fs::file_time_type writeTime = fs::last_write_time(path, ec);
+	if (!ec) {
+		result += ":" + std::to_string(writeTime.time_since_epoch().count());
+	}
+
+	return result;
+}
+
+bool CUDAJitCache::readFile(const std::string &path, std::string &contents) {
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file) {
+		return false;
+	}
+
+	const std::streamsize size = file.tellg();
+	if (size < 0) {
+		return false;
+	}
+
+	contents.resize(size_t(size));
+	file.seekg(0);
+	return bool(file.read(&contents[0], size)) || size == 0;
+}
+
+std::string CUDAJitCache::getEntryPath(uint64_t key) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.cubin", (unsigned long long)key);
+	return (fs::path(directory) / name).string();
+}
+
+bool CUDAJitCache::load(uint64_t key, std::vector<char> &cubin) const {
+	if (!isEnabled()) {
+		return false;
+	}
+
+	const std::string path = getEntryPath(key);
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+
+	FileHeader header;
+	bool valid = bool(file.read(reinterpret_cast<char*>(&header), sizeof(header)));
+	valid = valid &&
+		header.magic == FILE_MAGIC &&
+		header.version == FILE_VERSION &&
+		header.key == key &&
+		header.payloadSize > 0;
+
+	if (valid) {
+		cubin.resize(size_t(header.payloadSize));
+		valid = bool(file.read(cubin.data(), cubin.size())) && hash(cubin.data(), cubin.size()) == header.payloadHash;
+	}
+
+	file.close();
+
+	if (!valid) {
+		CUDABASE_LOG(LogLevel::Warning, "JIT cache entry %s is corrupt, removing it", path.c_str());
+		cubin.clear();
+		invalidate(key);
+		return false;
+	}
+
+	return true;
+}
+
+bool CUDAJitCache::store(uint64_t key, const void *cubin, SizeType size) const {
+	if (!isEnabled() || cubin == nullptr || size == 0) {
+		return false;
+	}
+
+	std::error_code ec;
+	fs::create_directories(directory, ec);
+	if (ec) {
+		CUDABASE_LOG(LogLevel::Warning, "Failed to create JIT cache directory %s", directory.c_str());
+		return false;
+	}
+
+	// Unique per process and thread so concurrent writers never share a temp file.
+	static std::atomic<unsigned int> tempCounter(0);
+	const std::string path = getEntryPath(key);
+	const std::string tempPath =
+		path + ".tmp." +
+		std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "." +
+		std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "." +
+		std::to_string(tempCounter++);
+
+	FileHeader header;
+	header.magic = FILE_MAGIC;
+	header.version = FILE_VERSION;
+	header.key = key;
+	header.payloadSize = size;
+	header.payloadHash = hash(cubin, size);
+
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		const bool written =
+			file &&
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header)) &&
+			file.write(reinterpret_cast<const char*>(cubin), std::streamsize(size)) &&
+			file.flush();
+
+		if (!written) {
+			file.close();
+			fs::remove(tempPath, ec);
+			CUDABASE_LOG(LogLevel::Warning, "Failed to write JIT cache entry %s", path.c_str());
+			return false;
+		}
+	}
+
+	// Replaces any existing entry in one step.
+	fs::rename(tempPath, path, ec);
+	if (ec) {
+		fs::remove(tempPath, ec);
+		CUDABASE_LOG(LogLevel::Warning, "Failed to publish JIT cache entry %s", path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+void CUDAJitCache::invalidate(uint64_t key) const {
+	if (!isEnabled()) {
+		return;
+	}
+
+	std::error_code ec;
+	fs::remove(getEntryPath(key), ec);
+}
@@ -0,0 +1,88 @@
+#include <cuda_kernel.h>
+
+/*
+===============================================================
+CUDAKernel
+===============================================================
+*/
+CUDAKernel::CUDAKernel() {
+	clearCache();
+}
+
+CUDAKernel::CUDAKernel(const char *name) : name(name) {
+	clearCache();
+}
+
+void CUDAKernel::initialize(const char *name) {
+	this->name = name;
+	clearCache();
+}
+
+void CUDAKernel::clearCache() {
+	for (int i = 0; i < maxCachedDevices; ++i) {
+		functions[i].store(NULL, std::memory_order_relaxed);
+	}
+}
+
+CUDAError CUDAKernel::getFunction(const CUDADevice &device, CUfunction &func) const {
+	const CUdevice dev = device.getDevice();
+	const bool cacheable = dev >= 0 && dev < maxCachedDevices;
+	if (cacheable) {
+		func = functions[dev].load(std::memory_order_acquire);
+		if (func != NULL) {
+			return CUDAError();
+		}
+	}
+
+	// Threads missing at the same time all look it up and store the same handle.
+	CUDAError err = handleCUDAError(cuModuleGetFunction(&func, device.getModule(), name.c_str()));
+	if (err.hasError()) {
+		CUDABASE_LOG(LogLevel::Error, "Failed to load function %s", name.c_str());
+		return err;
+	}
+
+	if (cacheable) {
+		functions[dev].store(func, std::memory_order_release);
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAKernel::getCurrentFunction(CUfunction &func) const {
+	RETURN_ON_CUDA_ERROR_HANDLED(bindThreadContext());
+
+	CUdevice dev = CU_DEVICE_INVALID;
+	RETURN_ON_CUDA_ERROR(cuCtxGetDevice(&dev));
+	if (dev >= 0 && dev < maxCachedDevices) {
+		func = functions[dev].load(std::memory_order_acquire);
+		if (func != NULL) {
+			return CUDAError();
+		}
+	}
+
+	const CUDADevice *device = getCUDAManager().getCurrentDevice();
+	if (device == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_CONTEXT, "CUDAKernel_ERROR_NO_CURRENT_DEVICE", "");
+	}
+
+	return getFunction(*device, func);
+}
+
+CUDAError CUDAKernel::launch(const CUDALaunchConfig &config, CUstream stream, const CUDAArgumentFrame &args) const {
+	CUfunction func = NULL;
+	CUDAError err = getCurrentFunction(func);
+	if (err.hasError()) {
+		LOG_CUDA_ERROR_RATE_LIMITED(err, LogLevel::Warning, 10);
+		return err;
+	}
+
+	return launchKernel(func, args.getParams(), config, stream, name.c_str());
+}
+
+CUDAError CUDAKernel::launchSync(const CUDALaunchConfig &config, CUstream stream, const CUDAArgumentFrame &args) const {
+	RETURN_ON_CUDA_ERROR_HANDLED(launch(config, stream, args));
+
+	RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream));
+
+	return CUDAError();
+}
@@ -0,0 +1,243 @@
+#include <cuda_launch_config.h>
+
+#include <algorithm>
+
+/*
+===============================================================
+CUDALaunchConfig
+===============================================================
+*/
+CUDALaunchConfig CUDALaunchConfig::forThreads(const CUDADim3 &threads, unsigned int dynamicSharedMemBytes) {
+	CUDALaunchConfig config;
+	config.threads = threads;
+	config.dynamicSharedMemBytes = dynamicSharedMemBytes;
+	config.autoBlock = true;
+	config.autoGrid = true;
+	return config;
+}
+
+CUDALaunchConfig CUDALaunchConfig::forThreads(const CUDADim3 &threads, const CUDADim3 &block, unsigned int dynamicSharedMemBytes) {
+	CUDALaunchConfig config;
+	config.threads = threads;
+	config.block = block;
+	config.dynamicSharedMemBytes = dynamicSharedMemBytes;
+	config.autoGrid = true;
+	return config;
+}
+
+CUDALaunchConfig CUDALaunchConfig::forGrid(const CUDADim3 &grid, const CUDADim3 &block, unsigned int dynamicSharedMemBytes) {
+	CUDALaunchConfig config;
+	config.grid = grid;
+	config.block = block;
+	config.dynamicSharedMemBytes = dynamicSharedMemBytes;
+	return config;
+}
+
+/*
+===============================================================
+Grid math
+===============================================================
+*/
+/// In 64 bits, so extents close to the 32 bit limit don't wrap around.
+static SizeType roundUp(SizeType value, SizeType multiple) {
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+static SizeType divideRoundUp(SizeType value, SizeType divisor) {
+	return (value + divisor - 1) / divisor;
+}
+
+static unsigned int clampDim(SizeType value, SizeType extent, int deviceLimit) {
+	SizeType result = std::min<SizeType>(value, extent);
+	if (deviceLimit > 0) {
+		result = std::min<SizeType>(result, SizeType(deviceLimit));
+	}
+	return result > 0 ? static_cast<unsigned int>(result) : 1;
+}
+
+CUDADim3 shapeBlock(int blockSize, const CUDADim3 &threads, const CUDADeviceProperties &props) {
+	if (blockSize <= 0) {
+		return CUDADim3();
+	}
+
+	const unsigned int warpSize = props.warpSize > 0 ? props.warpSize : 1;
+	const unsigned int rowWidth = std::min<unsigned int>(warpSize, blockSize);
+
+	CUDADim3 block;
+	block.y = clampDim(blockSize / rowWidth, threads.y, props.maxBlockDim[1]);
+	block.z = clampDim(blockSize / (rowWidth * block.y), threads.z, props.maxBlockDim[2]);
+
+	// Give x whatever y and z could not use, in whole warps.
+	SizeType x = blockSize / (block.y * block.z);
+	if (x >= warpSize) {
+		x = x / warpSize * warpSize;
+	}
+	block.x = clampDim(x, roundUp(threads.x, warpSize), props.maxBlockDim[0]);
+
+	return block;
+}
+
+CUDADim3 computeGrid(const CUDADim3 &threads, const CUDADim3 &block) {
+	return CUDADim3(
+		static_cast<unsigned int>(divideRoundUp(threads.x, block.x)),
+		static_cast<unsigned int>(divideRoundUp(threads.y, block.y)),
+		static_cast<unsigned int>(divideRoundUp(threads.z, block.z))
+	);
+}
+
+CUDAError resolveLaunchConfig(
+	const CUDALaunchConfig &config,
+	int occupancyBlockSize,
+	int maxActiveBlocksPerSM,
+	const CUDADeviceProperties &props,
+	CUDALaunchConfig &resolved
+) {
+	CUDALaunchConfig result = config;
+
+	if (config.autoBlock) {
+		if (occupancyBlockSize <= 0) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDALaunchConfig_ERROR_NO_OCCUPANCY_BLOCK_SIZE", "");
+		}
+		result.block = shapeBlock(occupancyBlockSize, config.threads, props);
+	}
+
+	if (result.block.count() == 0) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDALaunchConfig_ERROR_EMPTY_BLOCK", "");
+	}
+
+	if (config.autoGrid) {
+		if (config.threads.count() == 0) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDALaunchConfig_ERROR_EMPTY_LAUNCH", "");
+		}
+
+		result.grid = computeGrid(config.threads, result.block);
+
+		// Round the grid up to whole clusters. The kernel already guards against the extra threads.
+		if (config.mode == CUDALaunchMode::Cluster && result.cluster.count() > 0) {
+			result.grid.x = static_cast<unsigned int>(roundUp(result.grid.x, result.cluster.x));
+			result.grid.y = static_cast<unsigned int>(roundUp(result.grid.y, result.cluster.y));
+			result.grid.z = static_cast<unsigned int>(roundUp(result.grid.z, result.cluster.z));
+		}
+
+		// Cooperative kernels must have all their blocks resident at once.
+		// They are expected to loop over their work with a grid stride, so just cap the grid.
+		if (config.mode == CUDALaunchMode::Cooperative && maxActiveBlocksPerSM > 0) {
+			const SizeType maxBlocks = SizeType(maxActiveBlocksPerSM) * props.multiProcessorCount;
+			if (maxBlocks > 0 && result.grid.count() > maxBlocks) {
+				result.grid.z = std::max<SizeType>(1, std::min<SizeType>(result.grid.z, maxBlocks));
+				result.grid.y = std::max<SizeType>(1, std::min<SizeType>(result.grid.y, maxBlocks / result.grid.z));
+				result.grid.x = std::max<SizeType>(1, std::min<SizeType>(result.grid.x, maxBlocks / (SizeType(result.grid.y) * result.grid.z)));
+			}
+		}
+	}
+
+	result.autoBlock = false;
+	result.autoGrid = false;
+	resolved = result;
+
+	return CUDAError();
+}
+
+CUDAError validateLaunchConfig(const CUDALaunchConfig &config, int maxActiveBlocksPerSM, const CUDADeviceProperties &props) {
+	const CUDADim3 &block = config.block;
+	const CUDADim3 &grid = config.grid;
+
+	if (block.count() == 0 || grid.count() == 0) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDALaunchConfig_ERROR_EMPTY_LAUNCH", "");
+	}
+
+	if (props.maxThreadsPerBlock > 0 && block.count() > SizeType(props.maxThreadsPerBlock)) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDALaunchConfig_ERROR_BLOCK_TOO_BIG", "");
+	}
+
+	const unsigned int blockDims[3] = { block.x, block.y, block.z };
+	const unsigned int gridDims[3] = { grid.x, grid.y, grid.z };
+	for (int i = 0; i < 3; ++i) {
+		if (props.maxBlockDim[i] > 0 && blockDims[i] > unsigned(props.maxBlockDim[i])) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDALaunchConfig_ERROR_BLOCK_DIM_TOO_BIG", "");
+		}
+		if (props.maxGridDim[i] > 0 && gridDims[i] > unsigned(props.maxGridDim[i])) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDALaunchConfig_ERROR_GRID_DIM_TOO_BIG", "");
+		}
+	}
+
+	const int sharedMemLimit = std::max(props.maxSharedMemPerBlock, props.maxSharedMemPerBlockOptin);
+	if (sharedMemLimit > 0 && config.dynamicSharedMemBytes > unsigned(sharedMemLimit)) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDALaunchConfig_ERROR_SHARED_MEMORY_TOO_BIG", "");
+	}
+
+	if (config.mode == CUDALaunchMode::Cooperative) {
+		if (!props.cooperativeLaunch) {
+			return CUDAError(CUDA_ERROR_NOT_SUPPORTED, "CUDALaunchConfig_ERROR_COOPERATIVE_NOT_SUPPORTED", "");
+		}
+
+		if (maxActiveBlocksPerSM > 0 && grid.count() > SizeType(maxActiveBlocksPerSM) * props.multiProcessorCount) {
+			return CUDAError(CUDA_ERROR_COOPERATIVE_LAUNCH_TOO_LARGE, "CUDALaunchConfig_ERROR_COOPERATIVE_GRID_TOO_BIG", "");
+		}
+	}
+
+	if (config.mode == CUDALaunchMode::Cluster) {
+		if (!props.supportsClusterLaunch()) {
+			return CUDAError(CUDA_ERROR_NOT_SUPPORTED, "CUDALaunchConfig_ERROR_CLUSTER_NOT_SUPPORTED", "");
+		}
+
+		const CUDADim3 &cluster = config.cluster;
+		if (cluster.count() == 0 || grid.x % cluster.x || grid.y % cluster.y || grid.z % cluster.z) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDALaunchConfig_ERROR_GRID_NOT_MULTIPLE_OF_CLUSTER", "");
+		}
+	}
+
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDAOccupancyCache
+===============================================================
+*/
+CUDAError CUDAOccupancyCache::getBlockSize(CUfunction func, CUdevice dev, unsigned int dynamicSharedMemBytes, int &blockSize) {
+	const Key key = { func, dev, 0, dynamicSharedMemBytes };
+	if (findAnswer(key, blockSize)) {
+		return CUDAError();
+	}
+
+	// Threads racing on the same key both ask the driver, they get the same answer anyway.
+	int minGridSize = 0;
+	RETURN_ON_CUDA_ERROR(cuOccupancyMaxPotentialBlockSize(&minGridSize, &blockSize, func, nullptr, dynamicSharedMemBytes, 0));
+	storeAnswer(key, blockSize);
+
+	return CUDAError();
+}
+
+CUDAError CUDAOccupancyCache::getMaxActiveBlocksPerSM(CUfunction func, CUdevice dev, int blockSize, unsigned int dynamicSharedMemBytes, int &numBlocks) {
+	const Key key = { func, dev, blockSize, dynamicSharedMemBytes };
+	if (findAnswer(key, numBlocks)) {
+		return CUDAError();
+	}
+
+	RETURN_ON_CUDA_ERROR(cuOccupancyMaxActiveBlocksPerMultiprocessor(&numBlocks, func, blockSize, dynamicSharedMemBytes));
+	storeAnswer(key, numBlocks);
+
+	return CUDAError();
+}
+
+bool CUDAOccupancyCache::findAnswer(const Key &key, int &answer) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = answers.find(key);
+	if (it == answers.end()) {
+		return false;
+	}
+
+	answer = it->second;
+	return true;
+}
+
+void CUDAOccupancyCache::storeAnswer(const Key &key, int answer) {
+	std::lock_guard<std::mutex> lock(mutex);
+	answers[key] = answer;
+}
+
+void CUDAOccupancyCache::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	answers.clear();
+}
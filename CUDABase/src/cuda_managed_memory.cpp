@@ -0,0 +1,269 @@
+#include <cuda_managed_memory.h>
+#include <cuda_manager.h>
+
+/*
+===============================================================
+CUDADriverManagedMemoryBackend
+===============================================================
+*/
+CUDAError CUDADriverManagedMemoryBackend::allocate(CUDAMemHandle &ptr, SizeType size) {
+	// Not using RETURN_ON_CUDA_ERROR since running out of memory is reported to the caller.
+	return handleCUDAError(cuMemAllocManaged(reinterpret_cast<CUdeviceptr*>(&ptr), size_t(size), CU_MEM_ATTACH_GLOBAL));
+}
+
+CUDAError CUDADriverManagedMemoryBackend::free(CUDAMemHandle ptr) {
+	RETURN_ON_CUDA_ERROR(cuMemFree(static_cast<CUdeviceptr>(ptr)));
+	return CUDAError();
+}
+
+CUDAError CUDADriverManagedMemoryBackend::canPrefetch(CUdevice device, bool &result) {
+	result = false;
+
+	// Prefetches to the host are issued by the device of the current context.
+	if (device == CU_DEVICE_CPU) {
+		RETURN_ON_CUDA_ERROR(cuCtxGetDevice(&device));
+	}
+
+	int concurrentManagedAccess = 0;
+	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&concurrentManagedAccess, CU_DEVICE_ATTRIBUTE_CONCURRENT_MANAGED_ACCESS, device));
+	result = concurrentManagedAccess != 0;
+
+	return CUDAError();
+}
+
+CUDAError CUDADriverManagedMemoryBackend::prefetch(CUDAMemHandle ptr, SizeType size, CUdevice device, CUstream stream) {
+	RETURN_ON_CUDA_ERROR(cuMemPrefetchAsync(static_cast<CUdeviceptr>(ptr), size_t(size), device, stream));
+	return CUDAError();
+}
+
+CUDAError CUDADriverManagedMemoryBackend::advise(CUDAMemHandle ptr, SizeType size, CUmem_advise advice, CUdevice device) {
+	RETURN_ON_CUDA_ERROR(cuMemAdvise(static_cast<CUdeviceptr>(ptr), size_t(size), advice, device));
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDAHostManagedMemoryBackend
+===============================================================
+*/
+CUDAHostManagedMemoryBackend::CUDAHostManagedMemoryBackend() : numLiveBlocks(0), prefetchSupported(true) { }
+
+void CUDAHostManagedMemoryBackend::setCanPrefetch(bool canPrefetch) {
+	std::lock_guard<std::mutex> lock(mutex);
+	prefetchSupported = canPrefetch;
+}
+
+CUDAError CUDAHostManagedMemoryBackend::allocate(CUDAMemHandle &ptr, SizeType size) {
+	RETURN_ON_CUDA_ERROR_HANDLED(hostBackend.allocate(ptr, size));
+
+	std::lock_guard<std::mutex> lock(mutex);
+	++numLiveBlocks;
+
+	return CUDAError();
+}
+
+CUDAError CUDAHostManagedMemoryBackend::free(CUDAMemHandle ptr) {
+	RETURN_ON_CUDA_ERROR_HANDLED(hostBackend.free(ptr));
+
+	std::lock_guard<std::mutex> lock(mutex);
+	--numLiveBlocks;
+
+	return CUDAError();
+}
+
+CUDAError CUDAHostManagedMemoryBackend::canPrefetch(CUdevice device, bool &result) {
+	std::lock_guard<std::mutex> lock(mutex);
+	result = prefetchSupported;
+	return CUDAError();
+}
+
+CUDAError CUDAHostManagedMemoryBackend::prefetch(CUDAMemHandle ptr, SizeType size, CUdevice device, CUstream stream) {
+	std::lock_guard<std::mutex> lock(mutex);
+	prefetches.push_back({ ptr, size, device, stream });
+	return CUDAError();
+}
+
+CUDAError CUDAHostManagedMemoryBackend::advise(CUDAMemHandle ptr, SizeType size, CUmem_advise advice, CUdevice device) {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->advice.push_back({ ptr, size, advice, device });
+	return CUDAError();
+}
+
+std::vector<CUDAHostManagedMemoryBackend::Prefetch> CUDAHostManagedMemoryBackend::getPrefetches() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return prefetches;
+}
+
+std::vector<CUDAHostManagedMemoryBackend::Advice> CUDAHostManagedMemoryBackend::getAdvice() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return advice;
+}
+
+int CUDAHostManagedMemoryBackend::getNumLiveBlocks() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return numLiveBlocks;
+}
+
+/*
+===============================================================
+CUDAManagedAllocator
+===============================================================
+*/
+CUDAManagedAllocator::CUDAManagedAllocator() : backend(nullptr) { }
+
+CUDAError CUDAManagedAllocator::initialize(CUDAManagedMemoryBackend *backend) {
+	this->backend = backend != nullptr ? backend : &driverBackend;
+	return CUDAError();
+}
+
+CUDAError CUDAManagedAllocator::deinitialize() {
+	if (backend == nullptr) {
+		return CUDAError();
+	}
+
+	std::lock_guard<std::mutex> lock(allocationsMutex);
+	for (auto it = allocations.begin(); it != allocations.end(); ++it) {
+		const CUDAMemBlock &memBlock = it->second;
+		stats.recordFree(memBlock.deviceOrdinal, memBlock.size, memBlock.reserved);
+		RETURN_ON_CUDA_ERROR_HANDLED(backend->free(memBlock.ptr));
+	}
+	allocations.clear();
+
+	return CUDAError();
+}
+
+CUDAError CUDAManagedAllocator::allocate(CUDAMemBlock &memBlock) {
+	if (memBlock.size <= 0) {
+		return CUDAError(CUDA_ERROR_UNKNOWN, "CUDAManagedAllocator_ERROR_INVALID_SIZE", "");
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(bindThreadContext());
+
+	// Managed blocks belong to no device, they are accounted to the one the thread uses.
+	const int deviceOrdinal = getThreadDeviceOrdinal();
+	CUDAError err = backend->allocate(memBlock.ptr, memBlock.size);
+	if (err.hasError()) {
+		stats.recordFailedAllocation(deviceOrdinal);
+		return err;
+	}
+	memBlock.reserved = memBlock.size;
+	memBlock.deviceOrdinal = deviceOrdinal;
+	stats.recordAllocation(deviceOrdinal, memBlock.size, memBlock.reserved);
+
+	std::lock_guard<std::mutex> lock(allocationsMutex);
+	allocations[memBlock.ptr] = memBlock;
+
+	return CUDAError();
+}
+
+CUDAError CUDAManagedAllocator::upload(const CUDAMemBlock &memBlock, const void *hostPtr, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	// A plain memcpy would also work, but it would pull every page to the host first.
+	if (stream != NULL) {
+		RETURN_ON_CUDA_ERROR(cuMemcpyHtoDAsync(memBlock.ptr, hostPtr, memBlock.size, stream));
+	} else {
+		RETURN_ON_CUDA_ERROR(cuMemcpyHtoD(memBlock.ptr, hostPtr, memBlock.size));
+	}
+	return CUDAError();
+}
+
+CUDAError CUDAManagedAllocator::download(const CUDAMemBlock &memBlock, void *hostPtr, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	if (stream != NULL) {
+		RETURN_ON_CUDA_ERROR(cuMemcpyDtoHAsync(hostPtr, memBlock.ptr, memBlock.size, stream));
+	} else {
+		RETURN_ON_CUDA_ERROR(cuMemcpyDtoH(hostPtr, memBlock.ptr, memBlock.size));
+	}
+	return CUDAError();
+}
+
+CUDAError CUDAManagedAllocator::uploadChunked(const CUDAMemBlock &memBlock, const void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransferChunks({}, memBlock.size, maxChunkSize, chunks));
+
+	return transfer.upload(memBlock.ptr, hostPtr, chunks, stream);
+}
+
+CUDAError CUDAManagedAllocator::downloadChunked(const CUDAMemBlock &memBlock, void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransferChunks({}, memBlock.size, maxChunkSize, chunks));
+
+	return transfer.download(hostPtr, memBlock.ptr, chunks, stream);
+}
+
+CUDAError CUDAManagedAllocator::free(CUDAMemBlock &memBlock) {
+	{
+		std::lock_guard<std::mutex> lock(allocationsMutex);
+		auto it = allocations.find(memBlock.ptr);
+		if (it == allocations.end()) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAManagedAllocator_ERROR_UNKNOWN_BLOCK", "");
+		}
+		allocations.erase(it);
+	}
+
+	stats.recordFree(memBlock.deviceOrdinal, memBlock.size, memBlock.reserved);
+	RETURN_ON_CUDA_ERROR_HANDLED(backend->free(memBlock.ptr));
+
+	memBlock.ptr = NULL;
+	memBlock.size = 0;
+	memBlock.reserved = 0;
+	memBlock.deviceOrdinal = -1;
+
+	return CUDAError();
+}
+
+CUDAError CUDAManagedAllocator::prefetch(const CUDAMemBlock &memBlock, CUDAMemoryLocation location, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	if (location.kind == CUDAMemoryLocation::Kind::None) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAManagedAllocator_ERROR_NO_PREFETCH_LOCATION", "");
+	}
+
+	CUdevice device = CU_DEVICE_INVALID;
+	RETURN_ON_CUDA_ERROR_HANDLED(getDevice(location, device));
+
+	bool canPrefetch = false;
+	RETURN_ON_CUDA_ERROR_HANDLED(backend->canPrefetch(device, canPrefetch));
+	if (!canPrefetch) {
+		return CUDAError();
+	}
+
+	return backend->prefetch(memBlock.ptr, memBlock.reserved, device, stream);
+}
+
+CUDAError CUDAManagedAllocator::advise(const CUDAMemBlock &memBlock, bool readMostly, CUDAMemoryLocation preferredLocation) {
+	massert(memBlock.size > 0);
+
+	// The device argument is ignored for these two.
+	const CUmem_advise readMostlyAdvice = readMostly ? CU_MEM_ADVISE_SET_READ_MOSTLY : CU_MEM_ADVISE_UNSET_READ_MOSTLY;
+	RETURN_ON_CUDA_ERROR_HANDLED(backend->advise(memBlock.ptr, memBlock.reserved, readMostlyAdvice, CU_DEVICE_CPU));
+
+	if (preferredLocation.kind == CUDAMemoryLocation::Kind::None) {
+		return backend->advise(memBlock.ptr, memBlock.reserved, CU_MEM_ADVISE_UNSET_PREFERRED_LOCATION, CU_DEVICE_CPU);
+	}
+
+	CUdevice device = CU_DEVICE_INVALID;
+	RETURN_ON_CUDA_ERROR_HANDLED(getDevice(preferredLocation, device));
+	return backend->advise(memBlock.ptr, memBlock.reserved, CU_MEM_ADVISE_SET_PREFERRED_LOCATION, device);
+}
+
+void CUDAManagedAllocator::dumpStats(LogLevel level) {
+	stats.dump("CUDAManagedAllocator", level);
+}
+
+CUDAError CUDAManagedAllocator::getDevice(CUDAMemoryLocation location, CUdevice &device) {
+	if (location.kind == CUDAMemoryLocation::Kind::Host) {
+		device = CU_DEVICE_CPU;
+		return CUDAError();
+	}
+
+	massert(location.kind == CUDAMemoryLocation::Kind::Device);
+	RETURN_ON_CUDA_ERROR(cuDeviceGet(&device, location.deviceOrdinal));
+	return CUDAError();
+}
@@ -1,4 +1,7 @@
 #include <cuda_manager.h>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
 #include <sstream>
 
 #include <cuda_buffer.h>
@@ -10,13 +13,15 @@
 CUDADevice
 ===============================================================
 */
-CUDADevice::CUDADevice() : ctx(NULL), linkState(NULL), dev(CU_DEVICE_INVALID), module(NULL), name("unknown device"), totalMem(0) { }
+CUDADevice::CUDADevice() : ctx(NULL), linkState(NULL), dev(CU_DEVICE_INVALID), module(NULL), name("unknown device"), totalMem(0), hostMemoryMode(CUDAHostMemoryMode::Staged) { }
 
 CUDADevice::~CUDADevice() {
 	deinitialize();
 }
 
 CUDAError CUDADevice::deinitialize() {
+	RETURN_ON_CUDA_ERROR_HANDLED(streamPool.deinitialize());
+
 	for (int i = 0; i < streams.size(); ++i) {
 		RETURN_ON_CUDA_ERROR(cuStreamDestroy(streams[i]));
 	}
@@ -29,6 +34,7 @@ CUDAError CUDADevice::deinitialize() {
 
 	if (linkState != NULL) {
 		RETURN_ON_CUDA_ERROR(cuLinkDestroy(linkState));
+		linkState = NULL;
 	}
 
 	if (ctx != NULL) {
@@ -42,12 +48,14 @@ CUDAError CUDADevice::deinitialize() {
 
 	memset(name, 0x0, sizeof(name));
 	totalMem = 0;
+	properties = CUDADeviceProperties();
+	hostMemoryMode = CUDAHostMemoryMode::Staged;
 
 	return CUDAError();
 }
 
 
-CUDAError CUDADevice::initialize(int deviceOridnal, const std::vector<std::string> &ptxFiles, bool useDynamicParallelism) {
+CUDAError CUDADevice::initialize(int deviceOridnal, const std::vector<std::string> &ptxFiles, bool useDynamicParallelism, const CUDAJitCache *jitCache) {
 	RETURN_ON_CUDA_ERROR_HANDLED(deinitialize());
 
 	struct DestructRAII {
@@ -62,29 +70,21 @@ CUDAError CUDADevice::initialize(int deviceOridnal, const std::vector<std::strin
 
 	RETURN_ON_CUDA_ERROR(cuDeviceGet(&dev, deviceOridnal));
 	RETURN_ON_CUDA_ERROR(cuDeviceGetName(name, 128, dev));
-	RETURN_ON_CUDA_ERROR(cuDeviceTotalMem(&totalMem, dev));
-	int supportUVA = false;
-	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&supportUVA, CU_DEVICE_ATTRIBUTE_UNIFIED_ADDRESSING, dev));
-
-	if (!supportUVA) {
-		char errorMsg[256];
-		sprintf_s(errorMsg, "Device %s does not support unified virtual addresing!", name);
-		CUDAError err(CUDA_ERROR_INVALID_DEVICE, errorMsg, "");
-		LOG_CUDA_ERROR(err, LogLevel::Warning);
-		return err;
+	RETURN_ON_CUDA_ERROR_HANDLED(queryDeviceProperties(dev, deviceOridnal, properties));
+	totalMem = properties.totalMem;
+
+	if (!isDeviceSupported(properties)) {
+		CUDABASE_LOG(
+			LogLevel::Warning,
+			"Device %s is not supported! It needs unified virtual addressing and compute capability 5.2 (has %d.%d)",
+			name,
+			properties.computeCapabilityMajor,
+			properties.computeCapabilityMinor
+		);
+		return CUDAError(CUDA_ERROR_INVALID_DEVICE, "CUDADevice_ERROR_UNSUPPORTED_DEVICE", "");
 	}
 
-	int cpMajor, cpMinor;
-	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&cpMajor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, dev));
-	RETURN_ON_CUDA_ERROR(cuDeviceGetAttribute(&cpMinor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, dev));
-
-	if (cpMajor < 5 || (cpMajor == 5 && cpMinor < 2)) {
-		char errorMsg[256];
-		sprintf_s(errorMsg, "Device %s have compute capability %d.%d. Minimum supported is 5.2!", name, cpMajor, cpMinor);
-		CUDAError err(CUDA_ERROR_INVALID_DEVICE, errorMsg, "");
-		LOG_CUDA_ERROR(err, LogLevel::Warning);
-		return err;
-	}
+	hostMemoryMode = chooseHostMemoryMode(properties);
 
 	// Create a context for the device.
 	// We create a contex for each device and associate it with it.
@@ -95,7 +95,7 @@ CUDAError CUDADevice::initialize(int deviceOridnal, const std::vector<std::strin
 	);
 
 	// cuCtxCreate pushes the context onto the stack, so safe to load the module for this context
-	loadModule(ptxFiles, useDynamicParallelism);
+	RETURN_ON_CUDA_ERROR_HANDLED(loadModule(ptxFiles, useDynamicParallelism, jitCache));
 
 	const int numDefaultStreams = static_cast<int>(CUDADefaultStreamsEnumeration::Count);
 	CUstream defaultStreams[numDefaultStreams];
@@ -104,10 +104,13 @@ CUDAError CUDADevice::initialize(int deviceOridnal, const std::vector<std::strin
 		streams.push_back(defaultStreams[i]);
 	}
 
-	Logger::log(LogLevel::Info,
-		"Device %s initialized! Total mem: %.2fGB",
+	RETURN_ON_CUDA_ERROR_HANDLED(streamPool.initialize(&streamBackend));
+
+	CUDABASE_LOG(LogLevel::Info,
+		"Device %s initialized! Total mem: %.2fGB. Pinned buffers: %s",
 		name,
-		totalMem / GB_IN_BYTES
+		totalMem / GB_IN_BYTES,
+		hostMemoryMode == CUDAHostMemoryMode::Mapped ? "mapped" : "staged"
 	);
 
 	destructRAII.hasError = false;
@@ -119,10 +122,22 @@ CUdevice CUDADevice::getDevice() const {
 	return dev;
 }
 
+CUcontext CUDADevice::getContext() const {
+	return ctx;
+}
+
 CUmodule CUDADevice::getModule() const {
 	return module;
 }
 
+const CUDADeviceProperties &CUDADevice::getProperties() const {
+	return properties;
+}
+
+CUDAHostMemoryMode CUDADevice::getHostMemoryMode() const {
+	return hostMemoryMode;
+}
+
 CUstream CUDADevice::getDefaultStream(CUDADefaultStreamsEnumeration defStreamEnum) const {
 	if (dev == CU_DEVICE_INVALID) {
 		return NULL;
@@ -137,6 +152,10 @@ CUstream CUDADevice::getDefaultStream(CUDADefaultStreamsEnumeration defStreamEnu
 	return streams[streamIdx];
 }
 
+CUDAStreamPool &CUDADevice::getStreamPool() const {
+	return streamPool;
+}
+
 CUDAError CUDADevice::getTotalMemory(SizeType &result) const {
 	if (dev == CU_DEVICE_INVALID) {
 		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDADevice_ERROR_NOT_INITIALIZED", "");
@@ -166,17 +185,27 @@ CUDAError CUDADevice::getFreeMemory(SizeType &result) const {
 	return CUDAError();
 }
 
+/// Ordinal of the device the calling thread used last. See bindThreadContext.
+static thread_local int threadDeviceOrdinal = -1;
+
 CUDAError CUDADevice::use() const {
 	if (dev == CU_DEVICE_INVALID) {
 		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDADevice_ERROR_NOT_INITIALIZED", "");
 	}
 
 	RETURN_ON_CUDA_ERROR(cuCtxSetCurrent(ctx));
+	threadDeviceOrdinal = properties.ordinal;
 
 	return CUDAError();
 }
 
-CUDAError CUDADevice::loadModule(const std::vector<std::string> &ptxFiles, bool useDynamicParallelism) {
+CUDAError CUDADevice::loadModule(const std::vector<std::string> &ptxFiles, bool useDynamicParallelism, const CUDAJitCache *jitCache) {
+#ifdef CUDA_HOST_BACKEND
+	// Host kernels are registered C++ functions and every module sees all of them, there is no PTX to link.
+	RETURN_ON_CUDA_ERROR(cuModuleLoadData(&module, nullptr));
+	return CUDAError();
+#endif // CUDA_HOST_BACKEND
+
 #ifdef CUDA_DEBUG
 	int generateDebugInfo = 1;
 #else // !CUDA_DEBUG
@@ -187,11 +216,57 @@ CUDAError CUDADevice::loadModule(const std::vector<std::string> &ptxFiles, bool
 	CUjit_option options[NUM_LINK_OPTIONS] = { CU_JIT_GENERATE_DEBUG_INFO };
 	void *optionValues[] = { (void*)&generateDebugInfo };
 
-	CUlinkState linkState;
+	static const char *deviceRuntimeLibrary = CUDA_LIB_PATH "/cudadevrt.lib";
+
+	// The sources are needed for the cache key anyway, so link them from memory afterwards.
+	std::vector<std::string> ptxSources(ptxFiles.size());
+	for (int i = 0; i < ptxFiles.size(); ++i) {
+		if (!CUDAJitCache::readFile(ptxFiles[i], ptxSources[i])) {
+			CUDABASE_LOG(LogLevel::Error, "Failed to read PTX file %s", ptxFiles[i].c_str());
+			return CUDAError(CUDA_ERROR_FILE_NOT_FOUND, "CUDADevice_ERROR_PTX_NOT_FOUND", "");
+		}
+	}
+
+	uint64_t cacheKey = 0;
+	const bool useCache = jitCache != nullptr && jitCache->isEnabled();
+	if (useCache) {
+		CUDAJitCacheKeyDesc keyDesc;
+		keyDesc.ptxSources = &ptxSources;
+		keyDesc.linkOptionValues.push_back(generateDebugInfo);
+		keyDesc.libraryFingerprint = useDynamicParallelism ? CUDAJitCache::getFileFingerprint(deviceRuntimeLibrary) : "";
+		keyDesc.computeCapabilityMajor = properties.computeCapabilityMajor;
+		keyDesc.computeCapabilityMinor = properties.computeCapabilityMinor;
+		keyDesc.useDynamicParallelism = useDynamicParallelism;
+		RETURN_ON_CUDA_ERROR(cuDriverGetVersion(&keyDesc.driverVersion));
+		cacheKey = CUDAJitCache::computeKey(keyDesc);
+
+		std::vector<char> cachedCubin;
+		if (jitCache->load(cacheKey, cachedCubin)) {
+			if (cuModuleLoadData(&module, cachedCubin.data()) == CUDA_SUCCESS) {
+				CUDABASE_LOG(LogLevel::Debug, "Loaded module for device %s from the JIT cache", name);
+				return CUDAError();
+			}
+
+			// Valid file the driver does not accept anymore. Drop it and link again.
+			module = NULL;
+			jitCache->invalidate(cacheKey);
+		}
+	}
+
 	RETURN_ON_CUDA_ERROR(cuLinkCreate(NUM_LINK_OPTIONS, options, optionValues, &linkState));
 	CUjitInputType moduleType = CU_JIT_INPUT_PTX;
-	for (int i = 0; i < ptxFiles.size(); ++i) {
-		RETURN_ON_CUDA_ERROR(cuLinkAddFile(linkState, moduleType, ptxFiles[i].c_str(), 0, nullptr, nullptr));
+	for (int i = 0; i < ptxSources.size(); ++i) {
+		// PTX has to be NUL terminated.
+		RETURN_ON_CUDA_ERROR(cuLinkAddData(
+			linkState,
+			moduleType,
+			(void*)ptxSources[i].c_str(),
+			ptxSources[i].size() + 1,
+			ptxFiles[i].c_str(),
+			0,
+			nullptr,
+			nullptr
+		));
 	}
 
 	if (useDynamicParallelism) {
@@ -199,7 +274,7 @@ CUDAError CUDADevice::loadModule(const std::vector<std::string> &ptxFiles, bool
 		RETURN_ON_CUDA_ERROR(cuLinkAddFile(
 			linkState,
 			libType,
-			CUDA_LIB_PATH "/cudadevrt.lib",
+			deviceRuntimeLibrary,
 			0,
 			nullptr,
 			nullptr
@@ -212,7 +287,164 @@ CUDAError CUDADevice::loadModule(const std::vector<std::string> &ptxFiles, bool
 
 	RETURN_ON_CUDA_ERROR(cuModuleLoadData(&module, outCubin));
 
+	// The cubin is owned by the link state, store it before destroying it.
+	if (useCache) {
+		jitCache->store(cacheKey, outCubin, outSize);
+	}
+
 	RETURN_ON_CUDA_ERROR(cuLinkDestroy(linkState));
+	linkState = NULL;
+
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDADefaultDeviceDriver
+===============================================================
+*/
+CUDADefaultDeviceDriver::CUDADefaultDeviceDriver() : jitCache(nullptr), useDynamicParallelism(false) { }
+
+void CUDADefaultDeviceDriver::setModule(const std::vector<std::string> &ptxFiles, bool useDynamicParallelism, const CUDAJitCache *jitCache) {
+	this->ptxFiles = ptxFiles;
+	this->useDynamicParallelism = useDynamicParallelism;
+	this->jitCache = jitCache;
+}
+
+CUDAError CUDADefaultDeviceDriver::getDeviceCount(int &count) {
+	RETURN_ON_CUDA_ERROR(cuDeviceGetCount(&count));
+	return CUDAError();
+}
+
+CUDAError CUDADefaultDeviceDriver::queryDevice(int ordinal, CUDADeviceProperties &props) {
+	CUdevice dev;
+	RETURN_ON_CUDA_ERROR(cuDeviceGet(&dev, ordinal));
+	RETURN_ON_CUDA_ERROR_HANDLED(queryDeviceProperties(dev, ordinal, props));
+	return CUDAError();
+}
+
+CUDAError CUDADefaultDeviceDriver::initializeDevice(int ordinal, CUDADevice &device) {
+	return device.initialize(ordinal, ptxFiles, useDynamicParallelism, jitCache);
+}
+
+CUDAError CUDADefaultDeviceDriver::deinitializeDevice(CUDADevice &device) {
+	return device.deinitialize();
+}
+
+/*
+===============================================================
+Kernel launch
+===============================================================
+*/
+CUDAError resolveKernelLaunch(CUfunction func, const CUDALaunchConfig &config, CUDALaunchConfig &resolved) {
+	RETURN_ON_CUDA_ERROR_HANDLED(bindThreadContext());
+
+	CUDAManager &cudaman = getCUDAManager();
+	const CUDADevice *device = cudaman.getCurrentDevice();
+	if (device == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_CONTEXT, "CUDAKernel_ERROR_NO_CURRENT_DEVICE", "");
+	}
+
+	const CUDADeviceProperties &props = device->getProperties();
+	CUDAOccupancyCache &occupancy = cudaman.getOccupancyCache();
+
+	int occupancyBlockSize = 0;
+	if (config.autoBlock) {
+		RETURN_ON_CUDA_ERROR_HANDLED(occupancy.getBlockSize(func, device->getDevice(), config.dynamicSharedMemBytes, occupancyBlockSize));
+	}
+
+	// Residency depends on the block size, so resolve the block first and the cooperative grid after.
+	RETURN_ON_CUDA_ERROR_HANDLED(resolveLaunchConfig(config, occupancyBlockSize, 0, props, resolved));
+
+	int maxActiveBlocksPerSM = 0;
+	if (config.mode == CUDALaunchMode::Cooperative) {
+		RETURN_ON_CUDA_ERROR_HANDLED(occupancy.getMaxActiveBlocksPerSM(
+			func,
+			device->getDevice(),
+			int(resolved.block.count()),
+			config.dynamicSharedMemBytes,
+			maxActiveBlocksPerSM
+		));
+
+		CUDALaunchConfig blockResolved = config;
+		blockResolved.block = resolved.block;
+		blockResolved.autoBlock = false;
+		RETURN_ON_CUDA_ERROR_HANDLED(resolveLaunchConfig(blockResolved, 0, maxActiveBlocksPerSM, props, resolved));
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(validateLaunchConfig(resolved, maxActiveBlocksPerSM, props));
+
+	// Anything above the default limit has to be opted in per kernel.
+	if (resolved.dynamicSharedMemBytes > unsigned(props.maxSharedMemPerBlock)) {
+		RETURN_ON_CUDA_ERROR(cuFuncSetAttribute(func, CU_FUNC_ATTRIBUTE_MAX_DYNAMIC_SHARED_SIZE_BYTES, resolved.dynamicSharedMemBytes));
+	}
+
+	return CUDAError();
+}
+
+CUDAError launchKernel(CUfunction func, void **params, const CUDALaunchConfig &config, CUstream stream, const char *kernelName) {
+	CUDALaunchConfig resolved;
+	RETURN_ON_CUDA_ERROR_HANDLED(resolveKernelLaunch(func, config, resolved));
+
+	CUDAManager &cudaman = getCUDAManager();
+	CUDAProfiler &profiler = cudaman.getProfiler();
+	CUDAProfiler::Range profileRange;
+	RETURN_ON_CUDA_ERROR_HANDLED(profiler.begin(stream, profileRange));
+
+	const CUDADim3 &grid = resolved.grid;
+	const CUDADim3 &block = resolved.block;
+	switch (resolved.mode) {
+	case CUDALaunchMode::Cooperative:
+		RETURN_ON_CUDA_ERROR(cuLaunchCooperativeKernel(
+			func,
+			grid.x, grid.y, grid.z,
+			block.x, block.y, block.z,
+			resolved.dynamicSharedMemBytes,
+			stream,
+			params
+		));
+		break;
+	case CUDALaunchMode::Cluster: {
+#if CUDA_VERSION >= 12000
+		CUlaunchAttribute clusterAttribute;
+		clusterAttribute.id = CU_LAUNCH_ATTRIBUTE_CLUSTER_DIMENSION;
+		clusterAttribute.value.clusterDim.x = resolved.cluster.x;
+		clusterAttribute.value.clusterDim.y = resolved.cluster.y;
+		clusterAttribute.value.clusterDim.z = resolved.cluster.z;
+
+		CUlaunchConfig launchConfig = {};
+		launchConfig.gridDimX = grid.x;
+		launchConfig.gridDimY = grid.y;
+		launchConfig.gridDimZ = grid.z;
+		launchConfig.blockDimX = block.x;
+		launchConfig.blockDimY = block.y;
+		launchConfig.blockDimZ = block.z;
+		launchConfig.sharedMemBytes = resolved.dynamicSharedMemBytes;
+		launchConfig.hStream = stream;
+		launchConfig.attrs = &clusterAttribute;
+		launchConfig.numAttrs = 1;
+
+		RETURN_ON_CUDA_ERROR(cuLaunchKernelEx(&launchConfig, func, params, nullptr));
+#else // CUDA_VERSION < 12000
+		return CUDAError(CUDA_ERROR_NOT_SUPPORTED, "CUDAKernel_ERROR_CLUSTER_LAUNCH_NEEDS_CUDA_12", "");
+#endif // CUDA_VERSION >= 12000
+		break;
+	}
+	case CUDALaunchMode::Default:
+	default:
+		RETURN_ON_CUDA_ERROR(cuLaunchKernel(
+			func,
+			grid.x, grid.y, grid.z,
+			block.x, block.y, block.z,
+			resolved.dynamicSharedMemBytes,
+			stream,
+			params,
+			nullptr
+		));
+		break;
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(profiler.end(kernelName, stream, profileRange));
 
 	return CUDAError();
 }
@@ -234,42 +466,31 @@ void CUDAFunction::initialize(CUmodule module, const char *name) {
 		func = NULL;
 	}
 
+	kernelParams.reserve(maxParams);
+	kernelParamSizes.reserve(maxParams);
+
 	CUDAError err = handleCUDAError(cuModuleGetFunction(&func, module, name));
 	if (err.hasError()) {
 		LOG_CUDA_ERROR(err, LogLevel::Error);
-		Logger::log(LogLevel::Error, "Failed to load function %s", name);
+		CUDABASE_LOG(LogLevel::Error, "Failed to load function %s", name);
 	}
 	successfulLoading = !err.hasError();
 
-#ifdef TIME_KERNEL_EXECUTION
 	kernelName = name;
-#endif
 }
 
 CUDAError CUDAFunction::launch(unsigned int threadCount, CUstream stream) {
-#ifdef TIME_KERNEL_EXECUTION
-	Timer kernelTimer;
-#endif
-
-	const int blockDim = 128;
-	const int gridDim = threadCount / blockDim + (threadCount % blockDim != 0);
-	RETURN_ON_CUDA_ERROR(cuLaunchKernel(
-		getFunction(),
-		gridDim, 1, 1,
-		blockDim, 1, 1,
-		0,
-		stream,
-		getParams(),
-		nullptr
-	));
+	return launch(CUDALaunchConfig::forThreads(CUDADim3(threadCount)), stream);
+}
 
-#ifdef TIME_KERNEL_EXECUTION
-	RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream));
-	float kernelTimeMS = kernelTimer.time();
-	Logger::log(LogLevel::InfoFancy, "Execution of CUDA kernel \"%s\" took %.2fms", kernelName.c_str(), kernelTimeMS);
-#endif
+CUDAError CUDAFunction::launch(const CUDALaunchConfig &config, CUstream stream) {
+	if (!successfulLoading) {
+		CUDAError err(CUDA_ERROR_NOT_INITIALIZED, "HOST Error", "Launching non-loaded funtion!");
+		LOG_CUDA_ERROR_RATE_LIMITED(err, LogLevel::Warning, 10);
+		return err;
+	}
 
-	return CUDAError();
+	return launchKernel(func, getParams(), config, stream, kernelName.c_str());
 }
 
 CUDAError CUDAFunction::launchSync(unsigned int threadCount, CUstream stream) {
@@ -280,9 +501,18 @@ CUDAError CUDAFunction::launchSync(unsigned int threadCount, CUstream stream) {
 	return CUDAError();
 }
 
+CUDAError CUDAFunction::launchSync(const CUDALaunchConfig &config, CUstream stream) {
+	RETURN_ON_CUDA_ERROR_HANDLED(launch(config, stream));
+
+	RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream));
+
+	return CUDAError();
+}
+
 void CUDAFunction::clearParams() {
 	currParam = params;
 	kernelParams.clear();
+	kernelParamSizes.clear();
 }
 
 /* 
@@ -304,35 +534,81 @@ CUDAError CUDAManager::initialize(const std::vector<std::string> &ptxFiles, bool
 	RETURN_ON_CUDA_ERROR(cuInit(0));
 	RETURN_ON_CUDA_ERROR(cuDriverGetVersion(&cudaVersion));
 
-	Logger::log(LogLevel::Info, "CUDA version: %d.%d", cudaVersion / 1000, (cudaVersion % 100) / 10);
+#ifdef TIME_KERNEL_EXECUTION
+	profiler.setEnabled(true);
+#endif
+
+	CUDABASE_LOG(LogLevel::Info, "CUDA version: %d.%d", cudaVersion / 1000, (cudaVersion % 100) / 10);
 
 	RETURN_ON_CUDA_ERROR_HANDLED(initializeDevices(ptxFiles, useDynamicParallelism));
 
-	if (devices.size() == 0) {
+	if (devices.getNumDevices() == 0) {
 		deinitialize();
-		Logger::log(LogLevel::Info, "Sorry! No compatible CUDA devices! Exiting...");
+		CUDABASE_LOG(LogLevel::Info, "Sorry! No compatible CUDA devices! Exiting...");
 		return CUDAError(CUDA_ERROR_INVALID_DEVICE, "No compatible CUDA devices", "");
 	}
 
 	RETURN_ON_CUDA_ERROR_HANDLED(initializeAllocators());
 
+	const char *envStatsInterval = getenv("CUDABASE_ALLOCATOR_STATS_INTERVAL_MS");
+	if (envStatsInterval != nullptr && atoi(envStatsInterval) > 0) {
+		setAllocatorStatsInterval(unsigned(atoi(envStatsInterval)));
+	}
+
 	initialized = true;
 
 	return CUDAError();
 }
 
-const std::vector<CUDADevice> &CUDAManager::getDevices() const {
+CUDADeviceRegistry &CUDAManager::getDevices() {
 	return devices;
 }
 
+const CUDADevice *CUDAManager::getCurrentDevice() const {
+	CUdevice currentDev;
+	if (cuCtxGetDevice(&currentDev) != CUDA_SUCCESS) {
+		return nullptr;
+	}
+
+	return devices.findReadyDevice(currentDev);
+}
+
+void CUDAManager::dumpAllocatorStats(LogLevel level) {
+	defaultAllocator.dumpStats(level);
+	virtualAllocator.dumpStats(level);
+	fallbackAllocator.dumpStats(level);
+	managedAllocator.dumpStats(level);
+}
+
+void CUDAManager::setAllocatorStatsInterval(unsigned int intervalMs) {
+	if (intervalMs == 0) {
+		allocatorStatsReporter.stop();
+		return;
+	}
+
+	allocatorStatsReporter.start(intervalMs, [this]() {
+		dumpAllocatorStats(LogLevel::Info);
+	});
+}
+
 CUDAError CUDAManager::deinitialize() {
+	// The reporter reads the allocators.
+	allocatorStatsReporter.stop();
+
+	// Events of pending ranges belong to the device contexts.
+	profiler.deinitialize();
+
 	defaultAllocator.deinitialize();
+	// Its virtual tier lives in the virtual allocator.
+	fallbackAllocator.deinitialize();
 	virtualAllocator.deinitialize();
+	managedAllocator.deinitialize();
+	pinnedHostPool.deinitialize();
+	occupancyCache.clear();
+	peerAccess.deinitialize();
 
 	// Destroy devices last as they hold the contexts
-	for (int i = 0; i < devices.size(); ++i) {
-		devices[i].deinitialize();
-	}
+	devices.deinitialize();
 
 	initialized = false;
 
@@ -340,45 +616,58 @@ CUDAError CUDAManager::deinitialize() {
 }
 
 CUDAError CUDAManager::initializeDevices(const std::vector<std::string> &ptxFiles, bool useDynamicParallelism) {
-	int deviceCount = 0;
-	RETURN_ON_CUDA_ERROR(cuDeviceGetCount(&deviceCount));
+	deviceDriver.setModule(ptxFiles, useDynamicParallelism, &jitCache);
+	peerTopology.initialize(&devices);
+	peerAccess.initialize(&peerTopology);
+
+	// Only enumerate here. Contexts, modules and streams are created on first use of a device.
+	RETURN_ON_CUDA_ERROR_HANDLED(devices.discover(&deviceDriver, getenv("CUDABASE_VISIBLE_DEVICES")));
 
-	if (deviceCount == 0) {
-		Logger::log(LogLevel::Warning, "No CUDA devices found!");
+	if (devices.getNumDevices() == 0) {
+		CUDABASE_LOG(LogLevel::Warning, "No CUDA devices found!");
 		return CUDAError();
 	}
 
-	devices.resize(deviceCount);
-	int i = 0;
-	for (int ordinal = 0; ordinal < deviceCount; ++i, ++ordinal) {
-		CUDAError err = devices[i].initialize(ordinal, ptxFiles, useDynamicParallelism);
-		if (err.hasError()) {
-			--i;
-		}
+	for (int i = 0; i < devices.getNumDevices(); ++i) {
+		const CUDADeviceProperties &props = devices.getProperties(i);
+		CUDABASE_LOG(
+			LogLevel::Info,
+			"Found device %d with compute capability %d.%d and %.2fGB",
+			props.ordinal,
+			props.computeCapabilityMajor,
+			props.computeCapabilityMinor,
+			props.totalMem / GB_IN_BYTES
+		);
 	}
 
-	if (i < devices.size()) {
-		devices.resize(i);
+	// Processes which use every GPU anyway can bring them all up at once.
+	if (getenv("CUDABASE_EAGER_DEVICE_INIT") != nullptr) {
+		RETURN_ON_CUDA_ERROR_HANDLED(devices.initializeAll());
 	}
 
 	return CUDAError();
 }
 
 CUDAError CUDAManager::initializeAllocators() {
-	RETURN_ON_CUDA_ERROR_HANDLED(defaultAllocator.initialize());
+	RETURN_ON_CUDA_ERROR_HANDLED(defaultAllocator.initialize(nullptr, &eventFenceBackend));
 	RETURN_ON_CUDA_ERROR_HANDLED(virtualAllocator.initialize());
+	RETURN_ON_CUDA_ERROR_HANDLED(fallbackAllocator.initialize(&virtualAllocator));
+	RETURN_ON_CUDA_ERROR_HANDLED(managedAllocator.initialize());
+	RETURN_ON_CUDA_ERROR_HANDLED(pinnedHostPool.initialize(&pinnedHostBackend, &eventFenceBackend));
 	return CUDAError();
 }
 
 CUDAError CUDAManager::testSystem() {
 	const int deviceToUseIdx = 0;
-	auto &dev = devices[deviceToUseIdx];
-	dev.use();
+	const CUDADevice *device = nullptr;
+	RETURN_ON_CUDA_ERROR_HANDLED(devices.getDevice(deviceToUseIdx, device));
+	const CUDADevice &dev = *device;
+	RETURN_ON_CUDA_ERROR_HANDLED(dev.use());
 
 	int arrSize = 1 << 20; // ~ 1 million
 	arrSize = arrSize + (arrSize % 100 ? (100 - arrSize % 100) : 0);
 
-	Logger::log(
+	CUDABASE_LOG(
 		LogLevel::Info,
 		"Starting following test:\n"
 		"\tTwo int arrays each with %ld elements will be added\n"
@@ -417,20 +706,20 @@ CUDAError CUDAManager::testSystem() {
 	CUDAFunction adder(dev.getModule(), "adder");
 	RETURN_ON_CUDA_ERROR_HANDLED(adder.addParams(arrA_d.handle(), arrB_d.handle(), result_d.handle()));
 
-	CUstream stream;
-	RETURN_ON_CUDA_ERROR(cuStreamCreate(&stream, 0));
+	CUDAStreamLease stream;
+	RETURN_ON_CUDA_ERROR_HANDLED(dev.getStreamPool().acquire(CUDAStreamPriority::Normal, stream));
 
 	Timer kernelTimer;
-	adder.launch(arrSize, stream);
+	adder.launch(arrSize, stream.get());
 
 	// We only need to wait on the last stream as it's the last computation sent to the device
-	RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream));
+	RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream.get()));
 	const float kernelTime = kernelTimer.time();
 
 	RETURN_ON_CUDA_ERROR_HANDLED(result_d.download(result_h));
 	const float gpuTime = gpuTimer.time();
 
-	Logger::log(LogLevel::InfoFancy, "GPUTime: %.2fms with kernel execution time: %.2fms\n", gpuTime, kernelTime);
+	CUDABASE_LOG(LogLevel::InfoFancy, "GPUTime: %.2fms with kernel execution time: %.2fms\n", gpuTime, kernelTime);
 
 	for (int i = 0; i < arrSize; ++i) {
 		massert(result_h[i] == 4 * i + 1);
@@ -441,7 +730,7 @@ CUDAError CUDAManager::testSystem() {
 		result_h[i] = arrA_h[i] + arrB_h[i];
 	}
 	const float cpuTime = cpuTimer.time();
-	Logger::log(LogLevel::InfoFancy, "CPU execution time: %.2fms", cpuTime);
+	CUDABASE_LOG(LogLevel::InfoFancy, "CPU execution time: %.2fms", cpuTime);
 
 	return CUDAError();
 }
@@ -452,28 +741,86 @@ CUDADefaultAllocator &CUDAManager::getAllocator<CUDADefaultAllocator>() { return
 template <>
 CUDAVirtualAllocator &CUDAManager::getAllocator<CUDAVirtualAllocator>() { return virtualAllocator; }
 
-static CUDAManager *_cudamanagerSingleton = nullptr;
+template <>
+CUDAFallbackAllocator &CUDAManager::getAllocator<CUDAFallbackAllocator>() { return fallbackAllocator; }
+
+template <>
+CUDAManagedAllocator &CUDAManager::getAllocator<CUDAManagedAllocator>() { return managedAllocator; }
+
+CUDAPinnedHostPool &CUDAManager::getPinnedHostPool() {
+	return pinnedHostPool;
+}
+
+CUDAOccupancyCache &CUDAManager::getOccupancyCache() {
+	return occupancyCache;
+}
+
+CUDAProfiler &CUDAManager::getProfiler() {
+	return profiler;
+}
+
+CUDAJitCache &CUDAManager::getJitCache() {
+	return jitCache;
+}
+
+CUDAPeerAccess &CUDAManager::getPeerAccess() {
+	return peerAccess;
+}
+
+/// Serializes initializeCUDAManager and deinitializeCUDAManager.
+static std::mutex _cudamanagerMutex;
+static std::atomic<CUDAManager*> _cudamanagerSingleton(nullptr);
 
 bool initializeCUDAManager(const std::vector<std::string> &ptxFiles, bool useDynamicParallelism) {
-	if (_cudamanagerSingleton == nullptr) {
-		_cudamanagerSingleton = new CUDAManager(ptxFiles, useDynamicParallelism);
-		if (!_cudamanagerSingleton->initialized) {
-			_cudamanagerSingleton = nullptr;
+	std::lock_guard<std::mutex> lock(_cudamanagerMutex);
+	if (_cudamanagerSingleton.load() == nullptr) {
+		CUDAManager *manager = new CUDAManager(ptxFiles, useDynamicParallelism);
+		if (!manager->initialized) {
+			delete manager;
 			return false;
 		}
+
+		// Published only once fully initialized, so other threads never see a half built manager.
+		_cudamanagerSingleton.store(manager, std::memory_order_release);
 	}
 	return true;
 }
 
 void deinitializeCUDAManager() {
-	if (_cudamanagerSingleton == nullptr) {
+	std::lock_guard<std::mutex> lock(_cudamanagerMutex);
+	CUDAManager *manager = _cudamanagerSingleton.exchange(nullptr);
+	if (manager == nullptr) {
 		return;
 	}
 
-	delete _cudamanagerSingleton;
-	_cudamanagerSingleton = nullptr;
+	delete manager;
 }
 
 CUDAManager &getCUDAManager() {
-	return *_cudamanagerSingleton;
+	return *_cudamanagerSingleton.load(std::memory_order_acquire);
+}
+
+bool isCUDAManagerInitialized() {
+	return _cudamanagerSingleton.load(std::memory_order_acquire) != nullptr;
+}
+
+CUDAError bindThreadContext() {
+	CUcontext ctx = NULL;
+	if (!isCUDAManagerInitialized() || (cuCtxGetCurrent(&ctx) == CUDA_SUCCESS && ctx != NULL)) {
+		return CUDAError();
+	}
+
+	CUDADeviceRegistry &devices = getCUDAManager().getDevices();
+	const CUDADevice *device = nullptr;
+	if (threadDeviceOrdinal < 0 || devices.getDeviceByOrdinal(threadDeviceOrdinal, device).hasError()) {
+		RETURN_ON_CUDA_ERROR_HANDLED(devices.findDevice(CUDADeviceRequirements(), device));
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(device->use());
+
+	return CUDAError();
+}
+
+int getThreadDeviceOrdinal() {
+	return threadDeviceOrdinal;
 }
@@ -6,17 +6,38 @@
 CUDADefaultAllocator
 ===============================================================
 */
-CUDAError CUDADefaultAllocator::initialize() {
+static CUDAPoolStream getPoolStream(CUstream stream) {
+	// Without a current context (f.e. host backed pool) all blocks share the NULL context key.
+	CUcontext ctx = NULL;
+	if (cuCtxGetCurrent(&ctx) != CUDA_SUCCESS) {
+		ctx = NULL;
+	}
+
+	return CUDAPoolStream(ctx, stream);
+}
+
+CUDAError CUDADefaultAllocator::initialize(CUDAMemoryBackend *backend, CUDAFenceBackend *fenceBackend) {
+	if (backend == nullptr) {
+		backend = &deviceBackend;
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(pool.initialize(backend, CUDACachingPool::DEFAULT_MAX_CACHED_BYTES, fenceBackend));
+
 	return CUDAError();
 }
 
 CUDAError CUDADefaultAllocator::deinitialize() {
-	// TODO: we need the context also
-	for (auto it = allocations.begin(); it != allocations.end(); ++it) {
-		RETURN_ON_CUDA_ERROR_HANDLED(internalFree(**it));
+	{
+		std::lock_guard<std::mutex> lock(allocationsMutex);
+		// TODO: we need the context also
+		for (auto it = allocations.begin(); it != allocations.end(); ++it) {
+			RETURN_ON_CUDA_ERROR_HANDLED(internalFree(it->second));
+		}
+
+		allocations.clear();
 	}
 
-	allocations.clear();
+	RETURN_ON_CUDA_ERROR_HANDLED(pool.deinitialize());
 
 	return CUDAError();
 }
@@ -26,9 +47,23 @@ CUDAError CUDADefaultAllocator::allocate(CUDAMemBlock &memBlock) {
 		return CUDAError(CUDA_ERROR_UNKNOWN, "CUDADefaultAllocator_ERROR_INVALID_SIZE", "");
 	}
 
-	RETURN_ON_CUDA_ERROR(cuMemAlloc(reinterpret_cast<CUdeviceptr*>(&memBlock.ptr), size_t(memBlock.size)));
+	RETURN_ON_CUDA_ERROR_HANDLED(bindThreadContext());
 
-	allocations.insert(&memBlock);
+	const CUDAPoolStream poolStream = getPoolStream(memBlock.stream);
+	const int deviceOrdinal = getThreadDeviceOrdinal();
+	SizeType blockSize = 0;
+	CUDAError err = pool.allocate(memBlock.ptr, blockSize, memBlock.size, poolStream);
+	if (err.hasError()) {
+		stats.recordFailedAllocation(deviceOrdinal);
+		return err;
+	}
+	memBlock.reserved = blockSize;
+	memBlock.ctx = poolStream.ctx;
+	memBlock.deviceOrdinal = deviceOrdinal;
+	stats.recordAllocation(deviceOrdinal, memBlock.size, blockSize);
+
+	std::lock_guard<std::mutex> lock(allocationsMutex);
+	allocations[memBlock.ptr] = memBlock;
 
 	return CUDAError();
 }
@@ -55,21 +90,82 @@ CUDAError CUDADefaultAllocator::download(const CUDAMemBlock &memBlock, void *hos
 	return CUDAError();
 }
 
+CUDAError CUDADefaultAllocator::uploadChunked(const CUDAMemBlock &memBlock, const void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransferChunks({}, memBlock.size, maxChunkSize, chunks));
+
+	return transfer.upload(memBlock.ptr, hostPtr, chunks, stream);
+}
+
+CUDAError CUDADefaultAllocator::downloadChunked(const CUDAMemBlock &memBlock, void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransferChunks({}, memBlock.size, maxChunkSize, chunks));
+
+	return transfer.download(hostPtr, memBlock.ptr, chunks, stream);
+}
+
 CUDAError CUDADefaultAllocator::free(CUDAMemBlock &memBlock) {
-	RETURN_ON_CUDA_ERROR_HANDLED(internalFree(memBlock));
+	// Claim the block first, so a second free of it never reaches the pool.
+	CUDAMemBlock allocated;
+	{
+		std::lock_guard<std::mutex> lock(allocationsMutex);
+		auto it = allocations.find(memBlock.ptr);
+		if (memBlock.ptr == NULL || it == allocations.end()) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDADefaultAllocator_ERROR_UNKNOWN_BLOCK", "Attempt to free a block which is not allocated!");
+		}
+		allocated = it->second;
+		allocated.stream = memBlock.stream;
+		allocations.erase(it);
+	}
 
-	auto it = allocations.find(&memBlock);
-	massert(it != allocations.end());
-	allocations.erase(it);
+	CUDAError err = internalFree(allocated);
+	if (err.hasError()) {
+		std::lock_guard<std::mutex> lock(allocationsMutex);
+		allocations[allocated.ptr] = allocated;
+		return err;
+	}
+
+	memBlock.ptr = NULL;
+	memBlock.size = 0;
+	memBlock.reserved = 0;
+	memBlock.ctx = NULL;
+	memBlock.deviceOrdinal = -1;
 
 	return CUDAError();
 }
 
+CUDAError CUDADefaultAllocator::trim(SizeType targetCachedBytes) {
+	return pool.trim(targetCachedBytes);
+}
+
+void CUDADefaultAllocator::setMaxCachedBytes(SizeType maxBytes) {
+	pool.setMaxCachedBytes(maxBytes);
+}
+
+void CUDADefaultAllocator::dumpStats(LogLevel level) {
+	stats.dump("CUDADefaultAllocator", level);
+	Logger::log(
+		level,
+		"	pool: %.2fMB cached in %llu blocks, cap %.2fMB",
+		double(pool.getCachedBytes()) / MEGABYTE_IN_BYTES,
+		pool.getNumCachedBlocks(),
+		double(pool.getMaxCachedBytes()) / MEGABYTE_IN_BYTES
+	);
+}
+
 CUDAError CUDADefaultAllocator::internalFree(CUDAMemBlock &memBlock) {
-	RETURN_ON_CUDA_ERROR(cuMemFree(static_cast<CUdeviceptr>(memBlock.ptr)));
+	// The block knows its context, so small ones can skip the pool's lock.
+	RETURN_ON_CUDA_ERROR_HANDLED(pool.free(memBlock.ptr, memBlock.reserved, CUDAPoolStream(memBlock.ctx, memBlock.stream)));
+	stats.recordFree(memBlock.deviceOrdinal, memBlock.size, memBlock.reserved);
 	memBlock.ptr = NULL;
 	memBlock.size = 0;
 	memBlock.reserved = 0;
+	memBlock.ctx = NULL;
+	memBlock.deviceOrdinal = -1;
 
 	return CUDAError();
 }
@@ -83,109 +179,313 @@ SizeType getPaddedSize(SizeType size, SizeType granularity) {
 	return ((size + granularity - 1) / granularity) * granularity;
 }
 
+CUDAVirtualAllocator::CUDAVirtualAllocator() : maxReservationHeadroom(DEFAULT_MAX_RESERVATION_HEADROOM) { }
+
 CUDAError CUDAVirtualAllocator::initialize() {
 	return CUDAError();
 }
 
 CUDAError CUDAVirtualAllocator::deinitialize() {
+	while (true) {
+		CUDAMemBlock memBlock;
+		{
+			std::lock_guard<std::mutex> lock(reservationsMutex);
+			if (reservations.empty()) {
+				break;
+			}
+			memBlock.ptr = reservations.begin()->first;
+		}
+		RETURN_ON_CUDA_ERROR_HANDLED(free(memBlock));
+	}
+
 	return CUDAError();
 }
 
+void CUDAVirtualAllocator::setMaxReservationHeadroom(SizeType headroom) {
+	maxReservationHeadroom = headroom;
+}
+
+SizeType CUDAVirtualAllocator::getReservationSize(SizeType size) const {
+	const SizeType headroom = size * (RESERVATION_SIZE_FACTOR - 1);
+	return size + (headroom < maxReservationHeadroom ? headroom : maxReservationHeadroom);
+}
+
+void CUDAVirtualAllocator::dumpStats(LogLevel level) {
+	stats.dump("CUDAVirtualAllocator", level);
+}
+
 CUDAError CUDAVirtualAllocator::allocate(CUDAMemBlock &memBlock) {
 	if (memBlock.size <= 0) {
 		return CUDAError(CUDA_ERROR_UNKNOWN, "CUDAVirtualAllocator_ERROR_INVALID_SIZE", "");
 	}
 
 	CUDAManager &cudaManager = getCUDAManager();
-	const std::vector<CUDADevice> &devices = cudaManager.getDevices();
+	CUDADeviceRegistry &devices = cudaManager.getDevices();
 
 	// Check if we have the required memory (plus some just in case bytes over it)
-	// on any one of the devices. 
+	// on any one of the devices. Devices already in use are tried first,
+	// the others are only brought up if none of those has enough.
 	const SizeType jicBytes = 64 * MEGABYTE_IN_BYTES;
 	const SizeType requiredMemory = memBlock.size + jicBytes;
-	int devIdx = -1;
-	for (int i = 0; i < devices.size(); ++i) {
-		const CUDADevice &dev = devices[i];
-		SizeType currDeviceFreeMem;
-		RETURN_ON_CUDA_ERROR_HANDLED(dev.getFreeMemory(currDeviceFreeMem));
-		if (currDeviceFreeMem >= requiredMemory) {
-			devIdx = i;
-			break;
+	const CUDADevice *allocationDevice = nullptr;
+	for (int pass = 0; pass < 2 && allocationDevice == nullptr; ++pass) {
+		for (int i = 0; i < devices.getNumDevices(); ++i) {
+			const bool isReady = devices.getState(i) == CUDADeviceState::Ready;
+			if (isReady != (pass == 0) || devices.getProperties(i).totalMem < requiredMemory) {
+				continue;
+			}
+
+			const CUDADevice *dev = nullptr;
+			if (devices.getDevice(i, dev).hasError()) {
+				continue;
+			}
+
+			SizeType currDeviceFreeMem;
+			RETURN_ON_CUDA_ERROR_HANDLED(dev->getFreeMemory(currDeviceFreeMem));
+			if (currDeviceFreeMem >= requiredMemory) {
+				allocationDevice = dev;
+				break;
+			}
 		}
 	}
 
-	if (devIdx < 0 || devIdx >= devices.size()) {
+	if (allocationDevice == nullptr) {
+		stats.recordFailedAllocation(-1);
 		return CUDAError(CUDA_ERROR_OUT_OF_MEMORY, "CUDAVirtualAllocator_ERROR_OUT_OF_MEM", "");
 	}
 
-	CUmemAllocationProp allocationProperties = {};
-	allocationProperties.type = CU_MEM_ALLOCATION_TYPE_PINNED;
-	allocationProperties.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
-	allocationProperties.location.id = devIdx;
-	SizeType granularity = 0;
-	cuMemGetAllocationGranularity(&granularity, &allocationProperties, CU_MEM_ALLOC_GRANULARITY_MINIMUM);
+	VirtualReservation reservation = {};
+	reservation.deviceOrdinal = allocationDevice->getProperties().ordinal;
+	reservation.allocationProperties.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+	reservation.allocationProperties.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+	reservation.allocationProperties.location.id = allocationDevice->getDevice();
+	RETURN_ON_CUDA_ERROR(cuMemGetAllocationGranularity(&reservation.granularity, &reservation.allocationProperties, CU_MEM_ALLOC_GRANULARITY_MINIMUM));
+
+	// Reserve more address space than asked for so the buffer can later grow in place.
+	// Only the mapped part is backed by physical memory. Growing past the reservation
+	// tries to extend it, and the buffer is moved if that fails.
+	reservation.addressRangeSize = getPaddedSize(getReservationSize(memBlock.size), reservation.granularity);
+	reservation.mappedSize = 0;
+
+	CUDAMemHandle basePtr = NULL;
+	RETURN_ON_CUDA_ERROR(cuMemAddressReserve(&basePtr, reservation.addressRangeSize, 0, 0, 0));
+
+	VirtualReservation *insertedPtr = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(reservationsMutex);
+		insertedPtr = &reservations[basePtr];
+		*insertedPtr = reservation;
+	}
+	VirtualReservation &inserted = *insertedPtr;
+
+	CUDAError err = mapPhysicalMemory(basePtr, inserted, getPaddedSize(memBlock.size, reservation.granularity));
+	if (err.hasError()) {
+		CUDAMemBlock failedBlock(basePtr, 0);
+		free(failedBlock);
+		stats.recordFailedAllocation(reservation.deviceOrdinal);
+		return err;
+	}
+
+	memBlock.ptr = basePtr;
+	memBlock.reserved = inserted.mappedSize;
+	memBlock.deviceOrdinal = reservation.deviceOrdinal;
+	inserted.requestedSize = memBlock.size;
+	stats.recordAllocation(reservation.deviceOrdinal, memBlock.size, inserted.mappedSize);
+
+	return CUDAError();
+}
 
-	memBlock.size = getPaddedSize(memBlock.size, granularity);
-	RETURN_ON_CUDA_ERROR(cuMemAddressReserve(&memBlock.ptr, memBlock.size, 0, 0, 0));
+CUDAError CUDAVirtualAllocator::mapPhysicalMemory(CUDAMemHandle basePtr, VirtualReservation &reservation, SizeType newMappedSize) {
+	massert(newMappedSize % reservation.granularity == 0);
+	massert(newMappedSize <= reservation.addressRangeSize);
 
-	// Try to create physical blocks which will be mapped to the virtual adress range we just reserved.
+	if (newMappedSize <= reservation.mappedSize) {
+		return CUDAError();
+	}
+
+	// Try to create physical blocks which will be mapped to the tail of the virtual adress range.
 	// If an allocation fails, ask for two times less memory. If we start asking for less memory than is
 	// the padding size(`granulariry`) then the memory is just too fragmeneted so we fail.
 	// Each time a physical block is allocated - it is mapped to a sub-region of the virtual range and
-	// is saved in virtualToPhysicalAllocations, so we can later unmap and release it.
-	CUDAMemHandle currPtr = memBlock.ptr;
-	SizeType requiredMemorySize = memBlock.size;
+	// is saved in the reservation, so we can later unmap and release it.
+	// A physical block never spans two reserved ranges, the driver doesn't map across their boundary.
+	const SizeType oldMappedSize = reservation.mappedSize;
+	const SizeType oldNumChunks = reservation.physicalAllocations.size();
+	CUDAMemHandle currPtr = basePtr + reservation.mappedSize;
+	SizeType requiredMemorySize = newMappedSize - reservation.mappedSize;
 	SizeType physicalAllocationSize = requiredMemorySize;
 	while (requiredMemorySize > 0) {
-		CUDAMemHandle physicalMemHandle;
-		CUresult res = cuMemCreate(&physicalMemHandle, physicalAllocationSize, &allocationProperties, 0);
+		const SizeType rangeLeft = getRangeEnd(reservation, currPtr - basePtr) - (currPtr - basePtr);
+		SizeType chunkSize = physicalAllocationSize < requiredMemorySize ? physicalAllocationSize : requiredMemorySize;
+		chunkSize = chunkSize < rangeLeft ? chunkSize : rangeLeft;
+
+		CUmemGenericAllocationHandle physicalMemHandle;
+		CUresult res = cuMemCreate(&physicalMemHandle, chunkSize, &reservation.allocationProperties, 0);
 		if (res != CUDA_SUCCESS) {
-			// Memory is too defragmented. Free all allocations and fail.
-			if (physicalAllocationSize == granularity) {
-				RETURN_ON_CUDA_ERROR_HANDLED(free(memBlock));
+			// Memory is too defragmented. Drop what we mapped so far and fail.
+			if (chunkSize == reservation.granularity) {
+				RETURN_ON_CUDA_ERROR_HANDLED(unmapPhysicalMemory(basePtr, reservation, oldMappedSize));
 				return CUDAError(CUDA_ERROR_OUT_OF_MEMORY, "CUDAVirtualAllocator_ERROR_OUT_OF_MEM", "");
 			}
 
-			physicalAllocationSize = getPaddedSize(physicalAllocationSize / 2, granularity);
+			physicalAllocationSize = getPaddedSize(chunkSize / 2, reservation.granularity);
 			continue;
 		}
 
-		RETURN_ON_CUDA_ERROR(cuMemMap(currPtr, physicalAllocationSize, 0, physicalMemHandle, 0));
+		CUresult mapRes = cuMemMap(currPtr, chunkSize, 0, physicalMemHandle, 0);
+		if (mapRes != CUDA_SUCCESS) {
+			cuMemRelease(physicalMemHandle);
+			RETURN_ON_CUDA_ERROR_HANDLED(unmapPhysicalMemory(basePtr, reservation, oldMappedSize));
+			RETURN_ON_CUDA_ERROR(mapRes);
+		}
 
-		requiredMemorySize -= physicalAllocationSize;
-		currPtr += physicalAllocationSize;
+		PhysicalMemAllocation physicalMemAlloc = { currPtr, physicalMemHandle, chunkSize };
+		reservation.physicalAllocations.push_back(physicalMemAlloc);
+		reservation.mappedSize += chunkSize;
+		stats.recordPhysicalChunks(reservation.deviceOrdinal, 1);
 
-		PhysicalMemAllocation physicalMemAlloc = { currPtr, physicalMemHandle, physicalAllocationSize };
-		auto &block = virtualToPhysicalAllocations[memBlock];
-		block.push_back(physicalMemAlloc);
+		requiredMemorySize -= chunkSize;
+		currPtr += chunkSize;
 	}
-	massert(requiredMemorySize == 0);
+	massert(reservation.mappedSize == newMappedSize);
+
+	// Many chunks per mapping mean the device memory is fragmented.
+	stats.recordMappingSplit(reservation.deviceOrdinal, int(reservation.physicalAllocations.size() - oldNumChunks));
 
 	CUmemAccessDesc accessDesc = {};
-	accessDesc.location = allocationProperties.location;
+	accessDesc.location = reservation.allocationProperties.location;
 	accessDesc.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
-	RETURN_ON_CUDA_ERROR(cuMemSetAccess(memBlock.ptr, memBlock.size, &accessDesc, 1));
+	for (SizeType offset = oldMappedSize; offset < newMappedSize;) {
+		const SizeType rangeEnd = getRangeEnd(reservation, offset);
+		const SizeType end = rangeEnd < newMappedSize ? rangeEnd : newMappedSize;
+		RETURN_ON_CUDA_ERROR(cuMemSetAccess(basePtr + offset, end - offset, &accessDesc, 1));
+		offset = end;
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAVirtualAllocator::unmapPhysicalMemory(CUDAMemHandle basePtr, VirtualReservation &reservation, SizeType newMappedSize) {
+	// Physical blocks are only dropped whole, so the result may stay a bit above newMappedSize.
+	std::vector<PhysicalMemAllocation> &allocs = reservation.physicalAllocations;
+	while (!allocs.empty() && allocs.back().virtualPtr - basePtr >= newMappedSize) {
+		const PhysicalMemAllocation &memAlloc = allocs.back();
+		RETURN_ON_CUDA_ERROR(cuMemUnmap(memAlloc.virtualPtr, memAlloc.size));
+		RETURN_ON_CUDA_ERROR(cuMemRelease(memAlloc.physicalPtr));
+		reservation.mappedSize -= memAlloc.size;
+		allocs.pop_back();
+		stats.recordPhysicalChunks(reservation.deviceOrdinal, -1);
+	}
 
 	return CUDAError();
 }
 
+CUDAError CUDAVirtualAllocator::extendReservation(CUDAMemHandle basePtr, VirtualReservation &reservation, SizeType newRangeSize) {
+	// Ask for the range right after ours. If the driver gives us something else
+	// the pointer can't be kept, so give it back and fail.
+	const SizeType extraSize = newRangeSize - reservation.addressRangeSize;
+	const CUDAMemHandle wantedPtr = basePtr + reservation.addressRangeSize;
+	CUDAMemHandle extraPtr = NULL;
+	CUresult res = cuMemAddressReserve(&extraPtr, extraSize, 0, wantedPtr, 0);
+	if (res != CUDA_SUCCESS || extraPtr != wantedPtr) {
+		if (res == CUDA_SUCCESS) {
+			RETURN_ON_CUDA_ERROR(cuMemAddressFree(extraPtr, extraSize));
+		}
+		return CUDAError(CUDA_ERROR_OUT_OF_MEMORY, "CUDAVirtualAllocator_ERROR_RESERVATION_EXCEEDED", "");
+	}
+
+	reservation.extraRanges.push_back(std::make_pair(extraPtr, extraSize));
+	reservation.addressRangeSize = newRangeSize;
+
+	return CUDAError();
+}
+
+CUDAError CUDAVirtualAllocator::grow(CUDAMemBlock &memBlock, SizeType newSize) {
+	VirtualReservation *found = findReservation(memBlock.ptr);
+	if (found == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAVirtualAllocator_ERROR_UNKNOWN_BLOCK", "");
+	}
+
+	if (newSize < memBlock.size) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAVirtualAllocator_ERROR_INVALID_SIZE", "");
+	}
+
+	VirtualReservation &reservation = *found;
+	const SizeType newMappedSize = getPaddedSize(newSize, reservation.granularity);
+	const SizeType oldMappedSize = reservation.mappedSize;
+	if (newMappedSize > reservation.addressRangeSize) {
+		CUDAError err = extendReservation(memBlock.ptr, reservation, newMappedSize);
+		if (err.hasError()) {
+			stats.recordFailedAllocation(reservation.deviceOrdinal);
+			return err;
+		}
+	}
+
+	CUDAError err = mapPhysicalMemory(memBlock.ptr, reservation, newMappedSize);
+	if (err.hasError()) {
+		stats.recordFailedAllocation(reservation.deviceOrdinal);
+		return err;
+	}
+
+	stats.recordResize(reservation.deviceOrdinal, reservation.requestedSize, oldMappedSize, newSize, reservation.mappedSize);
+	reservation.requestedSize = newSize;
+	memBlock.size = newSize;
+	memBlock.reserved = reservation.mappedSize;
+
+	return CUDAError();
+}
+
+CUDAError CUDAVirtualAllocator::shrink(CUDAMemBlock &memBlock, SizeType newSize) {
+	VirtualReservation *found = findReservation(memBlock.ptr);
+	if (found == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAVirtualAllocator_ERROR_UNKNOWN_BLOCK", "");
+	}
+
+	if (newSize == 0 || newSize > memBlock.size) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAVirtualAllocator_ERROR_INVALID_SIZE", "");
+	}
+
+	VirtualReservation &reservation = *found;
+	const SizeType oldMappedSize = reservation.mappedSize;
+	RETURN_ON_CUDA_ERROR_HANDLED(unmapPhysicalMemory(memBlock.ptr, reservation, getPaddedSize(newSize, reservation.granularity)));
+
+	stats.recordResize(reservation.deviceOrdinal, reservation.requestedSize, oldMappedSize, newSize, reservation.mappedSize);
+	reservation.requestedSize = newSize;
+	memBlock.size = newSize;
+	memBlock.reserved = reservation.mappedSize;
+
+	return CUDAError();
+}
+
+CUDAError CUDAVirtualAllocator::planTransfer(const CUDAMemBlock &memBlock, SizeType maxChunkSize, std::vector<CUDATransferChunk> &chunks) const {
+	VirtualReservation *found = findReservation(memBlock.ptr);
+	if (found == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAVirtualAllocator_ERROR_UNKNOWN_BLOCK", "");
+	}
+
+	const std::vector<PhysicalMemAllocation> &blocks = found->physicalAllocations;
+	std::vector<SizeType> physicalChunkSizes(blocks.size());
+	for (int i = 0; i < blocks.size(); ++i) {
+		physicalChunkSizes[i] = blocks[i].size;
+	}
+
+	return planTransferChunks(physicalChunkSizes, memBlock.size, maxChunkSize, chunks);
+}
+
 CUDAError CUDAVirtualAllocator::upload(const CUDAMemBlock &memBlock, const void *hostPtr, CUstream stream) {
 	massert(memBlock.size > 0);
 
-	std::vector<PhysicalMemAllocation> &blocks = virtualToPhysicalAllocations[memBlock];
-	CUDAMemHandle hostPtrUVA = reinterpret_cast<CUDAMemHandle>(hostPtr);
-	SizeType offset = 0;
-	for (int i = 0; blocks.size(); ++i) {
-		auto memAlloc = blocks[i];
-		CUDAMemHandle dstDevice = memAlloc.virtualPtr;
-		CUDAMemHandle srcHost = hostPtrUVA + offset;
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransfer(memBlock, 0, chunks));
 
-		/*if (stream != NULL) {
-			RETURN_ON_CUDA_ERROR(cuMemcpyAsync(dstDevice, srcHost, memAlloc.size, stream));
+	const char *srcHost = reinterpret_cast<const char*>(hostPtr);
+	for (int i = 0; i < chunks.size(); ++i) {
+		const CUDATransferChunk &chunk = chunks[i];
+		if (stream != NULL) {
+			RETURN_ON_CUDA_ERROR(cuMemcpyHtoDAsync(memBlock.ptr + chunk.offset, srcHost + chunk.offset, chunk.size, stream));
 		} else {
-			RETURN_ON_CUDA_ERROR(cuMemcpy(dstDevice, srcHost, memAlloc.size));
-		}*/
-		offset += memAlloc.size;
+			RETURN_ON_CUDA_ERROR(cuMemcpyHtoD(memBlock.ptr + chunk.offset, srcHost + chunk.offset, chunk.size));
+		}
 	}
 
 	return CUDAError();
@@ -194,32 +494,484 @@ CUDAError CUDAVirtualAllocator::upload(const CUDAMemBlock &memBlock, const void
 CUDAError CUDAVirtualAllocator::download(const CUDAMemBlock &memBlock, void *hostPtr, CUstream stream) {
 	massert(memBlock.size > 0);
 
-	std::vector<PhysicalMemAllocation> blocks = virtualToPhysicalAllocations[memBlock];
-	CUDAMemHandle hostPtrUVA = reinterpret_cast<CUDAMemHandle>(hostPtr);
-	SizeType offset = 0;
-	for (int i = 0; blocks.size(); ++i) {
-		auto memAlloc = blocks[i];
-		CUDAMemHandle srcDevice = memAlloc.virtualPtr;
-		CUDAMemHandle dstHost = hostPtrUVA + offset;
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransfer(memBlock, 0, chunks));
+
+	char *dstHost = reinterpret_cast<char*>(hostPtr);
+	for (int i = 0; i < chunks.size(); ++i) {
+		const CUDATransferChunk &chunk = chunks[i];
 		if (stream != NULL) {
-			RETURN_ON_CUDA_ERROR(cuMemcpyAsync(dstHost, srcDevice, memAlloc.size, stream));
+			RETURN_ON_CUDA_ERROR(cuMemcpyDtoHAsync(dstHost + chunk.offset, memBlock.ptr + chunk.offset, chunk.size, stream));
 		} else {
-			RETURN_ON_CUDA_ERROR(cuMemcpy(dstHost, srcDevice, memAlloc.size));
+			RETURN_ON_CUDA_ERROR(cuMemcpyDtoH(dstHost + chunk.offset, memBlock.ptr + chunk.offset, chunk.size));
 		}
-		offset += memAlloc.size;
 	}
 
 	return CUDAError();
 }
 
+CUDAError CUDAVirtualAllocator::uploadChunked(const CUDAMemBlock &memBlock, const void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransfer(memBlock, maxChunkSize, chunks));
+
+	return transfer.upload(memBlock.ptr, hostPtr, chunks, stream);
+}
+
+CUDAError CUDAVirtualAllocator::downloadChunked(const CUDAMemBlock &memBlock, void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransfer(memBlock, maxChunkSize, chunks));
+
+	return transfer.download(hostPtr, memBlock.ptr, chunks, stream);
+}
+
 CUDAError CUDAVirtualAllocator::free(CUDAMemBlock &memBlock) {
-	const std::vector<PhysicalMemAllocation> &allocs = virtualToPhysicalAllocations[memBlock];
-	for (PhysicalMemAllocation memAlloc : allocs) {
-		RETURN_ON_CUDA_ERROR(cuMemUnmap(memAlloc.virtualPtr, memAlloc.size));
-		RETURN_ON_CUDA_ERROR(cuMemRelease(memAlloc.physicalPtr));
+	// Taken out of the map before the address range is freed, another thread may reserve the same range right after.
+	VirtualReservation reservation;
+	{
+		std::lock_guard<std::mutex> lock(reservationsMutex);
+		auto it = reservations.find(memBlock.ptr);
+		if (it == reservations.end()) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAVirtualAllocator_ERROR_UNKNOWN_BLOCK", "");
+		}
+		reservation = std::move(it->second);
+		reservations.erase(it);
+	}
+
+	// Blocks which failed to allocate were never counted.
+	if (reservation.requestedSize > 0) {
+		stats.recordFree(reservation.deviceOrdinal, reservation.requestedSize, reservation.mappedSize);
+	}
+	RETURN_ON_CUDA_ERROR_HANDLED(unmapPhysicalMemory(memBlock.ptr, reservation, 0));
+
+	for (int i = 0; i < reservation.extraRanges.size(); ++i) {
+		RETURN_ON_CUDA_ERROR(cuMemAddressFree(reservation.extraRanges[i].first, reservation.extraRanges[i].second));
+	}
+
+	const SizeType baseRangeSize = reservation.addressRangeSize - getExtraRangesSize(reservation);
+	RETURN_ON_CUDA_ERROR(cuMemAddressFree(memBlock.ptr, baseRangeSize));
+
+	return CUDAError();
+}
+
+CUDAVirtualAllocator::VirtualReservation *CUDAVirtualAllocator::findReservation(CUDAMemHandle ptr) const {
+	std::lock_guard<std::mutex> lock(reservationsMutex);
+	auto it = reservations.find(ptr);
+	if (it == reservations.end()) {
+		return nullptr;
+	}
+
+	return const_cast<VirtualReservation*>(&it->second);
+}
+
+SizeType CUDAVirtualAllocator::getRangeEnd(const VirtualReservation &reservation, SizeType offset) {
+	SizeType rangeEnd = reservation.addressRangeSize - getExtraRangesSize(reservation);
+	for (int i = 0; i < reservation.extraRanges.size() && rangeEnd <= offset; ++i) {
+		rangeEnd += reservation.extraRanges[i].second;
+	}
+	return rangeEnd;
+}
+
+SizeType CUDAVirtualAllocator::getExtraRangesSize(const VirtualReservation &reservation) {
+	SizeType result = 0;
+	for (int i = 0; i < reservation.extraRanges.size(); ++i) {
+		result += reservation.extraRanges[i].second;
+	}
+	return result;
+}
+
+/*
+===============================================================
+CUDAVirtualMemoryBackend
+===============================================================
+*/
+CUDAVirtualMemoryBackend::CUDAVirtualMemoryBackend() : allocator(nullptr) { }
+
+void CUDAVirtualMemoryBackend::initialize(CUDAVirtualAllocator *allocator) {
+	this->allocator = allocator;
+}
+
+CUDAError CUDAVirtualMemoryBackend::allocate(CUDAMemHandle &ptr, SizeType size) {
+	massert(allocator != nullptr);
+
+	CUDAVirtualAllocator::CUDAMemBlock memBlock;
+	memBlock.size = size;
+	RETURN_ON_CUDA_ERROR_HANDLED(allocator->allocate(memBlock));
+
+	const CUDADevice *currentDevice = getCUDAManager().getCurrentDevice();
+	if (currentDevice != nullptr && currentDevice->getProperties().ordinal != memBlock.deviceOrdinal) {
+		RETURN_ON_CUDA_ERROR_HANDLED(allocator->free(memBlock));
+		return CUDAError(CUDA_ERROR_OUT_OF_MEMORY, "CUDAVirtualMemoryBackend_ERROR_OUT_OF_MEM", "");
+	}
+
+	ptr = memBlock.ptr;
+	return CUDAError();
+}
+
+CUDAError CUDAVirtualMemoryBackend::free(CUDAMemHandle ptr) {
+	massert(allocator != nullptr);
+
+	CUDAVirtualAllocator::CUDAMemBlock memBlock(ptr, 0);
+	return allocator->free(memBlock);
+}
+
+/*
+===============================================================
+CUDAFallbackAllocator
+===============================================================
+*/
+const char *getMemoryTierName(CUDAMemoryTier tier) {
+	switch (tier) {
+	case CUDAMemoryTier::Device: return "device";
+	case CUDAMemoryTier::Virtual: return "virtual";
+	case CUDAMemoryTier::MappedHost: return "mapped host";
+	default: return "unknown";
+	}
+}
+
+CUDAFallbackAllocator::CUDAFallbackAllocator()
+	: backends{}
+	, fenceBackend(nullptr)
+	, tierBytes{}
+	, tierBlocks{}
+	, numFrees(0) { }
+
+CUDAError CUDAFallbackAllocator::initialize(CUDAVirtualAllocator *virtualAllocator) {
+	virtualBackend.initialize(virtualAllocator);
+
+	TierBackends tierBackends = {};
+	tierBackends[int(CUDAMemoryTier::Device)] = &deviceBackend;
+	tierBackends[int(CUDAMemoryTier::Virtual)] = &virtualBackend;
+	tierBackends[int(CUDAMemoryTier::MappedHost)] = &mappedHostBackend;
+
+	return initialize(tierBackends, &eventFenceBackend);
+}
+
+CUDAError CUDAFallbackAllocator::initialize(const TierBackends &tierBackends, CUDAFenceBackend *fences) {
+	if (fences == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAFallbackAllocator_ERROR_NO_FENCE_BACKEND", "");
 	}
 
-	RETURN_ON_CUDA_ERROR(cuMemAddressFree(memBlock.ptr, memBlock.size));
+	std::lock_guard<std::mutex> lock(mutex);
+	backends = tierBackends;
+	fenceBackend = fences;
 
 	return CUDAError();
 }
+
+CUDAError CUDAFallbackAllocator::deinitialize() {
+	if (fenceBackend == nullptr) {
+		return CUDAError();
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(releaseFinishedPromotions(true));
+
+	while (true) {
+		CUDAMemBlock memBlock;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (allocations.empty()) {
+				break;
+			}
+			memBlock.ptr = allocations.begin()->first;
+			memBlock.size = allocations.begin()->second.size;
+			memBlock.reserved = memBlock.size;
+		}
+		RETURN_ON_CUDA_ERROR_HANDLED(free(memBlock));
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAFallbackAllocator::allocate(CUDAMemBlock &memBlock) {
+	if (memBlock.size <= 0) {
+		return CUDAError(CUDA_ERROR_UNKNOWN, "CUDAFallbackAllocator_ERROR_INVALID_SIZE", "");
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(bindThreadContext());
+	RETURN_ON_CUDA_ERROR_HANDLED(releaseFinishedPromotions(false));
+
+	const int deviceOrdinal = getThreadDeviceOrdinal();
+	CUDAMemoryTier tier = CUDAMemoryTier::Device;
+	CUDAError err = allocateFromTiers(memBlock.ptr, memBlock.size, CUDAMemoryTier::Count, tier);
+	if (err.hasError()) {
+		stats.recordFailedAllocation(deviceOrdinal);
+		return err;
+	}
+
+	if (tier != CUDAMemoryTier::Device) {
+		CUDABASE_LOG_RATE_LIMITED(
+			LogLevel::Warning,
+			1,
+			"CUDAFallbackAllocator: out of device memory, %.2fMB placed in %s memory",
+			double(memBlock.size) / MEGABYTE_IN_BYTES,
+			getMemoryTierName(tier)
+		);
+	}
+
+	memBlock.reserved = memBlock.size;
+	memBlock.deviceOrdinal = deviceOrdinal;
+	stats.recordAllocation(deviceOrdinal, memBlock.size, memBlock.reserved);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	allocations[memBlock.ptr] = { tier, memBlock.size, deviceOrdinal, numFrees };
+	tierBytes[int(tier)] += memBlock.size;
+	++tierBlocks[int(tier)];
+
+	return CUDAError();
+}
+
+CUDAError CUDAFallbackAllocator::upload(const CUDAMemBlock &memBlock, const void *hostPtr, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	// Every tier hands out device pointers, mapped host memory included.
+	if (stream != NULL) {
+		RETURN_ON_CUDA_ERROR(cuMemcpyHtoDAsync(memBlock.ptr, hostPtr, memBlock.size, stream));
+	} else {
+		RETURN_ON_CUDA_ERROR(cuMemcpyHtoD(memBlock.ptr, hostPtr, memBlock.size));
+	}
+	return CUDAError();
+}
+
+CUDAError CUDAFallbackAllocator::download(const CUDAMemBlock &memBlock, void *hostPtr, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	if (stream != NULL) {
+		RETURN_ON_CUDA_ERROR(cuMemcpyDtoHAsync(hostPtr, memBlock.ptr, memBlock.size, stream));
+	} else {
+		RETURN_ON_CUDA_ERROR(cuMemcpyDtoH(hostPtr, memBlock.ptr, memBlock.size));
+	}
+	return CUDAError();
+}
+
+CUDAError CUDAFallbackAllocator::uploadChunked(const CUDAMemBlock &memBlock, const void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransferChunks({}, memBlock.size, maxChunkSize, chunks));
+
+	return transfer.upload(memBlock.ptr, hostPtr, chunks, stream);
+}
+
+CUDAError CUDAFallbackAllocator::downloadChunked(const CUDAMemBlock &memBlock, void *hostPtr, CUDAChunkedTransfer &transfer, SizeType maxChunkSize, CUstream stream) {
+	massert(memBlock.size > 0);
+
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransferChunks({}, memBlock.size, maxChunkSize, chunks));
+
+	return transfer.download(hostPtr, memBlock.ptr, chunks, stream);
+}
+
+CUDAError CUDAFallbackAllocator::free(CUDAMemBlock &memBlock) {
+	Allocation allocation;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = allocations.find(memBlock.ptr);
+		if (it == allocations.end()) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAFallbackAllocator_ERROR_UNKNOWN_BLOCK", "");
+		}
+
+		allocation = it->second;
+		allocations.erase(it);
+		tierBytes[int(allocation.tier)] -= allocation.size;
+		--tierBlocks[int(allocation.tier)];
+	}
+
+	stats.recordFree(allocation.deviceOrdinal, allocation.size, allocation.size);
+	RETURN_ON_CUDA_ERROR_HANDLED(releaseMemory(memBlock.ptr, allocation.tier, allocation.size));
+
+	memBlock.ptr = NULL;
+	memBlock.size = 0;
+	memBlock.reserved = 0;
+	memBlock.deviceOrdinal = -1;
+
+	return CUDAError();
+}
+
+CUDAError CUDAFallbackAllocator::promote(CUDAMemBlock &memBlock, CUstream stream, bool &promoted) {
+	promoted = false;
+
+	RETURN_ON_CUDA_ERROR_HANDLED(releaseFinishedPromotions(false));
+
+	const CUDAMemHandle oldPtr = memBlock.ptr;
+	CUDAMemoryTier oldTier = CUDAMemoryTier::Device;
+	SizeType size = 0;
+	int deviceOrdinal = -1;
+	SizeType numFreesBefore = 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = allocations.find(oldPtr);
+		if (it == allocations.end()) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAFallbackAllocator_ERROR_UNKNOWN_BLOCK", "");
+		}
+
+		// Nothing was freed since the last attempt, so it would fail again.
+		if (it->second.tier == CUDAMemoryTier::Device || it->second.numFreesSeen == numFrees) {
+			return CUDAError();
+		}
+
+		oldTier = it->second.tier;
+		size = it->second.size;
+		deviceOrdinal = it->second.deviceOrdinal;
+		numFreesBefore = numFrees;
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(bindThreadContext());
+
+	CUDAMemHandle newPtr = NULL;
+	CUDAMemoryTier newTier = CUDAMemoryTier::Device;
+	CUDAError err = allocateFromTiers(newPtr, size, oldTier, newTier);
+	if (err.hasError()) {
+		if (err.getError() != CUDA_ERROR_OUT_OF_MEMORY) {
+			return err;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		allocations[oldPtr].numFreesSeen = numFreesBefore;
+		return CUDAError();
+	}
+
+	if (stream != NULL) {
+		err = handleCUDAError(cuMemcpyDtoDAsync(newPtr, oldPtr, size, stream));
+	} else {
+		err = handleCUDAError(cuMemcpyDtoD(newPtr, oldPtr, size));
+	}
+	if (err.hasError()) {
+		LOG_CUDA_ERROR(err, LogLevel::Error);
+		backends[int(newTier)]->free(newPtr);
+		return err;
+	}
+
+	// The copy out of the old memory may still be running, it is released once the fence is signaled.
+	PendingRelease release = { oldPtr, oldTier, size, NULL };
+	bool releaseNow = stream == NULL;
+	if (!releaseNow && fenceBackend->record(release.fence, stream).hasError()) {
+		RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream));
+		releaseNow = true;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		allocations.erase(oldPtr);
+		allocations[newPtr] = { newTier, size, deviceOrdinal, numFrees };
+		tierBytes[int(oldTier)] -= size;
+		--tierBlocks[int(oldTier)];
+		tierBytes[int(newTier)] += size;
+		++tierBlocks[int(newTier)];
+
+		if (!releaseNow) {
+			pendingReleases.push_back(release);
+		}
+	}
+
+	memBlock.ptr = newPtr;
+	promoted = true;
+
+	if (releaseNow) {
+		RETURN_ON_CUDA_ERROR_HANDLED(releaseMemory(oldPtr, oldTier, size));
+	}
+
+	return CUDAError();
+}
+
+CUDAMemoryTier CUDAFallbackAllocator::getTier(const CUDAMemBlock &memBlock) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = allocations.find(memBlock.ptr);
+	massert(it != allocations.end());
+	return it == allocations.end() ? CUDAMemoryTier::Count : it->second.tier;
+}
+
+SizeType CUDAFallbackAllocator::getTierBytes(CUDAMemoryTier tier) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return tierBytes[int(tier)];
+}
+
+SizeType CUDAFallbackAllocator::getTierBlocks(CUDAMemoryTier tier) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return tierBlocks[int(tier)];
+}
+
+void CUDAFallbackAllocator::dumpStats(LogLevel level) {
+	stats.dump("CUDAFallbackAllocator", level);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (int i = 0; i < NUM_TIERS; ++i) {
+		Logger::log(
+			level,
+			"	%s tier: %.2fMB in %llu blocks",
+			getMemoryTierName(CUDAMemoryTier(i)),
+			double(tierBytes[i]) / MEGABYTE_IN_BYTES,
+			tierBlocks[i]
+		);
+	}
+	Logger::log(level, "	%llu promotions waiting for their copy", SizeType(pendingReleases.size()));
+}
+
+CUDAError CUDAFallbackAllocator::allocateFromTiers(CUDAMemHandle &ptr, SizeType size, CUDAMemoryTier endTier, CUDAMemoryTier &tier) {
+	for (int i = 0; i < int(endTier); ++i) {
+		// Tiers without memory are skipped, f.e. when simulating a device without the virtual memory API.
+		if (backends[i] == nullptr) {
+			continue;
+		}
+
+		CUDAError err = backends[i]->allocate(ptr, size);
+		if (!err.hasError()) {
+			tier = CUDAMemoryTier(i);
+			return CUDAError();
+		}
+
+		if (err.getError() != CUDA_ERROR_OUT_OF_MEMORY) {
+			LOG_CUDA_ERROR(err, LogLevel::Error);
+			return err;
+		}
+	}
+
+	return CUDAError(CUDA_ERROR_OUT_OF_MEMORY, "CUDAFallbackAllocator_ERROR_OUT_OF_MEM", "");
+}
+
+CUDAError CUDAFallbackAllocator::releaseMemory(CUDAMemHandle ptr, CUDAMemoryTier tier, SizeType size) {
+	RETURN_ON_CUDA_ERROR_HANDLED(backends[int(tier)]->free(ptr));
+
+	// Room in the slowest tier doesn't help any block move up.
+	if (int(tier) < NUM_TIERS - 1) {
+		std::lock_guard<std::mutex> lock(mutex);
+		++numFrees;
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAFallbackAllocator::releaseFinishedPromotions(bool wait) {
+	std::vector<PendingRelease> finished;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < pendingReleases.size(); ) {
+			if (wait || fenceBackend->isComplete(pendingReleases[i].fence)) {
+				finished.push_back(pendingReleases[i]);
+				pendingReleases[i] = pendingReleases.back();
+				pendingReleases.pop_back();
+			} else {
+				++i;
+			}
+		}
+	}
+
+	// Keep going on errors so one bad fence doesn't leak the rest.
+	CUDAError result;
+	for (int i = 0; i < finished.size(); ++i) {
+		const PendingRelease &release = finished[i];
+		CUDAError err = wait ? fenceBackend->wait(release.fence) : CUDAError();
+		fenceBackend->destroy(release.fence);
+		if (!err.hasError()) {
+			err = releaseMemory(release.ptr, release.tier, release.size);
+		}
+		if (err.hasError() && !result.hasError()) {
+			result = err;
+		}
+	}
+
+	return result;
+}
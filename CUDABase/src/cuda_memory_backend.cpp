@@ -0,0 +1,231 @@
+#include <cuda_memory_backend.h>
+
+#include <cstdlib>
+
+/*
+===============================================================
+CUDADeviceMemoryBackend
+===============================================================
+*/
+CUDAError CUDADeviceMemoryBackend::allocate(CUDAMemHandle &ptr, SizeType size) {
+	// Not using RETURN_ON_CUDA_ERROR since running out of memory is expected
+	// and handled by the pools.
+	return handleCUDAError(cuMemAlloc(reinterpret_cast<CUdeviceptr*>(&ptr), size_t(size)));
+}
+
+CUDAError CUDADeviceMemoryBackend::free(CUDAMemHandle ptr) {
+	RETURN_ON_CUDA_ERROR(cuMemFree(static_cast<CUdeviceptr>(ptr)));
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDAPinnedHostMemoryBackend
+===============================================================
+*/
+CUDAError CUDAPinnedHostMemoryBackend::allocate(CUDAMemHandle &ptr, SizeType size) {
+	void *hostPtr = nullptr;
+	CUDAError err = handleCUDAError(cuMemHostAlloc(&hostPtr, size_t(size), CU_MEMHOSTALLOC_PORTABLE | CU_MEMHOSTALLOC_DEVICEMAP));
+	if (err.hasError()) {
+		return err;
+	}
+
+	ptr = reinterpret_cast<CUDAMemHandle>(hostPtr);
+	return CUDAError();
+}
+
+CUDAError CUDAPinnedHostMemoryBackend::free(CUDAMemHandle ptr) {
+	RETURN_ON_CUDA_ERROR(cuMemFreeHost(reinterpret_cast<void*>(ptr)));
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDAMappedHostMemoryBackend
+===============================================================
+*/
+CUDAError CUDAMappedHostMemoryBackend::allocate(CUDAMemHandle &ptr, SizeType size) {
+	// Not using RETURN_ON_CUDA_ERROR since running out of memory is expected
+	// and handled by the fallback allocator.
+	void *hostPtr = nullptr;
+	CUDAError err = handleCUDAError(cuMemHostAlloc(&hostPtr, size_t(size), CU_MEMHOSTALLOC_PORTABLE | CU_MEMHOSTALLOC_DEVICEMAP));
+	if (err.hasError()) {
+		return err;
+	}
+
+	CUdeviceptr devicePtr = 0;
+	err = handleCUDAError(cuMemHostGetDevicePointer(&devicePtr, hostPtr, 0));
+	if (err.hasError()) {
+		LOG_CUDA_ERROR(err, LogLevel::Error);
+		cuMemFreeHost(hostPtr);
+		return err;
+	}
+
+	ptr = static_cast<CUDAMemHandle>(devicePtr);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	hostPointers[ptr] = hostPtr;
+
+	return CUDAError();
+}
+
+CUDAError CUDAMappedHostMemoryBackend::free(CUDAMemHandle ptr) {
+	void *hostPtr = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = hostPointers.find(ptr);
+		if (it == hostPointers.end()) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAMappedHostMemoryBackend_ERROR_UNKNOWN_POINTER", "");
+		}
+		hostPtr = it->second;
+		hostPointers.erase(it);
+	}
+
+	RETURN_ON_CUDA_ERROR(cuMemFreeHost(hostPtr));
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDAHostMemoryBackend
+===============================================================
+*/
+CUDAError CUDAHostMemoryBackend::allocate(CUDAMemHandle &ptr, SizeType size) {
+	void *hostPtr = malloc(size_t(size));
+	if (hostPtr == nullptr) {
+		return CUDAError(CUDA_ERROR_OUT_OF_MEMORY, "CUDAHostMemoryBackend_ERROR_OUT_OF_MEM", "");
+	}
+
+	ptr = reinterpret_cast<CUDAMemHandle>(hostPtr);
+	return CUDAError();
+}
+
+CUDAError CUDAHostMemoryBackend::free(CUDAMemHandle ptr) {
+	::free(reinterpret_cast<void*>(ptr));
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDABudgetMemoryBackend
+===============================================================
+*/
+CUDABudgetMemoryBackend::CUDABudgetMemoryBackend(CUDAMemoryBackend *backend, SizeType budget)
+	: backend(backend)
+	, budget(budget)
+	, usedBytes(0)
+	, numFailedAllocations(0) { }
+
+void CUDABudgetMemoryBackend::setBudget(SizeType budget) {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->budget = budget;
+}
+
+CUDAError CUDABudgetMemoryBackend::allocate(CUDAMemHandle &ptr, SizeType size) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (usedBytes + size > budget) {
+		++numFailedAllocations;
+		return CUDAError(CUDA_ERROR_OUT_OF_MEMORY, "CUDABudgetMemoryBackend_ERROR_OUT_OF_MEM", "");
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(backend->allocate(ptr, size));
+	usedBytes += size;
+	sizes[ptr] = size;
+
+	return CUDAError();
+}
+
+CUDAError CUDABudgetMemoryBackend::free(CUDAMemHandle ptr) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = sizes.find(ptr);
+	if (it == sizes.end()) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDABudgetMemoryBackend_ERROR_UNKNOWN_POINTER", "");
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(backend->free(ptr));
+	usedBytes -= it->second;
+	sizes.erase(it);
+
+	return CUDAError();
+}
+
+SizeType CUDABudgetMemoryBackend::getBudget() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return budget;
+}
+
+SizeType CUDABudgetMemoryBackend::getUsedBytes() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return usedBytes;
+}
+
+int CUDABudgetMemoryBackend::getNumFailedAllocations() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return numFailedAllocations;
+}
+
+/*
+===============================================================
+CUDAEventFenceBackend
+===============================================================
+*/
+CUDAError CUDAEventFenceBackend::record(CUDAFence &fence, CUstream stream) {
+	RETURN_ON_CUDA_ERROR(cuEventCreate(&fence, CU_EVENT_DISABLE_TIMING));
+	CUDAError err = handleCUDAError(cuEventRecord(fence, stream));
+	if (err.hasError()) {
+		LOG_CUDA_ERROR(err, LogLevel::Error);
+		cuEventDestroy(fence);
+		fence = NULL;
+		return err;
+	}
+
+	return CUDAError();
+}
+
+bool CUDAEventFenceBackend::isComplete(CUDAFence fence) {
+	// Anything other than CUDA_ERROR_NOT_READY means the event will never
+	// become pending again, so treat it as done.
+	return cuEventQuery(fence) != CUDA_ERROR_NOT_READY;
+}
+
+CUDAError CUDAEventFenceBackend::wait(CUDAFence fence) {
+	RETURN_ON_CUDA_ERROR(cuEventSynchronize(fence));
+	return CUDAError();
+}
+
+void CUDAEventFenceBackend::destroy(CUDAFence fence) {
+	cuEventDestroy(fence);
+}
+
+/*
+===============================================================
+CUDAHostFenceBackend
+===============================================================
+*/
+CUDAError CUDAHostFenceBackend::record(CUDAFence &fence, CUstream stream) {
+	const SizeType id = ++nextFence;
+	fence = reinterpret_cast<CUDAFence>(id);
+	if (!manualSignal) {
+		signalUpTo(id);
+	}
+
+	return CUDAError();
+}
+
+bool CUDAHostFenceBackend::isComplete(CUDAFence fence) {
+	return reinterpret_cast<SizeType>(fence) <= signaledUpTo;
+}
+
+CUDAError CUDAHostFenceBackend::wait(CUDAFence fence) {
+	// Nothing will signal the fence while we block the only thread, so signal it ourselves.
+	signalUpTo(reinterpret_cast<SizeType>(fence));
+
+	return CUDAError();
+}
+
+void CUDAHostFenceBackend::destroy(CUDAFence fence) { }
+
+void CUDAHostFenceBackend::signalUpTo(SizeType fence) {
+	SizeType current = signaledUpTo.load();
+	while (current < fence && !signaledUpTo.compare_exchange_weak(current, fence)) { }
+}
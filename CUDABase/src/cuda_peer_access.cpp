@@ -0,0 +1,337 @@
+#include <cuda_peer_access.h>
+
+#include <cuda_manager.h>
+
+#include <algorithm>
+
+const char *getCopyPathName(CUDACopyPath path) {
+	switch (path) {
+	case CUDACopyPath::SameDevice:
+		return "same device";
+	case CUDACopyPath::Peer:
+		return "peer";
+	case CUDACopyPath::Staged:
+		return "staged";
+	default:
+		return "unknown";
+	}
+}
+
+CUDACopyPath chooseCopyPath(int dstOrdinal, int srcOrdinal, bool peerAccessEnabled) {
+	if (dstOrdinal == srcOrdinal) {
+		return CUDACopyPath::SameDevice;
+	}
+
+	return peerAccessEnabled ? CUDACopyPath::Peer : CUDACopyPath::Staged;
+}
+
+namespace {
+
+/// Makes a context current on the calling thread until the end of the scope.
+struct CUDAContextScope {
+	CUDAContextScope() : pushed(false) { }
+
+	~CUDAContextScope() {
+		if (pushed) {
+			cuCtxPopCurrent(nullptr);
+		}
+	}
+
+	CUDAError push(CUcontext ctx) {
+		RETURN_ON_CUDA_ERROR(cuCtxPushCurrent(ctx));
+		pushed = true;
+		return CUDAError();
+	}
+
+private:
+	bool pushed;
+};
+
+} // namespace
+
+/*
+===============================================================
+CUDADriverPeerTopology
+===============================================================
+*/
+CUDADriverPeerTopology::CUDADriverPeerTopology() : devices(nullptr) { }
+
+void CUDADriverPeerTopology::initialize(CUDADeviceRegistry *devices) {
+	this->devices = devices;
+}
+
+CUDAError CUDADriverPeerTopology::canAccessPeer(int dstOrdinal, int srcOrdinal, bool &result) {
+	CUdevice dstDev;
+	CUdevice srcDev;
+	RETURN_ON_CUDA_ERROR(cuDeviceGet(&dstDev, dstOrdinal));
+	RETURN_ON_CUDA_ERROR(cuDeviceGet(&srcDev, srcOrdinal));
+
+	int canAccess = 0;
+	RETURN_ON_CUDA_ERROR(cuDeviceCanAccessPeer(&canAccess, dstDev, srcDev));
+	result = canAccess != 0;
+
+	return CUDAError();
+}
+
+CUDAError CUDADriverPeerTopology::enablePeerAccess(int dstOrdinal, int srcOrdinal) {
+	if (devices == nullptr) {
+		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDADriverPeerTopology_ERROR_NOT_INITIALIZED", "");
+	}
+
+	const CUDADevice *dstDevice = nullptr;
+	const CUDADevice *srcDevice = nullptr;
+	RETURN_ON_CUDA_ERROR_HANDLED(devices->getDeviceByOrdinal(dstOrdinal, dstDevice));
+	RETURN_ON_CUDA_ERROR_HANDLED(devices->getDeviceByOrdinal(srcOrdinal, srcDevice));
+
+	CUDAContextScope dstScope;
+	RETURN_ON_CUDA_ERROR_HANDLED(dstScope.push(dstDevice->getContext()));
+
+	const CUresult res = cuCtxEnablePeerAccess(srcDevice->getContext(), 0);
+	if (res != CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED) {
+		RETURN_ON_CUDA_ERROR(res);
+	}
+
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDAHostPeerTopology
+===============================================================
+*/
+CUDAHostPeerTopology::CUDAHostPeerTopology() : numEnableCalls(0), enableFails(false) { }
+
+void CUDAHostPeerTopology::setLink(int dstOrdinal, int srcOrdinal, bool canAccess) {
+	std::lock_guard<std::mutex> lock(mutex);
+	links[std::make_pair(dstOrdinal, srcOrdinal)] = canAccess;
+}
+
+void CUDAHostPeerTopology::setEnableFails(bool fails) {
+	std::lock_guard<std::mutex> lock(mutex);
+	enableFails = fails;
+}
+
+CUDAError CUDAHostPeerTopology::canAccessPeer(int dstOrdinal, int srcOrdinal, bool &result) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = links.find(std::make_pair(dstOrdinal, srcOrdinal));
+	result = it != links.end() && it->second;
+	return CUDAError();
+}
+
+CUDAError CUDAHostPeerTopology::enablePeerAccess(int dstOrdinal, int srcOrdinal) {
+	std::lock_guard<std::mutex> lock(mutex);
+	++numEnableCalls;
+
+	auto it = links.find(std::make_pair(dstOrdinal, srcOrdinal));
+	if (enableFails || it == links.end() || !it->second) {
+		return CUDAError(CUDA_ERROR_PEER_ACCESS_UNSUPPORTED, "CUDAHostPeerTopology_ERROR_ENABLE_FAILED", "");
+	}
+
+	enabled[std::make_pair(dstOrdinal, srcOrdinal)] = true;
+	return CUDAError();
+}
+
+int CUDAHostPeerTopology::getNumEnableCalls() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return numEnableCalls;
+}
+
+bool CUDAHostPeerTopology::isEnabled(int dstOrdinal, int srcOrdinal) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return enabled.find(std::make_pair(dstOrdinal, srcOrdinal)) != enabled.end();
+}
+
+/*
+===============================================================
+CUDAPeerAccess
+===============================================================
+*/
+CUDAPeerAccess::CUDAPeerAccess() : topology(nullptr) { }
+
+void CUDAPeerAccess::initialize(CUDAPeerTopology *topology) {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->topology = topology;
+	pairs.clear();
+}
+
+void CUDAPeerAccess::deinitialize() {
+	std::lock_guard<std::mutex> lock(mutex);
+	pairs.clear();
+}
+
+CUDACopyPath CUDAPeerAccess::getCopyPath(int dstOrdinal, int srcOrdinal) {
+	if (dstOrdinal == srcOrdinal) {
+		return chooseCopyPath(dstOrdinal, srcOrdinal, false);
+	}
+
+	// Held while enabling, so two threads never enable the same pair.
+	std::lock_guard<std::mutex> lock(mutex);
+	const std::pair<int, int> key(dstOrdinal, srcOrdinal);
+	auto it = pairs.find(key);
+	if (it == pairs.end()) {
+		bool canAccess = false;
+		CUDAError err;
+		if (topology != nullptr) {
+			err = topology->canAccessPeer(dstOrdinal, srcOrdinal, canAccess);
+		}
+		if (!err.hasError() && canAccess) {
+			err = topology->enablePeerAccess(dstOrdinal, srcOrdinal);
+		}
+
+		if (err.hasError()) {
+			LOG_CUDA_ERROR(err, LogLevel::Warning);
+		}
+
+		const bool enabled = canAccess && !err.hasError();
+		CUDABASE_LOG(
+			LogLevel::Info,
+			"Copies from device %d to device %d are %s",
+			srcOrdinal,
+			dstOrdinal,
+			getCopyPathName(chooseCopyPath(dstOrdinal, srcOrdinal, enabled))
+		);
+
+		it = pairs.insert(std::make_pair(key, enabled ? PairState::Enabled : PairState::Unavailable)).first;
+	}
+
+	return chooseCopyPath(dstOrdinal, srcOrdinal, it->second == PairState::Enabled);
+}
+
+/*
+===============================================================
+Copies between devices
+===============================================================
+*/
+/// Chunks alternate between two page-locked slices. The download of a chunk waits for the upload
+/// which used its slice before, so downloads of one chunk overlap with uploads of the previous one.
+static CUDAError copyStagedChunks(
+	CUDAMemHandle dst,
+	const CUDADevice &dstDevice,
+	CUDAMemHandle src,
+	const CUDADevice &srcDevice,
+	const std::vector<CUDATransferChunk> &chunks,
+	CUDAPinnedSlice (&slices)[2],
+	CUstream stream
+) {
+	CUDAStreamPool &dstPool = dstDevice.getStreamPool();
+	CUDAStreamPool &srcPool = srcDevice.getStreamPool();
+
+	CUDADependency start;
+	{
+		CUDAContextScope dstScope;
+		RETURN_ON_CUDA_ERROR_HANDLED(dstScope.push(dstDevice.getContext()));
+		RETURN_ON_CUDA_ERROR_HANDLED(dstPool.record(stream, start));
+	}
+
+	CUDAStreamLease srcStream;
+	{
+		CUDAContextScope srcScope;
+		RETURN_ON_CUDA_ERROR_HANDLED(srcScope.push(srcDevice.getContext()));
+		RETURN_ON_CUDA_ERROR_HANDLED(srcPool.acquire(CUDAStreamPriority::Normal, srcStream));
+		RETURN_ON_CUDA_ERROR_HANDLED(srcPool.waitFor(srcStream.get(), start));
+	}
+
+	CUDADependency downloaded[2];
+	CUDADependency uploaded[2];
+	for (int i = 0; i < chunks.size(); ++i) {
+		const CUDATransferChunk &chunk = chunks[i];
+		const int slot = i % 2;
+
+		{
+			CUDAContextScope srcScope;
+			RETURN_ON_CUDA_ERROR_HANDLED(srcScope.push(srcDevice.getContext()));
+			RETURN_ON_CUDA_ERROR_HANDLED(srcPool.waitFor(srcStream.get(), uploaded[slot]));
+			RETURN_ON_CUDA_ERROR(cuMemcpyDtoHAsync(slices[slot].ptr, src + chunk.offset, chunk.size, srcStream.get()));
+			RETURN_ON_CUDA_ERROR_HANDLED(srcPool.record(srcStream.get(), downloaded[slot]));
+		}
+
+		{
+			CUDAContextScope dstScope;
+			RETURN_ON_CUDA_ERROR_HANDLED(dstScope.push(dstDevice.getContext()));
+			RETURN_ON_CUDA_ERROR_HANDLED(dstPool.waitFor(stream, downloaded[slot]));
+			RETURN_ON_CUDA_ERROR(cuMemcpyHtoDAsync(dst + chunk.offset, slices[slot].ptr, chunk.size, stream));
+			RETURN_ON_CUDA_ERROR_HANDLED(dstPool.record(stream, uploaded[slot]));
+		}
+	}
+
+	return CUDAError();
+}
+
+CUDAError copyDeviceMemory(
+	CUDAMemHandle dst,
+	const CUDADevice &dstDevice,
+	CUDAMemHandle src,
+	const CUDADevice &srcDevice,
+	SizeType size,
+	CUDACopyPath path,
+	CUstream stream,
+	SizeType maxChunkSize
+) {
+	if (size == 0) {
+		return CUDAError();
+	}
+
+	switch (path) {
+	case CUDACopyPath::SameDevice:
+		RETURN_ON_CUDA_ERROR(cuMemcpyDtoDAsync(dst, src, size, stream));
+		return CUDAError();
+	case CUDACopyPath::Peer:
+		RETURN_ON_CUDA_ERROR(cuMemcpyPeerAsync(dst, dstDevice.getContext(), src, srcDevice.getContext(), size, stream));
+		return CUDAError();
+	case CUDACopyPath::Staged:
+		break;
+	default:
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAPeerAccess_ERROR_INVALID_PATH", "");
+	}
+
+	const SizeType sliceSize = maxChunkSize > 0 ? std::min(size, maxChunkSize) : size;
+	std::vector<CUDATransferChunk> chunks;
+	RETURN_ON_CUDA_ERROR_HANDLED(planTransferChunks(std::vector<SizeType>(), size, sliceSize, chunks));
+
+	CUDAPinnedHostPool &pinnedPool = getCUDAManager().getPinnedHostPool();
+	CUDAPinnedSlice slices[2];
+	CUDAError err = pinnedPool.acquire(sliceSize, slices[0]);
+	if (!err.hasError() && chunks.size() > 1) {
+		err = pinnedPool.acquire(sliceSize, slices[1]);
+	}
+
+	if (!err.hasError()) {
+		err = copyStagedChunks(dst, dstDevice, src, srcDevice, chunks, slices, stream);
+	}
+
+	// The last use of both slices is an upload on stream, even if the copy failed halfway.
+	CUDAContextScope dstScope;
+	RETURN_ON_CUDA_ERROR_HANDLED(dstScope.push(dstDevice.getContext()));
+	for (int i = 0; i < 2; ++i) {
+		RETURN_ON_CUDA_ERROR_HANDLED(pinnedPool.release(slices[i], stream));
+	}
+
+	return err;
+}
+
+static CUDAError resolveDevice(int ordinal, const CUDADevice *&device) {
+	CUDAManager &cudaman = getCUDAManager();
+	if (ordinal >= 0) {
+		return cudaman.getDevices().getDeviceByOrdinal(ordinal, device);
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(bindThreadContext());
+	device = cudaman.getCurrentDevice();
+	if (device == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_CONTEXT, "CUDAPeerAccess_ERROR_NO_CURRENT_DEVICE", "");
+	}
+
+	return CUDAError();
+}
+
+CUDAError copyBetweenDevices(CUDAMemHandle dst, int dstOrdinal, CUDAMemHandle src, int srcOrdinal, SizeType size, CUstream stream) {
+	const CUDADevice *dstDevice = nullptr;
+	const CUDADevice *srcDevice = nullptr;
+	RETURN_ON_CUDA_ERROR_HANDLED(resolveDevice(dstOrdinal, dstDevice));
+	RETURN_ON_CUDA_ERROR_HANDLED(resolveDevice(srcOrdinal, srcDevice));
+
+	CUDAPeerAccess &peerAccess = getCUDAManager().getPeerAccess();
+	const CUDACopyPath path = peerAccess.getCopyPath(dstDevice->getProperties().ordinal, srcDevice->getProperties().ordinal);
+
+	return copyDeviceMemory(dst, *dstDevice, src, *srcDevice, size, path, stream);
+}
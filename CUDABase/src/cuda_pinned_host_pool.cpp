@@ -0,0 +1,340 @@
+#include <cuda_pinned_host_pool.h>
+
+#include <algorithm>
+
+/*
+===============================================================
+CUDAPinnedHostPool
+===============================================================
+*/
+CUDAPinnedHostPool::CUDAPinnedHostPool()
+	: memoryBackend(nullptr), fenceBackend(nullptr), chunkSize(DEFAULT_CHUNK_SIZE), maxPinnedBytes(DEFAULT_MAX_PINNED_BYTES), pinnedBytes(0) { }
+
+CUDAPinnedHostPool::~CUDAPinnedHostPool() {
+	deinitialize();
+}
+
+CUDAError CUDAPinnedHostPool::initialize(CUDAMemoryBackend *memoryBackend, CUDAFenceBackend *fenceBackend, SizeType chunkSize, SizeType maxPinnedBytes) {
+	RETURN_ON_CUDA_ERROR_HANDLED(deinitialize());
+
+	if (memoryBackend == nullptr || fenceBackend == nullptr || chunkSize < 4 * MIN_SLICE_SIZE) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAPinnedHostPool_ERROR_INVALID_INIT_ARGUMENTS", "");
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	this->memoryBackend = memoryBackend;
+	this->fenceBackend = fenceBackend;
+	this->chunkSize = chunkSize;
+	this->maxPinnedBytes = maxPinnedBytes;
+
+	return CUDAError();
+}
+
+CUDAError CUDAPinnedHostPool::deinitialize() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (memoryBackend == nullptr) {
+		return CUDAError();
+	}
+
+	// The chunks may still be read by copies in flight.
+	for (int i = 0; i < inFlight.size(); ++i) {
+		RETURN_ON_CUDA_ERROR_HANDLED(fenceBackend->wait(inFlight[i].fence));
+		fenceBackend->destroy(inFlight[i].fence);
+	}
+	inFlight.clear();
+
+	for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+		RETURN_ON_CUDA_ERROR_HANDLED(memoryBackend->free(reinterpret_cast<CUDAMemHandle>(it->second.ptr)));
+	}
+	for (auto it = dedicatedSlices.begin(); it != dedicatedSlices.end(); ++it) {
+		RETURN_ON_CUDA_ERROR_HANDLED(memoryBackend->free(reinterpret_cast<CUDAMemHandle>(it->first)));
+	}
+	chunks.clear();
+	dedicatedSlices.clear();
+	freeSlices.clear();
+	pinnedBytes = 0;
+
+	memoryBackend = nullptr;
+	fenceBackend = nullptr;
+
+	return CUDAError();
+}
+
+SizeType CUDAPinnedHostPool::getSliceSize(SizeType size) const {
+	// Rounding big requests to a power of two could page-lock almost twice what was asked for.
+	if (size > getMaxPooledSliceSize()) {
+		return (size + MIN_SLICE_SIZE - 1) / MIN_SLICE_SIZE * MIN_SLICE_SIZE;
+	}
+
+	SizeType sliceSize = MIN_SLICE_SIZE;
+	while (sliceSize < size) {
+		sliceSize <<= 1;
+	}
+	return sliceSize;
+}
+
+CUDAError CUDAPinnedHostPool::reclaim() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (fenceBackend == nullptr) {
+		return CUDAError();
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(reclaimLocked());
+	if (pinnedBytes > maxPinnedBytes) {
+		RETURN_ON_CUDA_ERROR_HANDLED(trimLocked(maxPinnedBytes));
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAPinnedHostPool::reclaimLocked() {
+	// Collect the finished ones first so an error in recycle() doesn't leave the list half compacted.
+	std::vector<CUDAPinnedSlice> done;
+	int numDone = 0;
+	for (int i = 0; i < inFlight.size(); ++i) {
+		InFlightSlice &curr = inFlight[i];
+		if (!fenceBackend->isComplete(curr.fence)) {
+			// Keep the pending ones packed at the front.
+			inFlight[i - numDone] = curr;
+			continue;
+		}
+
+		fenceBackend->destroy(curr.fence);
+		done.push_back(curr.slice);
+		++numDone;
+	}
+
+	inFlight.resize(inFlight.size() - numDone);
+
+	CUDAError result;
+	for (int i = 0; i < done.size(); ++i) {
+		CUDAError err = recycle(done[i]);
+		if (err.hasError() && !result.hasError()) {
+			result = err;
+		}
+	}
+
+	return result;
+}
+
+CUDAError CUDAPinnedHostPool::recycle(const CUDAPinnedSlice &slice) {
+	auto dedicated = dedicatedSlices.find(slice.ptr);
+	if (dedicated != dedicatedSlices.end()) {
+		RETURN_ON_CUDA_ERROR_HANDLED(memoryBackend->free(reinterpret_cast<CUDAMemHandle>(slice.ptr)));
+		pinnedBytes -= dedicated->second;
+		dedicatedSlices.erase(dedicated);
+		return CUDAError();
+	}
+
+	Chunk *chunk = findChunk(slice.ptr);
+	if (chunk == nullptr) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAPinnedHostPool_ERROR_UNKNOWN_SLICE", "");
+	}
+
+	freeSlices[slice.size].push_back(slice.ptr);
+	--chunk->numSlicesInUse;
+
+	return CUDAError();
+}
+
+CUDAPinnedHostPool::Chunk *CUDAPinnedHostPool::findChunk(void *ptr) {
+	char *bytePtr = static_cast<char*>(ptr);
+	auto it = chunks.upper_bound(bytePtr);
+	if (it == chunks.begin()) {
+		return nullptr;
+	}
+
+	--it;
+	Chunk &chunk = it->second;
+	return bytePtr < chunk.ptr + chunk.size ? &chunk : nullptr;
+}
+
+void CUDAPinnedHostPool::dropFreeSlices(const Chunk &chunk) {
+	const char *begin = chunk.ptr;
+	const char *end = chunk.ptr + chunk.size;
+	for (auto it = freeSlices.begin(); it != freeSlices.end(); ++it) {
+		std::vector<void*> &slices = it->second;
+		slices.erase(
+			std::remove_if(slices.begin(), slices.end(), [begin, end](void *ptr) {
+				return static_cast<char*>(ptr) >= begin && static_cast<char*>(ptr) < end;
+			}),
+			slices.end()
+		);
+	}
+}
+
+CUDAError CUDAPinnedHostPool::trim(SizeType targetPinnedBytes) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (memoryBackend == nullptr) {
+		return CUDAError();
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(reclaimLocked());
+
+	return trimLocked(targetPinnedBytes);
+}
+
+CUDAError CUDAPinnedHostPool::trimLocked(SizeType targetPinnedBytes) {
+	for (auto it = chunks.begin(); it != chunks.end() && pinnedBytes > targetPinnedBytes; ) {
+		Chunk &chunk = it->second;
+		if (chunk.numSlicesInUse > 0) {
+			++it;
+			continue;
+		}
+
+		RETURN_ON_CUDA_ERROR_HANDLED(memoryBackend->free(reinterpret_cast<CUDAMemHandle>(chunk.ptr)));
+		dropFreeSlices(chunk);
+		pinnedBytes -= chunk.size;
+		it = chunks.erase(it);
+
+		CUDABASE_LOG(LogLevel::Debug, "CUDAPinnedHostPool: released an idle chunk, %llu bytes still page-locked", pinnedBytes);
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAPinnedHostPool::carve(SizeType sliceSize, CUDAPinnedSlice &slice) {
+	// Slices never span chunks. Start from the newest chunk since the older ones are mostly used up.
+	Chunk *target = nullptr;
+	for (auto it = chunks.rbegin(); it != chunks.rend() && target == nullptr; ++it) {
+		if (it->second.size - it->second.used >= sliceSize) {
+			target = &it->second;
+		}
+	}
+
+	// A chunk nobody uses can be carved anew into slices of the size asked for now,
+	// which is cheaper than page-locking another one.
+	for (auto it = chunks.begin(); it != chunks.end() && target == nullptr; ++it) {
+		if (it->second.numSlicesInUse == 0) {
+			target = &it->second;
+			dropFreeSlices(*target);
+			target->used = 0;
+		}
+	}
+
+	if (target == nullptr) {
+		CUDAMemHandle chunkHandle = 0;
+		RETURN_ON_CUDA_ERROR_HANDLED(memoryBackend->allocate(chunkHandle, chunkSize));
+
+		char *chunkPtr = reinterpret_cast<char*>(chunkHandle);
+		target = &chunks[chunkPtr];
+		*target = { chunkPtr, chunkSize, 0, 0 };
+		pinnedBytes += chunkSize;
+
+		CUDABASE_LOG(LogLevel::Debug, "CUDAPinnedHostPool: page-locked a new chunk of %llu bytes", chunkSize);
+	}
+
+	slice.ptr = target->ptr + target->used;
+	slice.size = sliceSize;
+	target->used += sliceSize;
+	++target->numSlicesInUse;
+
+	return CUDAError();
+}
+
+CUDAError CUDAPinnedHostPool::acquireDedicated(SizeType sliceSize, CUDAPinnedSlice &slice) {
+	// Make room under the cap with the idle chunks first.
+	if (pinnedBytes + sliceSize > maxPinnedBytes) {
+		RETURN_ON_CUDA_ERROR_HANDLED(reclaimLocked());
+		RETURN_ON_CUDA_ERROR_HANDLED(trimLocked(maxPinnedBytes > sliceSize ? maxPinnedBytes - sliceSize : 0));
+	}
+
+	CUDAMemHandle handle = 0;
+	RETURN_ON_CUDA_ERROR_HANDLED(memoryBackend->allocate(handle, sliceSize));
+
+	slice.ptr = reinterpret_cast<void*>(handle);
+	slice.size = sliceSize;
+	dedicatedSlices[slice.ptr] = sliceSize;
+	pinnedBytes += sliceSize;
+
+	return CUDAError();
+}
+
+CUDAError CUDAPinnedHostPool::acquire(SizeType size, CUDAPinnedSlice &slice) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (memoryBackend == nullptr) {
+		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDAPinnedHostPool_ERROR_NOT_INITIALIZED", "");
+	}
+
+	if (size == 0) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAPinnedHostPool_ERROR_INVALID_SIZE", "");
+	}
+
+	const SizeType sliceSize = getSliceSize(size);
+	if (sliceSize > getMaxPooledSliceSize()) {
+		return acquireDedicated(sliceSize, slice);
+	}
+
+	auto it = freeSlices.find(sliceSize);
+	if (it == freeSlices.end() || it->second.empty()) {
+		RETURN_ON_CUDA_ERROR_HANDLED(reclaimLocked());
+		it = freeSlices.find(sliceSize);
+	}
+
+	if (it != freeSlices.end() && !it->second.empty()) {
+		slice.ptr = it->second.back();
+		slice.size = sliceSize;
+		it->second.pop_back();
+		++findChunk(slice.ptr)->numSlicesInUse;
+		return CUDAError();
+	}
+
+	return carve(sliceSize, slice);
+}
+
+CUDAError CUDAPinnedHostPool::release(CUDAPinnedSlice &slice, CUstream stream) {
+	if (slice.ptr == nullptr) {
+		return CUDAError();
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (memoryBackend == nullptr) {
+		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDAPinnedHostPool_ERROR_NOT_INITIALIZED", "");
+	}
+
+	if (stream == NULL) {
+		RETURN_ON_CUDA_ERROR_HANDLED(recycle(slice));
+		if (pinnedBytes > maxPinnedBytes) {
+			RETURN_ON_CUDA_ERROR_HANDLED(trimLocked(maxPinnedBytes));
+		}
+	} else {
+		InFlightSlice pending;
+		pending.slice = slice;
+		RETURN_ON_CUDA_ERROR_HANDLED(fenceBackend->record(pending.fence, stream));
+		inFlight.push_back(pending);
+	}
+
+	slice = CUDAPinnedSlice();
+
+	return CUDAError();
+}
+
+void CUDAPinnedHostPool::setMaxPinnedBytes(SizeType maxBytes) {
+	std::lock_guard<std::mutex> lock(mutex);
+	maxPinnedBytes = maxBytes;
+}
+
+SizeType CUDAPinnedHostPool::getMaxPinnedBytes() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return maxPinnedBytes;
+}
+
+SizeType CUDAPinnedHostPool::getNumChunks() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return SizeType(chunks.size());
+}
+
+SizeType CUDAPinnedHostPool::getNumDedicatedSlices() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return SizeType(dedicatedSlices.size());
+}
+
+SizeType CUDAPinnedHostPool::getPinnedBytes() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return pinnedBytes;
+}
+
+SizeType CUDAPinnedHostPool::getNumInFlight() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return SizeType(inFlight.size());
+}
@@ -0,0 +1,303 @@
+#include <cuda_profiler.h>
+
+#include <cmath>
+#include <cstring>
+
+/*
+===============================================================
+CUDALatencyHistogram
+===============================================================
+*/
+CUDALatencyHistogram::CUDALatencyHistogram() {
+	reset();
+}
+
+void CUDALatencyHistogram::reset() {
+	memset(buckets, 0, sizeof(buckets));
+	count = 0;
+	maxMs = 0.f;
+	totalMs = 0.0;
+}
+
+int CUDALatencyHistogram::getBucket(float ms) {
+	const float us = ms * 1000.f;
+	if (!(us > 1.f)) {
+		return 0;
+	}
+
+	const int bucket = int(std::log2(us) * BUCKETS_PER_DOUBLING);
+	return bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS - 1;
+}
+
+float CUDALatencyHistogram::getBucketUpperBound(int bucket) {
+	return std::exp2(float(bucket + 1) / BUCKETS_PER_DOUBLING) / 1000.f;
+}
+
+void CUDALatencyHistogram::add(float ms) {
+	++buckets[getBucket(ms)];
+	++count;
+	totalMs += ms;
+	if (ms > maxMs) {
+		maxMs = ms;
+	}
+}
+
+float CUDALatencyHistogram::getPercentile(float fraction) const {
+	if (count == 0) {
+		return 0.f;
+	}
+
+	SizeType target = SizeType(std::ceil(double(fraction) * count));
+	if (target == 0) {
+		target = 1;
+	}
+
+	SizeType seen = 0;
+	for (int i = 0; i < NUM_BUCKETS; ++i) {
+		seen += buckets[i];
+		if (seen >= target) {
+			const float upperBound = getBucketUpperBound(i);
+			return upperBound < maxMs ? upperBound : maxMs;
+		}
+	}
+
+	return maxMs;
+}
+
+/*
+===============================================================
+CUDAProfiler
+===============================================================
+*/
+CUDAProfiler::CUDAProfiler() : numDropped(0), enabled(false) { }
+
+CUDAProfiler::~CUDAProfiler() {
+	deinitialize();
+}
+
+void CUDAProfiler::setEnabled(bool enabled) {
+	this->enabled = enabled;
+}
+
+CUDAError CUDAProfiler::acquireEvent(CUcontext ctx, CUevent &event) {
+	std::vector<CUevent> &events = freeEvents[ctx];
+	if (!events.empty()) {
+		event = events.back();
+		events.pop_back();
+		return CUDAError();
+	}
+
+	// Timing must stay enabled, so these can't come from the fence backends.
+	RETURN_ON_CUDA_ERROR(cuEventCreate(&event, CU_EVENT_DEFAULT));
+
+	return CUDAError();
+}
+
+void CUDAProfiler::releaseEvent(CUcontext ctx, CUevent event) {
+	freeEvents[ctx].push_back(event);
+}
+
+int CUDAProfiler::getHistogramIdx(const char *name) {
+	auto it = histogramIndices.find(name);
+	if (it != histogramIndices.end()) {
+		return it->second;
+	}
+
+	const int idx = int(histograms.size());
+	histograms.push_back(NamedHistogram{ name, CUDALatencyHistogram() });
+	histogramIndices[name] = idx;
+
+	return idx;
+}
+
+CUDAError CUDAProfiler::begin(CUstream stream, Range &range) {
+	range = Range();
+	if (!isEnabled()) {
+		return CUDAError();
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Keep the pending list short without ever waiting for the GPU.
+	if (pending.size() >= MAX_PENDING_RANGES / 2) {
+		collectLocked();
+	}
+
+	if (pending.size() >= MAX_PENDING_RANGES) {
+		++numDropped;
+		return CUDAError();
+	}
+
+	RETURN_ON_CUDA_ERROR(cuCtxGetCurrent(&range.ctx));
+	RETURN_ON_CUDA_ERROR_HANDLED(acquireEvent(range.ctx, range.start));
+
+	CUDAError err = handleCUDAError(cuEventRecord(range.start, stream));
+	if (err.hasError()) {
+		releaseEvent(range.ctx, range.start);
+		range = Range();
+		return err;
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAProfiler::end(const char *name, CUstream stream, Range &range) {
+	if (range.start == NULL) {
+		return CUDAError();
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	PendingRange curr;
+	curr.start = range.start;
+	curr.ctx = range.ctx;
+	curr.histogramIdx = getHistogramIdx(name != nullptr ? name : "unnamed");
+	range = Range();
+
+	CUDAError err = acquireEvent(curr.ctx, curr.end);
+	if (!err.hasError()) {
+		err = handleCUDAError(cuEventRecord(curr.end, stream));
+		if (err.hasError()) {
+			releaseEvent(curr.ctx, curr.end);
+		}
+	}
+
+	if (err.hasError()) {
+		releaseEvent(curr.ctx, curr.start);
+		return err;
+	}
+
+	pending.push_back(curr);
+
+	return CUDAError();
+}
+
+void CUDAProfiler::collect() {
+	std::lock_guard<std::mutex> lock(mutex);
+	collectLocked();
+}
+
+void CUDAProfiler::collectLocked() {
+	int numDone = 0;
+	for (int i = 0; i < pending.size(); ++i) {
+		PendingRange &curr = pending[i];
+
+		const CUresult status = cuEventQuery(curr.end);
+		if (status == CUDA_ERROR_NOT_READY) {
+			// Keep the pending ones packed at the front.
+			pending[i - numDone] = curr;
+			continue;
+		}
+
+		float ms = 0.f;
+		if (status == CUDA_SUCCESS && cuEventElapsedTime(&ms, curr.start, curr.end) == CUDA_SUCCESS) {
+			histograms[curr.histogramIdx].histogram.add(ms);
+		} else {
+			++numDropped;
+		}
+
+		releaseEvent(curr.ctx, curr.start);
+		releaseEvent(curr.ctx, curr.end);
+		++numDone;
+	}
+
+	pending.resize(pending.size() - numDone);
+}
+
+CUDAError CUDAProfiler::flush() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return flushLocked();
+}
+
+CUDAError CUDAProfiler::flushLocked() {
+	for (int i = 0; i < pending.size(); ++i) {
+		RETURN_ON_CUDA_ERROR(cuEventSynchronize(pending[i].end));
+	}
+
+	collectLocked();
+
+	return CUDAError();
+}
+
+void CUDAProfiler::dump(LogLevel level) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	dumpLocked(level);
+}
+
+void CUDAProfiler::dumpLocked(LogLevel level) const {
+	Logger::log(level, "GPU profile (%d entries, %llu samples dropped):", int(histograms.size()), numDropped);
+	for (int i = 0; i < histograms.size(); ++i) {
+		const NamedHistogram &entry = histograms[i];
+		const CUDALatencyHistogram &hist = entry.histogram;
+		if (hist.getCount() == 0) {
+			continue;
+		}
+
+		Logger::log(
+			level,
+			"\t%-32s count: %-8llu p50: %.3fms p99: %.3fms max: %.3fms total: %.2fms",
+			entry.name.c_str(),
+			hist.getCount(),
+			hist.getPercentile(0.5f),
+			hist.getPercentile(0.99f),
+			hist.getMax(),
+			hist.getTotal()
+		);
+	}
+}
+
+void CUDAProfiler::reset() {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (int i = 0; i < histograms.size(); ++i) {
+		histograms[i].histogram.reset();
+	}
+	numDropped = 0;
+}
+
+CUDAError CUDAProfiler::deinitialize() {
+	std::lock_guard<std::mutex> lock(mutex);
+	CUDAError err = flushLocked();
+
+	bool hasSamples = false;
+	for (int i = 0; i < histograms.size(); ++i) {
+		hasSamples = hasSamples || histograms[i].histogram.getCount() > 0;
+	}
+	if (hasSamples) {
+		dumpLocked(LogLevel::InfoFancy);
+	}
+
+	// Whatever is still pending after a failed flush can't be measured anymore.
+	for (int i = 0; i < pending.size(); ++i) {
+		releaseEvent(pending[i].ctx, pending[i].start);
+		releaseEvent(pending[i].ctx, pending[i].end);
+	}
+	pending.clear();
+
+	for (auto &it : freeEvents) {
+		for (int i = 0; i < it.second.size(); ++i) {
+			cuEventDestroy(it.second[i]);
+		}
+	}
+	freeEvents.clear();
+
+	histograms.clear();
+	histogramIndices.clear();
+	numDropped = 0;
+
+	return err;
+}
+
+const CUDALatencyHistogram *CUDAProfiler::getHistogram(const char *name) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = histogramIndices.find(name);
+	if (it == histogramIndices.end()) {
+		return nullptr;
+	}
+
+	return &histograms[it->second].histogram;
+}
+
+SizeType CUDAProfiler::getNumDropped() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return numDropped;
+}
@@ -0,0 +1,470 @@
+#include <cuda_stream_pool.h>
+
+/*
+===============================================================
+CUDADriverStreamBackend
+===============================================================
+*/
+CUDAError CUDADriverStreamBackend::getPriorityRange(int &leastPriority, int &greatestPriority) {
+	RETURN_ON_CUDA_ERROR(cuCtxGetStreamPriorityRange(&leastPriority, &greatestPriority));
+	return CUDAError();
+}
+
+CUDAError CUDADriverStreamBackend::createStream(CUstream &stream, int priority) {
+	RETURN_ON_CUDA_ERROR(cuStreamCreateWithPriority(&stream, CU_STREAM_NON_BLOCKING, priority));
+	return CUDAError();
+}
+
+CUDAError CUDADriverStreamBackend::destroyStream(CUstream stream) {
+	RETURN_ON_CUDA_ERROR(cuStreamDestroy(stream));
+	return CUDAError();
+}
+
+CUDAError CUDADriverStreamBackend::createEvent(CUevent &event) {
+	RETURN_ON_CUDA_ERROR(cuEventCreate(&event, CU_EVENT_DISABLE_TIMING));
+	return CUDAError();
+}
+
+CUDAError CUDADriverStreamBackend::destroyEvent(CUevent event) {
+	RETURN_ON_CUDA_ERROR(cuEventDestroy(event));
+	return CUDAError();
+}
+
+CUDAError CUDADriverStreamBackend::recordEvent(CUevent event, CUstream stream) {
+	RETURN_ON_CUDA_ERROR(cuEventRecord(event, stream));
+	return CUDAError();
+}
+
+CUDAError CUDADriverStreamBackend::waitEvent(CUstream stream, CUevent event) {
+	RETURN_ON_CUDA_ERROR(cuStreamWaitEvent(stream, event, 0));
+	return CUDAError();
+}
+
+bool CUDADriverStreamBackend::isEventComplete(CUevent event) {
+	return cuEventQuery(event) == CUDA_SUCCESS;
+}
+
+CUDAError CUDADriverStreamBackend::synchronizeEvent(CUevent event) {
+	RETURN_ON_CUDA_ERROR(cuEventSynchronize(event));
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDAHostStreamBackend
+===============================================================
+*/
+CUDAHostStreamBackend::CUDAHostStreamBackend() : nextHandle(1) { }
+
+CUDAError CUDAHostStreamBackend::getPriorityRange(int &leastPriority, int &greatestPriority) {
+	leastPriority = 0;
+	greatestPriority = -5;
+	return CUDAError();
+}
+
+CUDAError CUDAHostStreamBackend::createStream(CUstream &stream, int priority) {
+	std::lock_guard<std::mutex> lock(mutex);
+	stream = reinterpret_cast<CUstream>(nextHandle++);
+	streamPriorities[stream] = priority;
+	return CUDAError();
+}
+
+CUDAError CUDAHostStreamBackend::destroyStream(CUstream stream) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (streamPriorities.erase(stream) == 0) {
+		return CUDAError(CUDA_ERROR_INVALID_HANDLE, "CUDAHostStreamBackend_ERROR_UNKNOWN_STREAM", "");
+	}
+	return CUDAError();
+}
+
+CUDAError CUDAHostStreamBackend::createEvent(CUevent &event) {
+	std::lock_guard<std::mutex> lock(mutex);
+	event = reinterpret_cast<CUevent>(nextHandle++);
+	eventStreams[event] = NULL;
+	return CUDAError();
+}
+
+CUDAError CUDAHostStreamBackend::destroyEvent(CUevent event) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (eventStreams.erase(event) == 0) {
+		return CUDAError(CUDA_ERROR_INVALID_HANDLE, "CUDAHostStreamBackend_ERROR_UNKNOWN_EVENT", "");
+	}
+	return CUDAError();
+}
+
+CUDAError CUDAHostStreamBackend::recordEvent(CUevent event, CUstream stream) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = eventStreams.find(event);
+	if (it == eventStreams.end()) {
+		return CUDAError(CUDA_ERROR_INVALID_HANDLE, "CUDAHostStreamBackend_ERROR_UNKNOWN_EVENT", "");
+	}
+	it->second = stream;
+	return CUDAError();
+}
+
+CUDAError CUDAHostStreamBackend::waitEvent(CUstream stream, CUevent event) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = eventStreams.find(event);
+	if (it == eventStreams.end()) {
+		return CUDAError(CUDA_ERROR_INVALID_HANDLE, "CUDAHostStreamBackend_ERROR_UNKNOWN_EVENT", "");
+	}
+	waits.push_back(Wait{ stream, event, it->second });
+	return CUDAError();
+}
+
+bool CUDAHostStreamBackend::isEventComplete(CUevent event) {
+	return true;
+}
+
+CUDAError CUDAHostStreamBackend::synchronizeEvent(CUevent event) {
+	return CUDAError();
+}
+
+int CUDAHostStreamBackend::getStreamPriority(CUstream stream) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = streamPriorities.find(stream);
+	return it != streamPriorities.end() ? it->second : 0;
+}
+
+int CUDAHostStreamBackend::getNumLiveStreams() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return int(streamPriorities.size());
+}
+
+int CUDAHostStreamBackend::getNumLiveEvents() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return int(eventStreams.size());
+}
+
+std::vector<CUDAHostStreamBackend::Wait> CUDAHostStreamBackend::getWaits() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return waits;
+}
+
+/*
+===============================================================
+CUDAEventPool
+===============================================================
+*/
+CUDAEventPool::CUDAEventPool() : backend(nullptr), numCreated(0), deinitialized(false) { }
+
+CUDAEventPool::~CUDAEventPool() {
+	deinitialize();
+}
+
+CUDAError CUDAEventPool::initialize(CUDAStreamBackend *backend) {
+	RETURN_ON_CUDA_ERROR_HANDLED(deinitialize());
+
+	std::lock_guard<std::mutex> lock(mutex);
+	this->backend = backend;
+	deinitialized = false;
+
+	return CUDAError();
+}
+
+CUDAError CUDAEventPool::deinitialize() {
+	std::lock_guard<std::mutex> lock(mutex);
+	CUDAError result;
+	for (int i = 0; i < freeEvents.size(); ++i) {
+		CUDAError err = backend->destroyEvent(freeEvents[i]);
+		if (err.hasError()) {
+			result = err;
+		}
+	}
+
+	numCreated -= freeEvents.size();
+	freeEvents.clear();
+	deinitialized = true;
+
+	return result;
+}
+
+CUDAError CUDAEventPool::acquire(CUevent &event) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (backend == nullptr || deinitialized) {
+		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDAEventPool_ERROR_NOT_INITIALIZED", "");
+	}
+
+	if (!freeEvents.empty()) {
+		event = freeEvents.back();
+		freeEvents.pop_back();
+		return CUDAError();
+	}
+
+	RETURN_ON_CUDA_ERROR_HANDLED(backend->createEvent(event));
+	++numCreated;
+
+	return CUDAError();
+}
+
+void CUDAEventPool::release(CUevent event) {
+	if (event == NULL) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (deinitialized) {
+		backend->destroyEvent(event);
+		--numCreated;
+		return;
+	}
+
+	freeEvents.push_back(event);
+}
+
+SizeType CUDAEventPool::getNumCreated() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return numCreated;
+}
+
+SizeType CUDAEventPool::getNumFree() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return freeEvents.size();
+}
+
+/*
+===============================================================
+CUDADependency
+===============================================================
+*/
+CUDADependency::CUDADependency() : event(NULL), eventPool(nullptr) { }
+
+CUDADependency::~CUDADependency() {
+	reset();
+}
+
+CUDADependency::CUDADependency(CUDADependency &&other) : event(other.event), eventPool(other.eventPool) {
+	other.event = NULL;
+	other.eventPool = nullptr;
+}
+
+CUDADependency &CUDADependency::operator=(CUDADependency &&other) {
+	if (this != &other) {
+		reset();
+		event = other.event;
+		eventPool = other.eventPool;
+		other.event = NULL;
+		other.eventPool = nullptr;
+	}
+	return *this;
+}
+
+bool CUDADependency::isComplete() const {
+	return event == NULL || eventPool->getBackend()->isEventComplete(event);
+}
+
+CUDAError CUDADependency::synchronize() const {
+	if (event == NULL) {
+		return CUDAError();
+	}
+
+	return eventPool->getBackend()->synchronizeEvent(event);
+}
+
+void CUDADependency::reset() {
+	if (eventPool != nullptr) {
+		eventPool->release(event);
+	}
+	event = NULL;
+	eventPool = nullptr;
+}
+
+/*
+===============================================================
+CUDAStreamLease
+===============================================================
+*/
+CUDAStreamLease::CUDAStreamLease() : pool(nullptr), stream(NULL), priority(CUDAStreamPriority::Normal) { }
+
+CUDAStreamLease::~CUDAStreamLease() {
+	release();
+}
+
+CUDAStreamLease::CUDAStreamLease(CUDAStreamLease &&other) : pool(other.pool), stream(other.stream), priority(other.priority) {
+	other.pool = nullptr;
+	other.stream = NULL;
+}
+
+CUDAStreamLease &CUDAStreamLease::operator=(CUDAStreamLease &&other) {
+	if (this != &other) {
+		release();
+		pool = other.pool;
+		stream = other.stream;
+		priority = other.priority;
+		other.pool = nullptr;
+		other.stream = NULL;
+	}
+	return *this;
+}
+
+void CUDAStreamLease::release() {
+	if (pool != nullptr) {
+		pool->release(stream, priority);
+	}
+	pool = nullptr;
+	stream = NULL;
+}
+
+/*
+===============================================================
+CUDAStreamPool
+===============================================================
+*/
+CUDAStreamPool::CUDAStreamPool() : backend(nullptr), maxStreamsPerPriority(DEFAULT_MAX_STREAMS_PER_PRIORITY) {
+	for (int i = 0; i < int(CUDAStreamPriority::Count); ++i) {
+		driverPriorities[i] = 0;
+	}
+}
+
+CUDAStreamPool::~CUDAStreamPool() {
+	deinitialize();
+}
+
+CUDAError CUDAStreamPool::initialize(CUDAStreamBackend *backend, int maxStreamsPerPriority) {
+	RETURN_ON_CUDA_ERROR_HANDLED(deinitialize());
+
+	if (backend == nullptr || maxStreamsPerPriority <= 0) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAStreamPool_ERROR_INVALID_ARGUMENTS", "");
+	}
+
+	int leastPriority = 0;
+	int greatestPriority = 0;
+	RETURN_ON_CUDA_ERROR_HANDLED(backend->getPriorityRange(leastPriority, greatestPriority));
+	RETURN_ON_CUDA_ERROR_HANDLED(eventPool.initialize(backend));
+
+	std::lock_guard<std::mutex> lock(mutex);
+	this->backend = backend;
+	this->maxStreamsPerPriority = maxStreamsPerPriority;
+	driverPriorities[int(CUDAStreamPriority::Normal)] = leastPriority;
+	driverPriorities[int(CUDAStreamPriority::High)] = greatestPriority;
+
+	return CUDAError();
+}
+
+CUDAError CUDAStreamPool::deinitialize() {
+	CUDAError result;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < int(CUDAStreamPriority::Count); ++i) {
+			for (int j = 0; j < streams[i].size(); ++j) {
+				CUDAError err = backend->destroyStream(streams[i][j].stream);
+				if (err.hasError()) {
+					result = err;
+				}
+			}
+			streams[i].clear();
+		}
+		backend = nullptr;
+	}
+
+	CUDAError err = eventPool.deinitialize();
+	if (err.hasError()) {
+		result = err;
+	}
+
+	return result;
+}
+
+CUDAError CUDAStreamPool::acquire(CUDAStreamPriority priority, CUDAStreamLease &lease) {
+	if (priority < CUDAStreamPriority::Normal || priority >= CUDAStreamPriority::Count) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAStreamPool_ERROR_INVALID_PRIORITY", "");
+	}
+
+	lease.release();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (backend == nullptr) {
+		return CUDAError(CUDA_ERROR_NOT_INITIALIZED, "CUDAStreamPool_ERROR_NOT_INITIALIZED", "");
+	}
+
+	std::vector<PooledStream> &pooled = streams[int(priority)];
+	int leastShared = -1;
+	for (int i = 0; i < pooled.size(); ++i) {
+		if (leastShared < 0 || pooled[i].numLeases < pooled[leastShared].numLeases) {
+			leastShared = i;
+		}
+	}
+
+	// Only share a stream once no more can be created.
+	if (leastShared < 0 || (pooled[leastShared].numLeases > 0 && pooled.size() < maxStreamsPerPriority)) {
+		PooledStream created = { NULL, 0 };
+		RETURN_ON_CUDA_ERROR_HANDLED(backend->createStream(created.stream, driverPriorities[int(priority)]));
+		pooled.push_back(created);
+		leastShared = int(pooled.size()) - 1;
+	}
+
+	++pooled[leastShared].numLeases;
+	lease.pool = this;
+	lease.stream = pooled[leastShared].stream;
+	lease.priority = priority;
+
+	return CUDAError();
+}
+
+void CUDAStreamPool::release(CUstream stream, CUDAStreamPriority priority) {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<PooledStream> &pooled = streams[int(priority)];
+	for (int i = 0; i < pooled.size(); ++i) {
+		if (pooled[i].stream == stream) {
+			--pooled[i].numLeases;
+			return;
+		}
+	}
+	// Not found if the pool was deinitialized while the lease was held.
+}
+
+CUDAError CUDAStreamPool::record(CUstream stream, CUDADependency &dependency) {
+	dependency.reset();
+
+	CUevent event = NULL;
+	RETURN_ON_CUDA_ERROR_HANDLED(eventPool.acquire(event));
+
+	CUDAError err = backend->recordEvent(event, stream);
+	if (err.hasError()) {
+		eventPool.release(event);
+		return err;
+	}
+
+	dependency.event = event;
+	dependency.eventPool = &eventPool;
+
+	return CUDAError();
+}
+
+CUDAError CUDAStreamPool::waitFor(CUstream stream, const CUDADependency &dependency) {
+	if (!dependency.isValid()) {
+		return CUDAError();
+	}
+
+	return backend->waitEvent(stream, dependency.event);
+}
+
+CUDAError CUDAStreamPool::waitForStream(CUstream stream, CUstream producer) {
+	if (stream == producer) {
+		return CUDAError();
+	}
+
+	// The event can go back to the pool right away, the wait is already ordered after its record.
+	CUDADependency dependency;
+	RETURN_ON_CUDA_ERROR_HANDLED(record(producer, dependency));
+	return waitFor(stream, dependency);
+}
+
+int CUDAStreamPool::getDriverPriority(CUDAStreamPriority priority) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return driverPriorities[int(priority)];
+}
+
+int CUDAStreamPool::getNumStreams(CUDAStreamPriority priority) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return int(streams[int(priority)].size());
+}
+
+int CUDAStreamPool::getNumLeases(CUDAStreamPriority priority) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	int result = 0;
+	for (int i = 0; i < streams[int(priority)].size(); ++i) {
+		result += streams[int(priority)][i].numLeases;
+	}
+	return result;
+}
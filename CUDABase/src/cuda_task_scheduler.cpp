@@ -0,0 +1,394 @@
+#include <cuda_task_scheduler.h>
+
+#include <algorithm>
+#include <chrono>
+
+/// Scheduler and index of the worker running on this thread.
+static thread_local const CUDATaskScheduler *threadScheduler = nullptr;
+static thread_local int threadWorkerIndex = -1;
+
+/*
+===============================================================
+CUDATaskGroup
+===============================================================
+*/
+CUDATaskGroup::CUDATaskGroup(CUDATaskScheduler &scheduler) : scheduler(scheduler), numPending(0) { }
+
+CUDATaskGroup::~CUDATaskGroup() {
+	// Tasks still queued would report to a dead group.
+	massert(numPending.load() == 0);
+}
+
+void CUDATaskGroup::run(CUDATask task) {
+	scheduler.push(wrap(std::move(task)));
+}
+
+void CUDATaskGroup::runAfter(CUDAFence fence, CUDATask task) {
+	scheduler.addContinuation({ fence, wrap(std::move(task)), false });
+}
+
+CUDAError CUDATaskGroup::runAfterStream(CUstream stream, CUDATask task) {
+	CUDAFence fence = NULL;
+	RETURN_ON_CUDA_ERROR_HANDLED(scheduler.fenceBackend->record(fence, stream));
+	scheduler.addContinuation({ fence, wrap(std::move(task)), true });
+	return CUDAError();
+}
+
+CUDAError CUDATaskGroup::wait() {
+	const int workerIndex = scheduler.getCurrentWorkerIndex();
+	while (numPending.load() > 0) {
+		if (scheduler.tryRunOne(workerIndex)) {
+			continue;
+		}
+
+		// Nothing to help with, the remaining tasks run elsewhere or wait for a fence.
+		// Wake up now and then anyway, they may start tasks we could take.
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait_for(lock, std::chrono::milliseconds(1), [this]() { return numPending.load() == 0; });
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	CUDAError result = firstError;
+	firstError = CUDAError();
+	return result;
+}
+
+std::function<void()> CUDATaskGroup::wrap(CUDATask task) {
+	numPending.fetch_add(1);
+	return [this, task = std::move(task)]() {
+		finishTask(task());
+	};
+}
+
+void CUDATaskGroup::finishTask(const CUDAError &err) {
+	// Notify under the lock, the group may be destroyed as soon as a waiter sees the count drop.
+	std::lock_guard<std::mutex> lock(mutex);
+	if (err.hasError() && !firstError.hasError()) {
+		firstError = err;
+	}
+	if (numPending.fetch_sub(1) == 1) {
+		finished.notify_all();
+	}
+}
+
+/*
+===============================================================
+CUDATaskScheduler
+===============================================================
+*/
+CUDATaskScheduler::CUDATaskScheduler()
+	: numQueued(0)
+	, numSleeping(0)
+	, stopping(false)
+	, stoppingWatcher(false)
+	, fenceBackend(&eventFenceBackend) { }
+
+CUDATaskScheduler::~CUDATaskScheduler() {
+	deinitialize();
+}
+
+CUDAError CUDATaskScheduler::initialize(int numWorkers, CUDAFenceBackend *fences) {
+	if (!workers.empty()) {
+		return CUDAError(CUDA_ERROR_UNKNOWN, "CUDATaskScheduler_ERROR_ALREADY_INITIALIZED", "");
+	}
+
+	if (numWorkers <= 0) {
+		numWorkers = std::max(1, int(std::thread::hardware_concurrency()));
+	}
+
+	fenceBackend = fences != nullptr ? fences : &eventFenceBackend;
+	stopping = false;
+	stoppingWatcher = false;
+
+	// All workers exist before any of them runs, they steal from each other.
+	for (int i = 0; i < numWorkers; ++i) {
+		workers.push_back(std::make_unique<Worker>());
+		workers.back()->randomState = 0x9E3779B9u * unsigned(i + 1);
+	}
+	for (int i = 0; i < numWorkers; ++i) {
+		workers[i]->thread = std::thread(&CUDATaskScheduler::workerLoop, this, i);
+	}
+	watcher = std::thread(&CUDATaskScheduler::watcherLoop, this);
+
+	return CUDAError();
+}
+
+void CUDATaskScheduler::deinitialize() {
+	if (watcher.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(continuationsMutex);
+			stoppingWatcher = true;
+			continuationAdded.notify_all();
+		}
+		watcher.join();
+	}
+
+	if (!continuations.empty()) {
+		CUDABASE_LOG(LogLevel::Warning, "CUDATaskScheduler: dropping %d continuations waiting for their fence", int(continuations.size()));
+		for (int i = 0; i < continuations.size(); ++i) {
+			if (continuations[i].ownsFence) {
+				fenceBackend->destroy(continuations[i].fence);
+			}
+		}
+		continuations.clear();
+	}
+
+	if (workers.empty()) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+		wakeUp.notify_all();
+	}
+	for (int i = 0; i < workers.size(); ++i) {
+		workers[i]->thread.join();
+	}
+	workers.clear();
+}
+
+void CUDATaskScheduler::submit(CUDATask task) {
+	push([task = std::move(task)]() {
+		CUDAError err = task();
+		if (err.hasError()) {
+			LOG_CUDA_ERROR(err, LogLevel::Error);
+		}
+	});
+}
+
+void CUDATaskScheduler::runAfter(CUDAFence fence, CUDATask task) {
+	addContinuation({ fence, [task = std::move(task)]() {
+		CUDAError err = task();
+		if (err.hasError()) {
+			LOG_CUDA_ERROR(err, LogLevel::Error);
+		}
+	}, false });
+}
+
+CUDAError CUDATaskScheduler::runAfterStream(CUstream stream, CUDATask task) {
+	CUDAFence fence = NULL;
+	RETURN_ON_CUDA_ERROR_HANDLED(fenceBackend->record(fence, stream));
+	addContinuation({ fence, [task = std::move(task)]() {
+		CUDAError err = task();
+		if (err.hasError()) {
+			LOG_CUDA_ERROR(err, LogLevel::Error);
+		}
+	}, true });
+	return CUDAError();
+}
+
+/// Run body on [begin, end), splitting off the upper halves as tasks of group until the range is small enough.
+static CUDAError runRange(CUDATaskGroup &group, SizeType begin, SizeType end, SizeType grainSize, const CUDARangeTask &body) {
+	while (end - begin > grainSize) {
+		const SizeType middle = begin + (end - begin) / 2;
+		group.run([&group, middle, end, grainSize, &body]() {
+			return runRange(group, middle, end, grainSize, body);
+		});
+		end = middle;
+	}
+
+	return body(begin, end);
+}
+
+CUDAError CUDATaskScheduler::parallelFor(SizeType begin, SizeType end, SizeType grainSize, const CUDARangeTask &body) {
+	if (end <= begin) {
+		return CUDAError();
+	}
+
+	if (grainSize == 0) {
+		const SizeType numPieces = SizeType(std::max(1, getNumWorkers())) * 8;
+		grainSize = std::max<SizeType>(1, (end - begin + numPieces - 1) / numPieces);
+	}
+
+	CUDATaskGroup group(*this);
+	CUDAError err = runRange(group, begin, end, grainSize, body);
+	CUDAError groupErr = group.wait();
+
+	return err.hasError() ? err : groupErr;
+}
+
+int CUDATaskScheduler::getNumWorkers() const {
+	return int(workers.size());
+}
+
+SizeType CUDATaskScheduler::getNumExecuted() const {
+	SizeType result = 0;
+	for (int i = 0; i < workers.size(); ++i) {
+		result += workers[i]->numExecuted.load(std::memory_order_relaxed);
+	}
+	return result;
+}
+
+SizeType CUDATaskScheduler::getNumStolen() const {
+	SizeType result = 0;
+	for (int i = 0; i < workers.size(); ++i) {
+		result += workers[i]->numStolen.load(std::memory_order_relaxed);
+	}
+	return result;
+}
+
+void CUDATaskScheduler::push(Job job) {
+	const int workerIndex = getCurrentWorkerIndex();
+	if (workerIndex >= 0) {
+		Worker &worker = *workers[workerIndex];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.jobs.push_back(std::move(job));
+	} else {
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		sharedJobs.push_back(std::move(job));
+	}
+
+	// Pairs with the sleeping worker incrementing numSleeping before it checks numQueued,
+	// so either it sees the job or we see it sleeping.
+	numQueued.fetch_add(1);
+	if (numSleeping.load() > 0) {
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		wakeUp.notify_one();
+	}
+}
+
+bool CUDATaskScheduler::tryRunOne(int workerIndex) {
+	Job job;
+	bool stolen = false;
+
+	if (workerIndex >= 0) {
+		Worker &worker = *workers[workerIndex];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		if (!worker.jobs.empty()) {
+			job = std::move(worker.jobs.back());
+			worker.jobs.pop_back();
+		}
+	}
+
+	if (!job) {
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		if (!sharedJobs.empty()) {
+			job = std::move(sharedJobs.front());
+			sharedJobs.pop_front();
+		}
+	}
+
+	// Start at a random worker so thieves don't all pile onto the first one.
+	const int numWorkers = int(workers.size());
+	if (!job && numWorkers > 0) {
+		int start = 0;
+		if (workerIndex >= 0) {
+			unsigned int &state = workers[workerIndex]->randomState;
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			start = int(state % unsigned(numWorkers));
+		}
+
+		for (int i = 0; i < numWorkers && !job; ++i) {
+			const int victimIndex = (start + i) % numWorkers;
+			if (victimIndex == workerIndex) {
+				continue;
+			}
+
+			Worker &victim = *workers[victimIndex];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.jobs.empty()) {
+				job = std::move(victim.jobs.front());
+				victim.jobs.pop_front();
+				stolen = true;
+			}
+		}
+	}
+
+	if (!job) {
+		return false;
+	}
+
+	numQueued.fetch_sub(1);
+	job();
+
+	if (workerIndex >= 0) {
+		Worker &worker = *workers[workerIndex];
+		worker.numExecuted.fetch_add(1, std::memory_order_relaxed);
+		if (stolen) {
+			worker.numStolen.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	return true;
+}
+
+int CUDATaskScheduler::getCurrentWorkerIndex() const {
+	return threadScheduler == this ? threadWorkerIndex : -1;
+}
+
+void CUDATaskScheduler::addContinuation(const Continuation &continuation) {
+	std::lock_guard<std::mutex> lock(continuationsMutex);
+	continuations.push_back(continuation);
+	continuationAdded.notify_one();
+}
+
+void CUDATaskScheduler::workerLoop(int workerIndex) {
+	threadScheduler = this;
+	threadWorkerIndex = workerIndex;
+
+	while (true) {
+		if (tryRunOne(workerIndex)) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		numSleeping.fetch_add(1);
+		wakeUp.wait(lock, [this]() { return numQueued.load() > 0 || stopping.load(); });
+		numSleeping.fetch_sub(1);
+
+		// Queued work is finished before stopping.
+		if (stopping.load() && numQueued.load() <= 0) {
+			break;
+		}
+	}
+
+	threadScheduler = nullptr;
+	threadWorkerIndex = -1;
+}
+
+void CUDATaskScheduler::watcherLoop() {
+	// Fences are polled, sleeping longer while none of them gets signaled.
+	const std::chrono::microseconds minPollInterval(20);
+	const std::chrono::microseconds maxPollInterval(1000);
+	std::chrono::microseconds pollInterval = minPollInterval;
+
+	std::vector<Continuation> ready;
+	std::unique_lock<std::mutex> lock(continuationsMutex);
+	while (!stoppingWatcher) {
+		if (continuations.empty()) {
+			continuationAdded.wait(lock, [this]() { return !continuations.empty() || stoppingWatcher; });
+			pollInterval = minPollInterval;
+			continue;
+		}
+
+		for (int i = 0; i < continuations.size(); ) {
+			if (fenceBackend->isComplete(continuations[i].fence)) {
+				ready.push_back(std::move(continuations[i]));
+				continuations[i] = std::move(continuations.back());
+				continuations.pop_back();
+			} else {
+				++i;
+			}
+		}
+
+		if (ready.empty()) {
+			continuationAdded.wait_for(lock, pollInterval);
+			pollInterval = std::min(pollInterval * 2, maxPollInterval);
+			continue;
+		}
+
+		lock.unlock();
+		for (int i = 0; i < ready.size(); ++i) {
+			if (ready[i].ownsFence) {
+				fenceBackend->destroy(ready[i].fence);
+			}
+			push(std::move(ready[i].job));
+		}
+		ready.clear();
+		pollInterval = minPollInterval;
+		lock.lock();
+	}
+}
@@ -0,0 +1,140 @@
+#include <cuda_transfer.h>
+
+CUDAError planTransferChunks(const std::vector<SizeType> &physicalChunkSizes, SizeType transferSize, SizeType maxChunkSize, std::vector<CUDATransferChunk> &chunks) {
+	chunks.clear();
+
+	if (!physicalChunkSizes.empty()) {
+		SizeType physicalSize = 0;
+		for (int i = 0; i < physicalChunkSizes.size(); ++i) {
+			physicalSize += physicalChunkSizes[i];
+		}
+		if (transferSize > physicalSize) {
+			return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDATransfer_ERROR_TRANSFER_TOO_BIG", "");
+		}
+	}
+
+	SizeType physicalStart = 0;
+	int physicalIdx = 0;
+	for (SizeType offset = 0; offset < transferSize; ) {
+		// Bytes left in the physical allocation containing offset.
+		SizeType physicalLeft = transferSize - offset;
+		if (!physicalChunkSizes.empty()) {
+			while (physicalIdx < physicalChunkSizes.size() && physicalStart + physicalChunkSizes[physicalIdx] <= offset) {
+				physicalStart += physicalChunkSizes[physicalIdx];
+				++physicalIdx;
+			}
+
+			physicalLeft = physicalStart + physicalChunkSizes[physicalIdx] - offset;
+		}
+
+		SizeType size = transferSize - offset;
+		if (size > physicalLeft) {
+			size = physicalLeft;
+		}
+		if (maxChunkSize > 0 && size > maxChunkSize) {
+			size = maxChunkSize;
+		}
+
+		chunks.push_back(CUDATransferChunk{ offset, size });
+		offset += size;
+	}
+
+	return CUDAError();
+}
+
+/*
+===============================================================
+CUDAChunkedTransfer
+===============================================================
+*/
+CUDAChunkedTransfer::CUDAChunkedTransfer() { }
+
+CUDAChunkedTransfer::~CUDAChunkedTransfer() {
+	deinitialize();
+}
+
+CUDAError CUDAChunkedTransfer::deinitialize() {
+	for (int i = 0; i < events.size(); ++i) {
+		RETURN_ON_CUDA_ERROR(cuEventDestroy(events[i]));
+	}
+	events.clear();
+	chunks.clear();
+
+	return CUDAError();
+}
+
+CUDAError CUDAChunkedTransfer::prepare(const std::vector<CUDATransferChunk> &newChunks) {
+	// Events are kept between transfers, only create the missing ones.
+	while (events.size() < newChunks.size()) {
+		CUevent event;
+		RETURN_ON_CUDA_ERROR(cuEventCreate(&event, CU_EVENT_DISABLE_TIMING));
+		events.push_back(event);
+	}
+
+	chunks = newChunks;
+
+	return CUDAError();
+}
+
+CUDAError CUDAChunkedTransfer::upload(CUDAMemHandle dst, const void *src, const std::vector<CUDATransferChunk> &newChunks, CUstream stream) {
+	RETURN_ON_CUDA_ERROR_HANDLED(prepare(newChunks));
+
+	const char *srcBytes = reinterpret_cast<const char*>(src);
+	for (int i = 0; i < chunks.size(); ++i) {
+		const CUDATransferChunk &chunk = chunks[i];
+		RETURN_ON_CUDA_ERROR(cuMemcpyHtoDAsync(dst + chunk.offset, srcBytes + chunk.offset, chunk.size, stream));
+		RETURN_ON_CUDA_ERROR(cuEventRecord(events[i], stream));
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAChunkedTransfer::download(void *dst, CUDAMemHandle src, const std::vector<CUDATransferChunk> &newChunks, CUstream stream) {
+	RETURN_ON_CUDA_ERROR_HANDLED(prepare(newChunks));
+
+	char *dstBytes = reinterpret_cast<char*>(dst);
+	for (int i = 0; i < chunks.size(); ++i) {
+		const CUDATransferChunk &chunk = chunks[i];
+		RETURN_ON_CUDA_ERROR(cuMemcpyDtoHAsync(dstBytes + chunk.offset, src + chunk.offset, chunk.size, stream));
+		RETURN_ON_CUDA_ERROR(cuEventRecord(events[i], stream));
+	}
+
+	return CUDAError();
+}
+
+CUDAError CUDAChunkedTransfer::waitForChunk(int chunkIdx, CUstream consumer) const {
+	if (chunkIdx < 0 || chunkIdx >= chunks.size()) {
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "CUDAChunkedTransfer_ERROR_INVALID_CHUNK", "");
+	}
+
+	RETURN_ON_CUDA_ERROR(cuStreamWaitEvent(consumer, events[chunkIdx], 0));
+
+	return CUDAError();
+}
+
+CUDAError CUDAChunkedTransfer::waitForAll(CUstream consumer) const {
+	// All chunks are on the same stream so the last one landing means all did.
+	if (chunks.empty()) {
+		return CUDAError();
+	}
+
+	return waitForChunk(int(chunks.size()) - 1, consumer);
+}
+
+CUDAError CUDAChunkedTransfer::synchronize() const {
+	if (chunks.empty()) {
+		return CUDAError();
+	}
+
+	RETURN_ON_CUDA_ERROR(cuEventSynchronize(events[chunks.size() - 1]));
+
+	return CUDAError();
+}
+
+bool CUDAChunkedTransfer::isChunkDone(int chunkIdx) const {
+	if (chunkIdx < 0 || chunkIdx >= chunks.size()) {
+		return false;
+	}
+
+	return cuEventQuery(events[chunkIdx]) == CUDA_SUCCESS;
+}
@@ -1,8 +1,28 @@
 #include <logger.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else // !_WIN32
+#include <unistd.h>
+#endif // _WIN32
 
 #define OUT_STREAM stdout
+#define OUT_FD 1 // File descriptor of OUT_STREAM, for writes which can't go through stdio.
 #define IN_STREAM stdin
 #define ERR_STREAM stderr
 
@@ -12,10 +32,370 @@
 #define ANSI_COLOR_BLUE    "\u001b[34;1m"
 #define ANSI_COLOR_RESET   "\x1b[0m"
 
-int Logger::loggingLevel = static_cast<int>(LogLevel::InfoFancy);
+static_assert((Logger::RING_CAPACITY & (Logger::RING_CAPACITY - 1)) == 0, "Logger::RING_CAPACITY must be a power of two");
+
+namespace {
+
+/// How long the drain thread sleeps when nobody wakes it.
+constexpr std::chrono::milliseconds DRAIN_INTERVAL(10);
+
+/// How long a crash handler waits for a drain in progress before giving up.
+constexpr std::chrono::milliseconds CRASH_FLUSH_TIMEOUT(100);
+
+struct LogRecord {
+	uint64_t sequence; ///< Global order of the message across all threads.
+	LogLevel level;
+	char message[Logger::MAX_MESSAGE_SIZE];
+};
+
+/// Single producer, single consumer ring of one thread.
+/// The owning thread advances head, the drain (under drainMutex) advances tail.
+struct LogRing {
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+	std::atomic<uint64_t> numDropped;
+	std::atomic<bool> abandoned; ///< The owning thread exited. Freed by the drain once empty.
+	LogRecord records[Logger::RING_CAPACITY];
+
+	LogRing() : head(0), tail(0), numDropped(0), abandoned(false) { }
+};
+
+struct LoggerState {
+	std::mutex ringsMutex; ///< Guards rings. Taken by producers only to register their ring.
+	std::vector<LogRing*> rings;
+
+	std::mutex drainMutex; ///< Held while writing out, so records of concurrent drains don't interleave.
+	std::vector<LogRecord> batch;
+
+	std::mutex wakeMutex;
+	std::condition_variable wake;
+	std::thread drainThread;
+	std::atomic<bool> stopped;
+
+	std::atomic<uint64_t> nextSequence;
+	std::atomic<uint64_t> numDropped;
+
+	LoggerState() : stopped(false), nextSequence(0), numDropped(0) { }
+};
+
+/// Never destroyed, logging from static destructors and crash handlers still has a state to use.
+std::atomic<LoggerState*> loggerState(nullptr);
+
+thread_local LogRing *threadRing = nullptr;
+thread_local bool threadRingReleased = false;
+
+/// Hands the ring of a thread over to the drain when the thread exits.
+struct LogRingReleaser {
+	~LogRingReleaser() {
+		if (threadRing != nullptr) {
+			threadRing->abandoned.store(true, std::memory_order_release);
+			threadRing = nullptr;
+		}
+		threadRingReleased = true;
+	}
+};
+
+thread_local LogRingReleaser threadRingReleaser;
+
+const char *getLevelColor(LogLevel lvl) {
+	switch (lvl) {
+	case LogLevel::Info:
+		return ANSI_COLOR_RESET;
+	case LogLevel::InfoFancy:
+		return ANSI_COLOR_BLUE;
+	case LogLevel::Warning:
+		return ANSI_COLOR_YELLOW;
+	case LogLevel::Error:
+		return ANSI_COLOR_RED;
+	case LogLevel::Debug:
+		return ANSI_COLOR_GREEN;
+	default:
+		return ANSI_COLOR_RESET;
+	}
+}
+
+void writeRecord(const LogRecord &record) {
+	fprintf(OUT_STREAM, "%s%s %s\n", getLevelColor(record.level), record.message, ANSI_COLOR_RESET);
+}
+
+/// Write out the records of all rings in the order they were logged. Needs drainMutex.
+void drainLocked(LoggerState &state) {
+	uint64_t numDropped = 0;
+	state.batch.clear();
+
+	{
+		std::lock_guard<std::mutex> lock(state.ringsMutex);
+		for (int i = 0; i < int(state.rings.size()); ++i) {
+			LogRing *ring = state.rings[i];
+
+			// Checked before head, so an abandoned ring has no pushes after the ones read here.
+			const bool abandoned = ring->abandoned.load(std::memory_order_acquire);
+			const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+			const uint64_t head = ring->head.load(std::memory_order_acquire);
+			for (uint64_t j = tail; j < head; ++j) {
+				state.batch.push_back(ring->records[j & (Logger::RING_CAPACITY - 1)]);
+			}
+			ring->tail.store(head, std::memory_order_release);
+			numDropped += ring->numDropped.exchange(0, std::memory_order_relaxed);
+
+			if (abandoned) {
+				delete ring;
+				state.rings[i] = state.rings.back();
+				state.rings.pop_back();
+				--i;
+			}
+		}
+	}
+
+	if (state.batch.empty() && numDropped == 0) {
+		return;
+	}
+
+	std::sort(state.batch.begin(), state.batch.end(), [](const LogRecord &a, const LogRecord &b) {
+		return a.sequence < b.sequence;
+	});
+
+	for (int i = 0; i < int(state.batch.size()); ++i) {
+		writeRecord(state.batch[i]);
+	}
+
+	if (numDropped > 0) {
+		fprintf(OUT_STREAM, "%sLogger dropped %llu messages %s\n", ANSI_COLOR_YELLOW, (unsigned long long)numDropped, ANSI_COLOR_RESET);
+	}
+
+	fflush(OUT_STREAM);
+}
+
+void drainThreadMain(LoggerState *state) {
+	while (!state->stopped.load(std::memory_order_acquire)) {
+		{
+			std::unique_lock<std::mutex> lock(state->wakeMutex);
+			state->wake.wait_for(lock, DRAIN_INTERVAL);
+		}
+
+		std::lock_guard<std::mutex> lock(state->drainMutex);
+		drainLocked(*state);
+	}
+}
+
+/// Write all of text with write(2), which unlike stdio may be used in signal handlers.
+void writeRaw(const char *text, size_t size) {
+	while (size > 0) {
+#ifdef _WIN32
+		const int written = _write(OUT_FD, text, unsigned(size));
+#else // !_WIN32
+		const ssize_t written = write(OUT_FD, text, size);
+#endif // _WIN32
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return;
+		}
+		text += written;
+		size -= size_t(written);
+	}
+}
+
+/// Append text to line, cut off at capacity.
+void appendRaw(char *line, size_t capacity, size_t &length, const char *text) {
+	const size_t size = std::min(strlen(text), capacity - length);
+	memcpy(line + length, text, size);
+	length += size;
+}
+
+void appendRaw(char *line, size_t capacity, size_t &length, uint64_t value) {
+	char digits[20];
+	int numDigits = 0;
+	do {
+		digits[numDigits++] = char('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+
+	while (numDigits > 0 && length < capacity) {
+		line[length++] = digits[--numDigits];
+	}
+}
+
+/// Same output as writeRecord, formatted on the stack and written with a single write(2).
+void writeRecordRaw(const LogRecord &record) {
+	char line[Logger::MAX_MESSAGE_SIZE + 32];
+	size_t length = 0;
+	appendRaw(line, sizeof(line), length, getLevelColor(record.level));
+	appendRaw(line, sizeof(line), length, record.message);
+	appendRaw(line, sizeof(line), length, " " ANSI_COLOR_RESET "\n");
+	writeRaw(line, length);
+}
+
+/// Write out the records of all rings in the order they were logged. Needs drainMutex and ringsMutex.
+/// Safe in signal handlers: nothing is allocated or freed, so abandoned rings are left in place,
+/// and instead of sorting a batch the ring with the oldest next record is picked each time.
+void drainRawLocked(LoggerState &state) {
+	// Only what is there now, threads still logging must not keep the crashing one here.
+	uint64_t numPending = 0;
+	uint64_t numDropped = 0;
+	for (size_t i = 0; i < state.rings.size(); ++i) {
+		LogRing *ring = state.rings[i];
+		numPending += ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_relaxed);
+		numDropped += ring->numDropped.exchange(0, std::memory_order_relaxed);
+	}
+
+	for (; numPending > 0; --numPending) {
+		LogRing *oldest = nullptr;
+		uint64_t oldestSequence = 0;
+		for (size_t i = 0; i < state.rings.size(); ++i) {
+			LogRing *ring = state.rings[i];
+			const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+			if (tail == ring->head.load(std::memory_order_acquire)) {
+				continue;
+			}
+
+			const uint64_t sequence = ring->records[tail & (Logger::RING_CAPACITY - 1)].sequence;
+			if (oldest == nullptr || sequence < oldestSequence) {
+				oldest = ring;
+				oldestSequence = sequence;
+			}
+		}
+
+		if (oldest == nullptr) {
+			break;
+		}
+
+		const uint64_t tail = oldest->tail.load(std::memory_order_relaxed);
+		writeRecordRaw(oldest->records[tail & (Logger::RING_CAPACITY - 1)]);
+		oldest->tail.store(tail + 1, std::memory_order_release);
+	}
+
+	if (numDropped > 0) {
+		char line[64];
+		size_t length = 0;
+		appendRaw(line, sizeof(line), length, ANSI_COLOR_YELLOW "Logger dropped ");
+		appendRaw(line, sizeof(line), length, numDropped);
+		appendRaw(line, sizeof(line), length, " messages " ANSI_COLOR_RESET "\n");
+		writeRaw(line, length);
+	}
+}
+
+/// Flush from a crashing thread, possibly inside a signal handler. Best effort, the process is going down anyway.
+/// Locks are only tried, never waited on. If one stays taken the records are left where they are,
+/// since writing them next to a drain in progress would duplicate and interleave them.
+void crashFlush() {
+	LoggerState *state = loggerState.load(std::memory_order_acquire);
+	if (state == nullptr) {
+		return;
+	}
+
+	// The drain in progress may be on the crashing thread itself, so don't wait for it forever.
+	const auto deadline = std::chrono::steady_clock::now() + CRASH_FLUSH_TIMEOUT;
+	bool locked = state->drainMutex.try_lock();
+	while (!locked && std::chrono::steady_clock::now() < deadline) {
+		locked = state->drainMutex.try_lock();
+	}
+	if (!locked) {
+		return;
+	}
+
+	// Only taken by threads registering their ring, which are not worth waiting for either.
+	if (state->ringsMutex.try_lock()) {
+		drainRawLocked(*state);
+		state->ringsMutex.unlock();
+	}
+
+	state->drainMutex.unlock();
+}
+
+typedef void (*SignalHandler)(int);
+
+constexpr int CRASH_SIGNALS[] = { SIGSEGV, SIGABRT, SIGFPE, SIGILL };
+SignalHandler previousSignalHandlers[sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0])];
+std::terminate_handler previousTerminateHandler = nullptr;
+
+void onCrashSignal(int sig) {
+	crashFlush();
+
+	// Let whoever was there before us (or the default action) finish the job.
+	for (int i = 0; i < int(sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0])); ++i) {
+		if (CRASH_SIGNALS[i] == sig) {
+			const SignalHandler previous = previousSignalHandlers[i];
+			signal(sig, previous == SIG_ERR ? SIG_DFL : previous);
+			break;
+		}
+	}
+	raise(sig);
+}
+
+void onTerminate() {
+	crashFlush();
+
+	if (previousTerminateHandler != nullptr) {
+		previousTerminateHandler();
+	}
+	abort();
+}
+
+void onExit() {
+	LoggerState *state = loggerState.load(std::memory_order_acquire);
+
+	state->stopped.store(true, std::memory_order_release);
+	state->wake.notify_one();
+	if (state->drainThread.joinable()) {
+		state->drainThread.join();
+	}
+
+	// Logs after this point are written synchronously by the logging thread.
+	Logger::flush();
+}
+
+LoggerState &getLoggerState() {
+	static LoggerState *state = []() {
+		LoggerState *result = new LoggerState();
+		result->batch.reserve(Logger::RING_CAPACITY * 4);
+		loggerState.store(result, std::memory_order_release);
+
+		result->drainThread = std::thread(drainThreadMain, result);
+		atexit(onExit);
+
+		for (int i = 0; i < int(sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0])); ++i) {
+			previousSignalHandlers[i] = signal(CRASH_SIGNALS[i], onCrashSignal);
+		}
+		previousTerminateHandler = std::set_terminate(onTerminate);
+
+		return result;
+	}();
+
+	return *state;
+}
+
+/// Ring of the calling thread or nullptr if the thread is already exiting.
+LogRing *getThreadRing(LoggerState &state) {
+	if (threadRing != nullptr || threadRingReleased) {
+		return threadRing;
+	}
+
+	LogRing *ring = new LogRing();
+	{
+		std::lock_guard<std::mutex> lock(state.ringsMutex);
+		state.rings.push_back(ring);
+	}
+
+	// Touching the releaser constructs it, so its destructor runs at thread exit.
+	(void)&threadRingReleaser;
+	threadRing = ring;
+
+	return ring;
+}
+
+} // namespace
+
+/*
+===============================================================
+Logger
+===============================================================
+*/
+std::atomic<int> Logger::loggingLevel(static_cast<int>(LogLevel::InfoFancy));
 
 void Logger::setLogLevel(LogLevel lvl) {
-	loggingLevel = static_cast<int>(lvl);
+	loggingLevel.store(static_cast<int>(lvl), std::memory_order_relaxed);
 }
 
 void Logger::log(LogLevel lvl, const char *fmt, ...) {
@@ -26,37 +406,90 @@ void Logger::log(LogLevel lvl, const char *fmt, ...) {
 #endif
 
 	int currentLvl = static_cast<int>(lvl);
-	if (lvl != LogLevel::Debug && lvl != LogLevel::Error && currentLvl > loggingLevel) {
+	if (lvl != LogLevel::Debug && lvl != LogLevel::Error && currentLvl > loggingLevel.load(std::memory_order_relaxed)) {
 		return;
 	}
 
-	const char *color = nullptr;
-	switch (lvl) {
-	case LogLevel::Info:
-		color = ANSI_COLOR_RESET;
-		break;
-	case LogLevel::InfoFancy:
-		color = ANSI_COLOR_BLUE;
-		break;
-	case LogLevel::Warning:
-		color = ANSI_COLOR_YELLOW;
-		break;
-	case LogLevel::Error:
-		color = ANSI_COLOR_RED;
-		break;
-	case LogLevel::Debug:
-		color = ANSI_COLOR_GREEN;
-		break;
-	default:
-		color = ANSI_COLOR_RESET;
-		break;
-	}
+	LoggerState &state = getLoggerState();
+	LogRing *ring = state.stopped.load(std::memory_order_acquire) ? nullptr : getThreadRing(state);
 
 	va_list args;
-	__va_start(&args, fmt);
-	char fmt_[1024];
-	sprintf_s(fmt_, "%s%s %s", color, fmt, ANSI_COLOR_RESET);
-	vfprintf(OUT_STREAM, fmt_, args);
-	__crt_va_end(args);
-	fprintf(OUT_STREAM, "\n");
+	va_start(args, fmt);
+
+	if (ring == nullptr) {
+		// Exiting thread or process, nobody drains the rings anymore.
+		LogRecord record;
+		record.sequence = state.nextSequence.fetch_add(1, std::memory_order_relaxed);
+		record.level = lvl;
+		vsnprintf(record.message, sizeof(record.message), fmt, args);
+		va_end(args);
+
+		std::lock_guard<std::mutex> lock(state.drainMutex);
+		writeRecord(record);
+		fflush(OUT_STREAM);
+		return;
+	}
+
+	const uint64_t head = ring->head.load(std::memory_order_relaxed);
+	const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+	if (head - tail >= RING_CAPACITY) {
+		va_end(args);
+		ring->numDropped.fetch_add(1, std::memory_order_relaxed);
+		state.numDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	LogRecord &record = ring->records[head & (RING_CAPACITY - 1)];
+	record.sequence = state.nextSequence.fetch_add(1, std::memory_order_relaxed);
+	record.level = lvl;
+	vsnprintf(record.message, sizeof(record.message), fmt, args);
+	va_end(args);
+
+	ring->head.store(head + 1, std::memory_order_release);
+
+	// Errors are worth seeing right away and a filling ring is worth draining early.
+	if (lvl == LogLevel::Error || head - tail >= RING_CAPACITY / 2) {
+		state.wake.notify_one();
+	}
+}
+
+void Logger::flush() {
+	LoggerState *state = loggerState.load(std::memory_order_acquire);
+	if (state == nullptr) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(state->drainMutex);
+	drainLocked(*state);
+}
+
+unsigned long long Logger::getNumDropped() {
+	LoggerState *state = loggerState.load(std::memory_order_acquire);
+	return state != nullptr ? state->numDropped.load(std::memory_order_relaxed) : 0;
+}
+
+/*
+===============================================================
+LogRateLimiter
+===============================================================
+*/
+bool LogRateLimiter::allow(unsigned int &suppressed) {
+	suppressed = 0;
+
+	const long long nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+	).count();
+
+	long long windowStart = windowStartMs.load(std::memory_order_relaxed);
+	if (nowMs - windowStart >= 1000 && windowStartMs.compare_exchange_strong(windowStart, nowMs, std::memory_order_relaxed)) {
+		numInWindow.store(0, std::memory_order_relaxed);
+	}
+
+	if (numInWindow.fetch_add(1, std::memory_order_relaxed) < maxPerSecond) {
+		suppressed = numSuppressed.exchange(0, std::memory_order_relaxed);
+		return true;
+	}
+
+	numSuppressed.fetch_add(1, std::memory_order_relaxed);
+	return false;
 }
\ No newline at end of file
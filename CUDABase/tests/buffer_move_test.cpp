@@ -0,0 +1,260 @@
+// Moving, swapping and storing CUDABuffers and CUDAPinnedMemoryBuffers in containers.
+#include <cuda_buffer.h>
+
+#include <test_common.h>
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr SizeType KB = 1024;
+
+void fillPattern(std::vector<unsigned char> &data, unsigned char seed) {
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = (unsigned char)(seed + i * 11);
+	}
+}
+
+std::vector<unsigned char> makePattern(SizeType size, unsigned char seed) {
+	std::vector<unsigned char> data(static_cast<size_t>(size));
+	fillPattern(data, seed);
+	return data;
+}
+
+/// Blocks of allocator which are not freed yet, over all devices.
+template <class Allocator>
+SizeType getLiveBlocks() {
+	std::vector<CUDAAllocatorStatsSnapshot> snapshots;
+	getCUDAManager().getAllocator<Allocator>().getStats().getSnapshots(snapshots);
+
+	SizeType liveBlocks = 0;
+	for (int i = 0; i < snapshots.size(); ++i) {
+		liveBlocks += snapshots[i].liveBlocks;
+	}
+	return liveBlocks;
+}
+
+template <class Buffer>
+bool holds(Buffer &buffer, const std::vector<unsigned char> &data) {
+	std::vector<unsigned char> result(data.size());
+	return buffer.getSize() == data.size() && !buffer.download(result.data()).hasError() && result == data;
+}
+
+/*
+===============================================================
+CUDABuffer
+===============================================================
+*/
+void testVectorGrowth() {
+	const SizeType liveBefore = getLiveBlocks<CUDADefaultAllocator>();
+
+	// No reserve, so the buffers are moved every time the vector grows.
+	std::vector<CUDADefaultBuffer> buffers;
+	std::vector<CUDAMemHandle> handles;
+	for (int i = 0; i < 40; ++i) {
+		CUDADefaultBuffer buffer;
+		TEST_CHECK_NO_ERROR(buffer.initialize(4 * KB));
+		TEST_CHECK_NO_ERROR(buffer.upload(makePattern(4 * KB, (unsigned char)i).data()));
+		handles.push_back(buffer.handle());
+		buffers.push_back(std::move(buffer));
+		TEST_CHECK(buffer.handle() == NULL && buffer.getSize() == 0);
+	}
+	TEST_CHECK(getLiveBlocks<CUDADefaultAllocator>() == liveBefore + 40);
+
+	for (int i = 0; i < buffers.size(); ++i) {
+		TEST_CHECK(buffers[i].handle() == handles[i]);
+		TEST_CHECK(holds(buffers[i], makePattern(4 * KB, (unsigned char)i)));
+	}
+
+	// Erasing from the middle moves the buffers after it down by one and frees only the erased one.
+	buffers.erase(buffers.begin() + 10);
+	handles.erase(handles.begin() + 10);
+	TEST_CHECK(getLiveBlocks<CUDADefaultAllocator>() == liveBefore + 39);
+	for (int i = 0; i < buffers.size(); ++i) {
+		TEST_CHECK(buffers[i].handle() == handles[i]);
+	}
+	TEST_CHECK(holds(buffers[10], makePattern(4 * KB, 11)));
+
+	// Buffers can be freed after they were moved around.
+	TEST_CHECK_NO_ERROR(buffers[20].deinitialize());
+	TEST_CHECK(getLiveBlocks<CUDADefaultAllocator>() == liveBefore + 38);
+
+	buffers.clear();
+	TEST_CHECK(getLiveBlocks<CUDADefaultAllocator>() == liveBefore);
+}
+
+void testMoveAssignAndSwap() {
+	const SizeType liveBefore = getLiveBlocks<CUDADefaultAllocator>();
+	const std::vector<unsigned char> first = makePattern(8 * KB, 1);
+	const std::vector<unsigned char> second = makePattern(2 * KB, 2);
+
+	CUDADefaultBuffer a;
+	CUDADefaultBuffer b;
+	TEST_CHECK_NO_ERROR(a.initialize(first.size()));
+	TEST_CHECK_NO_ERROR(a.upload(first.data()));
+	TEST_CHECK_NO_ERROR(b.initialize(second.size()));
+	TEST_CHECK_NO_ERROR(b.upload(second.data()));
+
+	a.swap(b);
+	TEST_CHECK(holds(a, second));
+	TEST_CHECK(holds(b, first));
+
+	// Moving onto a buffer frees what it held.
+	const CUDAMemHandle ptr = b.handle();
+	a = std::move(b);
+	TEST_CHECK(a.handle() == ptr);
+	TEST_CHECK(holds(a, first));
+	TEST_CHECK(b.handle() == NULL);
+	TEST_CHECK(getLiveBlocks<CUDADefaultAllocator>() == liveBefore + 1);
+
+	// Moving onto itself keeps the memory.
+	CUDADefaultBuffer &alias = a;
+	a = std::move(alias);
+	TEST_CHECK(a.handle() == ptr);
+	TEST_CHECK(holds(a, first));
+
+	// A moved-from buffer is empty but can be used again.
+	TEST_CHECK(b.upload(second.data()).hasError());
+	TEST_CHECK_NO_ERROR(b.deinitialize());
+	TEST_CHECK_NO_ERROR(b.initialize(second.size()));
+	TEST_CHECK_NO_ERROR(b.upload(second.data()));
+	TEST_CHECK(holds(b, second));
+	TEST_CHECK(getLiveBlocks<CUDADefaultAllocator>() == liveBefore + 2);
+}
+
+void testMovedVirtualBufferGrows() {
+	const std::vector<unsigned char> data = makePattern(64 * KB, 5);
+
+	CUDAVirtualBuffer original;
+	TEST_CHECK_NO_ERROR(original.initialize(data.size()));
+	TEST_CHECK_NO_ERROR(original.upload(data.data()));
+
+	// The reservation is found by the device pointer, not by the buffer object.
+	CUDAVirtualBuffer moved(std::move(original));
+	const CUDAMemHandle ptr = moved.handle();
+	TEST_CHECK_NO_ERROR(moved.grow(2 * data.size()));
+	TEST_CHECK(moved.handle() == ptr);
+
+	std::vector<unsigned char> result(data.size() * 2);
+	TEST_CHECK_NO_ERROR(moved.download(result.data()));
+	TEST_CHECK(memcmp(result.data(), data.data(), data.size()) == 0);
+}
+
+/*
+===============================================================
+CUDAPinnedMemoryBuffer
+===============================================================
+*/
+/// Write data to the host side of buffer and send it to the device side.
+void uploadPinned(CUDADefaultPinnedBuffer &buffer, const std::vector<unsigned char> &data) {
+	memcpy(buffer.hostHandle(), data.data(), data.size());
+	TEST_CHECK_NO_ERROR(buffer.upload());
+}
+
+/// Clear the host side of buffer and bring the device side back into it.
+bool pinnedHolds(CUDADefaultPinnedBuffer &buffer, const std::vector<unsigned char> &data) {
+	if (buffer.getMode() == CUDAHostMemoryMode::Staged) {
+		memset(buffer.hostHandle(), 0, size_t(buffer.getSize()));
+	}
+	return buffer.getSize() == data.size()
+		&& !buffer.download().hasError()
+		&& memcmp(buffer.hostHandle(), data.data(), data.size()) == 0;
+}
+
+bool isEmpty(const CUDADefaultPinnedBuffer &buffer) {
+	return buffer.handle() == NULL && buffer.hostHandle() == nullptr && buffer.getSize() == 0;
+}
+
+void testPinnedMoves(CUDAHostMemoryMode mode) {
+	const std::vector<unsigned char> data = makePattern(16 * KB, 7);
+
+	CUDADefaultPinnedBuffer original;
+	TEST_CHECK_NO_ERROR(original.initialize(data.size(), NULL, mode));
+	TEST_CHECK(original.getMode() == mode);
+	uploadPinned(original, data);
+
+	const CUDAMemHandle ptr = original.handle();
+	void *hostPtr = original.hostHandle();
+
+	CUDADefaultPinnedBuffer moved(std::move(original));
+	TEST_CHECK(isEmpty(original));
+	TEST_CHECK(moved.handle() == ptr && moved.hostHandle() == hostPtr);
+	TEST_CHECK(moved.getMode() == mode);
+	TEST_CHECK(pinnedHolds(moved, data));
+
+	CUDADefaultPinnedBuffer &alias = moved;
+	moved = std::move(alias);
+	TEST_CHECK(moved.handle() == ptr && moved.hostHandle() == hostPtr);
+	TEST_CHECK(pinnedHolds(moved, data));
+
+	// Growing a vector moves the host slice and the device side together.
+	std::vector<CUDADefaultPinnedBuffer> buffers;
+	for (int i = 0; i < 20; ++i) {
+		CUDADefaultPinnedBuffer buffer;
+		TEST_CHECK_NO_ERROR(buffer.initialize(4 * KB, NULL, mode));
+		uploadPinned(buffer, makePattern(4 * KB, (unsigned char)i));
+		buffers.push_back(std::move(buffer));
+	}
+	buffers.erase(buffers.begin() + 3);
+	for (int i = 0; i < buffers.size(); ++i) {
+		TEST_CHECK(buffers[i].getMode() == mode);
+		TEST_CHECK(pinnedHolds(buffers[i], makePattern(4 * KB, (unsigned char)(i < 3 ? i : i + 1))));
+	}
+
+	// The moved-from buffer can be initialized again.
+	TEST_CHECK_NO_ERROR(original.initialize(data.size(), NULL, mode));
+	uploadPinned(original, data);
+	TEST_CHECK(pinnedHolds(original, data));
+}
+
+void testPinnedMoveAssignAndSwap() {
+	CUDAPinnedHostPool &pool = getCUDAManager().getPinnedHostPool();
+
+	// The manager's pool has the default chunk size, this is big enough for a slice of its own so the pool counts them.
+	const SizeType size = CUDAPinnedHostPool::DEFAULT_CHUNK_SIZE / 4 + CUDAPinnedHostPool::MIN_SLICE_SIZE;
+	const SizeType slicesBefore = pool.getNumDedicatedSlices();
+	const std::vector<unsigned char> stagedData = makePattern(size, 3);
+	const std::vector<unsigned char> mappedData = makePattern(size, 4);
+
+	CUDADefaultPinnedBuffer staged;
+	CUDADefaultPinnedBuffer mapped;
+	TEST_CHECK_NO_ERROR(staged.initialize(size, NULL, CUDAHostMemoryMode::Staged));
+	TEST_CHECK_NO_ERROR(mapped.initialize(size, NULL, CUDAHostMemoryMode::Mapped));
+	uploadPinned(staged, stagedData);
+	uploadPinned(mapped, mappedData);
+	TEST_CHECK(pool.getNumDedicatedSlices() == slicesBefore + 2);
+
+	// The mode goes with the memory.
+	staged.swap(mapped);
+	TEST_CHECK(staged.getMode() == CUDAHostMemoryMode::Mapped);
+	TEST_CHECK(mapped.getMode() == CUDAHostMemoryMode::Staged);
+	TEST_CHECK(pinnedHolds(staged, mappedData));
+	TEST_CHECK(pinnedHolds(mapped, stagedData));
+
+	// Moving onto a buffer gives its slice back to the pool.
+	staged = std::move(mapped);
+	TEST_CHECK(isEmpty(mapped));
+	TEST_CHECK(staged.getMode() == CUDAHostMemoryMode::Staged);
+	TEST_CHECK(pinnedHolds(staged, stagedData));
+	TEST_CHECK(pool.getNumDedicatedSlices() == slicesBefore + 1);
+
+	TEST_CHECK_NO_ERROR(staged.deinitialize());
+	TEST_CHECK(pool.getNumDedicatedSlices() == slicesBefore);
+}
+
+} // namespace
+
+int main() {
+	TEST_CHECK(initializeCUDAManager({}, false));
+	RUN_TEST(testVectorGrowth);
+	RUN_TEST(testMoveAssignAndSwap);
+	RUN_TEST(testMovedVirtualBufferGrows);
+	RUN_TEST(testPinnedMoves, CUDAHostMemoryMode::Staged);
+	RUN_TEST(testPinnedMoves, CUDAHostMemoryMode::Mapped);
+	RUN_TEST(testPinnedMoveAssignAndSwap);
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,240 @@
+// Bins, reuse, trimming and misuse of CUDACachingPool and CUDADefaultAllocator.
+#include <cuda_caching_pool.h>
+#include <cuda_manager.h>
+
+#include <test_common.h>
+
+#include <vector>
+
+namespace {
+
+constexpr SizeType KB = 1024;
+constexpr SizeType MB = 1024 * KB;
+
+/// Host fences which count how often the pool looked at another stream and waited for it.
+struct CountingFenceBackend : CUDAHostFenceBackend {
+	int numRecorded = 0;
+	int numWaits = 0;
+
+	CUDAError record(CUDAFence &fence, CUstream stream) override {
+		++numRecorded;
+		return CUDAHostFenceBackend::record(fence, stream);
+	}
+
+	CUDAError wait(CUDAFence fence) override {
+		++numWaits;
+		return CUDAHostFenceBackend::wait(fence);
+	}
+};
+
+struct TestPool {
+	CUDAHostMemoryBackend hostMemory;
+	CUDABudgetMemoryBackend memory;
+	CountingFenceBackend fences;
+	CUDACachingPool pool;
+
+	TestPool(SizeType budget = SizeType(-1) / 2) : memory(&hostMemory, budget) {
+		TEST_CHECK_NO_ERROR(pool.initialize(&memory, CUDACachingPool::DEFAULT_MAX_CACHED_BYTES, &fences));
+	}
+
+	CUDAMemHandle allocate(SizeType size, CUDAPoolStream stream) {
+		CUDAMemHandle ptr = NULL;
+		SizeType blockSize = 0;
+		TEST_CHECK_NO_ERROR(pool.allocate(ptr, blockSize, size, stream));
+		TEST_CHECK(ptr != NULL && blockSize >= CUDACachingPool::getBinSize(size));
+		return ptr;
+	}
+};
+
+const CUcontext testCtx = reinterpret_cast<CUcontext>(1);
+const CUDAPoolStream firstStream(testCtx, reinterpret_cast<CUstream>(1));
+const CUDAPoolStream secondStream(testCtx, reinterpret_cast<CUstream>(2));
+
+/// Same stream handle, but in another context.
+const CUDAPoolStream otherCtxStream(reinterpret_cast<CUcontext>(2), reinterpret_cast<CUstream>(1));
+
+/*
+===============================================================
+Bins and reuse
+===============================================================
+*/
+void testBinSizes() {
+	TEST_CHECK(CUDACachingPool::getBinSize(1) == CUDACachingPool::MIN_BIN_SIZE);
+	TEST_CHECK(CUDACachingPool::getBinSize(512) == 512);
+	TEST_CHECK(CUDACachingPool::getBinSize(513) == KB);
+	TEST_CHECK(CUDACachingPool::getBinSize(100 * KB) == 128 * KB);
+	TEST_CHECK(CUDACachingPool::getBinSize(MB) == MB);
+
+	// Past the small bins only LARGE_BIN_GRANULARITY steps.
+	TEST_CHECK(CUDACachingPool::getBinSize(MB + 1) == 2 * MB);
+	TEST_CHECK(CUDACachingPool::getBinSize(5 * MB) == 6 * MB);
+}
+
+void testReuseOnTheSameStream() {
+	TestPool test;
+
+	CUDAMemHandle small = test.allocate(100 * KB, firstStream);
+	TEST_CHECK_NO_ERROR(test.pool.free(small, firstStream.stream));
+	TEST_CHECK(test.pool.getCachedBytes() == 128 * KB);
+	TEST_CHECK(test.allocate(128 * KB, firstStream) == small);
+
+	// Small bins must match exactly.
+	TEST_CHECK_NO_ERROR(test.pool.free(small, firstStream.stream));
+	TEST_CHECK(test.allocate(64 * KB, firstStream) != small);
+
+	// Large blocks are reused with up to a quarter of slack, not more.
+	CUDAMemHandle large = test.allocate(8 * MB, firstStream);
+	TEST_CHECK_NO_ERROR(test.pool.free(large, firstStream.stream));
+	TEST_CHECK(test.allocate(4 * MB, firstStream) != large);
+	TEST_CHECK(test.allocate(7 * MB, firstStream) == large);
+
+	// The stream orders the old and the new work, so nothing was waited for.
+	TEST_CHECK(test.fences.numRecorded == 0);
+}
+
+void testReuseOnAnotherStream() {
+	TestPool test;
+
+	// The other stream is idle, so its block is taken right away.
+	CUDAMemHandle ptr = test.allocate(4 * MB, firstStream);
+	TEST_CHECK_NO_ERROR(test.pool.free(ptr, firstStream.stream));
+	TEST_CHECK(test.allocate(4 * MB, secondStream) == ptr);
+	TEST_CHECK(test.fences.numRecorded == 1);
+	TEST_CHECK(test.fences.numWaits == 0);
+
+	// Never across contexts.
+	TEST_CHECK_NO_ERROR(test.pool.free(ptr, secondStream.stream));
+	TEST_CHECK(test.allocate(4 * MB, otherCtxStream) != ptr);
+
+	// While the other stream is busy a new block is allocated and the cached one stays.
+	test.fences.setManualSignal(true);
+	TEST_CHECK(test.allocate(4 * MB, firstStream) != ptr);
+	TEST_CHECK(test.pool.getCachedBytes() == 4 * MB);
+	TEST_CHECK(test.fences.numWaits == 0);
+}
+
+void testWaitForAnotherStream() {
+	// Room for a single block.
+	TestPool test(4 * MB);
+	test.fences.setManualSignal(true);
+
+	CUDAMemHandle ptr = test.allocate(4 * MB, firstStream);
+	TEST_CHECK_NO_ERROR(test.pool.free(ptr, firstStream.stream));
+
+	// The backend is out of memory, so the pool waits for the first stream instead of releasing the block.
+	TEST_CHECK(test.allocate(4 * MB, secondStream) == ptr);
+	TEST_CHECK(test.fences.numWaits == 1);
+	TEST_CHECK(test.memory.getUsedBytes() == 4 * MB);
+}
+
+void testTrim() {
+	TestPool test;
+
+	std::vector<CUDAMemHandle> blocks;
+	for (int i = 0; i < 4; ++i) {
+		blocks.push_back(test.allocate(2 * MB, i % 2 == 0 ? firstStream : secondStream));
+	}
+	CUDAMemHandle live = test.allocate(2 * MB, firstStream);
+	for (int i = 0; i < blocks.size(); ++i) {
+		TEST_CHECK_NO_ERROR(test.pool.free(blocks[i], i % 2 == 0 ? firstStream.stream : secondStream.stream));
+	}
+	TEST_CHECK(test.pool.getCachedBytes() == 8 * MB);
+	TEST_CHECK(test.memory.getUsedBytes() == 10 * MB);
+
+	TEST_CHECK_NO_ERROR(test.pool.trim(4 * MB));
+	TEST_CHECK(test.pool.getCachedBytes() == 4 * MB);
+	TEST_CHECK(test.memory.getUsedBytes() == 6 * MB);
+
+	// Blocks in use are not touched.
+	TEST_CHECK_NO_ERROR(test.pool.trim());
+	TEST_CHECK(test.pool.getCachedBytes() == 0);
+	TEST_CHECK(test.pool.getNumCachedBlocks() == 0);
+	TEST_CHECK(test.memory.getUsedBytes() == 2 * MB);
+	TEST_CHECK(test.pool.getLiveBytes() == 2 * MB);
+
+	// Above the high-water cap blocks go back to the backend when they are freed.
+	test.pool.setMaxCachedBytes(0);
+	TEST_CHECK_NO_ERROR(test.pool.free(live, firstStream.stream));
+	TEST_CHECK(test.memory.getUsedBytes() == 0);
+}
+
+/*
+===============================================================
+Misuse
+===============================================================
+*/
+void testDoubleFree() {
+	TestPool test;
+	const SizeType blockSize = CUDACachingPool::getBinSize(4 * KB);
+
+	// The block is in the cache of this thread, the pool can tell without the lock.
+	CUDAMemHandle ptr = test.allocate(4 * KB, firstStream);
+	TEST_CHECK_NO_ERROR(test.pool.free(ptr, blockSize, firstStream));
+	TEST_CHECK(test.pool.free(ptr, blockSize, firstStream).hasError());
+	TEST_CHECK(test.pool.free(ptr, firstStream.stream).hasError());
+
+	CUDAMemHandle first = test.allocate(4 * KB, firstStream);
+	CUDAMemHandle second = test.allocate(4 * KB, firstStream);
+	TEST_CHECK(first != second);
+
+	// On the free lists it isn't live anymore.
+	TEST_CHECK_NO_ERROR(test.pool.free(first, firstStream.stream));
+	TEST_CHECK(test.pool.free(first, firstStream.stream).hasError());
+	TEST_CHECK(test.pool.free(NULL, blockSize, firstStream).hasError());
+}
+
+void testLiveBytes() {
+	TestPool test;
+	const SizeType blockSize = CUDACachingPool::getBinSize(4 * KB);
+
+	CUDAMemHandle ptr = test.allocate(4 * KB, firstStream);
+	TEST_CHECK(test.pool.getLiveBytes() == blockSize);
+
+	// Freed to the thread cache, it is cached and not live.
+	TEST_CHECK_NO_ERROR(test.pool.free(ptr, blockSize, firstStream));
+	TEST_CHECK(test.pool.getLiveBytes() == 0);
+	TEST_CHECK(test.pool.getCachedBytes() == blockSize);
+}
+
+void testDefaultAllocatorDoubleFree() {
+	CUDADefaultAllocator &allocator = getCUDAManager().getAllocator<CUDADefaultAllocator>();
+
+	CUDADefaultAllocator::CUDAMemBlock block;
+	block.size = 4 * KB;
+	TEST_CHECK_NO_ERROR(allocator.allocate(block));
+	const CUDADefaultAllocator::CUDAMemBlock copy = block;
+
+	TEST_CHECK_NO_ERROR(allocator.free(block));
+	TEST_CHECK(block.ptr == NULL);
+	CUDADefaultAllocator::CUDAMemBlock again = copy;
+	TEST_CHECK(allocator.free(again).hasError());
+	TEST_CHECK(allocator.free(block).hasError());
+
+	// The block went back to the pool once, so it is handed out once.
+	CUDADefaultAllocator::CUDAMemBlock first;
+	CUDADefaultAllocator::CUDAMemBlock second;
+	first.size = second.size = 4 * KB;
+	TEST_CHECK_NO_ERROR(allocator.allocate(first));
+	TEST_CHECK_NO_ERROR(allocator.allocate(second));
+	TEST_CHECK(first.ptr != second.ptr);
+	TEST_CHECK_NO_ERROR(allocator.free(first));
+	TEST_CHECK_NO_ERROR(allocator.free(second));
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testBinSizes);
+	RUN_TEST(testReuseOnTheSameStream);
+	RUN_TEST(testReuseOnAnotherStream);
+	RUN_TEST(testWaitForAnotherStream);
+	RUN_TEST(testTrim);
+	RUN_TEST(testDoubleFree);
+	RUN_TEST(testLiveBytes);
+
+	TEST_CHECK(initializeCUDAManager({}, false));
+	RUN_TEST(testDefaultAllocatorDoubleFree);
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,231 @@
+// Recording, merging and flushing of CUDACommandBuffer on the host command backend.
+#include <cuda_command_buffer.h>
+
+#include <test_common.h>
+
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const CUcontext firstCtx = reinterpret_cast<CUcontext>(1);
+const CUcontext secondCtx = reinterpret_cast<CUcontext>(2);
+const CUcontext otherCtx = reinterpret_cast<CUcontext>(3);
+
+const CUstream firstStream = reinterpret_cast<CUstream>(1);
+const CUstream secondStream = reinterpret_cast<CUstream>(2);
+
+const CUevent firstEvent = reinterpret_cast<CUevent>(1);
+const CUevent secondEvent = reinterpret_cast<CUevent>(2);
+
+const CUfunction testFunction = reinterpret_cast<CUfunction>(1);
+
+const CUDAMemHandle devicePtr = 0x10000;
+
+/*
+===============================================================
+Recording
+===============================================================
+*/
+void testMergeTransfers() {
+	CUDAHostCommandBackend backend;
+	CUDACommandBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(firstStream, firstCtx, &backend));
+
+	char host[256];
+
+	// Continuing in both memories, so the three are one copy.
+	TEST_CHECK_NO_ERROR(buffer.recordUpload(devicePtr, host, 64));
+	TEST_CHECK_NO_ERROR(buffer.recordUpload(devicePtr + 64, host + 64, 32));
+	TEST_CHECK_NO_ERROR(buffer.recordUpload(devicePtr + 96, host + 96, 32));
+
+	// Continuing only in device memory, in the other direction or after an empty copy, they stay apart.
+	TEST_CHECK_NO_ERROR(buffer.recordUpload(devicePtr + 128, host + 200, 16));
+	TEST_CHECK_NO_ERROR(buffer.recordDownload(host + 216, devicePtr + 144, 16));
+	TEST_CHECK_NO_ERROR(buffer.recordDownload(host, devicePtr + 160, 0));
+	TEST_CHECK_NO_ERROR(buffer.recordDownload(host + 232, devicePtr + 160, 16));
+
+	// The merge only looks at the last command, a kernel in between keeps them apart.
+	TEST_CHECK_NO_ERROR(buffer.recordKernel(testFunction, CUDALaunchConfig(), "kernel"));
+	TEST_CHECK_NO_ERROR(buffer.recordDownload(host + 248, devicePtr + 176, 8));
+
+	TEST_CHECK(buffer.getNumPendingCommands() == 5);
+	TEST_CHECK(buffer.getNumMergedCommands() == 4);
+
+	const std::vector<CUDACommand> &commands = buffer.getCommands();
+	TEST_CHECK(commands[0].type == CUDACommandType::Upload && commands[0].size == 128);
+	TEST_CHECK(commands[0].devicePtr == devicePtr && commands[0].hostPtr == host);
+	TEST_CHECK(commands[1].type == CUDACommandType::Upload && commands[1].size == 16);
+	TEST_CHECK(commands[2].type == CUDACommandType::Download && commands[2].size == 32);
+	TEST_CHECK(commands[3].type == CUDACommandType::Kernel);
+	TEST_CHECK(commands[4].type == CUDACommandType::Download && commands[4].size == 8);
+
+	TEST_CHECK_NO_ERROR(buffer.flush());
+	const std::vector<CUDAHostCommandBackend::Submission> submissions = backend.getSubmissions();
+	TEST_CHECK(submissions.size() == 5);
+	TEST_CHECK(submissions[0].command.size == 128 && submissions[0].stream == firstStream);
+	TEST_CHECK(buffer.getNumSubmittedCommands() == 5);
+	TEST_CHECK(buffer.getNumPendingCommands() == 0);
+}
+
+void testDeduplicateWaits() {
+	CUDAHostCommandBackend backend;
+	CUDACommandBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(firstStream, firstCtx, &backend));
+
+	TEST_CHECK_NO_ERROR(buffer.recordWaitEvent(firstEvent));
+	TEST_CHECK_NO_ERROR(buffer.recordWaitEvent(secondEvent));
+	TEST_CHECK_NO_ERROR(buffer.recordKernel(testFunction, CUDALaunchConfig(), "kernel"));
+	TEST_CHECK_NO_ERROR(buffer.recordWaitEvent(firstEvent));
+	TEST_CHECK(buffer.getNumPendingCommands() == 3);
+
+	// Recorded again in between, the event stands for other work.
+	TEST_CHECK_NO_ERROR(buffer.recordEvent(secondEvent));
+	TEST_CHECK_NO_ERROR(buffer.recordWaitEvent(secondEvent));
+	TEST_CHECK_NO_ERROR(buffer.recordWaitEvent(secondEvent));
+	TEST_CHECK(buffer.getNumPendingCommands() == 5);
+	TEST_CHECK(buffer.getNumMergedCommands() == 2);
+
+	// A flush forgets the waits, the stream still waits for them but the buffer can't tell.
+	TEST_CHECK_NO_ERROR(buffer.flush());
+	TEST_CHECK_NO_ERROR(buffer.recordWaitEvent(firstEvent));
+	TEST_CHECK(buffer.getNumPendingCommands() == 1);
+
+	const std::vector<CUDAHostCommandBackend::Submission> submissions = backend.getSubmissions();
+	TEST_CHECK(submissions.size() == 5);
+	TEST_CHECK(submissions[0].command.type == CUDACommandType::WaitEvent && submissions[0].command.event == firstEvent);
+	TEST_CHECK(submissions[3].command.type == CUDACommandType::RecordEvent);
+	TEST_CHECK(submissions[4].command.type == CUDACommandType::WaitEvent && submissions[4].command.event == secondEvent);
+}
+
+void testKernelArgs() {
+	CUDAHostCommandBackend backend;
+	CUDACommandBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(firstStream, firstCtx, &backend));
+
+	// Arguments are copied, so changing them after recording doesn't change the launch.
+	char c = 'a';
+	double d = 2.5;
+	CUDAMemHandle ptr = devicePtr;
+	TEST_CHECK_NO_ERROR(buffer.recordKernel(testFunction, CUDALaunchConfig(), "kernel", c, d, ptr));
+	c = 'b';
+	d = 0.0;
+	ptr = 0;
+
+	const CUDACommand &command = buffer.getCommands().back();
+	TEST_CHECK(command.numArgs == 3);
+	TEST_CHECK(isAlignedFor<double>(buffer.getArg(command, 1)));
+	TEST_CHECK(*static_cast<const double*>(buffer.getArg(command, 1)) == 2.5);
+
+	TEST_CHECK_NO_ERROR(buffer.flush());
+	const std::vector<CUDAHostCommandBackend::Submission> submissions = backend.getSubmissions();
+	TEST_CHECK(submissions.size() == 1);
+	if (submissions.size() == 1 && submissions[0].args.size() == 3) {
+		const std::vector<std::vector<char>> &args = submissions[0].args;
+		double submittedD = 0.0;
+		CUDAMemHandle submittedPtr = 0;
+		memcpy(&submittedD, args[1].data(), sizeof(double));
+		memcpy(&submittedPtr, args[2].data(), sizeof(CUDAMemHandle));
+		TEST_CHECK(args[0].size() == 1 && args[0][0] == 'a');
+		TEST_CHECK(submittedD == 2.5 && submittedPtr == devicePtr);
+	}
+
+	TEST_CHECK(buffer.recordKernel(NULL, CUDALaunchConfig(), "kernel").hasError());
+}
+
+void testAutoFlush() {
+	CUDAHostCommandBackend backend;
+	CUDACommandBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(firstStream, firstCtx, &backend));
+	buffer.setAutoFlushThreshold(2);
+
+	char host[64];
+	TEST_CHECK_NO_ERROR(buffer.recordUpload(devicePtr, host, 16));
+
+	// A merged command adds nothing to flush.
+	TEST_CHECK_NO_ERROR(buffer.recordUpload(devicePtr + 16, host + 16, 16));
+	TEST_CHECK(backend.getSubmissions().empty());
+
+	TEST_CHECK_NO_ERROR(buffer.recordEvent(firstEvent));
+	TEST_CHECK(backend.getSubmissions().size() == 2);
+	TEST_CHECK(buffer.getNumFlushes() == 1);
+
+	// Pending commands are flushed when the buffer goes away.
+	TEST_CHECK_NO_ERROR(buffer.recordEvent(secondEvent));
+	TEST_CHECK_NO_ERROR(buffer.deinitialize());
+	TEST_CHECK(backend.getSubmissions().size() == 3);
+	TEST_CHECK(buffer.recordEvent(firstEvent).hasError());
+}
+
+/*
+===============================================================
+Flushing many buffers
+===============================================================
+*/
+void testMergeContextSwitches() {
+	CUDAHostCommandBackend backend;
+	backend.setInitialContext(firstCtx);
+
+	CUDACommandBuffer a;
+	CUDACommandBuffer b;
+	CUDACommandBuffer c;
+	CUDACommandBuffer d;
+	CUDACommandBuffer empty;
+	TEST_CHECK_NO_ERROR(a.initialize(firstStream, firstCtx, &backend));
+	TEST_CHECK_NO_ERROR(b.initialize(secondStream, firstCtx, &backend));
+	TEST_CHECK_NO_ERROR(c.initialize(firstStream, secondCtx, &backend));
+	TEST_CHECK_NO_ERROR(d.initialize(secondStream, secondCtx, &backend));
+	TEST_CHECK_NO_ERROR(empty.initialize(firstStream, firstCtx, &backend));
+
+	CUDACommandBuffer *buffers[] = { &a, &b, &c, &empty, &d };
+	for (int i = 0; i < 5; ++i) {
+		if (buffers[i] != &empty) {
+			TEST_CHECK_NO_ERROR(buffers[i]->recordEvent(firstEvent));
+		}
+	}
+
+	// The first context is current already, the second one is switched to once for both of its buffers
+	// and the empty buffer between them doesn't switch back.
+	TEST_CHECK_NO_ERROR(flushCommandBuffers(buffers, 5));
+	std::vector<CUDAHostCommandBackend::Submission> submissions = backend.getSubmissions();
+	TEST_CHECK(submissions.size() == 4);
+	TEST_CHECK(backend.getNumContextSwitches() == 2);
+	if (submissions.size() == 4) {
+		TEST_CHECK(submissions[0].ctx == firstCtx && submissions[0].stream == firstStream);
+		TEST_CHECK(submissions[1].ctx == firstCtx && submissions[1].stream == secondStream);
+		TEST_CHECK(submissions[2].ctx == secondCtx && submissions[3].ctx == secondCtx);
+	}
+
+	CUcontext current = NULL;
+	TEST_CHECK_NO_ERROR(backend.getCurrentContext(current));
+	TEST_CHECK(current == firstCtx);
+
+	// Interleaved contexts switch for every buffer, and the context from before is restored once.
+	backend.reset();
+	backend.setInitialContext(otherCtx);
+	CUDACommandBuffer *interleaved[] = { &a, &c, &b, &d };
+	for (int i = 0; i < 4; ++i) {
+		TEST_CHECK_NO_ERROR(interleaved[i]->recordEvent(secondEvent));
+	}
+	TEST_CHECK_NO_ERROR(flushCommandBuffers(interleaved, 4));
+	TEST_CHECK(backend.getNumContextSwitches() == 5);
+	TEST_CHECK_NO_ERROR(backend.getCurrentContext(current));
+	TEST_CHECK(current == otherCtx);
+
+	// Nothing pending, nothing switched.
+	backend.reset();
+	TEST_CHECK_NO_ERROR(flushCommandBuffers(buffers, 5));
+	TEST_CHECK(backend.getNumContextSwitches() == 0);
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testMergeTransfers);
+	RUN_TEST(testDeduplicateWaits);
+	RUN_TEST(testKernelArgs);
+	RUN_TEST(testAutoFlush);
+	RUN_TEST(testMergeContextSwitches);
+
+	return TEST_RESULT();
+}
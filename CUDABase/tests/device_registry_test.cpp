@@ -0,0 +1,278 @@
+// Visible device lists, requirement filtering and per-device bring-up failures of CUDADeviceRegistry.
+#include <cuda_device_registry.h>
+#include <cuda_manager.h>
+
+#include <test_common.h>
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+constexpr SizeType GB = SizeType(1) << 30;
+
+/// Devices made up in a table, the bring-up of some of them fails.
+/// Ordinal 1 is too old and ordinal 4 can't be queried, so both are left out.
+/// Ordinal 3 has the most memory, but its bring-up fails.
+struct FakeDeviceDriver : CUDADeviceDriver {
+	struct FakeDevice {
+		int major;
+		int minor;
+		SizeType totalMem;
+		bool cooperativeLaunch;
+		bool queryFails;
+		bool initFails;
+	};
+
+	std::vector<FakeDevice> devices;
+
+	FakeDeviceDriver() {
+		devices = {
+			{ 7, 5, 8 * GB, false, false, false },
+			{ 3, 0, 2 * GB, false, false, false },
+			{ 9, 0, 16 * GB, true, false, false },
+			{ 8, 6, 24 * GB, true, false, true },
+			{ 8, 0, 40 * GB, true, true, false },
+		};
+	}
+
+	CUDAError getDeviceCount(int &count) override {
+		count = int(devices.size());
+		return CUDAError();
+	}
+
+	CUDAError queryDevice(int ordinal, CUDADeviceProperties &props) override {
+		const FakeDevice &fake = devices[ordinal];
+		if (fake.queryFails) {
+			return CUDAError(CUDA_ERROR_UNKNOWN, "FakeDeviceDriver_ERROR_QUERY", "");
+		}
+
+		props.ordinal = ordinal;
+		props.computeCapabilityMajor = fake.major;
+		props.computeCapabilityMinor = fake.minor;
+		props.totalMem = fake.totalMem;
+		props.cooperativeLaunch = fake.cooperativeLaunch;
+		props.unifiedAddressing = true;
+		return CUDAError();
+	}
+
+	CUDAError initializeDevice(int ordinal, CUDADevice &device) override {
+		std::lock_guard<std::mutex> lock(mutex);
+		++numInitCalls[ordinal];
+		if (devices[ordinal].initFails) {
+			return CUDAError(CUDA_ERROR_OUT_OF_MEMORY, "FakeDeviceDriver_ERROR_INIT", "");
+		}
+		return CUDAError();
+	}
+
+	CUDAError deinitializeDevice(CUDADevice &device) override {
+		std::lock_guard<std::mutex> lock(mutex);
+		++numDeinitCalls;
+		return CUDAError();
+	}
+
+	int getNumInitCalls(int ordinal) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return numInitCalls[ordinal];
+	}
+
+	int getNumDeinitCalls() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return numDeinitCalls;
+	}
+
+private:
+	std::mutex mutex;
+	std::map<int, int> numInitCalls;
+	int numDeinitCalls = 0;
+};
+
+int findSlot(CUDADeviceRegistry &registry, int ordinal) {
+	for (int i = 0; i < registry.getNumDevices(); ++i) {
+		if (registry.getProperties(i).ordinal == ordinal) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+===============================================================
+Parsing and filtering
+===============================================================
+*/
+bool parsesTo(const char *spec, bool valid, const std::vector<int> &expected) {
+	std::vector<int> ordinals;
+	return parseVisibleDevices(spec, 4, ordinals) == valid && ordinals == expected;
+}
+
+void testParseVisibleDevices() {
+	TEST_CHECK(parsesTo(nullptr, true, { 0, 1, 2, 3 }));
+	TEST_CHECK(parsesTo("2,0", true, { 2, 0 }));
+	TEST_CHECK(parsesTo(" 1 , 3 ,", true, { 1, 3 }));
+
+	// Empty lists hide every device.
+	TEST_CHECK(parsesTo("", true, {}));
+	TEST_CHECK(parsesTo("  ", true, {}));
+
+	// Out of range, duplicate and malformed entries end the list, the ones before stay visible.
+	TEST_CHECK(parsesTo("0,4,1", false, { 0 }));
+	TEST_CHECK(parsesTo("-1", false, {}));
+	TEST_CHECK(parsesTo("1,2,1,3", false, { 1, 2 }));
+	TEST_CHECK(parsesTo("2,,3", false, { 2 }));
+	TEST_CHECK(parsesTo("1x", false, {}));
+	TEST_CHECK(parsesTo("GPU-0", false, {}));
+
+	std::vector<int> ordinals;
+	TEST_CHECK(parseVisibleDevices("0", 0, ordinals) == false && ordinals.empty());
+}
+
+void testMeetsRequirements() {
+	CUDADeviceProperties props;
+	props.computeCapabilityMajor = 8;
+	props.computeCapabilityMinor = 6;
+	props.totalMem = 8 * GB;
+
+	CUDADeviceRequirements requirements;
+	TEST_CHECK(meetsRequirements(props, requirements));
+
+	requirements.minComputeCapabilityMajor = 8;
+	requirements.minComputeCapabilityMinor = 6;
+	TEST_CHECK(meetsRequirements(props, requirements));
+	requirements.minComputeCapabilityMinor = 7;
+	TEST_CHECK(!meetsRequirements(props, requirements));
+
+	// A newer major version is enough whatever the minor one is.
+	requirements.minComputeCapabilityMajor = 7;
+	requirements.minComputeCapabilityMinor = 9;
+	TEST_CHECK(meetsRequirements(props, requirements));
+
+	requirements.minTotalMem = 8 * GB;
+	TEST_CHECK(meetsRequirements(props, requirements));
+	requirements.minTotalMem = 8 * GB + 1;
+	TEST_CHECK(!meetsRequirements(props, requirements));
+	requirements.minTotalMem = 0;
+
+	requirements.cooperativeLaunch = true;
+	TEST_CHECK(!meetsRequirements(props, requirements));
+	props.cooperativeLaunch = true;
+	TEST_CHECK(meetsRequirements(props, requirements));
+
+	requirements.clusterLaunch = true;
+	TEST_CHECK(!meetsRequirements(props, requirements));
+	props.computeCapabilityMajor = 9;
+	TEST_CHECK(meetsRequirements(props, requirements));
+}
+
+/*
+===============================================================
+Registry
+===============================================================
+*/
+void testDiscover() {
+	FakeDeviceDriver driver;
+	CUDADeviceRegistry registry;
+
+	TEST_CHECK_NO_ERROR(registry.discover(&driver, nullptr));
+	TEST_CHECK(registry.getNumDevices() == 3);
+	TEST_CHECK(findSlot(registry, 1) < 0 && findSlot(registry, 4) < 0);
+	for (int i = 0; i < registry.getNumDevices(); ++i) {
+		TEST_CHECK(registry.getState(i) == CUDADeviceState::Discovered);
+	}
+
+	// The order of the list is kept, unsupported devices are still left out.
+	TEST_CHECK_NO_ERROR(registry.discover(&driver, "3,1,0"));
+	TEST_CHECK(registry.getNumDevices() == 2);
+	TEST_CHECK(registry.getProperties(0).ordinal == 3 && registry.getProperties(1).ordinal == 0);
+
+	// Devices after a bad entry are hidden.
+	TEST_CHECK_NO_ERROR(registry.discover(&driver, "2,7,0"));
+	TEST_CHECK(registry.getNumDevices() == 1 && registry.getProperties(0).ordinal == 2);
+
+	const CUDADevice *device = nullptr;
+	TEST_CHECK(registry.getDeviceByOrdinal(0, device).hasError() && device == nullptr);
+	TEST_CHECK(registry.getDevice(1, device).hasError());
+	TEST_CHECK(registry.getDevice(-1, device).hasError());
+
+	TEST_CHECK_NO_ERROR(registry.discover(&driver, ""));
+	TEST_CHECK(registry.getNumDevices() == 0);
+	TEST_CHECK(registry.initializeAll().hasError());
+}
+
+void testFailureStaysInItsSlot() {
+	FakeDeviceDriver driver;
+	CUDADeviceRegistry registry;
+	TEST_CHECK_NO_ERROR(registry.discover(&driver, nullptr));
+
+	// One device failing doesn't fail the others.
+	TEST_CHECK_NO_ERROR(registry.initializeAll());
+
+	const int failedSlot = findSlot(registry, 3);
+	TEST_CHECK(registry.getState(failedSlot) == CUDADeviceState::Failed);
+	TEST_CHECK(strcmp(registry.getError(failedSlot).getName(), "FakeDeviceDriver_ERROR_INIT") == 0);
+	for (int i = 0; i < registry.getNumDevices(); ++i) {
+		if (i != failedSlot) {
+			TEST_CHECK(registry.getState(i) == CUDADeviceState::Ready);
+			TEST_CHECK(!registry.getError(i).hasError());
+		}
+	}
+
+	// Lookups report the error of the slot and don't try again.
+	const CUDADevice *device = nullptr;
+	CUDAError err = registry.getDeviceByOrdinal(3, device);
+	TEST_CHECK(err.hasError() && strcmp(err.getName(), "FakeDeviceDriver_ERROR_INIT") == 0 && device == nullptr);
+	TEST_CHECK_NO_ERROR(registry.getDeviceByOrdinal(2, device));
+	TEST_CHECK(device != nullptr);
+	TEST_CHECK(driver.getNumInitCalls(3) == 1);
+	TEST_CHECK(driver.getNumInitCalls(2) == 1);
+
+	// Only devices which came up are taken down.
+	TEST_CHECK_NO_ERROR(registry.deinitialize());
+	TEST_CHECK(driver.getNumDeinitCalls() == 2);
+}
+
+void testFindDevice() {
+	FakeDeviceDriver driver;
+	CUDADeviceRegistry registry;
+	TEST_CHECK_NO_ERROR(registry.discover(&driver, nullptr));
+
+	const CUDADevice *device = nullptr;
+	CUDADeviceRequirements requirements;
+
+	// The device with the most memory fails, so the next best one is picked.
+	requirements.preferMostMemory = true;
+	TEST_CHECK_NO_ERROR(registry.findDevice(requirements, device));
+	TEST_CHECK(device != nullptr);
+	TEST_CHECK(registry.getState(findSlot(registry, 3)) == CUDADeviceState::Failed);
+	TEST_CHECK(registry.getState(findSlot(registry, 2)) == CUDADeviceState::Ready);
+
+	// Devices are brought up when they are picked, not before.
+	TEST_CHECK(registry.getState(findSlot(registry, 0)) == CUDADeviceState::Discovered);
+
+	requirements.preferMostMemory = false;
+	TEST_CHECK_NO_ERROR(registry.findDevice(requirements, device));
+	TEST_CHECK(registry.getState(findSlot(registry, 0)) == CUDADeviceState::Ready);
+
+	requirements.minComputeCapabilityMajor = 8;
+	requirements.cooperativeLaunch = true;
+	TEST_CHECK_NO_ERROR(registry.findDevice(requirements, device));
+	TEST_CHECK(driver.getNumInitCalls(3) == 1);
+
+	requirements.minTotalMem = 20 * GB;
+	TEST_CHECK(registry.findDevice(requirements, device).hasError());
+	TEST_CHECK(device == nullptr);
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testParseVisibleDevices);
+	RUN_TEST(testMeetsRequirements);
+	RUN_TEST(testDiscover);
+	RUN_TEST(testFailureStaysInItsSlot);
+	RUN_TEST(testFindDevice);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,251 @@
+// Tier decisions of CUDAFallbackAllocator under a simulated device memory budget.
+// Runs with CUDABASE_HOST_DEVICE_MEMORY_MB=64, see CMakeLists.txt.
+#include <cuda_buffer.h>
+#include <cuda_memory_backend.h>
+
+#include <test_common.h>
+
+#include <cstring>
+#include <vector>
+
+namespace {
+
+/// Megabyte as CUDABASE_HOST_DEVICE_MEMORY_MB counts it, not MEGABYTE_IN_BYTES.
+constexpr SizeType MB = 1024 * 1024;
+
+/// Fails every allocation with an error other than running out of memory.
+struct BrokenMemoryBackend : CUDAMemoryBackend {
+	int numAllocations = 0;
+
+	CUDAError allocate(CUDAMemHandle &ptr, SizeType size) override {
+		++numAllocations;
+		return CUDAError(CUDA_ERROR_INVALID_VALUE, "BrokenMemoryBackend_ERROR", "");
+	}
+
+	CUDAError free(CUDAMemHandle ptr) override {
+		return CUDAError();
+	}
+};
+
+/// Device and virtual tiers with small budgets, mapped host memory without one.
+struct TieredMemory {
+	CUDAHostMemoryBackend hostMemory;
+	CUDABudgetMemoryBackend device;
+	CUDABudgetMemoryBackend virtualMemory;
+	CUDABudgetMemoryBackend mappedHost;
+	CUDAHostFenceBackend fences;
+	CUDAFallbackAllocator allocator;
+
+	TieredMemory(SizeType deviceBudget, SizeType virtualBudget)
+		: device(&hostMemory, deviceBudget)
+		, virtualMemory(&hostMemory, virtualBudget)
+		, mappedHost(&hostMemory, SizeType(-1) / 2) {
+		CUDAFallbackAllocator::TierBackends backends = { &device, &virtualMemory, &mappedHost };
+		TEST_CHECK_NO_ERROR(allocator.initialize(backends, &fences));
+	}
+
+	~TieredMemory() {
+		TEST_CHECK_NO_ERROR(allocator.deinitialize());
+		TEST_CHECK(device.getUsedBytes() == 0);
+		TEST_CHECK(virtualMemory.getUsedBytes() == 0);
+		TEST_CHECK(mappedHost.getUsedBytes() == 0);
+	}
+
+	CUDAFallbackAllocator::CUDAMemBlock allocate(SizeType size) {
+		CUDAFallbackAllocator::CUDAMemBlock memBlock;
+		memBlock.size = size;
+		TEST_CHECK_NO_ERROR(allocator.allocate(memBlock));
+		return memBlock;
+	}
+};
+
+void fillPattern(std::vector<unsigned char> &data, unsigned char seed) {
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = (unsigned char)(seed + i * 7);
+	}
+}
+
+void testSpillsToSlowerTiers() {
+	TieredMemory memory(64 * MB, 32 * MB);
+
+	auto first = memory.allocate(48 * MB);
+	TEST_CHECK(memory.allocator.getTier(first) == CUDAMemoryTier::Device);
+
+	// Neither the device nor the virtual tier has 48MB left.
+	auto second = memory.allocate(48 * MB);
+	TEST_CHECK(memory.allocator.getTier(second) == CUDAMemoryTier::MappedHost);
+	TEST_CHECK(memory.device.getNumFailedAllocations() == 1);
+	TEST_CHECK(memory.virtualMemory.getNumFailedAllocations() == 1);
+
+	// Small blocks still fit in the faster tiers.
+	auto third = memory.allocate(16 * MB);
+	TEST_CHECK(memory.allocator.getTier(third) == CUDAMemoryTier::Device);
+	auto fourth = memory.allocate(16 * MB);
+	TEST_CHECK(memory.allocator.getTier(fourth) == CUDAMemoryTier::Virtual);
+
+	TEST_CHECK(memory.allocator.getTierBytes(CUDAMemoryTier::Device) == 64 * MB);
+	TEST_CHECK(memory.allocator.getTierBlocks(CUDAMemoryTier::Device) == 2);
+	TEST_CHECK(memory.allocator.getTierBytes(CUDAMemoryTier::Virtual) == 16 * MB);
+	TEST_CHECK(memory.allocator.getTierBytes(CUDAMemoryTier::MappedHost) == 48 * MB);
+
+	TEST_CHECK_NO_ERROR(memory.allocator.free(second));
+	TEST_CHECK(memory.allocator.getTierBlocks(CUDAMemoryTier::MappedHost) == 0);
+	TEST_CHECK(memory.mappedHost.getUsedBytes() == 0);
+}
+
+void testMissingTiersAreSkipped() {
+	TieredMemory memory(16 * MB, 0);
+	CUDAFallbackAllocator::TierBackends backends = { &memory.device, nullptr, &memory.mappedHost };
+	TEST_CHECK_NO_ERROR(memory.allocator.initialize(backends, &memory.fences));
+
+	auto block = memory.allocate(32 * MB);
+	TEST_CHECK(memory.allocator.getTier(block) == CUDAMemoryTier::MappedHost);
+	TEST_CHECK(memory.virtualMemory.getNumFailedAllocations() == 0);
+}
+
+void testOutOfMemoryInAllTiers() {
+	TieredMemory memory(8 * MB, 8 * MB);
+	memory.mappedHost.setBudget(8 * MB);
+
+	CUDAFallbackAllocator::CUDAMemBlock memBlock;
+	memBlock.size = 16 * MB;
+	CUDAError err = memory.allocator.allocate(memBlock);
+	TEST_CHECK(err.getError() == CUDA_ERROR_OUT_OF_MEMORY);
+	TEST_CHECK(memory.mappedHost.getNumFailedAllocations() == 1);
+
+	std::vector<CUDAAllocatorStatsSnapshot> snapshots;
+	memory.allocator.getStats().getSnapshots(snapshots);
+	TEST_CHECK(snapshots.size() == 1 && snapshots[0].numFailedAllocs == 1);
+}
+
+void testOtherErrorsDontFallThrough() {
+	TieredMemory memory(64 * MB, 64 * MB);
+	BrokenMemoryBackend broken;
+	CUDAFallbackAllocator::TierBackends backends = { &broken, &memory.virtualMemory, &memory.mappedHost };
+	TEST_CHECK_NO_ERROR(memory.allocator.initialize(backends, &memory.fences));
+
+	CUDAFallbackAllocator::CUDAMemBlock memBlock;
+	memBlock.size = MB;
+	CUDAError err = memory.allocator.allocate(memBlock);
+	TEST_CHECK(err.getError() == CUDA_ERROR_INVALID_VALUE);
+	TEST_CHECK(broken.numAllocations == 1);
+	TEST_CHECK(memory.virtualMemory.getUsedBytes() == 0);
+	TEST_CHECK(memory.mappedHost.getUsedBytes() == 0);
+}
+
+void testPromotion() {
+	TieredMemory memory(64 * MB, 0);
+
+	auto deviceBlock = memory.allocate(48 * MB);
+	auto spilled = memory.allocate(32 * MB);
+	TEST_CHECK(memory.allocator.getTier(spilled) == CUDAMemoryTier::MappedHost);
+
+	std::vector<unsigned char> data(size_t(32 * MB));
+	fillPattern(data, 3);
+	TEST_CHECK_NO_ERROR(memory.allocator.upload(spilled, data.data(), NULL));
+
+	// Nothing was freed since the block was placed, so the device isn't asked again.
+	const int failedBefore = memory.device.getNumFailedAllocations();
+	bool promoted = true;
+	TEST_CHECK_NO_ERROR(memory.allocator.promote(spilled, NULL, promoted));
+	TEST_CHECK(!promoted);
+	TEST_CHECK_NO_ERROR(memory.allocator.promote(spilled, NULL, promoted));
+	TEST_CHECK(!promoted);
+	TEST_CHECK(memory.device.getNumFailedAllocations() == failedBefore);
+
+	TEST_CHECK_NO_ERROR(memory.allocator.free(deviceBlock));
+
+	const CUDAMemHandle oldPtr = spilled.ptr;
+	TEST_CHECK_NO_ERROR(memory.allocator.promote(spilled, NULL, promoted));
+	TEST_CHECK(promoted);
+	TEST_CHECK(spilled.ptr != oldPtr);
+	TEST_CHECK(memory.allocator.getTier(spilled) == CUDAMemoryTier::Device);
+	TEST_CHECK(memory.allocator.getTierBytes(CUDAMemoryTier::MappedHost) == 0);
+	TEST_CHECK(memory.mappedHost.getUsedBytes() == 0);
+
+	std::vector<unsigned char> result(data.size());
+	TEST_CHECK_NO_ERROR(memory.allocator.download(spilled, result.data(), NULL));
+	TEST_CHECK(result == data);
+}
+
+void testPromotionWaitsForTheCopy() {
+	TieredMemory memory(64 * MB, 0);
+	memory.fences.setManualSignal(true);
+
+	CUcontext ctx = NULL;
+	CUdevice dev;
+	CUstream stream = NULL;
+	TEST_CHECK(cuInit(0) == CUDA_SUCCESS);
+	TEST_CHECK(cuDeviceGet(&dev, 0) == CUDA_SUCCESS);
+	TEST_CHECK(cuCtxCreate(&ctx, 0, dev) == CUDA_SUCCESS);
+	TEST_CHECK(cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING) == CUDA_SUCCESS);
+
+	auto deviceBlock = memory.allocate(48 * MB);
+	auto spilled = memory.allocate(32 * MB);
+	TEST_CHECK_NO_ERROR(memory.allocator.free(deviceBlock));
+
+	bool promoted = false;
+	TEST_CHECK_NO_ERROR(memory.allocator.promote(spilled, stream, promoted));
+	TEST_CHECK(promoted);
+
+	// The old memory is only given back once the fence of the copy is signaled.
+	TEST_CHECK(memory.mappedHost.getUsedBytes() == 32 * MB);
+	TEST_CHECK(memory.allocator.getTierBytes(CUDAMemoryTier::MappedHost) == 0);
+
+	TEST_CHECK(cuStreamSynchronize(stream) == CUDA_SUCCESS);
+	memory.fences.signalAll();
+	auto other = memory.allocate(MB);
+	TEST_CHECK(memory.mappedHost.getUsedBytes() == 0);
+	TEST_CHECK(memory.allocator.getTier(other) == CUDAMemoryTier::Device);
+
+	TEST_CHECK_NO_ERROR(memory.allocator.deinitialize());
+	TEST_CHECK(cuStreamDestroy(stream) == CUDA_SUCCESS);
+	TEST_CHECK(cuCtxDestroy(ctx) == CUDA_SUCCESS);
+}
+
+/// CUDAFallbackBuffers on the default tiers of the manager, with the 64MB device of the host backend.
+/// Spilling must not stop Debug builds, running out of memory is not a bug there.
+void testBuffersSpillOnSmallDevice() {
+	size_t freeMem = 0, totalMem = 0;
+	TEST_CHECK(cuMemGetInfo(&freeMem, &totalMem) == CUDA_SUCCESS);
+	TEST_CHECK(totalMem == 64 * MB);
+
+	CUDAFallbackBuffer first;
+	CUDAFallbackBuffer second;
+	TEST_CHECK_NO_ERROR(first.initialize(48 * MB));
+	TEST_CHECK_NO_ERROR(second.initialize(48 * MB));
+	TEST_CHECK(first.getMemoryTier() == CUDAMemoryTier::Device);
+	TEST_CHECK(second.getMemoryTier() == CUDAMemoryTier::MappedHost);
+
+	std::vector<unsigned char> data(size_t(48 * MB));
+	fillPattern(data, 11);
+	TEST_CHECK_NO_ERROR(second.upload(data.data()));
+
+	TEST_CHECK_NO_ERROR(first.deinitialize());
+
+	bool promoted = false;
+	TEST_CHECK_NO_ERROR(second.promote(NULL, promoted));
+	TEST_CHECK(promoted);
+	TEST_CHECK(second.getMemoryTier() == CUDAMemoryTier::Device);
+
+	std::vector<unsigned char> result(data.size());
+	TEST_CHECK_NO_ERROR(second.download(result.data()));
+	TEST_CHECK(result == data);
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testSpillsToSlowerTiers);
+	RUN_TEST(testMissingTiersAreSkipped);
+	RUN_TEST(testOutOfMemoryInAllTiers);
+	RUN_TEST(testOtherErrorsDontFallThrough);
+	RUN_TEST(testPromotion);
+	RUN_TEST(testPromotionWaitsForTheCopy);
+
+	TEST_CHECK(initializeCUDAManager({}, false));
+	RUN_TEST(testBuffersSpillOnSmallDevice);
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,140 @@
+// Kernel nodes of CUDAGraph keep their own copy of the arguments.
+#include <cuda_graph.h>
+#include <cuda_host_kernel.h>
+#include <cuda_typed_kernel.h>
+
+#include <test_common.h>
+
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+/// What the last launch of "graphArgs" got.
+struct GraphArgsResult {
+	char c;
+	double d;
+	int16_t s;
+	int i;
+};
+
+GraphArgsResult graphArgsResult;
+
+const bool registered = registerHostKernel<char, double, int16_t, int>(
+	"graphArgs",
+	[](const CUDAHostThread &thread, char c, double d, int16_t s, int i) {
+		graphArgsResult = { c, d, s, i };
+	}
+);
+
+bool isGraphArgsResult(char c, double d, int16_t s, int i) {
+	const GraphArgsResult &r = graphArgsResult;
+	return r.c == c && r.d == d && r.s == s && r.i == i;
+}
+
+/// Overwrite the stack the frames of the recording functions lived in.
+void clobberStack() {
+	volatile char garbage[4096];
+	memset(const_cast<char*>(garbage), 0xcd, sizeof(garbage));
+}
+
+const CUDALaunchConfig singleThread = CUDALaunchConfig::forThreads(1);
+
+/// Record the kernel with arguments which are gone once this returns.
+int recordFromFrame(CUDAGraph &graph, CUfunction func) {
+	CUDAArgumentFrame args;
+	TEST_CHECK_NO_ERROR(args.push(char(3), 1.25, int16_t(-9), 77));
+	return graph.addKernel(func, args, singleThread, "graphArgs");
+}
+
+CUDAError updateFromFrame(CUDAGraph &graph, int nodeIdx) {
+	CUDAArgumentFrame args;
+	RETURN_ON_CUDA_ERROR_HANDLED(args.push(char(4), -2.5, int16_t(11), 123));
+	return graph.updateKernel(nodeIdx, args, singleThread);
+}
+
+/// Launch graph on stream and wait for it.
+void launchAndWait(CUDAGraph &graph, CUstream stream) {
+	graphArgsResult = {};
+	TEST_CHECK_NO_ERROR(graph.launch(stream));
+	TEST_CHECK(cuStreamSynchronize(stream) == CUDA_SUCCESS);
+}
+
+void testArgsOutliveTheFrame(CUfunction func, CUstream stream) {
+	for (CUDAGraphMode mode : { CUDAGraphMode::Graph, CUDAGraphMode::Eager }) {
+		CUDAGraph graph;
+		graph.setMode(mode);
+		const int node = recordFromFrame(graph, func);
+		clobberStack();
+
+		launchAndWait(graph, stream);
+		TEST_CHECK(isGraphArgsResult(3, 1.25, -9, 77));
+		TEST_CHECK(graph.getMode() == mode);
+
+		// Updating an instantiated graph copies the new arguments as well.
+		TEST_CHECK_NO_ERROR(updateFromFrame(graph, node));
+		clobberStack();
+
+		launchAndWait(graph, stream);
+		TEST_CHECK(isGraphArgsResult(4, -2.5, 11, 123));
+	}
+}
+
+void testArgsAreAligned(CUfunction func) {
+	CUDAGraph graph;
+	recordFromFrame(graph, func);
+
+	const CUDAGraphNode &node = graph.getNodes()[0];
+	TEST_CHECK(node.argOffsets.size() == 4);
+	TEST_CHECK(node.argOffsets[0] == 0);
+	TEST_CHECK(node.argOffsets[1] == alignof(double));
+	TEST_CHECK(node.argOffsets[2] % alignof(int16_t) == 0);
+	TEST_CHECK(node.argOffsets[3] % alignof(int) == 0);
+
+	double d = 0;
+	memcpy(&d, node.args.data() + node.argOffsets[1], sizeof(d));
+	TEST_CHECK(d == 1.25);
+}
+
+void testKernelObjects(CUmodule module, CUstream stream) {
+	CUDAGraph graph;
+
+	// The kernel objects can change their arguments after recording without the graph seeing it.
+	TypedKernel<char, double, int16_t, int> typed(module, "graphArgs");
+	typed.setArgs('t', 0.5, int16_t(2), 3);
+	graph.addKernel(typed, singleThread);
+	typed.setArg<3>(-1);
+
+	CUDAFunction function(module, "graphArgs");
+	TEST_CHECK_NO_ERROR(function.addParams(char('f'), 8.0, int16_t(-4), 16));
+	const int functionNode = graph.addKernel(function, singleThread);
+	function.clearParams();
+
+	TEST_CHECK(graph.getNodes()[0].args.size() == graph.getNodes()[functionNode].args.size());
+
+	launchAndWait(graph, stream);
+	TEST_CHECK(isGraphArgsResult('f', 8.0, -4, 16));
+
+	TEST_CHECK(graph.updateKernel(5, nullptr, nullptr, 0, singleThread).hasError());
+}
+
+} // namespace
+
+int main() {
+	TEST_CHECK(registered);
+
+	TEST_CHECK(initializeCUDAManager({}, false));
+	TEST_CHECK_NO_ERROR(bindThreadContext());
+
+	const CUDADevice *device = getCUDAManager().getCurrentDevice();
+	const CUstream stream = device->getDefaultStream(CUDADefaultStreamsEnumeration::Execution);
+	CUfunction func = NULL;
+	TEST_CHECK(cuModuleGetFunction(&func, device->getModule(), "graphArgs") == CUDA_SUCCESS);
+
+	RUN_TEST(testArgsOutliveTheFrame, func, stream);
+	RUN_TEST(testArgsAreAligned, func);
+	RUN_TEST(testKernelObjects, device->getModule(), stream);
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
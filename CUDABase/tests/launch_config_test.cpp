@@ -0,0 +1,183 @@
+// Block shapes, grids and edge cases of resolving and validating CUDALaunchConfigs.
+#include <cuda_launch_config.h>
+
+#include <test_common.h>
+
+namespace {
+
+/// Limits of a typical compute capability 8.x device with 10 multiprocessors.
+CUDADeviceProperties makeProps() {
+	CUDADeviceProperties props;
+	props.computeCapabilityMajor = 8;
+	props.cooperativeLaunch = true;
+	props.warpSize = 32;
+	props.multiProcessorCount = 10;
+	props.maxThreadsPerBlock = 1024;
+	props.maxBlockDim[0] = 1024;
+	props.maxBlockDim[1] = 1024;
+	props.maxBlockDim[2] = 64;
+	props.maxGridDim[0] = 2147483647;
+	props.maxGridDim[1] = 65535;
+	props.maxGridDim[2] = 65535;
+	props.maxSharedMemPerBlock = 48 * 1024;
+	return props;
+}
+
+/// Resolve config, check that it resolves and return the result.
+CUDALaunchConfig resolve(const CUDALaunchConfig &config, int occupancyBlockSize, int maxActiveBlocksPerSM, const CUDADeviceProperties &props) {
+	CUDALaunchConfig resolved;
+	TEST_CHECK_NO_ERROR(resolveLaunchConfig(config, occupancyBlockSize, maxActiveBlocksPerSM, props, resolved));
+	TEST_CHECK(!resolved.autoBlock && !resolved.autoGrid);
+	return resolved;
+}
+
+/*
+===============================================================
+Grid math
+===============================================================
+*/
+void testShapeBlock() {
+	const CUDADeviceProperties props = makeProps();
+
+	TEST_CHECK(shapeBlock(256, CUDADim3(1000), props) == CUDADim3(256));
+	TEST_CHECK(shapeBlock(256, CUDADim3(100, 100), props) == CUDADim3(32, 8));
+	TEST_CHECK(shapeBlock(256, CUDADim3(64, 64, 64), props) == CUDADim3(32, 8, 1));
+
+	// Not more than the extent needs, but whole warps.
+	TEST_CHECK(shapeBlock(256, CUDADim3(10), props) == CUDADim3(32));
+	TEST_CHECK(shapeBlock(256, CUDADim3(33), props) == CUDADim3(64));
+
+	// Blocks smaller than a warp and empty ones.
+	TEST_CHECK(shapeBlock(16, CUDADim3(1000), props) == CUDADim3(16));
+	TEST_CHECK(shapeBlock(0, CUDADim3(1000), props) == CUDADim3());
+	TEST_CHECK(shapeBlock(256, CUDADim3(0), props) == CUDADim3(1));
+
+	// The device limits win over the suggestion.
+	TEST_CHECK(shapeBlock(2048, CUDADim3(1 << 20), props) == CUDADim3(1024));
+
+	// Rounding the extent up to a warp must not wrap around.
+	TEST_CHECK(shapeBlock(256, CUDADim3(0xFFFFFFF0u), props) == CUDADim3(256));
+}
+
+void testComputeGrid() {
+	TEST_CHECK(computeGrid(CUDADim3(1024), CUDADim3(256)) == CUDADim3(4));
+
+	// Sizes which are not a multiple of the block get one more block.
+	TEST_CHECK(computeGrid(CUDADim3(1000), CUDADim3(256)) == CUDADim3(4));
+	TEST_CHECK(computeGrid(CUDADim3(1025), CUDADim3(256)) == CUDADim3(5));
+	TEST_CHECK(computeGrid(CUDADim3(100, 100, 3), CUDADim3(32, 8)) == CUDADim3(4, 13, 3));
+
+	TEST_CHECK(computeGrid(CUDADim3(0), CUDADim3(256)).count() == 0);
+	TEST_CHECK(computeGrid(CUDADim3(0xFFFFFFFFu), CUDADim3(256)) == CUDADim3(16777216));
+}
+
+/*
+===============================================================
+Resolving and validating
+===============================================================
+*/
+void testResolve() {
+	const CUDADeviceProperties props = makeProps();
+
+	CUDALaunchConfig config = resolve(CUDALaunchConfig::forThreads(CUDADim3(1000)), 256, 0, props);
+	TEST_CHECK(config.block == CUDADim3(256) && config.grid == CUDADim3(4));
+	TEST_CHECK_NO_ERROR(validateLaunchConfig(config, 0, props));
+
+	config = resolve(CUDALaunchConfig::forThreads(CUDADim3(1000, 3), CUDADim3(128, 2)), 0, 0, props);
+	TEST_CHECK(config.grid == CUDADim3(8, 2));
+
+	// Explicit grids are kept as they are.
+	config = resolve(CUDALaunchConfig::forGrid(CUDADim3(7, 5), CUDADim3(64)), 0, 0, props);
+	TEST_CHECK(config.grid == CUDADim3(7, 5) && config.block == CUDADim3(64));
+
+	// Resolving in place.
+	config = CUDALaunchConfig::forThreads(CUDADim3(513));
+	TEST_CHECK_NO_ERROR(resolveLaunchConfig(config, 512, 0, props, config));
+	TEST_CHECK(config.grid == CUDADim3(2) && !config.autoGrid);
+}
+
+void testEmptyLaunches() {
+	const CUDADeviceProperties props = makeProps();
+	CUDALaunchConfig resolved;
+
+	TEST_CHECK(resolveLaunchConfig(CUDALaunchConfig::forThreads(CUDADim3(0)), 256, 0, props, resolved).hasError());
+	TEST_CHECK(resolveLaunchConfig(CUDALaunchConfig::forThreads(CUDADim3(64, 0)), 256, 0, props, resolved).hasError());
+	TEST_CHECK(resolveLaunchConfig(CUDALaunchConfig::forThreads(CUDADim3(64), CUDADim3(0)), 0, 0, props, resolved).hasError());
+
+	// autoBlock needs an answer from the occupancy calculator.
+	TEST_CHECK(resolveLaunchConfig(CUDALaunchConfig::forThreads(CUDADim3(64)), 0, 0, props, resolved).hasError());
+
+	TEST_CHECK(validateLaunchConfig(CUDALaunchConfig::forGrid(CUDADim3(0), CUDADim3(64)), 0, props).hasError());
+	TEST_CHECK(validateLaunchConfig(CUDALaunchConfig::forGrid(CUDADim3(1), CUDADim3(64, 0)), 0, props).hasError());
+}
+
+void testDeviceLimits() {
+	const CUDADeviceProperties props = makeProps();
+
+	// Grids above the device limit resolve, but don't pass validation.
+	CUDALaunchConfig config = resolve(CUDALaunchConfig::forThreads(CUDADim3(32, 70000), CUDADim3(32)), 0, 0, props);
+	TEST_CHECK(config.grid == CUDADim3(1, 70000));
+	TEST_CHECK(validateLaunchConfig(config, 0, props).hasError());
+
+	config = resolve(CUDALaunchConfig::forThreads(CUDADim3(0xFFFFFFFFu), CUDADim3(1)), 0, 0, props);
+	TEST_CHECK(config.grid == CUDADim3(0xFFFFFFFFu));
+	TEST_CHECK(validateLaunchConfig(config, 0, props).hasError());
+
+	// Right at the limit is fine.
+	config = resolve(CUDALaunchConfig::forThreads(CUDADim3(32, 65535), CUDADim3(32)), 0, 0, props);
+	TEST_CHECK_NO_ERROR(validateLaunchConfig(config, 0, props));
+
+	TEST_CHECK(validateLaunchConfig(CUDALaunchConfig::forGrid(CUDADim3(1), CUDADim3(2048)), 0, props).hasError());
+	TEST_CHECK(validateLaunchConfig(CUDALaunchConfig::forGrid(CUDADim3(1), CUDADim3(32, 32, 2)), 0, props).hasError());
+	TEST_CHECK(validateLaunchConfig(CUDALaunchConfig::forGrid(CUDADim3(1), CUDADim3(1, 1, 128)), 0, props).hasError());
+	TEST_CHECK(validateLaunchConfig(CUDALaunchConfig::forGrid(CUDADim3(1), CUDADim3(32), 64 * 1024), 0, props).hasError());
+}
+
+void testCooperative() {
+	CUDADeviceProperties props = makeProps();
+
+	// Capped to what fits on the device at once: 2 blocks on each of the 10 multiprocessors.
+	CUDALaunchConfig config = resolve(CUDALaunchConfig::forThreads(CUDADim3(1 << 20)).cooperative(), 256, 2, props);
+	TEST_CHECK(config.grid == CUDADim3(20));
+	TEST_CHECK_NO_ERROR(validateLaunchConfig(config, 2, props));
+
+	config = resolve(CUDALaunchConfig::forThreads(CUDADim3(4096, 4096), CUDADim3(32, 8)).cooperative(), 0, 2, props);
+	TEST_CHECK(config.grid.count() <= 20);
+	TEST_CHECK_NO_ERROR(validateLaunchConfig(config, 2, props));
+
+	// Explicit grids are not capped, they fail instead.
+	config = resolve(CUDALaunchConfig::forGrid(CUDADim3(21), CUDADim3(256)).cooperative(), 0, 2, props);
+	TEST_CHECK(validateLaunchConfig(config, 2, props).hasError());
+
+	props.cooperativeLaunch = false;
+	TEST_CHECK(validateLaunchConfig(CUDALaunchConfig::forGrid(CUDADim3(1), CUDADim3(32)).cooperative(), 2, props).hasError());
+}
+
+void testCluster() {
+	CUDADeviceProperties props = makeProps();
+	props.computeCapabilityMajor = 9;
+
+	// The grid is rounded up to whole clusters.
+	CUDALaunchConfig config = resolve(CUDALaunchConfig::forThreads(CUDADim3(1100), CUDADim3(256)).withCluster(CUDADim3(2)), 0, 0, props);
+	TEST_CHECK(config.grid == CUDADim3(6));
+	TEST_CHECK_NO_ERROR(validateLaunchConfig(config, 0, props));
+
+	TEST_CHECK(validateLaunchConfig(CUDALaunchConfig::forGrid(CUDADim3(5), CUDADim3(256)).withCluster(CUDADim3(2)), 0, props).hasError());
+
+	props.computeCapabilityMajor = 8;
+	TEST_CHECK(validateLaunchConfig(config, 0, props).hasError());
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testShapeBlock);
+	RUN_TEST(testComputeGrid);
+	RUN_TEST(testResolve);
+	RUN_TEST(testEmptyLaunches);
+	RUN_TEST(testDeviceLimits);
+	RUN_TEST(testCooperative);
+	RUN_TEST(testCluster);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,177 @@
+// Prefetches and advice CUDAManagedAllocator issues, on devices with and without prefetch support.
+#include <cuda_buffer.h>
+#include <cuda_managed_memory.h>
+
+#include <test_common.h>
+
+#include <cstring>
+#include <vector>
+
+namespace {
+
+constexpr SizeType KB = 1024;
+
+const CUstream testStream = reinterpret_cast<CUstream>(1);
+
+struct TestAllocator {
+	CUDAHostManagedMemoryBackend backend;
+	CUDAManagedAllocator allocator;
+
+	TestAllocator() {
+		TEST_CHECK_NO_ERROR(allocator.initialize(&backend));
+	}
+
+	~TestAllocator() {
+		TEST_CHECK_NO_ERROR(allocator.deinitialize());
+	}
+
+	CUDAManagedAllocator::CUDAMemBlock allocate(SizeType size) {
+		CUDAManagedAllocator::CUDAMemBlock block;
+		block.size = size;
+		TEST_CHECK_NO_ERROR(allocator.allocate(block));
+		TEST_CHECK(block.ptr != NULL && block.reserved == size);
+		return block;
+	}
+};
+
+bool isAdvice(const CUDAHostManagedMemoryBackend::Advice &advice, const CUDAManagedAllocator::CUDAMemBlock &block, CUmem_advise kind, CUdevice device) {
+	return advice.ptr == block.ptr && advice.size == block.size && advice.advice == kind && advice.device == device;
+}
+
+/*
+===============================================================
+Decisions
+===============================================================
+*/
+void testPrefetch() {
+	TestAllocator test;
+	CUDAManagedAllocator::CUDAMemBlock block = test.allocate(64 * KB);
+
+	CUdevice device0 = CU_DEVICE_INVALID;
+	TEST_CHECK(cuDeviceGet(&device0, 0) == CUDA_SUCCESS);
+
+	TEST_CHECK_NO_ERROR(test.allocator.prefetch(block, CUDAMemoryLocation::device(0), testStream));
+	TEST_CHECK_NO_ERROR(test.allocator.prefetch(block, CUDAMemoryLocation::host(), NULL));
+
+	// There is nowhere to move the pages to.
+	TEST_CHECK(test.allocator.prefetch(block, CUDAMemoryLocation::none(), testStream).hasError());
+
+	const std::vector<CUDAHostManagedMemoryBackend::Prefetch> prefetches = test.backend.getPrefetches();
+	TEST_CHECK(prefetches.size() == 2);
+	if (prefetches.size() == 2) {
+		TEST_CHECK(prefetches[0].ptr == block.ptr && prefetches[0].size == 64 * KB);
+		TEST_CHECK(prefetches[0].device == device0 && prefetches[0].stream == testStream);
+		TEST_CHECK(prefetches[1].device == CU_DEVICE_CPU && prefetches[1].stream == NULL);
+	}
+
+	TEST_CHECK_NO_ERROR(test.allocator.free(block));
+}
+
+void testAdvice() {
+	TestAllocator test;
+	CUDAManagedAllocator::CUDAMemBlock block = test.allocate(16 * KB);
+
+	CUdevice device0 = CU_DEVICE_INVALID;
+	TEST_CHECK(cuDeviceGet(&device0, 0) == CUDA_SUCCESS);
+
+	// Each call sets both hints, so an earlier call never leaves one behind.
+	TEST_CHECK_NO_ERROR(test.allocator.advise(block, true, CUDAMemoryLocation::device(0)));
+	TEST_CHECK_NO_ERROR(test.allocator.advise(block, false, CUDAMemoryLocation::host()));
+	TEST_CHECK_NO_ERROR(test.allocator.advise(block, false, CUDAMemoryLocation::none()));
+
+	const std::vector<CUDAHostManagedMemoryBackend::Advice> advice = test.backend.getAdvice();
+	TEST_CHECK(advice.size() == 6);
+	if (advice.size() == 6) {
+		TEST_CHECK(isAdvice(advice[0], block, CU_MEM_ADVISE_SET_READ_MOSTLY, CU_DEVICE_CPU));
+		TEST_CHECK(isAdvice(advice[1], block, CU_MEM_ADVISE_SET_PREFERRED_LOCATION, device0));
+		TEST_CHECK(isAdvice(advice[2], block, CU_MEM_ADVISE_UNSET_READ_MOSTLY, CU_DEVICE_CPU));
+		TEST_CHECK(isAdvice(advice[3], block, CU_MEM_ADVISE_SET_PREFERRED_LOCATION, CU_DEVICE_CPU));
+		TEST_CHECK(isAdvice(advice[4], block, CU_MEM_ADVISE_UNSET_READ_MOSTLY, CU_DEVICE_CPU));
+		TEST_CHECK(isAdvice(advice[5], block, CU_MEM_ADVISE_UNSET_PREFERRED_LOCATION, CU_DEVICE_CPU));
+	}
+
+	TEST_CHECK_NO_ERROR(test.allocator.free(block));
+}
+
+void testWithoutPrefetchSupport() {
+	TestAllocator test;
+	test.backend.setCanPrefetch(false);
+	CUDAManagedAllocator::CUDAMemBlock block = test.allocate(16 * KB);
+
+	// The driver migrates the pages on access anyway, so prefetching is skipped without an error.
+	TEST_CHECK_NO_ERROR(test.allocator.prefetch(block, CUDAMemoryLocation::device(0), testStream));
+	TEST_CHECK_NO_ERROR(test.allocator.prefetch(block, CUDAMemoryLocation::host(), testStream));
+	TEST_CHECK(test.backend.getPrefetches().empty());
+
+	// Advice is still given, it doesn't need concurrent access.
+	TEST_CHECK_NO_ERROR(test.allocator.advise(block, true, CUDAMemoryLocation::host()));
+	TEST_CHECK(test.backend.getAdvice().size() == 2);
+
+	TEST_CHECK_NO_ERROR(test.allocator.free(block));
+}
+
+/*
+===============================================================
+Lifetime
+===============================================================
+*/
+void testLifetime() {
+	TestAllocator test;
+
+	CUDAManagedAllocator::CUDAMemBlock invalid;
+	TEST_CHECK(test.allocator.allocate(invalid).hasError());
+
+	CUDAManagedAllocator::CUDAMemBlock block = test.allocate(4 * KB);
+	const CUDAManagedAllocator::CUDAMemBlock copy = block;
+	test.allocate(8 * KB);
+	TEST_CHECK(test.backend.getNumLiveBlocks() == 2);
+
+	TEST_CHECK_NO_ERROR(test.allocator.free(block));
+	TEST_CHECK(block.ptr == NULL);
+	CUDAManagedAllocator::CUDAMemBlock again = copy;
+	TEST_CHECK(test.allocator.free(again).hasError());
+	TEST_CHECK(test.backend.getNumLiveBlocks() == 1);
+
+	// Blocks still live are freed with the allocator.
+	TEST_CHECK_NO_ERROR(test.allocator.deinitialize());
+	TEST_CHECK(test.backend.getNumLiveBlocks() == 0);
+}
+
+void testManagedBuffer() {
+	std::vector<unsigned char> data(static_cast<size_t>(32 * KB));
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = (unsigned char)(i * 7);
+	}
+
+	// The host and the device see the same memory through one pointer.
+	CUDAManagedBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(data.size()));
+	memcpy(buffer.hostHandle(), data.data(), data.size());
+	TEST_CHECK_NO_ERROR(buffer.advise(true, CUDAMemoryLocation::device(0)));
+	TEST_CHECK_NO_ERROR(buffer.prefetchTo(CUDAMemoryLocation::device(0), NULL));
+
+	std::vector<unsigned char> result(data.size());
+	TEST_CHECK_NO_ERROR(buffer.download(result.data()));
+	TEST_CHECK(result == data);
+
+	CUDAManagedBuffer empty;
+	TEST_CHECK(empty.prefetchTo(CUDAMemoryLocation::host(), NULL).hasError());
+	TEST_CHECK(empty.advise(false, CUDAMemoryLocation::none()).hasError());
+}
+
+} // namespace
+
+int main() {
+	TEST_CHECK(initializeCUDAManager({}, false));
+	TEST_CHECK_NO_ERROR(bindThreadContext());
+
+	RUN_TEST(testPrefetch);
+	RUN_TEST(testAdvice);
+	RUN_TEST(testWithoutPrefetchSupport);
+	RUN_TEST(testLifetime);
+	RUN_TEST(testManagedBuffer);
+
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,149 @@
+// Copy path decisions of CUDAPeerAccess and the direct and staged copies between device memory.
+#include <cuda_buffer.h>
+#include <cuda_peer_access.h>
+
+#include <test_common.h>
+
+#include <vector>
+
+namespace {
+
+constexpr SizeType KB = 1024;
+
+std::vector<unsigned char> makePattern(SizeType size, unsigned char seed) {
+	std::vector<unsigned char> data(static_cast<size_t>(size));
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = (unsigned char)(seed + i * 13);
+	}
+	return data;
+}
+
+/*
+===============================================================
+Copy paths
+===============================================================
+*/
+void testCopyPaths() {
+	CUDAHostPeerTopology topology;
+	topology.setLink(0, 1, true);
+	topology.setLink(2, 0, false);
+
+	CUDAPeerAccess peerAccess;
+	peerAccess.initialize(&topology);
+
+	TEST_CHECK(peerAccess.getCopyPath(1, 1) == CUDACopyPath::SameDevice);
+	TEST_CHECK(topology.getNumEnableCalls() == 0);
+
+	// Peer access is enabled on first use and remembered.
+	TEST_CHECK(peerAccess.getCopyPath(0, 1) == CUDACopyPath::Peer);
+	TEST_CHECK(topology.isEnabled(0, 1));
+	TEST_CHECK(peerAccess.getCopyPath(0, 1) == CUDACopyPath::Peer);
+	TEST_CHECK(topology.getNumEnableCalls() == 1);
+
+	// Links are one-directional, pairs without one are staged without trying to enable anything.
+	TEST_CHECK(peerAccess.getCopyPath(1, 0) == CUDACopyPath::Staged);
+	TEST_CHECK(peerAccess.getCopyPath(2, 0) == CUDACopyPath::Staged);
+	TEST_CHECK(peerAccess.getCopyPath(0, 3) == CUDACopyPath::Staged);
+	TEST_CHECK(topology.getNumEnableCalls() == 1);
+	TEST_CHECK(!topology.isEnabled(1, 0));
+
+	// Without a topology every pair of different devices is staged.
+	CUDAPeerAccess unknown;
+	TEST_CHECK(unknown.getCopyPath(0, 1) == CUDACopyPath::Staged);
+	TEST_CHECK(unknown.getCopyPath(0, 0) == CUDACopyPath::SameDevice);
+}
+
+void testEnableFailureIsStaged() {
+	CUDAHostPeerTopology topology;
+	topology.setLink(0, 1, true);
+	topology.setLink(1, 0, true);
+	topology.setEnableFails(true);
+
+	CUDAPeerAccess peerAccess;
+	peerAccess.initialize(&topology);
+
+	// The link is there, but the copy must not rely on access that was never enabled.
+	TEST_CHECK(peerAccess.getCopyPath(0, 1) == CUDACopyPath::Staged);
+	TEST_CHECK(!topology.isEnabled(0, 1));
+
+	// The failure is remembered, so the driver isn't asked on every copy.
+	TEST_CHECK(peerAccess.getCopyPath(0, 1) == CUDACopyPath::Staged);
+	TEST_CHECK(topology.getNumEnableCalls() == 1);
+
+	// Other pairs are not affected by it, and a deinitialized object asks again.
+	topology.setEnableFails(false);
+	TEST_CHECK(peerAccess.getCopyPath(1, 0) == CUDACopyPath::Peer);
+	peerAccess.deinitialize();
+	TEST_CHECK(peerAccess.getCopyPath(0, 1) == CUDACopyPath::Peer);
+	TEST_CHECK(topology.getNumEnableCalls() == 3);
+}
+
+/*
+===============================================================
+Copies
+===============================================================
+*/
+/// Copy size bytes between two buffers of device 0 with path and check what arrived.
+/// The host driver has a single device, which is enough since the paths don't depend on the ordinals.
+void checkCopy(CUDACopyPath path, SizeType size, SizeType maxChunkSize) {
+	const CUDADevice *device = nullptr;
+	TEST_CHECK_NO_ERROR(getCUDAManager().getDevices().getDeviceByOrdinal(0, device));
+	if (device == nullptr) {
+		return;
+	}
+
+	const std::vector<unsigned char> data = makePattern(size, (unsigned char)size);
+	CUDADefaultBuffer src;
+	CUDADefaultBuffer dst;
+	TEST_CHECK_NO_ERROR(src.initialize(size));
+	TEST_CHECK_NO_ERROR(dst.initialize(size));
+	TEST_CHECK_NO_ERROR(src.upload(data.data()));
+	TEST_CHECK_NO_ERROR(dst.upload(makePattern(size, 0).data()));
+
+	CUstream stream = device->getDefaultStream(CUDADefaultStreamsEnumeration::Execution);
+	TEST_CHECK_NO_ERROR(copyDeviceMemory(dst.handle(), *device, src.handle(), *device, size, path, stream, maxChunkSize));
+	TEST_CHECK(cuStreamSynchronize(stream) == CUDA_SUCCESS);
+
+	std::vector<unsigned char> result(data.size());
+	TEST_CHECK_NO_ERROR(dst.download(result.data()));
+	TEST_CHECK(result == data);
+
+	// Both slices went back to the pool and are handed out again once the stream passed them.
+	CUDAPinnedHostPool &pinnedPool = getCUDAManager().getPinnedHostPool();
+	TEST_CHECK_NO_ERROR(pinnedPool.reclaim());
+	TEST_CHECK(pinnedPool.getNumInFlight() == 0);
+}
+
+void testCopies() {
+	TEST_CHECK_NO_ERROR(bindThreadContext());
+
+	checkCopy(CUDACopyPath::SameDevice, 40 * KB, 8 * KB);
+	checkCopy(CUDACopyPath::Peer, 40 * KB, 8 * KB);
+
+	// A single chunk uses one slice, more alternate between two and the last one may be short.
+	checkCopy(CUDACopyPath::Staged, 8 * KB, 8 * KB);
+	checkCopy(CUDACopyPath::Staged, 40 * KB + 123, 8 * KB);
+	checkCopy(CUDACopyPath::Staged, 1024 * KB + 123, 4 * KB);
+	checkCopy(CUDACopyPath::Staged, 2 * KB, 0);
+
+	// The path the enable failure falls back to still moves the data.
+	CUDAHostPeerTopology topology;
+	topology.setLink(0, 1, true);
+	topology.setEnableFails(true);
+	CUDAPeerAccess peerAccess;
+	peerAccess.initialize(&topology);
+	checkCopy(peerAccess.getCopyPath(0, 1), 64 * KB, 16 * KB);
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testCopyPaths);
+	RUN_TEST(testEnableFailureIsStaged);
+
+	TEST_CHECK(initializeCUDAManager({}, false));
+	RUN_TEST(testCopies);
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,156 @@
+// Staged and mapped CUDAPinnedMemoryBuffers of the manager and how the mode is chosen.
+#include <cuda_buffer.h>
+#include <cuda_host_kernel.h>
+
+#include <test_common.h>
+
+#include <chrono>
+#include <thread>
+
+namespace {
+
+/// Fills result with value, the first thread takes its time so the launch is still running when the host looks.
+const bool registered = registerHostKernel<int*, int, int>(
+	"slowFill",
+	[](const CUDAHostThread &thread, int *result, int count, int value) {
+		const int idx = thread.blockIdx.x * thread.blockDim.x + thread.threadIdx.x;
+		if (idx == 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		if (idx < count) {
+			result[idx] = value;
+		}
+	}
+);
+
+const int numElements = 256;
+
+/// Launch slowFill for all of buffer on stream without waiting for it.
+void launchSlowFill(CUDADefaultPinnedBuffer &buffer, CUstream stream, int value) {
+	const CUDADevice *device = getCUDAManager().getCurrentDevice();
+	CUDAFunction func(device->getModule(), "slowFill");
+	TEST_CHECK_NO_ERROR(func.addParams(buffer.handle(), numElements, value));
+	TEST_CHECK(cuLaunchKernel(func.getFunction(), 1, 1, 1, numElements, 1, 1, 0, stream, func.getParams(), NULL) == CUDA_SUCCESS);
+}
+
+bool isFilledWith(const CUDADefaultPinnedBuffer &buffer, int value) {
+	const int *data = static_cast<const int*>(buffer.hostHandle());
+	for (int i = 0; i < numElements; ++i) {
+		if (data[i] != value) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void testMappedDownloadWaitsForTheStream() {
+	const CUDADevice *device = getCUDAManager().getCurrentDevice();
+	const CUstream stream = device->getDefaultStream(CUDADefaultStreamsEnumeration::Execution);
+
+	CUDADefaultPinnedBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(numElements * sizeof(int), stream, CUDAHostMemoryMode::Mapped));
+	TEST_CHECK(buffer.getMode() == CUDAHostMemoryMode::Mapped);
+
+	launchSlowFill(buffer, stream, 42);
+	TEST_CHECK_NO_ERROR(buffer.download());
+	TEST_CHECK(isFilledWith(buffer, 42));
+}
+
+void testMappedDownloadWithoutStream() {
+	const CUDADevice *device = getCUDAManager().getCurrentDevice();
+	const CUstream stream = device->getDefaultStream(CUDADefaultStreamsEnumeration::Execution);
+
+	// The buffer doesn't know the stream, so download() waits for the whole context.
+	CUDADefaultPinnedBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(numElements * sizeof(int), NULL, CUDAHostMemoryMode::Mapped));
+
+	launchSlowFill(buffer, stream, 7);
+	TEST_CHECK_NO_ERROR(buffer.download());
+	TEST_CHECK(isFilledWith(buffer, 7));
+}
+
+void testStagedDownload() {
+	const CUDADevice *device = getCUDAManager().getCurrentDevice();
+	const CUstream stream = device->getDefaultStream(CUDADefaultStreamsEnumeration::Execution);
+
+	CUDADefaultPinnedBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(numElements * sizeof(int), stream, CUDAHostMemoryMode::Staged));
+	TEST_CHECK(buffer.getMode() == CUDAHostMemoryMode::Staged);
+
+	launchSlowFill(buffer, stream, 3);
+	TEST_CHECK_NO_ERROR(buffer.downloadAsync(stream));
+	TEST_CHECK(cuStreamSynchronize(stream) == CUDA_SUCCESS);
+	TEST_CHECK(isFilledWith(buffer, 3));
+}
+
+/// Attributes chooseHostMemoryMode looks at and the mode it should pick for them.
+struct HostMemoryModeCase {
+	bool canMapHostMemory;
+	bool unifiedAddressing;
+	bool integrated;
+	bool canUseHostPointerForRegisteredMem;
+	CUDAHostMemoryMode expected;
+};
+
+void testChooseHostMemoryMode() {
+	const CUDAHostMemoryMode Staged = CUDAHostMemoryMode::Staged;
+	const CUDAHostMemoryMode Mapped = CUDAHostMemoryMode::Mapped;
+
+	// Every combination. Mapping needs both mapped host memory and unified addressing,
+	// and only pays off on integrated devices or ones reading registered host memory directly.
+	// Everything else falls back to plain pinned memory with a device copy.
+	const HostMemoryModeCase cases[] = {
+		{ false, false, false, false, Staged },
+		{ false, false, false, true, Staged },
+		{ false, false, true, false, Staged },
+		{ false, false, true, true, Staged },
+		{ false, true, false, false, Staged },
+		{ false, true, false, true, Staged },
+		{ false, true, true, false, Staged },
+		{ false, true, true, true, Staged },
+		{ true, false, false, false, Staged },
+		{ true, false, false, true, Staged },
+		{ true, false, true, false, Staged },
+		{ true, false, true, true, Staged },
+		{ true, true, false, false, Staged },
+		{ true, true, false, true, Mapped },
+		{ true, true, true, false, Mapped },
+		{ true, true, true, true, Mapped },
+	};
+
+	for (const HostMemoryModeCase &c : cases) {
+		CUDADeviceProperties props;
+		props.canMapHostMemory = c.canMapHostMemory;
+		props.unifiedAddressing = c.unifiedAddressing;
+		props.integrated = c.integrated;
+		props.canUseHostPointerForRegisteredMem = c.canUseHostPointerForRegisteredMem;
+		TEST_CHECK(chooseHostMemoryMode(props) == c.expected);
+	}
+}
+
+/// Buffers asking for CUDAHostMemoryMode::Auto get the mode chosen for the device.
+void testAutoMode() {
+	const CUDADevice *device = getCUDAManager().getCurrentDevice();
+	TEST_CHECK(device->getHostMemoryMode() != CUDAHostMemoryMode::Auto);
+
+	CUDADefaultPinnedBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(numElements * sizeof(int)));
+	TEST_CHECK(buffer.getMode() == device->getHostMemoryMode());
+}
+
+} // namespace
+
+int main() {
+	TEST_CHECK(registered);
+	RUN_TEST(testChooseHostMemoryMode);
+
+	TEST_CHECK(initializeCUDAManager({}, false));
+	TEST_CHECK_NO_ERROR(bindThreadContext());
+	RUN_TEST(testMappedDownloadWaitsForTheStream);
+	RUN_TEST(testMappedDownloadWithoutStream);
+	RUN_TEST(testStagedDownload);
+	RUN_TEST(testAutoMode);
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,192 @@
+// Size classes, dedicated slices, the high-water cap and trimming of CUDAPinnedHostPool.
+#include <cuda_pinned_host_pool.h>
+
+#include <test_common.h>
+
+#include <vector>
+
+namespace {
+
+constexpr SizeType KB = 1024;
+constexpr SizeType MB = 1024 * KB;
+
+/// CUDAHostFenceBackend doesn't look at the stream, any non-NULL one puts a slice in flight.
+const CUstream inFlightStream = reinterpret_cast<CUstream>(1);
+
+struct TestPool {
+	CUDAHostMemoryBackend memory;
+	CUDAHostFenceBackend fences;
+	CUDAPinnedHostPool pool;
+
+	TestPool(SizeType chunkSize, SizeType maxPinnedBytes) {
+		fences.setManualSignal(true);
+		TEST_CHECK_NO_ERROR(pool.initialize(&memory, &fences, chunkSize, maxPinnedBytes));
+	}
+
+	CUDAPinnedSlice acquire(SizeType size) {
+		CUDAPinnedSlice slice;
+		TEST_CHECK_NO_ERROR(pool.acquire(size, slice));
+		TEST_CHECK(slice.ptr != nullptr && slice.size >= size);
+		return slice;
+	}
+};
+
+void testSliceSizes() {
+	TestPool test(MB, 4 * MB);
+	CUDAPinnedHostPool &pool = test.pool;
+
+	TEST_CHECK(pool.getSliceSize(1) == CUDAPinnedHostPool::MIN_SLICE_SIZE);
+	TEST_CHECK(pool.getSliceSize(100 * KB) == 128 * KB);
+	TEST_CHECK(pool.getSliceSize(256 * KB) == 256 * KB);
+
+	// Past a quarter of the chunk only whole pages are added.
+	TEST_CHECK(pool.getSliceSize(300 * KB) == 300 * KB);
+	TEST_CHECK(pool.getSliceSize(300 * KB + 1) == 304 * KB);
+
+	CUDAPinnedHostPool defaultPool;
+	TEST_CHECK(defaultPool.getSliceSize(33 * MB) == 33 * MB);
+	TEST_CHECK(defaultPool.getSliceSize(65 * MB) == 65 * MB);
+}
+
+void testSlicesAreReused() {
+	TestPool test(MB, 4 * MB);
+
+	CUDAPinnedSlice slice = test.acquire(100 * KB);
+	void *ptr = slice.ptr;
+	TEST_CHECK_NO_ERROR(test.pool.release(slice, NULL));
+	TEST_CHECK(slice.ptr == nullptr);
+
+	slice = test.acquire(128 * KB);
+	TEST_CHECK(slice.ptr == ptr);
+	TEST_CHECK(test.pool.getNumChunks() == 1);
+
+	// In flight it isn't handed out until the fence is signaled.
+	TEST_CHECK_NO_ERROR(test.pool.release(slice, inFlightStream));
+	CUDAPinnedSlice other = test.acquire(128 * KB);
+	TEST_CHECK(other.ptr != ptr);
+	TEST_CHECK_NO_ERROR(test.pool.release(other, NULL));
+
+	test.fences.signalAll();
+	TEST_CHECK_NO_ERROR(test.pool.reclaim());
+	TEST_CHECK(test.pool.getNumInFlight() == 0);
+}
+
+void testDedicatedSlices() {
+	TestPool test(MB, 4 * MB);
+
+	CUDAPinnedSlice big = test.acquire(600 * KB);
+	TEST_CHECK(big.size == 600 * KB);
+	TEST_CHECK(test.pool.getNumChunks() == 0);
+	TEST_CHECK(test.pool.getNumDedicatedSlices() == 1);
+	TEST_CHECK(test.pool.getPinnedBytes() == 600 * KB);
+
+	// Given back right away, big slices are not cached.
+	TEST_CHECK_NO_ERROR(test.pool.release(big, NULL));
+	TEST_CHECK(test.pool.getNumDedicatedSlices() == 0);
+	TEST_CHECK(test.pool.getPinnedBytes() == 0);
+
+	// Or once the stream is done with it.
+	big = test.acquire(2 * MB);
+	TEST_CHECK_NO_ERROR(test.pool.release(big, inFlightStream));
+	TEST_CHECK(test.pool.getPinnedBytes() == 2 * MB);
+	TEST_CHECK_NO_ERROR(test.pool.reclaim());
+	TEST_CHECK(test.pool.getPinnedBytes() == 2 * MB);
+
+	test.fences.signalAll();
+	TEST_CHECK_NO_ERROR(test.pool.reclaim());
+	TEST_CHECK(test.pool.getPinnedBytes() == 0);
+	TEST_CHECK(test.pool.getNumDedicatedSlices() == 0);
+}
+
+void testHighWaterCap() {
+	TestPool test(MB, 2 * MB);
+
+	// Three chunks worth of slices in use, the cap doesn't take them away.
+	std::vector<CUDAPinnedSlice> slices;
+	for (int i = 0; i < 12; ++i) {
+		slices.push_back(test.acquire(256 * KB));
+	}
+	TEST_CHECK(test.pool.getNumChunks() == 3);
+	TEST_CHECK(test.pool.getPinnedBytes() == 3 * MB);
+
+	// Once a chunk is idle and the pool is over the cap, it is released.
+	for (int i = 0; i < slices.size(); ++i) {
+		TEST_CHECK_NO_ERROR(test.pool.release(slices[i], NULL));
+	}
+	TEST_CHECK(test.pool.getPinnedBytes() == 2 * MB);
+	TEST_CHECK(test.pool.getNumChunks() == 2);
+
+	TEST_CHECK_NO_ERROR(test.pool.trim());
+	TEST_CHECK(test.pool.getPinnedBytes() == 0);
+	TEST_CHECK(test.pool.getNumChunks() == 0);
+}
+
+void testTrimKeepsChunksInUse() {
+	TestPool test(MB, 4 * MB);
+
+	CUDAPinnedSlice used = test.acquire(4 * KB);
+	CUDAPinnedSlice inFlight = test.acquire(256 * KB);
+	std::vector<CUDAPinnedSlice> rest;
+	for (int i = 0; i < 4; ++i) {
+		rest.push_back(test.acquire(256 * KB));
+	}
+	TEST_CHECK(test.pool.getNumChunks() == 2);
+
+	for (int i = 0; i < rest.size(); ++i) {
+		TEST_CHECK_NO_ERROR(test.pool.release(rest[i], NULL));
+	}
+	TEST_CHECK_NO_ERROR(test.pool.release(inFlight, inFlightStream));
+
+	// The first chunk has a slice in use and one in flight, the second is idle.
+	TEST_CHECK_NO_ERROR(test.pool.trim());
+	TEST_CHECK(test.pool.getNumChunks() == 1);
+
+	test.fences.signalAll();
+	TEST_CHECK_NO_ERROR(test.pool.trim());
+	TEST_CHECK(test.pool.getNumChunks() == 1);
+
+	TEST_CHECK_NO_ERROR(test.pool.release(used, NULL));
+	TEST_CHECK_NO_ERROR(test.pool.trim());
+	TEST_CHECK(test.pool.getNumChunks() == 0);
+}
+
+void testIdleChunksAreCarvedAgain() {
+	TestPool test(MB, 4 * MB);
+
+	// Fill the chunk with small slices, then give them all back.
+	std::vector<CUDAPinnedSlice> small;
+	for (int i = 0; i < 256; ++i) {
+		small.push_back(test.acquire(4 * KB));
+	}
+	for (int i = 0; i < small.size(); ++i) {
+		TEST_CHECK_NO_ERROR(test.pool.release(small[i], NULL));
+	}
+	TEST_CHECK(test.pool.getNumChunks() == 1);
+
+	// Bigger slices come from the same chunk instead of page-locking a new one.
+	std::vector<CUDAPinnedSlice> large;
+	for (int i = 0; i < 4; ++i) {
+		large.push_back(test.acquire(256 * KB));
+	}
+	TEST_CHECK(test.pool.getNumChunks() == 1);
+
+	// The small slices of the old carving are gone from the free lists.
+	CUDAPinnedSlice another = test.acquire(4 * KB);
+	TEST_CHECK(test.pool.getNumChunks() == 2);
+	for (int i = 0; i < large.size(); ++i) {
+		TEST_CHECK(another.ptr != large[i].ptr);
+	}
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testSliceSizes);
+	RUN_TEST(testSlicesAreReused);
+	RUN_TEST(testDedicatedSlices);
+	RUN_TEST(testHighWaterCap);
+	RUN_TEST(testTrimKeepsChunksInUse);
+	RUN_TEST(testIdleChunksAreCarvedAgain);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,180 @@
+// Stream selection, priorities and event reuse of CUDAStreamPool on the host stream backend.
+#include <cuda_stream_pool.h>
+
+#include <test_common.h>
+
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace {
+
+/*
+===============================================================
+Streams
+===============================================================
+*/
+void testPriorities() {
+	CUDAHostStreamBackend backend;
+	CUDAStreamPool pool;
+	TEST_CHECK_NO_ERROR(pool.initialize(&backend));
+
+	// The host backend reports the range [0, -5], like a device with six levels.
+	TEST_CHECK(pool.getDriverPriority(CUDAStreamPriority::Normal) == 0);
+	TEST_CHECK(pool.getDriverPriority(CUDAStreamPriority::High) == -5);
+
+	CUDAStreamLease normal;
+	CUDAStreamLease high;
+	TEST_CHECK_NO_ERROR(pool.acquire(CUDAStreamPriority::Normal, normal));
+	TEST_CHECK_NO_ERROR(pool.acquire(CUDAStreamPriority::High, high));
+	TEST_CHECK(normal.get() != high.get());
+	TEST_CHECK(high.getPriority() == CUDAStreamPriority::High);
+	TEST_CHECK(backend.getStreamPriority(normal.get()) == 0);
+	TEST_CHECK(backend.getStreamPriority(high.get()) == -5);
+
+	// Each priority has streams of its own.
+	TEST_CHECK(pool.getNumStreams(CUDAStreamPriority::Normal) == 1);
+	TEST_CHECK(pool.getNumStreams(CUDAStreamPriority::High) == 1);
+
+	CUDAStreamLease invalid;
+	TEST_CHECK(pool.acquire(CUDAStreamPriority::Count, invalid).hasError());
+	TEST_CHECK(!invalid.isValid());
+}
+
+void testSharedRoundRobin() {
+	CUDAHostStreamBackend backend;
+	CUDAStreamPool pool;
+	TEST_CHECK_NO_ERROR(pool.initialize(&backend, 3));
+
+	// A stream no one holds is created for each of the first leases.
+	std::vector<CUDAStreamLease> leases(9);
+	std::set<CUstream> streams;
+	for (int i = 0; i < 3; ++i) {
+		TEST_CHECK_NO_ERROR(pool.acquire(CUDAStreamPriority::Normal, leases[i]));
+		streams.insert(leases[i].get());
+	}
+	TEST_CHECK(streams.size() == 3);
+
+	// Past the cap the least shared stream is leased again, so the streams take turns.
+	for (int i = 3; i < leases.size(); ++i) {
+		TEST_CHECK_NO_ERROR(pool.acquire(CUDAStreamPriority::Normal, leases[i]));
+		TEST_CHECK(leases[i].get() == leases[i % 3].get());
+	}
+	TEST_CHECK(pool.getNumStreams(CUDAStreamPriority::Normal) == 3);
+	TEST_CHECK(pool.getNumLeases(CUDAStreamPriority::Normal) == 9);
+	TEST_CHECK(backend.getNumLiveStreams() == 3);
+
+	// Releasing both extra leases of a stream makes it the least shared one.
+	leases[4].release();
+	leases[7].release();
+	CUDAStreamLease next;
+	TEST_CHECK_NO_ERROR(pool.acquire(CUDAStreamPriority::Normal, next));
+	TEST_CHECK(next.get() == leases[1].get());
+
+	// Moving a lease keeps the count, destroying it gives the stream back.
+	CUDAStreamLease moved(std::move(next));
+	TEST_CHECK(!next.isValid() && moved.isValid());
+	TEST_CHECK(pool.getNumLeases(CUDAStreamPriority::Normal) == 8);
+	leases.clear();
+	TEST_CHECK(pool.getNumLeases(CUDAStreamPriority::Normal) == 1);
+
+	// An idle stream is reused before a new one is created.
+	CUDAStreamLease idle;
+	TEST_CHECK_NO_ERROR(pool.acquire(CUDAStreamPriority::Normal, idle));
+	TEST_CHECK(idle.get() != moved.get());
+	TEST_CHECK(pool.getNumStreams(CUDAStreamPriority::Normal) == 3);
+}
+
+/*
+===============================================================
+Events
+===============================================================
+*/
+void testEventReuse() {
+	CUDAHostStreamBackend backend;
+	CUDAStreamPool pool;
+	TEST_CHECK_NO_ERROR(pool.initialize(&backend));
+
+	CUDAStreamLease producer;
+	CUDAStreamLease consumer;
+	TEST_CHECK_NO_ERROR(pool.acquire(CUDAStreamPriority::Normal, producer));
+	TEST_CHECK_NO_ERROR(pool.acquire(CUDAStreamPriority::High, consumer));
+
+	CUDADependency dependency;
+	TEST_CHECK_NO_ERROR(pool.record(producer.get(), dependency));
+	TEST_CHECK(dependency.isValid() && dependency.isComplete());
+	TEST_CHECK_NO_ERROR(pool.waitFor(consumer.get(), dependency));
+	const CUevent event = dependency.getEvent();
+
+	// Recording again gives the old event back first and takes it right away.
+	TEST_CHECK_NO_ERROR(pool.record(producer.get(), dependency));
+	TEST_CHECK(dependency.getEvent() == event);
+	TEST_CHECK(pool.getEventPool().getNumCreated() == 1);
+
+	// Only events held at the same time are separate.
+	CUDADependency other;
+	TEST_CHECK_NO_ERROR(pool.record(consumer.get(), other));
+	TEST_CHECK(other.getEvent() != event);
+	TEST_CHECK(pool.getEventPool().getNumCreated() == 2);
+	dependency.reset();
+	other.reset();
+	TEST_CHECK(pool.getEventPool().getNumFree() == 2);
+
+	// The event of waitForStream goes back right away, so any number of them needs no new events.
+	for (int i = 0; i < 10; ++i) {
+		TEST_CHECK_NO_ERROR(pool.waitForStream(consumer.get(), producer.get()));
+	}
+	TEST_CHECK(pool.getEventPool().getNumCreated() == 2);
+	TEST_CHECK(pool.getEventPool().getNumFree() == 2);
+
+	// Every wait is ordered after the producer, and waiting for the same stream is skipped.
+	TEST_CHECK_NO_ERROR(pool.waitForStream(producer.get(), producer.get()));
+	const std::vector<CUDAHostStreamBackend::Wait> waits = backend.getWaits();
+	TEST_CHECK(waits.size() == 11);
+	for (int i = 0; i < waits.size(); ++i) {
+		TEST_CHECK(waits[i].stream == consumer.get());
+		TEST_CHECK(waits[i].recordedOn == producer.get());
+	}
+	TEST_CHECK(waits[0].event == event);
+
+	// An invalid dependency orders nothing.
+	TEST_CHECK_NO_ERROR(pool.waitFor(consumer.get(), CUDADependency()));
+	TEST_CHECK(backend.getWaits().size() == 11);
+}
+
+void testDeinitialize() {
+	CUDAHostStreamBackend backend;
+	CUDAStreamPool pool;
+	TEST_CHECK_NO_ERROR(pool.initialize(&backend));
+
+	CUDAStreamLease lease;
+	CUDADependency held;
+	CUDADependency returned;
+	TEST_CHECK_NO_ERROR(pool.acquire(CUDAStreamPriority::Normal, lease));
+	TEST_CHECK_NO_ERROR(pool.record(lease.get(), held));
+	TEST_CHECK_NO_ERROR(pool.record(lease.get(), returned));
+	returned.reset();
+	TEST_CHECK(backend.getNumLiveEvents() == 2);
+
+	// Pooled streams and events are destroyed, the held event once it comes back.
+	TEST_CHECK_NO_ERROR(pool.deinitialize());
+	TEST_CHECK(backend.getNumLiveStreams() == 0);
+	TEST_CHECK(backend.getNumLiveEvents() == 1);
+	held.reset();
+	TEST_CHECK(backend.getNumLiveEvents() == 0);
+
+	// Leases which outlive the pool are harmless.
+	lease.release();
+	TEST_CHECK(pool.acquire(CUDAStreamPriority::Normal, lease).hasError());
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testPriorities);
+	RUN_TEST(testSharedRoundRobin);
+	RUN_TEST(testEventReuse);
+	RUN_TEST(testDeinitialize);
+
+	return TEST_RESULT();
+}
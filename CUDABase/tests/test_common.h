@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+/// Number of failed TEST_CHECKs, the test returns non-zero if there was any.
+inline int numTestFailures = 0;
+
+/// Report a failed check and keep going, so one run shows every failure.
+#define TEST_CHECK(x) \
+do { \
+	if (!(x)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+		++numTestFailures; \
+	} \
+} while (false)
+
+#define TEST_CHECK_NO_ERROR(x) TEST_CHECK(!(x).hasError())
+
+template <class T>
+bool isAlignedFor(const void *ptr) {
+	return reinterpret_cast<uintptr_t>(ptr) % alignof(T) == 0;
+}
+
+/// Run a test case, printing its name so a failure can be found in the output.
+#define RUN_TEST(test, ...) \
+do { \
+	printf("%s\n", #test); \
+	test(__VA_ARGS__); \
+} while (false)
+
+#define TEST_RESULT() (numTestFailures > 0 ? 1 : 0)
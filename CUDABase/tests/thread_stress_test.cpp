@@ -0,0 +1,340 @@
+// Dozens of threads hammering the shared state of CUDABase at once.
+// Meant to be run under ThreadSanitizer as well, see CUDABASE_SANITIZE_THREAD.
+#include <cuda_buffer.h>
+#include <cuda_caching_pool.h>
+#include <cuda_device_registry.h>
+#include <cuda_memory_backend.h>
+#include <cuda_pinned_host_pool.h>
+
+#include <test_common.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr int NUM_THREADS = 32;
+constexpr SizeType KB = 1024;
+constexpr SizeType MB = 1024 * KB;
+
+/// Run func(threadIdx) on NUM_THREADS threads which all start at the same time.
+template <class Func>
+void runThreads(Func &&func) {
+	std::atomic<bool> go(false);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < NUM_THREADS; ++i) {
+		threads.emplace_back([&go, &func, i]() {
+			while (!go.load()) {
+				std::this_thread::yield();
+			}
+			func(i);
+		});
+	}
+
+	go.store(true);
+	for (int i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+}
+
+/// Mark the start of a block with its owner.
+void stamp(void *ptr, int owner) {
+	memcpy(ptr, &owner, sizeof(owner));
+}
+
+/// Check nobody else was handed the block while owner had it.
+bool hasStamp(const void *ptr, int owner) {
+	int value = -1;
+	memcpy(&value, ptr, sizeof(value));
+	return value == owner;
+}
+
+/*
+===============================================================
+CUDACachingPool
+===============================================================
+*/
+void testCachingPoolThreads() {
+	CUDAHostMemoryBackend hostMemory;
+	CUDABudgetMemoryBackend memory(&hostMemory, SizeType(-1) / 2);
+
+	// A low cap, so blocks also go back to the backend while the threads run.
+	CUDACachingPool pool;
+	TEST_CHECK_NO_ERROR(pool.initialize(&memory, 16 * MB));
+
+	const CUcontext ctx = reinterpret_cast<CUcontext>(1);
+	const CUstream streams[] = { NULL, reinterpret_cast<CUstream>(1), reinterpret_cast<CUstream>(2) };
+	const SizeType sizes[] = { 64, 4 * KB, 100 * KB, CUDACachingPool::SMALL_BIN_LIMIT, 3 * MB };
+
+	std::atomic<int> numErrors(0);
+	runThreads([&](int threadIdx) {
+		struct Block {
+			CUDAMemHandle ptr;
+			SizeType size;
+			CUDAPoolStream stream;
+		};
+
+		std::minstd_rand rng(threadIdx + 1);
+		std::vector<Block> blocks;
+		for (int i = 0; i < 2000; ++i) {
+			if (blocks.size() < 8 && (blocks.empty() || rng() % 2 == 0)) {
+				Block block;
+				block.stream = CUDAPoolStream(ctx, streams[rng() % 3]);
+				if (pool.allocate(block.ptr, block.size, sizes[rng() % 5], block.stream).hasError()) {
+					++numErrors;
+					continue;
+				}
+				stamp(reinterpret_cast<void*>(block.ptr), threadIdx);
+				blocks.push_back(block);
+				continue;
+			}
+
+			const int idx = int(rng() % blocks.size());
+			const Block block = blocks[idx];
+			blocks.erase(blocks.begin() + idx);
+			if (!hasStamp(reinterpret_cast<void*>(block.ptr), threadIdx)) {
+				++numErrors;
+			}
+
+			// Both free paths, with and without the thread cache.
+			const CUDAError err = i % 2 == 0 ? pool.free(block.ptr, block.size, block.stream) : pool.free(block.ptr, block.stream.stream);
+			if (err.hasError()) {
+				++numErrors;
+			}
+		}
+
+		for (int i = 0; i < blocks.size(); ++i) {
+			if (pool.free(blocks[i].ptr, blocks[i].size, blocks[i].stream).hasError()) {
+				++numErrors;
+			}
+		}
+	});
+
+	TEST_CHECK(numErrors == 0);
+	TEST_CHECK(pool.getLiveBytes() == 0);
+
+	// The caches of the threads went back to the shared lists when they exited.
+	TEST_CHECK_NO_ERROR(pool.trim());
+	TEST_CHECK(pool.getCachedBytes() == 0);
+	TEST_CHECK(memory.getUsedBytes() == 0);
+	TEST_CHECK_NO_ERROR(pool.deinitialize());
+}
+
+/*
+===============================================================
+CUDADeviceRegistry
+===============================================================
+*/
+/// Devices with a slow bring-up, the last one fails it.
+struct SlowDeviceDriver : CUDADeviceDriver {
+	static constexpr int NUM_DEVICES = 4;
+
+	std::atomic<int> numInitializations[NUM_DEVICES] = {};
+
+	CUDAError getDeviceCount(int &count) override {
+		count = NUM_DEVICES;
+		return CUDAError();
+	}
+
+	CUDAError queryDevice(int ordinal, CUDADeviceProperties &props) override {
+		props.ordinal = ordinal;
+		props.computeCapabilityMajor = 7;
+		props.unifiedAddressing = true;
+		props.totalMem = SizeType(ordinal + 1) * 1024 * MB;
+		return CUDAError();
+	}
+
+	CUDAError initializeDevice(int ordinal, CUDADevice &device) override {
+		++numInitializations[ordinal];
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		if (ordinal == NUM_DEVICES - 1) {
+			return CUDAError(CUDA_ERROR_INVALID_DEVICE, "SlowDeviceDriver_ERROR", "");
+		}
+		return CUDAError();
+	}
+
+	CUDAError deinitializeDevice(CUDADevice &device) override {
+		return CUDAError();
+	}
+};
+
+void testDeviceRegistryThreads() {
+	SlowDeviceDriver driver;
+	CUDADeviceRegistry registry;
+	TEST_CHECK_NO_ERROR(registry.discover(&driver, nullptr));
+	TEST_CHECK(registry.getNumDevices() == SlowDeviceDriver::NUM_DEVICES);
+
+	const CUDADevice *devices[NUM_THREADS] = {};
+	const CUDADevice *found[NUM_THREADS] = {};
+	std::atomic<int> numFailures(0);
+	std::atomic<int> numErrors(0);
+	runThreads([&](int threadIdx) {
+		const int idx = threadIdx % SlowDeviceDriver::NUM_DEVICES;
+		if (registry.getDevice(idx, devices[threadIdx]).hasError()) {
+			++numFailures;
+		}
+
+		// The device with the most memory fails, so the next best one is picked.
+		CUDADeviceRequirements requirements;
+		requirements.preferMostMemory = true;
+		if (registry.findDevice(requirements, found[threadIdx]).hasError()) {
+			++numErrors;
+		}
+	});
+
+	// Every device was brought up once, no matter how many threads asked for it at the same time.
+	for (int i = 0; i < SlowDeviceDriver::NUM_DEVICES; ++i) {
+		TEST_CHECK(driver.numInitializations[i] == 1);
+	}
+	TEST_CHECK(numFailures == NUM_THREADS / SlowDeviceDriver::NUM_DEVICES);
+	TEST_CHECK(numErrors == 0);
+	TEST_CHECK(registry.getState(SlowDeviceDriver::NUM_DEVICES - 1) == CUDADeviceState::Failed);
+
+	for (int i = 0; i < NUM_THREADS; ++i) {
+		const int idx = i % SlowDeviceDriver::NUM_DEVICES;
+		if (idx != SlowDeviceDriver::NUM_DEVICES - 1) {
+			TEST_CHECK(devices[i] == devices[idx]);
+		}
+		TEST_CHECK(found[i] == devices[SlowDeviceDriver::NUM_DEVICES - 2]);
+	}
+
+	TEST_CHECK_NO_ERROR(registry.deinitialize());
+}
+
+/*
+===============================================================
+CUDAPinnedHostPool
+===============================================================
+*/
+void testPinnedHostPoolThreads() {
+	CUDAHostMemoryBackend memory;
+	CUDAHostFenceBackend fences;
+	fences.setManualSignal(true);
+
+	CUDAPinnedHostPool pool;
+	TEST_CHECK_NO_ERROR(pool.initialize(&memory, &fences, MB, 4 * MB));
+
+	// Signals the fences of the slices released in flight while the threads run.
+	std::atomic<bool> done(false);
+	std::thread signaler([&]() {
+		while (!done.load()) {
+			fences.signalAll();
+			pool.reclaim();
+			pool.trim();
+			std::this_thread::yield();
+		}
+	});
+
+	const CUstream inFlightStream = reinterpret_cast<CUstream>(1);
+	const SizeType sizes[] = { 4 * KB, 64 * KB, 256 * KB, 600 * KB };
+
+	std::atomic<int> numErrors(0);
+	runThreads([&](int threadIdx) {
+		std::minstd_rand rng(threadIdx + 1);
+		std::vector<CUDAPinnedSlice> slices;
+		for (int i = 0; i < 500; ++i) {
+			if (slices.size() < 4 && (slices.empty() || rng() % 2 == 0)) {
+				CUDAPinnedSlice slice;
+				if (pool.acquire(sizes[rng() % 4], slice).hasError()) {
+					++numErrors;
+					continue;
+				}
+				memset(slice.ptr, threadIdx, size_t(slice.size));
+				slices.push_back(slice);
+				continue;
+			}
+
+			const int idx = int(rng() % slices.size());
+			CUDAPinnedSlice slice = slices[idx];
+			slices.erase(slices.begin() + idx);
+
+			const unsigned char *bytes = static_cast<const unsigned char*>(slice.ptr);
+			if (bytes[0] != threadIdx || bytes[slice.size - 1] != threadIdx) {
+				++numErrors;
+			}
+
+			if (pool.release(slice, rng() % 2 == 0 ? NULL : inFlightStream).hasError()) {
+				++numErrors;
+			}
+		}
+
+		for (int i = 0; i < slices.size(); ++i) {
+			if (pool.release(slices[i], NULL).hasError()) {
+				++numErrors;
+			}
+		}
+	});
+
+	done.store(true);
+	signaler.join();
+
+	TEST_CHECK(numErrors == 0);
+
+	fences.signalAll();
+	TEST_CHECK_NO_ERROR(pool.reclaim());
+	TEST_CHECK_NO_ERROR(pool.trim());
+	TEST_CHECK(pool.getNumInFlight() == 0);
+	TEST_CHECK(pool.getPinnedBytes() == 0);
+	TEST_CHECK_NO_ERROR(pool.deinitialize());
+}
+
+/*
+===============================================================
+CUDAManager
+===============================================================
+*/
+/// Buffers of the manager used from threads which never made a context current themselves.
+void testManagerBuffersThreads() {
+	std::atomic<int> numErrors(0);
+	runThreads([&](int threadIdx) {
+		std::vector<unsigned char> data(size_t(64 * KB));
+		std::vector<unsigned char> result(data.size());
+		for (size_t i = 0; i < data.size(); ++i) {
+			data[i] = (unsigned char)(threadIdx + i * 3);
+		}
+
+		for (int i = 0; i < 20; ++i) {
+			CUDADefaultBuffer buffer;
+			CUDAVirtualBuffer virtualBuffer;
+			CUDAError err = buffer.initialize(data.size());
+			if (!err.hasError()) err = buffer.upload(data.data());
+			if (!err.hasError()) err = virtualBuffer.initialize(data.size());
+			if (!err.hasError()) err = virtualBuffer.copyFrom(buffer, NULL);
+			if (!err.hasError()) err = virtualBuffer.download(result.data());
+			if (err.hasError() || result != data) {
+				++numErrors;
+			}
+
+			CUDADefaultPinnedBuffer pinned;
+			err = pinned.initialize(data.size());
+			if (!err.hasError()) {
+				memcpy(pinned.hostHandle(), data.data(), data.size());
+				err = pinned.upload();
+			}
+			if (!err.hasError()) err = pinned.download();
+			if (err.hasError() || memcmp(pinned.hostHandle(), data.data(), data.size()) != 0) {
+				++numErrors;
+			}
+		}
+	});
+
+	TEST_CHECK(numErrors == 0);
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testCachingPoolThreads);
+	RUN_TEST(testDeviceRegistryThreads);
+	RUN_TEST(testPinnedHostPoolThreads);
+
+	TEST_CHECK(initializeCUDAManager({}, false));
+	RUN_TEST(testManagerBuffersThreads);
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
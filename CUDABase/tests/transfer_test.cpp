@@ -0,0 +1,139 @@
+// Chunk planning of planTransferChunks and pipelined transfers with CUDAChunkedTransfer.
+#include <cuda_buffer.h>
+#include <cuda_transfer.h>
+
+#include <test_common.h>
+
+#include <vector>
+
+namespace {
+
+constexpr SizeType KB = 1024;
+
+bool isChunk(const CUDATransferChunk &chunk, SizeType offset, SizeType size) {
+	return chunk.offset == offset && chunk.size == size;
+}
+
+std::vector<CUDATransferChunk> plan(const std::vector<SizeType> &physicalChunkSizes, SizeType transferSize, SizeType maxChunkSize) {
+	std::vector<CUDATransferChunk> chunks;
+	TEST_CHECK_NO_ERROR(planTransferChunks(physicalChunkSizes, transferSize, maxChunkSize, chunks));
+	return chunks;
+}
+
+/*
+===============================================================
+planTransferChunks
+===============================================================
+*/
+void testContiguous() {
+	// One allocation without a limit is a single copy.
+	std::vector<CUDATransferChunk> chunks = plan({}, 10 * KB, 0);
+	TEST_CHECK(chunks.size() == 1 && isChunk(chunks[0], 0, 10 * KB));
+
+	// The last chunk takes what is left.
+	chunks = plan({}, 10 * KB, 4 * KB);
+	TEST_CHECK(chunks.size() == 3);
+	TEST_CHECK(isChunk(chunks[0], 0, 4 * KB) && isChunk(chunks[1], 4 * KB, 4 * KB) && isChunk(chunks[2], 8 * KB, 2 * KB));
+
+	TEST_CHECK(plan({}, 8 * KB, 4 * KB).size() == 2);
+	TEST_CHECK(plan({}, 0, 4 * KB).empty());
+}
+
+void testPhysicalBoundaries() {
+	// Chunks end at every boundary of the allocations, even where the limit would allow more.
+	std::vector<CUDATransferChunk> chunks = plan({ 6 * KB, 2 * KB, 8 * KB }, 16 * KB, 4 * KB);
+	TEST_CHECK(chunks.size() == 5);
+	if (chunks.size() == 5) {
+		TEST_CHECK(isChunk(chunks[0], 0, 4 * KB));
+		TEST_CHECK(isChunk(chunks[1], 4 * KB, 2 * KB));
+		TEST_CHECK(isChunk(chunks[2], 6 * KB, 2 * KB));
+		TEST_CHECK(isChunk(chunks[3], 8 * KB, 4 * KB));
+		TEST_CHECK(isChunk(chunks[4], 12 * KB, 4 * KB));
+	}
+
+	// Without a limit there is one chunk per allocation, up to the end of the transfer.
+	chunks = plan({ 6 * KB, 2 * KB, 8 * KB }, 9 * KB, 0);
+	TEST_CHECK(chunks.size() == 3);
+	if (chunks.size() == 3) {
+		TEST_CHECK(isChunk(chunks[0], 0, 6 * KB) && isChunk(chunks[1], 6 * KB, 2 * KB) && isChunk(chunks[2], 8 * KB, KB));
+	}
+
+	// Empty allocations are skipped.
+	chunks = plan({ 4 * KB, 0, 4 * KB }, 8 * KB, 0);
+	TEST_CHECK(chunks.size() == 2 && isChunk(chunks[1], 4 * KB, 4 * KB));
+}
+
+void testTransferTooBig() {
+	std::vector<CUDATransferChunk> chunks = plan({}, KB, 0);
+	TEST_CHECK(planTransferChunks({ 4 * KB, 4 * KB }, 8 * KB + 1, 0, chunks).hasError());
+	TEST_CHECK(chunks.empty());
+	TEST_CHECK(planTransferChunks({ 0 }, 1, 4 * KB, chunks).hasError());
+
+	// Exactly the size of the allocations is fine.
+	TEST_CHECK(plan({ 4 * KB, 4 * KB }, 8 * KB, 0).size() == 2);
+}
+
+/*
+===============================================================
+CUDAChunkedTransfer
+===============================================================
+*/
+void testChunkedRoundTrip() {
+	TEST_CHECK_NO_ERROR(bindThreadContext());
+
+	const SizeType size = 100 * KB + 7;
+	std::vector<unsigned char> data(static_cast<size_t>(size));
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = (unsigned char)(i * 3 + 1);
+	}
+
+	CUDADefaultBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(size));
+
+	const CUstream stream = getCUDAManager().getCurrentDevice()->getDefaultStream(CUDADefaultStreamsEnumeration::Upload);
+	const CUstream consumer = getCUDAManager().getCurrentDevice()->getDefaultStream(CUDADefaultStreamsEnumeration::Execution);
+
+	// More chunks than any queue depth, all of them are issued without waiting on the host.
+	CUDAChunkedTransfer upload;
+	TEST_CHECK_NO_ERROR(buffer.uploadChunked(data.data(), upload, stream, 4 * KB));
+	TEST_CHECK(upload.getNumChunks() == 26);
+	TEST_CHECK_NO_ERROR(upload.waitForAll(consumer));
+	TEST_CHECK_NO_ERROR(upload.waitForChunk(3, consumer));
+	TEST_CHECK(upload.waitForChunk(26, consumer).hasError());
+	TEST_CHECK(upload.waitForChunk(-1, consumer).hasError());
+
+	std::vector<unsigned char> result(data.size());
+	CUDAChunkedTransfer download;
+	TEST_CHECK_NO_ERROR(buffer.downloadChunked(result.data(), download, consumer, 16 * KB));
+	TEST_CHECK(download.getNumChunks() == 7);
+	TEST_CHECK_NO_ERROR(download.synchronize());
+	TEST_CHECK(result == data);
+	for (int i = 0; i < download.getNumChunks(); ++i) {
+		TEST_CHECK(download.isChunkDone(i));
+	}
+	TEST_CHECK(!download.isChunkDone(7));
+
+	// The events are kept for the next transfer.
+	TEST_CHECK_NO_ERROR(buffer.downloadChunked(result.data(), download, consumer, 64 * KB));
+	TEST_CHECK(download.getNumChunks() == 2);
+	TEST_CHECK_NO_ERROR(download.synchronize());
+	TEST_CHECK(result == data);
+
+	TEST_CHECK_NO_ERROR(upload.deinitialize());
+	TEST_CHECK(upload.getNumChunks() == 0);
+	TEST_CHECK_NO_ERROR(upload.synchronize());
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testContiguous);
+	RUN_TEST(testPhysicalBoundaries);
+	RUN_TEST(testTransferTooBig);
+
+	TEST_CHECK(initializeCUDAManager({}, false));
+	RUN_TEST(testChunkedRoundTrip);
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
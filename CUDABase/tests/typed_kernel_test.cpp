@@ -0,0 +1,194 @@
+// Packing of kernel parameters by CUDAFunction and TypedKernel, checked against a host kernel.
+#include <cuda_host_kernel.h>
+#include <cuda_typed_kernel.h>
+
+#include <test_common.h>
+
+#include <cstdint>
+
+namespace {
+
+struct alignas(16) Float4 {
+	float x, y, z, w;
+};
+
+/// What the last launch of "packTest" got.
+struct PackTestResult {
+	char c;
+	double d;
+	int16_t s;
+	Float4 f;
+	CUDAMemHandle ptr;
+};
+
+PackTestResult packTestResult;
+
+const bool registered = registerHostKernel<char, double, int16_t, Float4, CUDAMemHandle>(
+	"packTest",
+	[](const CUDAHostThread &thread, char c, double d, int16_t s, Float4 f, CUDAMemHandle ptr) {
+		packTestResult = { c, d, s, f, ptr };
+	}
+);
+
+struct TestContext {
+	CUmodule module = NULL;
+	CUcontext ctx = NULL;
+
+	TestContext() {
+		CUdevice dev;
+		TEST_CHECK(cuInit(0) == CUDA_SUCCESS);
+		TEST_CHECK(cuDeviceGet(&dev, 0) == CUDA_SUCCESS);
+		TEST_CHECK(cuCtxCreate(&ctx, 0, dev) == CUDA_SUCCESS);
+		TEST_CHECK(cuModuleLoadData(&module, nullptr) == CUDA_SUCCESS);
+	}
+
+	~TestContext() {
+		cuModuleUnload(module);
+		cuCtxDestroy(ctx);
+	}
+};
+
+/// Launch a single thread of func with params and wait for it.
+bool launchSingleThread(CUfunction func, void **params) {
+	return cuLaunchKernel(func, 1, 1, 1, 1, 1, 1, 0, NULL, params, NULL) == CUDA_SUCCESS
+		&& cuCtxSynchronize() == CUDA_SUCCESS;
+}
+
+bool isPackTestResult(char c, double d, int16_t s, const Float4 &f, CUDAMemHandle ptr) {
+	const PackTestResult &r = packTestResult;
+	return r.c == c && r.d == d && r.s == s && r.f.x == f.x && r.f.w == f.w && r.ptr == ptr;
+}
+
+// Narrowing conversions are rejected at compile time.
+static_assert(IsKernelArgCompatible<double, float>::value);
+static_assert(IsKernelArgCompatible<int, int16_t>::value);
+static_assert(IsKernelArgCompatible<CUDAMemHandle, CUDAMemHandle&>::value);
+static_assert(!IsKernelArgCompatible<int, double>::value);
+static_assert(!IsKernelArgCompatible<float, double>::value);
+static_assert(!IsKernelArgCompatible<int16_t, int>::value);
+static_assert(!IsKernelArgCompatible<unsigned int, int>::value);
+static_assert(!IsKernelArgCompatible<int*, CUDAMemHandle>::value);
+
+void testFunctionPacking(TestContext &test) {
+	CUDAFunction func(test.module, "packTest");
+	TEST_CHECK(func.getFunction() != NULL);
+
+	const Float4 f = { 1.f, 2.f, 3.f, 4.f };
+	TEST_CHECK_NO_ERROR(func.addParams(char(7), 2.5, int16_t(-3), f, CUDAMemHandle(0x1234)));
+	TEST_CHECK(func.getNumParams() == 5);
+
+	void **params = func.getParams();
+	TEST_CHECK(isAlignedFor<char>(params[0]));
+	TEST_CHECK(isAlignedFor<double>(params[1]));
+	TEST_CHECK(isAlignedFor<int16_t>(params[2]));
+	TEST_CHECK(isAlignedFor<Float4>(params[3]));
+	TEST_CHECK(isAlignedFor<CUDAMemHandle>(params[4]));
+
+	// The double after the char is padded to its alignment, not packed right after it.
+	TEST_CHECK(static_cast<char*>(params[1]) - static_cast<char*>(params[0]) == alignof(double));
+
+	TEST_CHECK(launchSingleThread(func.getFunction(), params));
+	TEST_CHECK(isPackTestResult(7, 2.5, -3, f, 0x1234));
+
+	// changeParam writes in place, the other parameters keep their values.
+	const double newD = -8.0;
+	TEST_CHECK_NO_ERROR(func.changeParam(&newD, 1));
+	TEST_CHECK(launchSingleThread(func.getFunction(), func.getParams()));
+	TEST_CHECK(isPackTestResult(7, -8.0, -3, f, 0x1234));
+
+	TEST_CHECK(func.changeParam(&newD, 5).hasError());
+
+	func.clearParams();
+	TEST_CHECK(func.getNumParams() == 0);
+}
+
+void testFunctionSizeCheck(TestContext &test) {
+	struct Blob {
+		char bytes[400];
+	};
+
+	CUDAFunction func(test.module, "packTest");
+	const Blob blob = {};
+	TEST_CHECK_NO_ERROR(func.addParams(blob, blob));
+
+	// 800 bytes are used, another blob would go past the 1024 byte parameter buffer.
+	TEST_CHECK(func.addParams(blob).hasError());
+	TEST_CHECK(func.getNumParams() == 2);
+
+	// The Float4s start at the next multiple of 16 after the char and fill the buffer up exactly.
+	TEST_CHECK_NO_ERROR(func.addParams(char(1), Float4{}, Float4{}, Float4{}, Float4{}, Float4{}, Float4{}, Float4{}, Float4{}, Float4{}, Float4{}, Float4{}, Float4{}, Float4{}));
+	TEST_CHECK(func.getNumParams() == 16);
+	TEST_CHECK(static_cast<char*>(func.getParams()[3]) - static_cast<char*>(func.getParams()[0]) == 816);
+	TEST_CHECK(func.addParams(char(2)).hasError());
+}
+
+void testFunctionNotLoaded(TestContext &test) {
+	CUDAFunction func;
+	TEST_CHECK(func.getFunction() == NULL);
+	TEST_CHECK(func.addParams(1, 2.0).hasError());
+	TEST_CHECK(func.getNumParams() == 0);
+
+	CUDAFunction missing(test.module, "noSuchKernel");
+	TEST_CHECK(missing.getFunction() == NULL);
+	TEST_CHECK(missing.addParams(1).hasError());
+}
+
+void testTypedKernelPacking(TestContext &test) {
+	using PackTestKernel = TypedKernel<char, double, int16_t, Float4, CUDAMemHandle>;
+
+	PackTestKernel kernel(test.module, "packTest");
+	TEST_CHECK(kernel.isLoaded());
+
+	const Float4 f = { 5.f, 6.f, 7.f, 8.f };
+	// Arguments convert to the signature as long as nothing is narrowed.
+	kernel.setArgs('a', 1.5f, int8_t(9), f, CUDAMemHandle(0x40));
+
+	void **params = kernel.getParams();
+	TEST_CHECK(params[0] == &kernel.getArg<0>());
+	TEST_CHECK(params[4] == &kernel.getArg<4>());
+	TEST_CHECK(isAlignedFor<double>(params[1]));
+	TEST_CHECK(isAlignedFor<int16_t>(params[2]));
+	TEST_CHECK(isAlignedFor<Float4>(params[3]));
+	TEST_CHECK(isAlignedFor<CUDAMemHandle>(params[4]));
+
+	TEST_CHECK(launchSingleThread(kernel.getFunction(), params));
+	TEST_CHECK(isPackTestResult('a', 1.5, 9, f, 0x40));
+
+	// One argument at a time, the pointer array stays the same.
+	kernel.setArg<2>(int16_t(-100));
+	TEST_CHECK(kernel.getParams() == params);
+	TEST_CHECK(launchSingleThread(kernel.getFunction(), kernel.getParams()));
+	TEST_CHECK(isPackTestResult('a', 1.5, -100, f, 0x40));
+
+	// Copies point to their own arguments, not to the ones of the original.
+	PackTestKernel copy(kernel);
+	TEST_CHECK(copy.getParams()[1] == &copy.getArg<1>());
+	copy.setArg<1>(3.0);
+	TEST_CHECK(kernel.getArg<1>() == 1.5);
+
+	PackTestKernel assigned;
+	assigned = kernel;
+	TEST_CHECK(assigned.getParams()[3] == &assigned.getArg<3>());
+	TEST_CHECK(assigned.getArg<2>() == -100);
+}
+
+void testTypedKernelWithoutArgs(TestContext &test) {
+	TypedKernel<> kernel;
+	TEST_CHECK(kernel.getParams() == nullptr);
+	TEST_CHECK(!kernel.isLoaded());
+}
+
+} // namespace
+
+int main() {
+	TEST_CHECK(registered);
+
+	TestContext test;
+	RUN_TEST(testFunctionPacking, test);
+	RUN_TEST(testFunctionSizeCheck, test);
+	RUN_TEST(testFunctionNotLoaded, test);
+	RUN_TEST(testTypedKernelPacking, test);
+	RUN_TEST(testTypedKernelWithoutArgs, test);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,196 @@
+// Address space reservations of CUDAVirtualAllocator and growing CUDAVirtualBuffers in place.
+#include <cuda_buffer.h>
+
+#include <test_common.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+constexpr SizeType MB = 1024 * 1024;
+
+void fillPattern(std::vector<unsigned char> &data, unsigned char seed) {
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = (unsigned char)(seed + i * 13);
+	}
+}
+
+void testReservationSize() {
+	CUDAVirtualAllocator allocator;
+	TEST_CHECK(allocator.getReservationSize(MB) == CUDAVirtualAllocator::RESERVATION_SIZE_FACTOR * MB);
+
+	// Large blocks only get the capped headroom, not a multiple of their size.
+	const SizeType large = 4096 * MB;
+	TEST_CHECK(allocator.getReservationSize(large) == large + CUDAVirtualAllocator::DEFAULT_MAX_RESERVATION_HEADROOM);
+
+	allocator.setMaxReservationHeadroom(0);
+	TEST_CHECK(allocator.getReservationSize(MB) == MB);
+}
+
+void testGrowInPlace() {
+	CUDAVirtualBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(MB));
+	const CUDAMemHandle ptr = buffer.handle();
+
+	std::vector<unsigned char> data(static_cast<size_t>(MB));
+	fillPattern(data, 5);
+	TEST_CHECK_NO_ERROR(buffer.upload(data.data()));
+
+	// Still inside the reservation, so the block doesn't move and keeps its contents.
+	TEST_CHECK_NO_ERROR(buffer.grow(3 * MB));
+	TEST_CHECK(buffer.handle() == ptr);
+	TEST_CHECK(buffer.getSize() == 3 * MB);
+
+	std::vector<unsigned char> result(size_t(3 * MB));
+	TEST_CHECK_NO_ERROR(buffer.download(result.data()));
+	TEST_CHECK(std::equal(data.begin(), data.end(), result.begin()));
+
+	TEST_CHECK_NO_ERROR(buffer.shrink(MB));
+	TEST_CHECK(buffer.handle() == ptr);
+	TEST_CHECK(buffer.getSize() == MB);
+}
+
+void testGrowPastTheReservation() {
+	CUDAVirtualAllocator &allocator = getCUDAManager().getAllocator<CUDAVirtualAllocator>();
+	allocator.setMaxReservationHeadroom(0);
+
+	// The reservation can only be extended if the range right after it is free,
+	// either way initialize() gets a buffer of the new size instead of failing.
+	CUDAVirtualBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(MB));
+	CUDAError err = buffer.grow(64 * MB);
+	TEST_CHECK(!err.hasError() || err.getError() == CUDA_ERROR_OUT_OF_MEMORY);
+	TEST_CHECK(buffer.getSize() == (err.hasError() ? MB : 64 * MB));
+
+	TEST_CHECK_NO_ERROR(buffer.initialize(128 * MB));
+	TEST_CHECK(buffer.getSize() == 128 * MB);
+
+	allocator.setMaxReservationHeadroom(CUDAVirtualAllocator::DEFAULT_MAX_RESERVATION_HEADROOM);
+}
+
+void testGrowAcrossReservations() {
+	CUDAVirtualAllocator &allocator = getCUDAManager().getAllocator<CUDAVirtualAllocator>();
+	allocator.setMaxReservationHeadroom(MB);
+
+	// 1 MB mapped of a 2 MB range, growing to 4 MB maps the rest of it and of the range reserved right after.
+	CUDAVirtualBuffer buffer;
+	TEST_CHECK_NO_ERROR(buffer.initialize(MB));
+	const CUDAMemHandle ptr = buffer.handle();
+
+	std::vector<unsigned char> data(static_cast<size_t>(MB));
+	fillPattern(data, 9);
+	TEST_CHECK_NO_ERROR(buffer.upload(data.data()));
+
+	TEST_CHECK_NO_ERROR(buffer.grow(4 * MB));
+	TEST_CHECK(buffer.handle() == ptr);
+	TEST_CHECK(buffer.getSize() == 4 * MB);
+
+	// Unmapped and mapped again over three ranges.
+	TEST_CHECK_NO_ERROR(buffer.grow(7 * MB));
+	TEST_CHECK_NO_ERROR(buffer.shrink(MB));
+	TEST_CHECK_NO_ERROR(buffer.grow(6 * MB));
+	TEST_CHECK(buffer.handle() == ptr);
+
+	std::vector<unsigned char> result(size_t(6 * MB));
+	TEST_CHECK_NO_ERROR(buffer.download(result.data()));
+	TEST_CHECK(std::equal(data.begin(), data.end(), result.begin()));
+
+	allocator.setMaxReservationHeadroom(CUDAVirtualAllocator::DEFAULT_MAX_RESERVATION_HEADROOM);
+}
+
+void testInitializeKeepsContentsWhenMoved() {
+	CUDAVirtualAllocator &allocator = getCUDAManager().getAllocator<CUDAVirtualAllocator>();
+	allocator.setMaxReservationHeadroom(0);
+
+	// The range reserved for next sits right after the one of buffer, so buffer can't grow in place.
+	CUDAVirtualBuffer buffer;
+	CUDAVirtualBuffer next;
+	TEST_CHECK_NO_ERROR(buffer.initialize(MB));
+	TEST_CHECK_NO_ERROR(next.initialize(MB));
+	const CUDAMemHandle ptr = buffer.handle();
+
+	std::vector<unsigned char> data(static_cast<size_t>(MB));
+	fillPattern(data, 21);
+	TEST_CHECK_NO_ERROR(buffer.upload(data.data()));
+
+	TEST_CHECK(buffer.grow(2 * MB).hasError());
+	TEST_CHECK_NO_ERROR(buffer.initialize(2 * MB));
+	TEST_CHECK(buffer.handle() != ptr);
+	TEST_CHECK(buffer.getSize() == 2 * MB);
+
+	std::vector<unsigned char> result(size_t(2 * MB));
+	TEST_CHECK_NO_ERROR(buffer.download(result.data()));
+	TEST_CHECK(std::equal(data.begin(), data.end(), result.begin()));
+
+	allocator.setMaxReservationHeadroom(CUDAVirtualAllocator::DEFAULT_MAX_RESERVATION_HEADROOM);
+}
+
+void testGrowToSmallerSizeFails() {
+	CUDAVirtualAllocator &allocator = getCUDAManager().getAllocator<CUDAVirtualAllocator>();
+
+	CUDAVirtualAllocator::CUDAMemBlock block;
+	block.size = 2 * MB;
+	TEST_CHECK_NO_ERROR(allocator.allocate(block));
+	TEST_CHECK(allocator.grow(block, MB).hasError());
+	TEST_CHECK(block.size == 2 * MB);
+	TEST_CHECK_NO_ERROR(allocator.grow(block, 2 * MB));
+	TEST_CHECK_NO_ERROR(allocator.free(block));
+}
+
+/// The stand-in rejects mappings across two reserved ranges like the driver does.
+void testMappingsStayInOneRange() {
+	CUdeviceptr first = 0;
+	CUdeviceptr second = 0;
+	TEST_CHECK(cuMemAddressReserve(&first, MB, 0, 0, 0) == CUDA_SUCCESS);
+	TEST_CHECK(cuMemAddressReserve(&second, MB, 0, first + MB, 0) == CUDA_SUCCESS);
+	TEST_CHECK(second == first + MB);
+
+	CUmemAllocationProp props = {};
+	props.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+	props.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+	props.location.id = 0;
+	CUmemGenericAllocationHandle physical = 0;
+	TEST_CHECK(cuMemCreate(&physical, 2 * MB, &props, 0) == CUDA_SUCCESS);
+	TEST_CHECK(cuMemMap(first, 2 * MB, 0, physical, 0) == CUDA_ERROR_INVALID_VALUE);
+
+	CUmemAccessDesc accessDesc = {};
+	accessDesc.location = props.location;
+	accessDesc.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+	TEST_CHECK(cuMemSetAccess(first, 2 * MB, &accessDesc, 1) == CUDA_ERROR_INVALID_VALUE);
+	TEST_CHECK(cuMemSetAccess(second, MB, &accessDesc, 1) == CUDA_SUCCESS);
+
+	TEST_CHECK(cuMemRelease(physical) == CUDA_SUCCESS);
+	TEST_CHECK(cuMemAddressFree(second, MB) == CUDA_SUCCESS);
+	TEST_CHECK(cuMemAddressFree(first, MB) == CUDA_SUCCESS);
+}
+
+void testManySmallBuffers() {
+	// Small blocks reserve a few times their size, not a fixed large range each.
+	std::vector<CUDAVirtualBuffer> buffers(1000);
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		TEST_CHECK_NO_ERROR(buffers[i].initialize(64 * 1024));
+	}
+
+	std::vector<CUDAAllocatorStatsSnapshot> snapshots;
+	getCUDAManager().getAllocator<CUDAVirtualAllocator>().getStats().getSnapshots(snapshots);
+	TEST_CHECK(snapshots.size() == 1 && snapshots[0].liveBlocks == buffers.size());
+}
+
+} // namespace
+
+int main() {
+	RUN_TEST(testReservationSize);
+
+	TEST_CHECK(initializeCUDAManager({}, false));
+	RUN_TEST(testGrowInPlace);
+	RUN_TEST(testGrowPastTheReservation);
+	RUN_TEST(testGrowAcrossReservations);
+	RUN_TEST(testInitializeKeepsContentsWhenMoved);
+	RUN_TEST(testGrowToSmallerSizeFails);
+	RUN_TEST(testMappingsStayInOneRange);
+	RUN_TEST(testManySmallBuffers);
+	deinitializeCUDAManager();
+
+	return TEST_RESULT();
+}
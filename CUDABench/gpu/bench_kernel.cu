@@ -0,0 +1,25 @@
+// Includes that fix syntax highlighting
+#ifdef CUDA_BENCH_DEBUG
+#include "device_launch_parameters.h"
+#endif
+
+#define gvoid  __global__ void
+#define cint   __constant__ int
+
+extern "C" {
+
+	/// Target of CUDADevice::uploadConstantParam.
+	cint benchParam;
+
+	/// Measures the launch overhead only.
+	gvoid benchEmpty() { }
+
+	/// One word per thread, used to move data through mapped host memory.
+	gvoid benchCopy(const unsigned int *src, unsigned int *dst, unsigned int count) {
+		const unsigned int idx = blockIdx.x * blockDim.x + threadIdx.x;
+		if (idx < count) {
+			dst[idx] = src[idx];
+		}
+	}
+
+}
@@ -0,0 +1,22 @@
+// Host versions of the kernels in bench_kernel.cu, built instead of the PTX with the CUDABase host backend.
+#include <cuda_host_kernel.h>
+
+namespace {
+
+int benchParam;
+
+void benchEmpty(const CUDAHostThread &thread) { }
+
+void benchCopy(const CUDAHostThread &thread, const unsigned int *src, unsigned int *dst, unsigned int count) {
+	const unsigned int idx = thread.blockIdx.x * thread.blockDim.x + thread.threadIdx.x;
+	if (idx < count) {
+		dst[idx] = src[idx];
+	}
+}
+
+const bool registered =
+	registerHostGlobal("benchParam", &benchParam) &&
+	registerHostKernel<>("benchEmpty", benchEmpty) &&
+	registerHostKernel<const unsigned int*, unsigned int*, unsigned int>("benchCopy", benchCopy);
+
+} // namespace
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cuda_memory_defines.h>
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// Summary of the samples of one benchmark case. Times are in milliseconds.
+struct BenchmarkStats {
+	int numSamples;
+	double min;
+	double max;
+	double mean;
+	double median;
+	double p90;
+	double p99;
+	double stdDev;
+
+	BenchmarkStats();
+
+	/// @param samples Sorted in place.
+	static BenchmarkStats compute(std::vector<double> &samples);
+};
+
+/// One measured case of a group, f.e. group "h2d" and name "pinned".
+struct BenchmarkResult {
+	std::string group;
+	std::string name;
+	SizeType bytes; ///< Bytes moved by one sample, 0 for cases which don't move data.
+	BenchmarkStats stats;
+
+	/// GB/s computed from bytes and the median, 0 if bytes is 0.
+	double getBandwidth() const;
+};
+
+struct BenchmarkConfig {
+	int warmupIterations; ///< Samples run before measuring and thrown away.
+	int repetitions; ///< Samples measured.
+	std::string filter; ///< Only cases whose "group/name" contains it are run. Empty runs all.
+
+	BenchmarkConfig() : warmupIterations(3), repetitions(20) { }
+};
+
+/// Size for case names, f.e. "64KB" or "16MB".
+std::string formatBenchmarkSize(SizeType bytes);
+
+/// Runs benchmark cases and collects their results.
+struct BenchmarkRunner {
+	/// One sample of a case. Sets elapsedMs to the time of the measured part only,
+	/// so setup and cleanup of the sample can be done outside of it.
+	using Sample = std::function<CUDAError(double &elapsedMs)>;
+
+public:
+	explicit BenchmarkRunner(const BenchmarkConfig &config);
+
+	bool isEnabled(const char *group, const std::string &name) const;
+
+	/// Run sample warmupIterations + repetitions times and record the result.
+	/// Does nothing for cases filtered out. Stops on the first failing sample.
+	CUDAError run(const char *group, const std::string &name, SizeType bytes, const Sample &sample);
+
+	const std::vector<BenchmarkResult> &getResults() const { return results; }
+
+	/// Write all results as a JSON document.
+	/// @param backend "cuda" or "host".
+	void writeJson(FILE *out, const char *backend, const std::string &deviceName) const;
+
+private:
+	BenchmarkConfig config;
+	std::vector<BenchmarkResult> results;
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <benchmark.h>
+#include <cuda_manager.h>
+
+/// Sizes the allocation and transfer benchmarks run with.
+struct PrimitiveBenchmarkSizes {
+	std::vector<SizeType> allocationSizes;
+	std::vector<SizeType> transferSizes;
+
+	/// 4KB to 64MB allocations and 64KB to 64MB transfers.
+	static PrimitiveBenchmarkSizes getDefault();
+
+	/// Small sizes only, for a quick check of the harness.
+	static PrimitiveBenchmarkSizes getQuick();
+};
+
+/// Latency of allocate and free for each device allocator.
+/// The default allocator caches freed blocks, so after warmup it measures the cached path.
+CUDAError benchmarkAllocators(BenchmarkRunner &runner, const PrimitiveBenchmarkSizes &sizes);
+
+/// H2D and D2H bandwidth of pageable, pinned and mapped host memory.
+/// Mapped memory is read and written by a copy kernel, since it needs no explicit copy.
+CUDAError benchmarkTransfers(BenchmarkRunner &runner, const CUDADevice &device, const PrimitiveBenchmarkSizes &sizes);
+
+/// Host cost of launching an empty kernel and the round trip of a launch and a stream synchronize.
+CUDAError benchmarkLaunches(BenchmarkRunner &runner, const CUDADevice &device);
+
+/// Cost of CUDADevice::uploadConstantParam.
+CUDAError benchmarkConstantUploads(BenchmarkRunner &runner, const CUDADevice &device);
+
+/// Latency of synchronizing an idle stream, a stream with a kernel in flight and a cross stream dependency.
+CUDAError benchmarkStreamSync(BenchmarkRunner &runner, const CUDADevice &device);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <benchmark.h>
+#include <cuda_manager.h>
+#include <cuda_task_scheduler.h>
+
+/// Worker counts and amounts of work the task scheduler benchmarks run with.
+struct TaskBenchmarkConfig {
+	std::vector<int> workerCounts;
+	int numTasks; ///< Empty tasks spawned by one sample.
+	SizeType parallelForBytes; ///< Size of the buffer summed by one parallel-for sample.
+
+	/// 1, 2, 4, ... workers up to all hardware threads, 10000 tasks and a 64MB parallel-for.
+	static TaskBenchmarkConfig getDefault();
+
+	/// 1 and all hardware threads with little work, for a quick check of the harness.
+	static TaskBenchmarkConfig getQuick();
+};
+
+/// Throughput of CUDATaskScheduler for each worker count:
+/// empty tasks spawned from the calling thread, the same spawned from inside tasks so workers steal from each other,
+/// and a parallel-for summing a buffer. Also the latency from the end of the work on a stream to its continuation running.
+CUDAError benchmarkTaskScheduler(BenchmarkRunner &runner, const CUDADevice &device, const TaskBenchmarkConfig &config);
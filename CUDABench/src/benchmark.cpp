@@ -0,0 +1,179 @@
+#include <benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+std::string formatBenchmarkSize(SizeType bytes) {
+	char buffer[32];
+	if (bytes >= (SizeType(1) << 20) && bytes % (SizeType(1) << 20) == 0) {
+		snprintf(buffer, sizeof(buffer), "%lluMB", static_cast<unsigned long long>(bytes >> 20));
+	} else if (bytes >= (SizeType(1) << 10) && bytes % (SizeType(1) << 10) == 0) {
+		snprintf(buffer, sizeof(buffer), "%lluKB", static_cast<unsigned long long>(bytes >> 10));
+	} else {
+		snprintf(buffer, sizeof(buffer), "%lluB", static_cast<unsigned long long>(bytes));
+	}
+	return buffer;
+}
+
+/*
+===============================================================
+BenchmarkStats
+===============================================================
+*/
+BenchmarkStats::BenchmarkStats() : numSamples(0), min(0.0), max(0.0), mean(0.0), median(0.0), p90(0.0), p99(0.0), stdDev(0.0) { }
+
+/// Nearest rank percentile of sorted samples.
+static double percentile(const std::vector<double> &sorted, double p) {
+	const SizeType rank = SizeType(std::ceil(p * sorted.size()));
+	return sorted[std::min(std::max(rank, SizeType(1)), SizeType(sorted.size())) - 1];
+}
+
+BenchmarkStats BenchmarkStats::compute(std::vector<double> &samples) {
+	BenchmarkStats result;
+	if (samples.empty()) {
+		return result;
+	}
+
+	std::sort(samples.begin(), samples.end());
+
+	double sum = 0.0;
+	for (int i = 0; i < samples.size(); ++i) {
+		sum += samples[i];
+	}
+
+	result.numSamples = int(samples.size());
+	result.min = samples.front();
+	result.max = samples.back();
+	result.mean = sum / samples.size();
+
+	const SizeType mid = samples.size() / 2;
+	result.median = samples.size() % 2 ? samples[mid] : (samples[mid - 1] + samples[mid]) / 2.0;
+	result.p90 = percentile(samples, 0.9);
+	result.p99 = percentile(samples, 0.99);
+
+	double variance = 0.0;
+	for (int i = 0; i < samples.size(); ++i) {
+		variance += (samples[i] - result.mean) * (samples[i] - result.mean);
+	}
+	result.stdDev = samples.size() > 1 ? std::sqrt(variance / (samples.size() - 1)) : 0.0;
+
+	return result;
+}
+
+/*
+===============================================================
+BenchmarkResult
+===============================================================
+*/
+double BenchmarkResult::getBandwidth() const {
+	if (bytes == 0 || stats.median <= 0.0) {
+		return 0.0;
+	}
+
+	return double(bytes) / (stats.median * 1e-3) / 1e9;
+}
+
+/*
+===============================================================
+BenchmarkRunner
+===============================================================
+*/
+BenchmarkRunner::BenchmarkRunner(const BenchmarkConfig &config) : config(config) { }
+
+bool BenchmarkRunner::isEnabled(const char *group, const std::string &name) const {
+	if (config.filter.empty()) {
+		return true;
+	}
+
+	const std::string fullName = std::string(group) + "/" + name;
+	return fullName.find(config.filter) != std::string::npos;
+}
+
+CUDAError BenchmarkRunner::run(const char *group, const std::string &name, SizeType bytes, const Sample &sample) {
+	if (!isEnabled(group, name)) {
+		return CUDAError();
+	}
+
+	CUDABASE_LOG(LogLevel::Info, "Running %s/%s", group, name.c_str());
+
+	double elapsedMs = 0.0;
+	for (int i = 0; i < config.warmupIterations; ++i) {
+		RETURN_ON_CUDA_ERROR_HANDLED(sample(elapsedMs));
+	}
+
+	std::vector<double> samples;
+	samples.reserve(config.repetitions);
+	for (int i = 0; i < config.repetitions; ++i) {
+		elapsedMs = 0.0;
+		RETURN_ON_CUDA_ERROR_HANDLED(sample(elapsedMs));
+		samples.push_back(elapsedMs);
+	}
+
+	BenchmarkResult result;
+	result.group = group;
+	result.name = name;
+	result.bytes = bytes;
+	result.stats = BenchmarkStats::compute(samples);
+	results.push_back(result);
+
+	return CUDAError();
+}
+
+static void writeJsonString(FILE *out, const std::string &str) {
+	fputc('"', out);
+	for (int i = 0; i < str.size(); ++i) {
+		const char c = str[i];
+		if (c == '"' || c == '\\') {
+			fputc('\\', out);
+			fputc(c, out);
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+void BenchmarkRunner::writeJson(FILE *out, const char *backend, const std::string &deviceName) const {
+	char timestamp[32] = "";
+	const time_t now = time(nullptr);
+	strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+	fprintf(out, "{\n");
+	fprintf(out, "\t\"timestamp\": \"%s\",\n", timestamp);
+	fprintf(out, "\t\"backend\": ");
+	writeJsonString(out, backend);
+	fprintf(out, ",\n\t\"device\": ");
+	writeJsonString(out, deviceName);
+	fprintf(out, ",\n\t\"warmupIterations\": %d,\n", config.warmupIterations);
+	fprintf(out, "\t\"repetitions\": %d,\n", config.repetitions);
+	fprintf(out, "\t\"results\": [");
+
+	for (int i = 0; i < results.size(); ++i) {
+		const BenchmarkResult &result = results[i];
+		const BenchmarkStats &stats = result.stats;
+
+		fprintf(out, "%s\n\t\t{\"group\": ", i ? "," : "");
+		writeJsonString(out, result.group);
+		fprintf(out, ", \"name\": ");
+		writeJsonString(out, result.name);
+		fprintf(out,
+			", \"bytes\": %llu, \"samples\": %d, \"minMs\": %.6f, \"maxMs\": %.6f, \"meanMs\": %.6f, "
+			"\"medianMs\": %.6f, \"p90Ms\": %.6f, \"p99Ms\": %.6f, \"stdDevMs\": %.6f, \"bandwidthGBs\": %.3f}",
+			static_cast<unsigned long long>(result.bytes),
+			stats.numSamples,
+			stats.min,
+			stats.max,
+			stats.mean,
+			stats.median,
+			stats.p90,
+			stats.p99,
+			stats.stdDev,
+			result.getBandwidth()
+		);
+	}
+
+	fprintf(out, "\n\t]\n}\n");
+}
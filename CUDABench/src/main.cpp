@@ -0,0 +1,135 @@
+#include <cuda_manager.h>
+#include <primitive_benchmarks.h>
+#include <task_benchmarks.h>
+
+void printUsage(const char *appName) {
+	Logger::log(
+		LogLevel::InfoFancy,
+		"Usage:\n"
+		"\t%s\n"
+		"\t-o|-output json_file_path OPTIONAL DEFAULT: stdout\n"
+		"\t-w|-warmup warmup iterations per case [0-inf) OPTIONAL DEFAULT: 3\n"
+		"\t-r|-repetitions measured iterations per case (0-inf) OPTIONAL DEFAULT: 20\n"
+		"\t-f|-filter only run cases whose group/name contains the string OPTIONAL\n"
+		"\t-q|-quick small sizes only OPTIONAL\n"
+		"\t-h prints this usage message and exits OPTIONAL\n"
+		"\n"
+		"\tGroups: alloc, free, h2d, d2h, launch, constant, sync, tasks.\n",
+		appName
+	);
+}
+
+int main(int argc, char **argv) {
+	BenchmarkConfig config;
+	PrimitiveBenchmarkSizes sizes = PrimitiveBenchmarkSizes::getDefault();
+	TaskBenchmarkConfig taskConfig = TaskBenchmarkConfig::getDefault();
+	const char *outputPath = nullptr;
+
+	for (int i = 1; i < argc; ) {
+		if (strcmp(argv[i], "-h") == 0) {
+			printUsage(argv[0]);
+			return 0;
+		}
+
+		if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "-quick") == 0) {
+			sizes = PrimitiveBenchmarkSizes::getQuick();
+			taskConfig = TaskBenchmarkConfig::getQuick();
+			++i;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			printUsage(argv[0]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-output") == 0) {
+			outputPath = argv[i + 1];
+		} else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "-warmup") == 0) {
+			config.warmupIterations = atoi(argv[i + 1]);
+		} else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-repetitions") == 0) {
+			config.repetitions = atoi(argv[i + 1]);
+		} else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "-filter") == 0) {
+			config.filter = argv[i + 1];
+		} else {
+			Logger::log(LogLevel::Error, "Unknown argument %s", argv[i]);
+			printUsage(argv[0]);
+			return 1;
+		}
+		i += 2;
+	}
+
+	if (config.warmupIterations < 0 || config.repetitions <= 0) {
+		Logger::log(LogLevel::Error, "Invalid arguments! Please refer to help:");
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	// Logs go to stdout too, only errors may end up next to the JSON.
+	if (outputPath == nullptr) {
+		Logger::setLogLevel(LogLevel::Error);
+	}
+
+	if (!initializeCUDAManager(std::vector<std::string>{"data/bench_kernel.ptx"}, false)) {
+		Logger::log(LogLevel::Error, "Failed to initialize CUDA");
+		return 1;
+	}
+
+	CUDAManager &cudaman = getCUDAManager();
+	const CUDADevice *device = nullptr;
+	CUDAError err = cudaman.getDevices().getDevice(0, device);
+	if (!err.hasError()) {
+		err = device->use();
+	}
+
+	BenchmarkRunner runner(config);
+	if (!err.hasError()) {
+		err = benchmarkAllocators(runner, sizes);
+	}
+	if (!err.hasError()) {
+		err = benchmarkTransfers(runner, *device, sizes);
+	}
+	if (!err.hasError()) {
+		err = benchmarkLaunches(runner, *device);
+	}
+	if (!err.hasError()) {
+		err = benchmarkConstantUploads(runner, *device);
+	}
+	if (!err.hasError()) {
+		err = benchmarkStreamSync(runner, *device);
+	}
+	if (!err.hasError()) {
+		err = benchmarkTaskScheduler(runner, *device, taskConfig);
+	}
+
+	int result = 0;
+	if (err.hasError()) {
+		LOG_CUDA_ERROR(err, LogLevel::Error);
+		result = 1;
+	} else {
+#ifdef CUDA_HOST_BACKEND
+		const char *backend = "host";
+#else // !CUDA_HOST_BACKEND
+		const char *backend = "cuda";
+#endif // CUDA_HOST_BACKEND
+
+		std::string deviceName;
+		device->getName(deviceName);
+
+		FILE *out = outputPath ? fopen(outputPath, "w") : stdout;
+		if (out == nullptr) {
+			Logger::log(LogLevel::Error, "Can't open %s for writing", outputPath);
+			result = 1;
+		} else {
+			Logger::flush();
+			runner.writeJson(out, backend, deviceName);
+			if (out != stdout) {
+				fclose(out);
+			}
+		}
+	}
+
+	deinitializeCUDAManager();
+
+	return result;
+}
@@ -0,0 +1,223 @@
+#include <primitive_benchmarks.h>
+
+#include <cuda_buffer.h>
+#include <cuda_typed_kernel.h>
+
+/*
+===============================================================
+PrimitiveBenchmarkSizes
+===============================================================
+*/
+PrimitiveBenchmarkSizes PrimitiveBenchmarkSizes::getDefault() {
+	PrimitiveBenchmarkSizes result;
+	result.allocationSizes = { SizeType(4) << 10, SizeType(1) << 20, SizeType(64) << 20 };
+	result.transferSizes = { SizeType(64) << 10, SizeType(1) << 20, SizeType(16) << 20, SizeType(64) << 20 };
+	return result;
+}
+
+PrimitiveBenchmarkSizes PrimitiveBenchmarkSizes::getQuick() {
+	PrimitiveBenchmarkSizes result;
+	result.allocationSizes = { SizeType(4) << 10, SizeType(1) << 20 };
+	result.transferSizes = { SizeType(64) << 10, SizeType(1) << 20 };
+	return result;
+}
+
+/*
+===============================================================
+Allocators
+===============================================================
+*/
+template <class Allocator>
+static CUDAError benchmarkAllocator(BenchmarkRunner &runner, const char *allocatorName, const PrimitiveBenchmarkSizes &sizes) {
+	using CUDAMemBlock = typename Allocator::CUDAMemBlock;
+	Allocator &allocator = getCUDAManager().getAllocator<Allocator>();
+
+	for (int i = 0; i < sizes.allocationSizes.size(); ++i) {
+		const SizeType size = sizes.allocationSizes[i];
+		const std::string name = std::string(allocatorName) + "/" + formatBenchmarkSize(size);
+
+		RETURN_ON_CUDA_ERROR_HANDLED(runner.run("alloc", name, 0, [&](double &elapsedMs) -> CUDAError {
+			CUDAMemBlock memBlock;
+			memBlock.size = size;
+			memBlock.reserved = size;
+
+			Timer timer;
+			RETURN_ON_CUDA_ERROR_HANDLED(allocator.allocate(memBlock));
+			elapsedMs = timer.time();
+
+			return allocator.free(memBlock);
+		}));
+
+		RETURN_ON_CUDA_ERROR_HANDLED(runner.run("free", name, 0, [&](double &elapsedMs) -> CUDAError {
+			CUDAMemBlock memBlock;
+			memBlock.size = size;
+			memBlock.reserved = size;
+			RETURN_ON_CUDA_ERROR_HANDLED(allocator.allocate(memBlock));
+
+			Timer timer;
+			RETURN_ON_CUDA_ERROR_HANDLED(allocator.free(memBlock));
+			elapsedMs = timer.time();
+
+			return CUDAError();
+		}));
+	}
+
+	return CUDAError();
+}
+
+CUDAError benchmarkAllocators(BenchmarkRunner &runner, const PrimitiveBenchmarkSizes &sizes) {
+	RETURN_ON_CUDA_ERROR_HANDLED(benchmarkAllocator<CUDADefaultAllocator>(runner, "default", sizes));
+	RETURN_ON_CUDA_ERROR_HANDLED(benchmarkAllocator<CUDAVirtualAllocator>(runner, "virtual", sizes));
+	return CUDAError();
+}
+
+/*
+===============================================================
+Transfers
+===============================================================
+*/
+/// Time op followed by a synchronize of stream.
+template <class Op>
+static CUDAError timeOnStream(CUstream stream, double &elapsedMs, Op &&op) {
+	Timer timer;
+	RETURN_ON_CUDA_ERROR_HANDLED(op());
+	RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream));
+	elapsedMs = timer.time();
+	return CUDAError();
+}
+
+CUDAError benchmarkTransfers(BenchmarkRunner &runner, const CUDADevice &device, const PrimitiveBenchmarkSizes &sizes) {
+	CUDAStreamLease stream;
+	RETURN_ON_CUDA_ERROR_HANDLED(device.getStreamPool().acquire(CUDAStreamPriority::Normal, stream));
+
+	TypedKernel<CUDAMemHandle, CUDAMemHandle, unsigned int> copyKernel(device.getModule(), "benchCopy");
+	const bool canMap = device.getProperties().canMapHostMemory;
+	if (!canMap) {
+		CUDABASE_LOG(LogLevel::Warning, "Device can't map host memory, skipping the mapped transfers");
+	}
+
+	for (int i = 0; i < sizes.transferSizes.size(); ++i) {
+		const SizeType size = sizes.transferSizes[i];
+		const std::string sizeName = formatBenchmarkSize(size);
+
+		CUDADefaultBuffer deviceBuffer;
+		RETURN_ON_CUDA_ERROR_HANDLED(deviceBuffer.initialize(size, stream.get()));
+
+		if (runner.isEnabled("h2d", "pageable/" + sizeName) || runner.isEnabled("d2h", "pageable/" + sizeName)) {
+			std::vector<unsigned char> pageable(size, 0x1);
+
+			RETURN_ON_CUDA_ERROR_HANDLED(runner.run("h2d", "pageable/" + sizeName, size, [&](double &elapsedMs) {
+				return timeOnStream(stream.get(), elapsedMs, [&]() { return deviceBuffer.uploadAsync(pageable.data(), stream.get()); });
+			}));
+			RETURN_ON_CUDA_ERROR_HANDLED(runner.run("d2h", "pageable/" + sizeName, size, [&](double &elapsedMs) {
+				return timeOnStream(stream.get(), elapsedMs, [&]() { return deviceBuffer.downloadAsync(pageable.data(), stream.get()); });
+			}));
+		}
+
+		if (runner.isEnabled("h2d", "pinned/" + sizeName) || runner.isEnabled("d2h", "pinned/" + sizeName)) {
+			CUDADefaultPinnedBuffer pinned;
+			RETURN_ON_CUDA_ERROR_HANDLED(pinned.initialize(size, stream.get(), CUDAHostMemoryMode::Staged));
+			memset(pinned.hostHandle(), 0x1, size);
+
+			RETURN_ON_CUDA_ERROR_HANDLED(runner.run("h2d", "pinned/" + sizeName, size, [&](double &elapsedMs) {
+				return timeOnStream(stream.get(), elapsedMs, [&]() { return pinned.uploadAsync(stream.get()); });
+			}));
+			RETURN_ON_CUDA_ERROR_HANDLED(runner.run("d2h", "pinned/" + sizeName, size, [&](double &elapsedMs) {
+				return timeOnStream(stream.get(), elapsedMs, [&]() { return pinned.downloadAsync(stream.get()); });
+			}));
+		}
+
+		if (canMap && (runner.isEnabled("h2d", "mapped/" + sizeName) || runner.isEnabled("d2h", "mapped/" + sizeName))) {
+			CUDADefaultPinnedBuffer mapped;
+			RETURN_ON_CUDA_ERROR_HANDLED(mapped.initialize(size, stream.get(), CUDAHostMemoryMode::Mapped));
+			memset(mapped.hostHandle(), 0x1, size);
+
+			const unsigned int numWords = unsigned(size / sizeof(unsigned int));
+			const CUDALaunchConfig config = CUDALaunchConfig::forThreads(CUDADim3(numWords));
+
+			RETURN_ON_CUDA_ERROR_HANDLED(runner.run("h2d", "mapped/" + sizeName, size, [&](double &elapsedMs) {
+				copyKernel.setArgs(mapped.handle(), deviceBuffer.handle(), numWords);
+				return timeOnStream(stream.get(), elapsedMs, [&]() { return copyKernel.launch(config, stream.get()); });
+			}));
+			RETURN_ON_CUDA_ERROR_HANDLED(runner.run("d2h", "mapped/" + sizeName, size, [&](double &elapsedMs) {
+				copyKernel.setArgs(deviceBuffer.handle(), mapped.handle(), numWords);
+				return timeOnStream(stream.get(), elapsedMs, [&]() { return copyKernel.launch(config, stream.get()); });
+			}));
+		}
+	}
+
+	return CUDAError();
+}
+
+/*
+===============================================================
+Launches, constants and streams
+===============================================================
+*/
+CUDAError benchmarkLaunches(BenchmarkRunner &runner, const CUDADevice &device) {
+	CUDAStreamLease stream;
+	RETURN_ON_CUDA_ERROR_HANDLED(device.getStreamPool().acquire(CUDAStreamPriority::Normal, stream));
+
+	TypedKernel<> emptyKernel(device.getModule(), "benchEmpty");
+	const CUDALaunchConfig config = CUDALaunchConfig::forGrid(CUDADim3(1), CUDADim3(1));
+
+	RETURN_ON_CUDA_ERROR_HANDLED(runner.run("launch", "empty_async", 0, [&](double &elapsedMs) -> CUDAError {
+		Timer timer;
+		RETURN_ON_CUDA_ERROR_HANDLED(emptyKernel.launch(config, stream.get()));
+		elapsedMs = timer.time();
+
+		// Not measured, keeps the queue from growing between samples.
+		RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream.get()));
+		return CUDAError();
+	}));
+
+	RETURN_ON_CUDA_ERROR_HANDLED(runner.run("launch", "empty_sync", 0, [&](double &elapsedMs) {
+		return timeOnStream(stream.get(), elapsedMs, [&]() { return emptyKernel.launch(config, stream.get()); });
+	}));
+
+	return CUDAError();
+}
+
+CUDAError benchmarkConstantUploads(BenchmarkRunner &runner, const CUDADevice &device) {
+	int value = 0;
+	return runner.run("constant", "uploadConstantParam", 0, [&](double &elapsedMs) -> CUDAError {
+		++value;
+
+		Timer timer;
+		RETURN_ON_CUDA_ERROR_HANDLED(device.uploadConstantParam(&value, "benchParam"));
+		elapsedMs = timer.time();
+
+		return CUDAError();
+	});
+}
+
+CUDAError benchmarkStreamSync(BenchmarkRunner &runner, const CUDADevice &device) {
+	CUDAStreamPool &streamPool = device.getStreamPool();
+	CUDAStreamLease producer;
+	CUDAStreamLease consumer;
+	RETURN_ON_CUDA_ERROR_HANDLED(streamPool.acquire(CUDAStreamPriority::Normal, producer));
+	RETURN_ON_CUDA_ERROR_HANDLED(streamPool.acquire(CUDAStreamPriority::Normal, consumer));
+
+	TypedKernel<> emptyKernel(device.getModule(), "benchEmpty");
+	const CUDALaunchConfig config = CUDALaunchConfig::forGrid(CUDADim3(1), CUDADim3(1));
+
+	RETURN_ON_CUDA_ERROR_HANDLED(runner.run("sync", "idle_stream", 0, [&](double &elapsedMs) {
+		return timeOnStream(producer.get(), elapsedMs, []() { return CUDAError(); });
+	}));
+
+	RETURN_ON_CUDA_ERROR_HANDLED(runner.run("sync", "after_launch", 0, [&](double &elapsedMs) -> CUDAError {
+		RETURN_ON_CUDA_ERROR_HANDLED(emptyKernel.launch(config, producer.get()));
+		return timeOnStream(producer.get(), elapsedMs, []() { return CUDAError(); });
+	}));
+
+	// The consumer waits for the producer on the device, the host only synchronizes with the consumer.
+	RETURN_ON_CUDA_ERROR_HANDLED(runner.run("sync", "event_dependency", 0, [&](double &elapsedMs) -> CUDAError {
+		RETURN_ON_CUDA_ERROR_HANDLED(emptyKernel.launch(config, producer.get()));
+		return timeOnStream(consumer.get(), elapsedMs, [&]() -> CUDAError {
+			RETURN_ON_CUDA_ERROR_HANDLED(streamPool.waitForStream(consumer.get(), producer.get()));
+			return emptyKernel.launch(config, consumer.get());
+		});
+	}));
+
+	return CUDAError();
+}
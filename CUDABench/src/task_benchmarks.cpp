@@ -0,0 +1,165 @@
+#include <task_benchmarks.h>
+
+#include <cuda_typed_kernel.h>
+
+#include <algorithm>
+#include <numeric>
+#include <thread>
+
+/*
+===============================================================
+TaskBenchmarkConfig
+===============================================================
+*/
+static int getNumHardwareThreads() {
+	return std::max(1, int(std::thread::hardware_concurrency()));
+}
+
+TaskBenchmarkConfig TaskBenchmarkConfig::getDefault() {
+	TaskBenchmarkConfig result;
+	const int numThreads = getNumHardwareThreads();
+	for (int count = 1; count < numThreads; count *= 2) {
+		result.workerCounts.push_back(count);
+	}
+	result.workerCounts.push_back(numThreads);
+	result.numTasks = 10000;
+	result.parallelForBytes = SizeType(64) << 20;
+	return result;
+}
+
+TaskBenchmarkConfig TaskBenchmarkConfig::getQuick() {
+	TaskBenchmarkConfig result;
+	const int numThreads = getNumHardwareThreads();
+	result.workerCounts.push_back(1);
+	if (numThreads > 1) {
+		result.workerCounts.push_back(numThreads);
+	}
+	result.numTasks = 1000;
+	result.parallelForBytes = SizeType(4) << 20;
+	return result;
+}
+
+/*
+===============================================================
+Task scheduler
+===============================================================
+*/
+static CUDAError benchmarkWorkerCount(BenchmarkRunner &runner, int numWorkers, const TaskBenchmarkConfig &config, const std::vector<unsigned int> &data) {
+	const std::string workersName = "/w" + std::to_string(numWorkers);
+	const std::string tasksName = std::to_string(config.numTasks);
+
+	CUDATaskScheduler scheduler;
+	RETURN_ON_CUDA_ERROR_HANDLED(scheduler.initialize(numWorkers));
+
+	std::atomic<int> numRan(0);
+	const CUDATask emptyTask = [&numRan]() {
+		numRan.fetch_add(1, std::memory_order_relaxed);
+		return CUDAError();
+	};
+
+	RETURN_ON_CUDA_ERROR_HANDLED(runner.run("tasks", "spawn_" + tasksName + workersName, 0, [&](double &elapsedMs) -> CUDAError {
+		CUDATaskGroup group(scheduler);
+
+		Timer timer;
+		for (int i = 0; i < config.numTasks; ++i) {
+			group.run(emptyTask);
+		}
+		RETURN_ON_CUDA_ERROR_HANDLED(group.wait());
+		elapsedMs = timer.time();
+
+		return CUDAError();
+	}));
+
+	// Each worker queues tasks on its own deque, the idle ones have to steal them.
+	RETURN_ON_CUDA_ERROR_HANDLED(runner.run("tasks", "spawn_nested_" + tasksName + workersName, 0, [&](double &elapsedMs) -> CUDAError {
+		const int numSpawners = 64;
+		const int tasksPerSpawner = std::max(1, config.numTasks / numSpawners);
+		CUDATaskGroup group(scheduler);
+
+		Timer timer;
+		for (int i = 0; i < numSpawners; ++i) {
+			group.run([&]() {
+				for (int j = 0; j < tasksPerSpawner; ++j) {
+					group.run(emptyTask);
+				}
+				return CUDAError();
+			});
+		}
+		RETURN_ON_CUDA_ERROR_HANDLED(group.wait());
+		elapsedMs = timer.time();
+
+		return CUDAError();
+	}));
+
+	const SizeType bytes = data.size() * sizeof(unsigned int);
+	RETURN_ON_CUDA_ERROR_HANDLED(runner.run("tasks", "parallel_for_" + formatBenchmarkSize(bytes) + workersName, bytes, [&](double &elapsedMs) -> CUDAError {
+		std::atomic<unsigned long long> sum(0);
+
+		Timer timer;
+		RETURN_ON_CUDA_ERROR_HANDLED(scheduler.parallelFor(0, data.size(), 0, [&](SizeType begin, SizeType end) {
+			sum.fetch_add(std::accumulate(data.begin() + begin, data.begin() + end, 0ull), std::memory_order_relaxed);
+			return CUDAError();
+		}));
+		elapsedMs = timer.time();
+
+		if (sum.load() != data.size()) {
+			return CUDAError(CUDA_ERROR_UNKNOWN, "TaskBenchmark_ERROR_WRONG_SUM", "");
+		}
+		return CUDAError();
+	}));
+
+	scheduler.deinitialize();
+	return CUDAError();
+}
+
+CUDAError benchmarkTaskScheduler(BenchmarkRunner &runner, const CUDADevice &device, const TaskBenchmarkConfig &config) {
+	std::vector<unsigned int> data;
+	for (int i = 0; i < config.workerCounts.size(); ++i) {
+		const std::string workersName = "/w" + std::to_string(config.workerCounts[i]);
+		if (!runner.isEnabled("tasks", "spawn_" + std::to_string(config.numTasks) + workersName) &&
+			!runner.isEnabled("tasks", "spawn_nested_" + std::to_string(config.numTasks) + workersName) &&
+			!runner.isEnabled("tasks", "parallel_for_" + formatBenchmarkSize(config.parallelForBytes) + workersName)) {
+			continue;
+		}
+
+		if (data.empty()) {
+			data.assign(config.parallelForBytes / sizeof(unsigned int), 1);
+		}
+		RETURN_ON_CUDA_ERROR_HANDLED(benchmarkWorkerCount(runner, config.workerCounts[i], config, data));
+	}
+
+	if (!runner.isEnabled("tasks", "continuation")) {
+		return CUDAError();
+	}
+
+	CUDAStreamLease stream;
+	RETURN_ON_CUDA_ERROR_HANDLED(device.getStreamPool().acquire(CUDAStreamPriority::Normal, stream));
+
+	CUDATaskScheduler scheduler;
+	RETURN_ON_CUDA_ERROR_HANDLED(scheduler.initialize());
+
+	TypedKernel<> emptyKernel(device.getModule(), "benchEmpty");
+	const CUDALaunchConfig launchConfig = CUDALaunchConfig::forGrid(CUDADim3(1), CUDADim3(1));
+
+	// From the end of the work on the stream, as seen by a synchronize, to the continuation running.
+	CUDAError err = runner.run("tasks", "continuation", 0, [&](double &elapsedMs) -> CUDAError {
+		CUDATaskGroup group(scheduler);
+		Timer timer;
+		double ranAtMs = 0.0;
+
+		RETURN_ON_CUDA_ERROR_HANDLED(emptyKernel.launch(launchConfig, stream.get()));
+		RETURN_ON_CUDA_ERROR_HANDLED(group.runAfterStream(stream.get(), [&]() {
+			ranAtMs = timer.time();
+			return CUDAError();
+		}));
+		RETURN_ON_CUDA_ERROR(cuStreamSynchronize(stream.get()));
+		const double streamDoneMs = timer.time();
+		RETURN_ON_CUDA_ERROR_HANDLED(group.wait());
+
+		elapsedMs = std::max(0.0, ranAtMs - streamDoneMs);
+		return CUDAError();
+	});
+
+	scheduler.deinitialize();
+	return err;
+}
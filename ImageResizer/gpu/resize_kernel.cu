@@ -119,18 +119,19 @@ extern "C" {
 		const int algorithm,
 		unsigned char *outImg
 	) {
-		const int pixelCount = outWidth * outHeight;
-		const int pixelIdx = blockIdx.x * blockDim.x + threadIdx.x;
+		// One thread per output pixel on a 2D grid, so neighbouring threads
+		// in a block sample neighbouring input rows and columns.
+		const int outX = blockIdx.x * blockDim.x + threadIdx.x;
+		const int outY = blockIdx.y * blockDim.y + threadIdx.y;
 
-		if (pixelIdx >= pixelCount) {
+		if (outX >= outWidth || outY >= outHeight) {
 			return;
 		}
 
+		const int pixelIdx = outY * outWidth + outX;
+
 		const float ratioW = float(outWidth) / inWidth;
 		const float ratioH = float(outHeight) / inHeight;
-
-		const int outX = pixelIdx % outWidth;
-		const int outY = pixelIdx / outWidth;
 		
 		float2 sample;
 		sample.x = (float(outX) + 0.5f) / ratioW;
@@ -0,0 +1,168 @@
+// Host versions of the kernels in resize_kernel.cu, built instead of the PTX with the CUDABase host backend.
+#include <cuda_host_kernel.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+constexpr float PI_F = 3.14159265358979f;
+
+struct hostFloat2 {
+	float x;
+	float y;
+};
+
+struct hostInt2 {
+	int x;
+	int y;
+};
+
+typedef float (*samplingKernel)(float x, float y, int window);
+
+int arrSize;
+
+float sinc(float x) {
+	float PI_x = PI_F * x;
+	return sinf(PI_x) / (PI_x);
+}
+
+float lanczos2(float x) {
+	if (x > -1e-6f && x < 1e-6f) {
+		return 1.f;
+	}
+
+	if (x < -2.f || x > 2.f) {
+		return 0.f;
+	}
+
+	return sinc(x) * sinc(x / 2.f);
+}
+
+float lanczos3(float x) {
+	if (x > -1e-6f && x < 1e-6f) {
+		return 1.f;
+	}
+
+	if (x < -3.f || x > 3.f) {
+		return 0.f;
+	}
+
+	return sinc(x) * sinc(x / 3.f);
+}
+
+float lanczos2D(float x, float y, int window) {
+	if (window != 2 && window != 3) {
+		return 0.f;
+	}
+
+	if (window == 2) {
+		return lanczos2(x) * lanczos2(y);
+	}
+
+	return lanczos3(x) * lanczos3(y);
+}
+
+float nearestNeighbour(float x, float y, int window) {
+	return x >= -0.5f && x <= 0.5f && y >= -0.5f && y <= 0.5f;
+}
+
+void convolve(
+	const unsigned char *inImg,
+	samplingKernel kernel,
+	hostFloat2 sample,
+	hostInt2 rangeX,
+	hostInt2 rangeY,
+	int inputWidth,
+	int numComp,
+	int window,
+	unsigned char *result
+) {
+	float result_[4];
+	for (int i = 0; i < numComp; ++i) {
+		result_[i] = 0;
+	}
+
+	for (int i = rangeY.x; i < rangeY.y; ++i) {
+		for (int j = rangeX.x; j < rangeX.y; ++j) {
+			int inputIdx = (i * inputWidth + j) * numComp;
+			float weight = kernel(sample.x - j, sample.y - i, window);
+
+			for (int k = 0; k < numComp; ++k) {
+				const float sampleWeighted = float(inImg[inputIdx + k]) * weight;
+				result_[k] += sampleWeighted;
+			}
+		}
+	}
+
+	for (int i = 0; i < numComp; ++i) {
+		result[i] = (unsigned char)(std::min(std::max(0.f, result_[i]), 255.f));
+	}
+}
+
+void adder(const CUDAHostThread &thread, int *arrA, int *arrB, int *result) {
+	int idx = thread.blockIdx.x * thread.blockDim.x + thread.threadIdx.x;
+	idx = std::min(idx, arrSize - 1);
+	result[idx] = arrA[idx] + arrB[idx];
+}
+
+void resize(
+	const CUDAHostThread &thread,
+	const unsigned char *inImg,
+	const int inWidth,
+	const int inHeight,
+	const int numComp,
+	const int outWidth,
+	const int outHeight,
+	const int algorithm,
+	unsigned char *outImg
+) {
+	const int outX = thread.blockIdx.x * thread.blockDim.x + thread.threadIdx.x;
+	const int outY = thread.blockIdx.y * thread.blockDim.y + thread.threadIdx.y;
+
+	if (outX >= outWidth || outY >= outHeight) {
+		return;
+	}
+
+	const int pixelIdx = outY * outWidth + outX;
+
+	const float ratioW = float(outWidth) / inWidth;
+	const float ratioH = float(outHeight) / inHeight;
+
+	hostFloat2 sample;
+	sample.x = (float(outX) + 0.5f) / ratioW;
+	sample.y = (float(outY) + 0.5f) / ratioH;
+
+	hostInt2 floorSample = { int(floorf(sample.x)), int(floorf(sample.y)) };
+
+	int window = 3;
+	samplingKernel kernelPtr;
+	switch (algorithm) {
+	case 0:
+		kernelPtr = nearestNeighbour;
+		window = 1;
+		break;
+	case 1:
+	default:
+		kernelPtr = lanczos2D;
+		window = 3;
+		break;
+	}
+
+	hostInt2 rangeX = {
+		std::min(std::max(0, floorSample.x - window - 1), inWidth),
+		std::min(std::max(0, floorSample.x + window + 1), inWidth)
+	};
+	hostInt2 rangeY = {
+		std::min(std::max(0, floorSample.y - window - 1), inHeight),
+		std::min(std::max(0, floorSample.y + window + 1), inHeight)
+	};
+	convolve(inImg, kernelPtr, sample, rangeX, rangeY, inWidth, numComp, window, &outImg[pixelIdx * numComp]);
+}
+
+const bool registered =
+	registerHostGlobal("arrSize", &arrSize) &&
+	registerHostKernel<int*, int*, int*>("adder", adder) &&
+	registerHostKernel<const unsigned char*, int, int, int, int, int, int, unsigned char*>("resize", resize);
+
+} // namespace
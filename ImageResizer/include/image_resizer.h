@@ -4,7 +4,8 @@
 #include <vector>
 #include <stack>
 
-#include <cuda_manager.h>
+#include <cuda_graph.h>
+#include <cuda_kernel.h>
 
 using ImageHandle = size_t;
 #define InvalidImageHandle ImageHandle(0)
@@ -76,5 +77,11 @@ private:
 	std::vector<ImageData> images;
 	std::stack<size_t> freeSlots;
 	const CUDADevice *device;
-	CUDAFunction resizeKernel;
+	/// Takes inImg, inWidth, inHeight, numComp, outWidth, outHeight, algorithm, outImg.
+	/// The arguments are passed per launch, the kernel itself holds no state of a resize.
+	CUDAKernel resizeKernel;
+	CUDAGraph resizeGraph;
+	int uploadNode;
+	int resizeNode;
+	int downloadNode;
 };
\ No newline at end of file
@@ -9,35 +9,26 @@
 
 #include <cuda_buffer.h>
 
-ImageResizer::ImageResizer() {
+ImageResizer::ImageResizer() : uploadNode(-1), resizeNode(-1), downloadNode(-1) {
 	// Push a sentinel value since index 0 is reserved for InvalidImageHandle
 	images.push_back(ImageData{});
 
 	// Choose device for resizing. Choose the one with maximum total mem.
+	// Only that device gets brought up.
 	CUDAManager &cudaman = getCUDAManager();
-	const std::vector<CUDADevice>& devices = cudaman.getDevices();
-	SizeType maxTotalMem = 0;
-	for (int i = 0; i < devices.size(); ++i) {
-		SizeType totalMem;
-		CUDAError err = devices[i].getTotalMemory(totalMem);
-		if (err.hasError()) {
-			continue;
-		}
-		if (totalMem > maxTotalMem) {
-			maxTotalMem = totalMem;
-			device = &devices[i];
-		}
-	}
+	CUDADeviceRequirements requirements;
+	requirements.preferMostMemory = true;
+	CUDAError err = cudaman.getDevices().findDevice(requirements, device);
 
 	// No device is suitable. Just fail
 	// We could fall back to CPU resizing but there is no point since this whole program
 	// is just a CUDA exercise.
-	if (maxTotalMem == 0) {
+	if (err.hasError()) {
 		Logger::log(LogLevel::Error, "No CUDA device suitable for resizing the image. Exitting...");
 		exit(1);
 	}
 
-	resizeKernel.initialize(device->getModule(), "resize");
+	resizeKernel.initialize("resize");
 }
 
 ImageHandle ImageResizer::openImage(const char *filename) {
@@ -129,11 +120,6 @@ ImageHandle ImageResizer::resize(ImageHandle handle, int outputWidth, int output
 		return InvalidImageHandle;
 	}
 
-	err = deviceInputImage.upload(inputImage.data);
-	if (err.hasError()) {
-		return InvalidImageHandle;
-	}
-
 	const SizeType outputImagePixels = SizeType(outputWidth) * outputHeight;
 	const SizeType outputImageSize = outputImagePixels * inputImage.numComp;
 	err = deviceOutputImage.initialize(outputImageSize);
@@ -141,13 +127,15 @@ ImageHandle ImageResizer::resize(ImageHandle handle, int outputWidth, int output
 		return InvalidImageHandle;
 	}
 
-	const int numResizeKernelParams = 7;
-	if (resizeKernel.getNumParams() > 0) {
-		massert(resizeKernel.getNumParams() == numResizeKernelParams);
-		resizeKernel.clearParams();
+	CUfunction resizeFunction = NULL;
+	err = resizeKernel.getFunction(*device, resizeFunction);
+	if (err.hasError()) {
+		return InvalidImageHandle;
 	}
 
-	err = resizeKernel.addParams(
+	// Copied into the graph when the node is recorded or updated below.
+	CUDAArgumentFrame resizeArgs;
+	err = resizeArgs.push(
 		deviceInputImage.handle(),
 		inputImage.width,
 		inputImage.height,
@@ -161,14 +149,6 @@ ImageHandle ImageResizer::resize(ImageHandle handle, int outputWidth, int output
 		return InvalidImageHandle;
 	}
 
-	err = resizeKernel.launchSync(
-		outputImagePixels,
-		device->getDefaultStream(CUDADefaultStreamsEnumeration::Execution)
-	);
-	if (err.hasError()) {
-		return InvalidImageHandle;
-	}
-
 	ImageData outputImage = {
 		nullptr,
 		outputWidth,
@@ -177,9 +157,35 @@ ImageHandle ImageResizer::resize(ImageHandle handle, int outputWidth, int output
 		false
 	};
 	outputImage.data = (unsigned char*)malloc(outputImageSize);
-	
-	err = deviceOutputImage.download(outputImage.data);
+
+	// Upload, resize and download are recorded once and replayed for every following image
+	// with the nodes pointed to the new buffers.
+	const CUDALaunchConfig resizeConfig = CUDALaunchConfig::forThreads(CUDADim3(outputWidth, outputHeight));
+	if (resizeGraph.getNodes().empty()) {
+		uploadNode = resizeGraph.addUpload(deviceInputImage, inputImage.data);
+		resizeNode = resizeGraph.addKernel(resizeFunction, resizeArgs, resizeConfig, resizeKernel.getName());
+		downloadNode = resizeGraph.addDownload(outputImage.data, deviceOutputImage);
+	} else {
+		err = resizeGraph.updateUpload(uploadNode, deviceInputImage.handle(), inputImage.data, inputImageSize);
+		if (!err.hasError()) {
+			err = resizeGraph.updateKernel(resizeNode, resizeArgs, resizeConfig);
+		}
+		if (!err.hasError()) {
+			err = resizeGraph.updateDownload(downloadNode, outputImage.data, deviceOutputImage.handle(), outputImageSize);
+		}
+		if (err.hasError()) {
+			free(outputImage.data);
+			return InvalidImageHandle;
+		}
+	}
+
+	CUstream stream = device->getDefaultStream(CUDADefaultStreamsEnumeration::Execution);
+	err = resizeGraph.launch(stream);
+	if (!err.hasError()) {
+		err = handleCUDAError(cuStreamSynchronize(stream));
+	}
 	if (err.hasError()) {
+		free(outputImage.data);
 		return InvalidImageHandle;
 	}
 